@@ -0,0 +1,33 @@
+#pragma once
+
+//! @file
+//!
+//! Copyright (c) Ticos, Inc.
+//! See License.txt for details
+//!
+//! @brief
+//! CRC-32C (Castagnoli) checksum.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Updates a running CRC-32C with the given data
+ *
+ * Uses the SSE4.2 crc32 instruction or the ARMv8 CRC32 instructions when available, and a
+ * slice-by-8 lookup table otherwise.
+ *
+ * @param crc CRC of the preceding data, or 0 to start a new CRC
+ * @param data Pointer to memory
+ * @param len Length of data
+ * @return uint32_t Updated CRC
+ */
+uint32_t ticos_crc32c(uint32_t crc, const void *data, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,32 @@
+#pragma once
+
+//! @file
+//!
+//! Copyright (c) Ticos, Inc.
+//! See License.txt for details
+//!
+//! @brief
+//! In-memory gzip compression, for HTTP request bodies.
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Compresses a buffer into a gzip stream (RFC 1952)
+ *
+ * @param data Data to compress
+ * @param len Length of data
+ * @param[out] out Compressed data, to be freed with free()
+ * @param[out] out_len Length of the compressed data
+ * @return true Successfully compressed, and the result is smaller than the data
+ * @return false Failed to compress, or compressing is not worth it, out is left NULL
+ */
+bool ticos_gzip_compress(const void *data, size_t len, void **out, size_t *out_len);
+
+#ifdef __cplusplus
+}
+#endif
@@ -19,6 +19,13 @@ extern "C" {
 
 #define TICOSD_IPC_SOCKET_PATH "/tmp/ticos-ipc.sock"
 
+//! Request, handled by ticosd itself, for the statistics of its transmit queue as JSON.
+#define TICOSD_IPC_STATS_NAME "STATS"
+
+//! Request, handled by ticosd itself, to move the entries of its dead-letter queue back into the
+//! transmit queue. The reply is the number of entries moved.
+#define TICOSD_IPC_RETRY_DEAD_LETTER_NAME "RETRY_DEAD_LETTER"
+
 /**
  * Send a SIGUSR1 signal to ticosd to immediately process the queue.
  */
@@ -32,6 +39,13 @@ bool ticosd_send_flush_queue_signal(void);
  */
 bool ticosd_ipc_sendmsg(uint8_t *msg, size_t len);
 
+/**
+ * Send an IPC request to ticosd and wait for its reply.
+ *
+ * The reply is NUL-terminated, and truncated if it does not fit in reply_size bytes.
+ */
+bool ticosd_ipc_request(const uint8_t *msg, size_t len, char *reply, size_t reply_size);
+
 typedef struct TicosAttributesIPC {
   char name[11] /*"ATTRIBUTES\0" */;
   time_t timestamp;
@@ -20,6 +20,7 @@ extern "C" {
 
 typedef struct Ticosd sTicosd;
 typedef struct TicosdPlugin sTicosdPlugin;
+typedef struct TicosdNetworkStream sTicosdNetworkStream;
 
 typedef bool (*ticosd_plugin_reload)(sTicosdPlugin *plugin);
 typedef void (*ticosd_plugin_destroy)(sTicosdPlugin *plugin);
@@ -80,6 +81,10 @@ int ticosd_main(int argc, char *argv[]);
 
 bool ticosd_txdata(sTicosd *ticosd, const sTicosdTxData *data, uint32_t payload_size);
 
+sTicosdNetworkStream *ticosd_core_upload_stream_open(sTicosd *ticosd, bool is_gzipped);
+bool ticosd_core_upload_stream_write(sTicosdNetworkStream *stream, const void *data, size_t size);
+bool ticosd_core_upload_stream_close(sTicosdNetworkStream *stream, bool complete);
+
 bool ticosd_get_boolean(sTicosd *ticosd, const char *parent_key, const char *key,
                            bool *val);
 bool ticosd_get_integer(sTicosd *ticosd, const char *parent_key, const char *key,
@@ -0,0 +1,326 @@
+//! @file
+//!
+//! Copyright (c) Ticos, Inc.
+//! See License.txt for details
+//!
+//! @brief
+//! Timing of the network requests: where the time of each request goes, from the DNS lookup to
+//! the last byte received, and the bytes sent and received, per endpoint
+//!
+//! network.c reads the timing of each request from libcurl once it is performed, whatever its
+//! result, and records it here. Each phase is kept in a fixed histogram per endpoint, from a
+//! millisecond to half a minute, the longest a request to the ticos API should take; coredump
+//! uploads mostly fall in the last bucket.
+//!
+
+#include "nettiming.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ticos/core/compiler.h"
+#include "ticos/core/math.h"
+
+//! Upper bounds of the timing buckets in milliseconds, the last bucket has no bound.
+static const uint32_t s_bucket_bounds[] = {1, 5, 10, 50, 100, 500, 1000, 5000, 10000, 30000};
+#define NUM_BUCKETS (TICOS_ARRAY_SIZE(s_bucket_bounds) + 1)
+
+static const char *const s_endpoint_names[kTicosdNetTimingEndpoint_NumEndpoints] = {
+  [kTicosdNetTimingEndpoint_Chunks] = "chunks",
+  [kTicosdNetTimingEndpoint_Attributes] = "attributes",
+  [kTicosdNetTimingEndpoint_UploadPrepare] = "upload_prepare",
+  [kTicosdNetTimingEndpoint_Upload] = "upload",
+  [kTicosdNetTimingEndpoint_UploadPart] = "upload_part",
+  [kTicosdNetTimingEndpoint_UploadCommit] = "upload_commit",
+  [kTicosdNetTimingEndpoint_Other] = "other",
+};
+
+static const char *const s_phase_names[kTicosdNetTimingPhase_NumPhases] = {
+  [kTicosdNetTimingPhase_NameLookup] = "namelookup",
+  [kTicosdNetTimingPhase_Connect] = "connect",
+  [kTicosdNetTimingPhase_AppConnect] = "appconnect",
+  [kTicosdNetTimingPhase_PreTransfer] = "pretransfer",
+  [kTicosdNetTimingPhase_StartTransfer] = "starttransfer",
+  [kTicosdNetTimingPhase_Total] = "total",
+};
+
+//! Last path segment of the "/chunks/<device>/..." endpoints, before the query string.
+static const struct {
+  const char *action;
+  eTicosdNetTimingEndpoint endpoint;
+} s_chunks_actions[] = {
+  {"json", kTicosdNetTimingEndpoint_Chunks},
+  {"fileUrl", kTicosdNetTimingEndpoint_UploadPrepare},
+  {"url", kTicosdNetTimingEndpoint_UploadCommit},
+};
+
+typedef struct NetTimingHistogram {
+  uint32_t buckets[NUM_BUCKETS];
+  uint64_t max_us;
+} sNetTimingHistogram;
+
+typedef struct NetTimingEndpointStats {
+  uint32_t count;
+  uint64_t bytes_up;
+  uint64_t bytes_down;
+  sNetTimingHistogram phases[kTicosdNetTimingPhase_NumPhases];
+} sNetTimingEndpointStats;
+
+struct TicosdNetTiming {
+  pthread_mutex_t lock;
+  sNetTimingEndpointStats endpoints[kTicosdNetTimingEndpoint_NumEndpoints];
+};
+
+typedef struct NetTimingBuffer {
+  char *str;
+  size_t len;
+  size_t capacity;
+  bool failed;
+} sNetTimingBuffer;
+
+TICOS_PRINTF_LIKE_FUNC(2, 3)
+static void prv_append(sNetTimingBuffer *buf, const char *fmt, ...) {
+  if (buf->failed) {
+    return;
+  }
+  va_list args;
+  va_start(args, fmt);
+  va_list args_copy;
+  va_copy(args_copy, args);
+  const int len = vsnprintf(buf->str ? buf->str + buf->len : NULL, buf->capacity - buf->len, fmt,
+                            args);
+  va_end(args);
+  if (len < 0) {
+    buf->failed = true;
+    goto cleanup;
+  }
+  if (buf->len + len >= buf->capacity) {
+    const size_t capacity = TICOS_MAX(buf->capacity * 2, buf->len + len + 1);
+    char *str = realloc(buf->str, capacity);
+    if (!str) {
+      buf->failed = true;
+      goto cleanup;
+    }
+    buf->str = str;
+    buf->capacity = capacity;
+    vsnprintf(buf->str + buf->len, buf->capacity - buf->len, fmt, args_copy);
+  }
+  buf->len += len;
+
+cleanup:
+  va_end(args_copy);
+}
+
+static char *prv_finish(sNetTimingBuffer *buf) {
+  if (buf->failed) {
+    fprintf(stderr, "nettiming:: Failed to allocate memory for statistics\n");
+    free(buf->str);
+    return NULL;
+  }
+  return buf->str;
+}
+
+//! Rounded up, so that a phase that took any time at all does not show as 0.
+static uint64_t prv_us_to_ms(uint64_t us) { return (us + 999) / 1000; }
+
+/**
+ * @brief Returns an approximation of a timing percentile: the upper bound of the bucket it falls
+ * in, or the maximum for the last bucket
+ */
+static uint64_t prv_percentile_ms(const sNetTimingHistogram *histogram, uint32_t count,
+                                  uint32_t percent) {
+  if (count == 0) {
+    return 0;
+  }
+  const uint64_t max_ms = prv_us_to_ms(histogram->max_us);
+  const uint64_t target = ((uint64_t)count * percent + 99) / 100;
+  uint64_t cumulative = 0;
+  for (size_t i = 0; i < NUM_BUCKETS - 1; ++i) {
+    cumulative += histogram->buckets[i];
+    if (cumulative >= target) {
+      return TICOS_MIN(s_bucket_bounds[i], max_ms);
+    }
+  }
+  return max_ms;
+}
+
+/**
+ * @brief Initialises the request timing statistics
+ *
+ * @return Statistics handle, NULL on error
+ */
+sTicosdNetTiming *ticosd_nettiming_init(void) {
+  sTicosdNetTiming *handle = calloc(sizeof(sTicosdNetTiming), 1);
+  if (!handle) {
+    fprintf(stderr, "nettiming:: Failed to allocate statistics handle\n");
+    return NULL;
+  }
+  pthread_mutex_init(&handle->lock, NULL);
+  return handle;
+}
+
+/**
+ * @brief Destroys the request timing statistics
+ *
+ * @param handle Statistics handle
+ */
+void ticosd_nettiming_destroy(sTicosdNetTiming *handle) {
+  if (!handle) {
+    return;
+  }
+  pthread_mutex_destroy(&handle->lock);
+  free(handle);
+}
+
+/**
+ * @brief Returns the endpoint a request to the ticos API is accounted to
+ *
+ * @param path Path of the request, with its query string
+ * @return Endpoint, kTicosdNetTimingEndpoint_Other if it is not one ticosd sends its data to
+ */
+eTicosdNetTimingEndpoint ticosd_nettiming_endpoint(const char *path) {
+  static const char attributes_path[] = "/api/v0/attributes";
+  static const char chunks_prefix[] = "/chunks/";
+
+  if (strncmp(path, attributes_path, sizeof(attributes_path) - 1) == 0) {
+    return kTicosdNetTimingEndpoint_Attributes;
+  }
+  if (strncmp(path, chunks_prefix, sizeof(chunks_prefix) - 1) != 0) {
+    return kTicosdNetTimingEndpoint_Other;
+  }
+  const char *action = strchr(path + sizeof(chunks_prefix) - 1, '/');
+  if (!action) {
+    return kTicosdNetTimingEndpoint_Other;
+  }
+  action++;
+  const size_t len = strcspn(action, "/?");
+  for (size_t i = 0; i < TICOS_ARRAY_SIZE(s_chunks_actions); ++i) {
+    if (strlen(s_chunks_actions[i].action) == len &&
+        strncmp(action, s_chunks_actions[i].action, len) == 0) {
+      return s_chunks_actions[i].endpoint;
+    }
+  }
+  return kTicosdNetTimingEndpoint_Other;
+}
+
+/**
+ * @brief Records the timing of a request that was just performed
+ *
+ * @param handle Statistics handle
+ * @param endpoint Endpoint of the request
+ * @param sample Timing of the request
+ */
+void ticosd_nettiming_record(sTicosdNetTiming *handle, eTicosdNetTimingEndpoint endpoint,
+                             const sTicosdNetTimingSample *sample) {
+  pthread_mutex_lock(&handle->lock);
+  sNetTimingEndpointStats *stats = &handle->endpoints[endpoint];
+  stats->count++;
+  stats->bytes_up += sample->bytes_up;
+  stats->bytes_down += sample->bytes_down;
+  for (int phase = 0; phase < kTicosdNetTimingPhase_NumPhases; ++phase) {
+    const uint64_t us = sample->phase_us[phase];
+    size_t bucket = 0;
+    while (bucket < NUM_BUCKETS - 1 && us > (uint64_t)s_bucket_bounds[bucket] * 1000) {
+      bucket++;
+    }
+    sNetTimingHistogram *histogram = &stats->phases[phase];
+    histogram->buckets[bucket]++;
+    histogram->max_us = TICOS_MAX(histogram->max_us, us);
+  }
+  pthread_mutex_unlock(&handle->lock);
+}
+
+/**
+ * @brief Formats the request timing statistics as a JSON object
+ *
+ * @param handle Statistics handle
+ * @return JSON string to free() by the caller, NULL on error
+ */
+char *ticosd_nettiming_to_json(sTicosdNetTiming *handle) {
+  sNetTimingBuffer buf = {0};
+
+  prv_append(&buf, "{\"bucket_bounds\": [");
+  for (size_t i = 0; i < NUM_BUCKETS - 1; ++i) {
+    prv_append(&buf, "%s%u", i == 0 ? "" : ", ", s_bucket_bounds[i]);
+  }
+  prv_append(&buf, "]");
+
+  pthread_mutex_lock(&handle->lock);
+  for (int endpoint = 0; endpoint < kTicosdNetTimingEndpoint_NumEndpoints; ++endpoint) {
+    const sNetTimingEndpointStats *stats = &handle->endpoints[endpoint];
+    prv_append(&buf, ", \"%s\": {\"count\": %u, \"bytes_up\": %llu, \"bytes_down\": %llu",
+               s_endpoint_names[endpoint], stats->count, (unsigned long long)stats->bytes_up,
+               (unsigned long long)stats->bytes_down);
+    for (int phase = 0; phase < kTicosdNetTimingPhase_NumPhases; ++phase) {
+      const sNetTimingHistogram *histogram = &stats->phases[phase];
+      prv_append(&buf, ", \"%s\": {\"max\": %llu, \"buckets\": [", s_phase_names[phase],
+                 (unsigned long long)prv_us_to_ms(histogram->max_us));
+      for (size_t i = 0; i < NUM_BUCKETS; ++i) {
+        prv_append(&buf, "%s%u", i == 0 ? "" : ", ", histogram->buckets[i]);
+      }
+      prv_append(&buf, "]}");
+    }
+    prv_append(&buf, "}");
+  }
+  pthread_mutex_unlock(&handle->lock);
+
+  prv_append(&buf, "}");
+  return prv_finish(&buf);
+}
+
+/**
+ * @brief Formats the request timing statistics as an attributes JSON array, to be sent along with
+ * the device's other attributes
+ *
+ * Only the endpoints requests were sent to are reported, their timings summarised by the
+ * approximate median and 95th percentile of the whole request, and the 95th percentile of the
+ * connection setup and of the wait for the first byte of the response.
+ *
+ * @param handle Statistics handle
+ * @return JSON string to free() by the caller, NULL on error
+ */
+char *ticosd_nettiming_to_attributes_json(sTicosdNetTiming *handle) {
+  sNetTimingBuffer buf = {0};
+  bool first = true;
+
+  prv_append(&buf, "[");
+  pthread_mutex_lock(&handle->lock);
+  for (int endpoint = 0; endpoint < kTicosdNetTimingEndpoint_NumEndpoints; ++endpoint) {
+    const sNetTimingEndpointStats *stats = &handle->endpoints[endpoint];
+    if (stats->count == 0) {
+      continue;
+    }
+    const char *name = s_endpoint_names[endpoint];
+    const sNetTimingHistogram *phases = stats->phases;
+    const uint64_t total_p50_ms =
+      prv_percentile_ms(&phases[kTicosdNetTimingPhase_Total], stats->count, 50);
+    const uint64_t total_p95_ms =
+      prv_percentile_ms(&phases[kTicosdNetTimingPhase_Total], stats->count, 95);
+    const uint64_t appconnect_p95_ms =
+      prv_percentile_ms(&phases[kTicosdNetTimingPhase_AppConnect], stats->count, 95);
+    const uint64_t starttransfer_p95_ms =
+      prv_percentile_ms(&phases[kTicosdNetTimingPhase_StartTransfer], stats->count, 95);
+    prv_append(&buf,
+               "%s{\"string_key\": \"ticosd_net_%s_count\", \"value\": %u}, "
+               "{\"string_key\": \"ticosd_net_%s_p50_ms\", \"value\": %llu}, "
+               "{\"string_key\": \"ticosd_net_%s_p95_ms\", \"value\": %llu}, "
+               "{\"string_key\": \"ticosd_net_%s_appconnect_p95_ms\", \"value\": %llu}, "
+               "{\"string_key\": \"ticosd_net_%s_starttransfer_p95_ms\", \"value\": %llu}, "
+               "{\"string_key\": \"ticosd_net_%s_bytes_up\", \"value\": %llu}, "
+               "{\"string_key\": \"ticosd_net_%s_bytes_down\", \"value\": %llu}",
+               first ? "" : ", ", name, stats->count, name, (unsigned long long)total_p50_ms,
+               name, (unsigned long long)total_p95_ms, name,
+               (unsigned long long)appconnect_p95_ms, name,
+               (unsigned long long)starttransfer_p95_ms, name,
+               (unsigned long long)stats->bytes_up, name, (unsigned long long)stats->bytes_down);
+    first = false;
+  }
+  pthread_mutex_unlock(&handle->lock);
+
+  prv_append(&buf, "]");
+  return prv_finish(&buf);
+}
@@ -0,0 +1,64 @@
+//! @file
+//!
+//! Copyright (c) Ticos, Inc.
+//! See License.txt for details
+//!
+//! @brief
+//! Timing of the network requests: where the time of each request goes, from the DNS lookup to
+//! the last byte received, and the bytes sent and received, per endpoint
+//!
+
+#ifndef __TICOS_NETTIMING_H
+#define __TICOS_NETTIMING_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+typedef enum TicosdNetTimingEndpoint {
+  kTicosdNetTimingEndpoint_Chunks,
+  kTicosdNetTimingEndpoint_Attributes,
+  kTicosdNetTimingEndpoint_UploadPrepare,
+  kTicosdNetTimingEndpoint_Upload,
+  kTicosdNetTimingEndpoint_UploadPart,
+  kTicosdNetTimingEndpoint_UploadCommit,
+  kTicosdNetTimingEndpoint_Other,
+  kTicosdNetTimingEndpoint_NumEndpoints,
+} eTicosdNetTimingEndpoint;
+
+//! Phases of a request, as libcurl times them: each one from the start of the request to the end
+//! of the phase, so that they add up rather than follow each other. The lookup, connect and TLS
+//! handshake phases take no time on a reused connection.
+typedef enum TicosdNetTimingPhase {
+  kTicosdNetTimingPhase_NameLookup,
+  kTicosdNetTimingPhase_Connect,
+  kTicosdNetTimingPhase_AppConnect,
+  kTicosdNetTimingPhase_PreTransfer,
+  kTicosdNetTimingPhase_StartTransfer,
+  kTicosdNetTimingPhase_Total,
+  kTicosdNetTimingPhase_NumPhases,
+} eTicosdNetTimingPhase;
+
+//! Timing of a request, as recorded by ticosd_nettiming_record().
+typedef struct TicosdNetTimingSample {
+  uint64_t phase_us[kTicosdNetTimingPhase_NumPhases];
+  uint64_t bytes_up;
+  uint64_t bytes_down;
+} sTicosdNetTimingSample;
+
+typedef struct TicosdNetTiming sTicosdNetTiming;
+
+sTicosdNetTiming *ticosd_nettiming_init(void);
+void ticosd_nettiming_destroy(sTicosdNetTiming *handle);
+eTicosdNetTimingEndpoint ticosd_nettiming_endpoint(const char *path);
+void ticosd_nettiming_record(sTicosdNetTiming *handle, eTicosdNetTimingEndpoint endpoint,
+                             const sTicosdNetTimingSample *sample);
+char *ticosd_nettiming_to_json(sTicosdNetTiming *handle);
+char *ticosd_nettiming_to_attributes_json(sTicosdNetTiming *handle);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -6,36 +6,191 @@
 //! @brief
 //! Network POST & GET API wrapper around libCURL
 //!
+//! Single requests are performed with a blocking easy handle. Batches of requests are performed
+//! concurrently with the multi interface, on a bounded pool of easy handles whose size is set by
+//! the "network"/"max_concurrent_requests" configuration key.
+//!
+//! All easy handles share a DNS cache, a TLS session cache and a connection cache, and negotiate
+//! HTTP/2 where the server supports it, so that requests to the ticos API and to the upload host
+//! reuse the connections of the previous ones instead of performing new handshakes. The requests of
+//! a batch wait for the HTTP/2 connection being set up and are multiplexed on it, rather than each
+//! opening its own. The headers, which are the same for every request, are built once.
+//!
+//! With "network"/"request_compression" set to "gzip", the bodies of POST and PATCH requests above
+//! "network"/"request_compression_threshold_bytes" are sent gzipped. Should the server reply 415
+//! Unsupported Media Type, the request is sent again as is, and so are the following ones.
+//!
+//! With "network"/"upload_part_size_kib" set, coredump files are uploaded in parts of that size,
+//! so that an interrupted upload resumes where it stopped rather than from the start. Each part is
+//! POSTed to the upload URL with a Content-Range header and the CRC-32C of its data in
+//! X-Ticos-Part-CRC32C. The server acknowledges each part with a 2xx, and the last one with the
+//! response of a whole file upload. It replies 409 or 416 if it lost the preceding parts, then the
+//! upload starts over, and 422 if the checksum does not match, then the part is sent again later.
+//! A part sent again is accepted. The acknowledged offset is persisted next to the file, see
+//! upload_progress.c. A resumed upload also starts over if the saved upload URL is rejected with
+//! any other client error, as when it expired.
+//!
+//! When several coredump files are pending, their uploads are pipelined: the upload URL of the next
+//! files is requested and the files already uploaded are committed while the current one is being
+//! uploaded, see ticosd_network_file_upload_batch().
+//!
+//! Coredumps are uploaded from the file they were written to, or streamed while they are being
+//! produced (ticosd_network_stream_open()). A stream is read by its own thread, on its own easy
+//! handle, the state shared with it is guarded by the lock of the network object.
+//!
+//! The timing of every request, as libcurl breaks it down, and the bytes it sent and received are
+//! recorded per endpoint, see nettiming.c. Upload requests go to the upload host rather than the
+//! ticos API, they are accounted to the upload endpoints by the code performing them.
+//!
 
 #include "network.h"
 
 #include <curl/curl.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "nettiming.h"
+#include "ticos/core/math.h"
+#include "ticos/util/crc32c.h"
+#include "ticos/util/gzip.h"
 #include "ticos/util/json-c.h"
 #include "ticos/util/string.h"
 #include "ticosd.h"
+#include "upload_progress.h"
+
+#define NETWORK_MAX_CONCURRENT_REQUESTS_DEFAULT 4
+#define NETWORK_REQUEST_COMPRESSION_DEFAULT "none"
+//! Below this, the gzip header and trailer eat most of what compression saves.
+#define NETWORK_REQUEST_COMPRESSION_THRESHOLD_DEFAULT 1024
+//! Time after which a warm-up is worth it: the connections left idle longer may have been closed
+//! by the server, and the DNS cache entries have expired (libcurl's default DNS cache timeout).
+#define NETWORK_WARM_UP_IDLE_MS (60 * 1000)
+#define NETWORK_WARM_UP_TIMEOUT_S 10L
+//! A coredump stream stalled for this long is given up on.
+#define NETWORK_STREAM_STALL_TIMEOUT_S 60L
+//! Files after the one being uploaded whose upload URL is requested ahead. The URLs are only valid
+//! for a limited time, and a couple of coredump uploads is ample time to get the next ones.
+#define NETWORK_UPLOAD_PREFETCH_COUNT 2
+
+struct _write_callback {
+  char *buf;
+  size_t size;
+};
+
+//! A request of a batch being performed on an easy handle of the pool.
+typedef struct TicosdNetworkTransfer {
+  CURL *curl;
+  char *url;
+  const sTicosdNetworkRequest *request;
+  //! Compressed body, NULL if the payload is sent as is.
+  void *body;
+  eTicosdHttpMethod method;
+  //! Index of the request in the batch.
+  uint32_t index;
+  bool in_flight;
+  //! Discards the response body.
+  struct _write_callback recv_buf;
+} sTicosdNetworkTransfer;
+
+//! Stages of a file upload, performed in this order.
+typedef enum TicosdFileUploadStage {
+  kFileUploadStage_Prepare,
+  kFileUploadStage_Upload,
+  kFileUploadStage_Commit,
+  kFileUploadStage_Done,
+} eTicosdFileUploadStage;
+
+//! A file of a batch being uploaded, see ticosd_network_file_upload_batch().
+typedef struct TicosdFileUploadJob {
+  const sTicosdNetworkFile *file;
+  eTicosdFileUploadStage stage;
+  //! Transfer the request of the current stage is in flight on, NULL if none is.
+  sTicosdNetworkTransfer *transfer;
+  uint64_t file_size;
+  //! Upload URL, and offset acknowledged by the server for uploads in parts.
+  sTicosdUploadProgress progress;
+  bool resumable;
+  //! Whether the upload URL was saved by an earlier attempt, and may have expired since.
+  bool resumed;
+  int fd;
+  //! Data of the part being uploaded.
+  uint8_t *part;
+  size_t part_size;
+  struct curl_slist *part_headers;
+  curl_mime *mime;
+  //! URL and payload of the prepare or commit request, and its compressed body.
+  char *url;
+  char *payload;
+  void *body;
+  char *file_url;
+  struct _write_callback recv_buf;
+  //! Times each stage started and ended, as prv_network_now_ms(), 0 if it did not run.
+  uint64_t start_ms[kFileUploadStage_Done];
+  uint64_t end_ms[kFileUploadStage_Done];
+} sTicosdFileUploadJob;
 
 struct TicosdNetwork {
   sTicosd *ticosd;
+  //! Guards the state updated by the requests, which coredump streams perform from their threads.
+  pthread_mutex_t lock;
   bool during_network_failure;
   CURL *curl;
+  CURLM *multi;
+  //! DNS, TLS session and connection caches shared by all easy handles.
+  CURLSH *share;
+  pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+  //! Headers of the requests to the ticos API, with and without a JSON body.
+  struct curl_slist *json_headers;
+  struct curl_slist *get_headers;
+  struct curl_slist *json_gzip_headers;
+  //! Headers of the file uploads, indexed by whether the file is gzipped.
+  struct curl_slist *upload_headers[2];
+  bool tcp_fastopen;
+  bool warm_up;
+  //! Cleared if the server rejects compressed requests.
+  bool gzip_requests;
+  uint32_t gzip_threshold_bytes;
+  //! Size of the parts of resumable file uploads, 0 to upload files in one request.
+  uint32_t upload_part_size;
+  //! Time the last request was performed, 0 if none was.
+  uint64_t last_activity_ms;
+  sTicosdNetworkStats stats;
+  sTicosdNetTiming *timing;
+  sTicosdNetworkTransfer *transfers;
+  uint32_t transfer_count;
+  //! Longest Retry-After delay received since ticosd_network_take_retry_after() was last called.
+  uint32_t retry_after_s;
   const char *base_url;
   char *project_key_header;
   const char *software_type;
   const char *software_version;
 };
 
-struct _write_callback {
-  char *buf;
+struct TicosdNetworkStream {
+  sTicosdNetwork *handle;
+  CURL *curl;
+  curl_mime *mime;
+  char *commit_endpoint;
+  char *upload_url;
+  bool is_gzipped;
+  //! Socket pair, the coredump is written to fds[1] and read by the upload thread from fds[0].
+  int fds[2];
+  pthread_t thread;
+  pthread_mutex_t lock;
+  //! Set if the coredump could not be produced entirely, so that the upload fails.
+  bool aborted;
+  //! Bytes read from the stream so far.
   size_t size;
+  eTicosdNetworkResult result;
 };
 
 /**
@@ -69,7 +224,139 @@ static size_t prv_network_write_callback(void *contents, size_t size, size_t nme
   return total_size;
 }
 
+static uint64_t prv_network_now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void prv_network_share_lock(CURL *curl, curl_lock_data data, curl_lock_access access,
+                                   void *userp) {
+  sTicosdNetwork *handle = userp;
+  pthread_mutex_lock(&handle->share_locks[data]);
+}
+
+static void prv_network_share_unlock(CURL *curl, curl_lock_data data, void *userp) {
+  sTicosdNetwork *handle = userp;
+  pthread_mutex_unlock(&handle->share_locks[data]);
+}
+
+/**
+ * @brief Sets the options common to all requests on an easy handle, after it was reset
+ *
+ * @param handle network object
+ * @param curl Easy handle
+ */
+static void prv_network_setup_connection(sTicosdNetwork *handle, CURL *curl) {
+  curl_easy_setopt(curl, CURLOPT_SHARE, handle->share);
+  curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+  curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+  curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+  if (handle->tcp_fastopen) {
+    curl_easy_setopt(curl, CURLOPT_TCP_FASTOPEN, 1L);
+  }
+  curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
+}
+
+/**
+ * @brief Accounts for the connections made by a request that was just performed
+ *
+ * @param handle network object
+ * @param curl Easy handle the request was performed on
+ */
+static void prv_network_account_connects(sTicosdNetwork *handle, CURL *curl) {
+  long connects = 0;
+  curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+  pthread_mutex_lock(&handle->lock);
+  if (connects > 0) {
+    handle->stats.connect_count += connects;
+  }
+  handle->last_activity_ms = prv_network_now_ms();
+  pthread_mutex_unlock(&handle->lock);
+}
+
+//! Timing information of each phase, see eTicosdNetTimingPhase.
+static const CURLINFO s_timing_infos[kTicosdNetTimingPhase_NumPhases] = {
+  [kTicosdNetTimingPhase_NameLookup] = CURLINFO_NAMELOOKUP_TIME_T,
+  [kTicosdNetTimingPhase_Connect] = CURLINFO_CONNECT_TIME_T,
+  [kTicosdNetTimingPhase_AppConnect] = CURLINFO_APPCONNECT_TIME_T,
+  [kTicosdNetTimingPhase_PreTransfer] = CURLINFO_PRETRANSFER_TIME_T,
+  [kTicosdNetTimingPhase_StartTransfer] = CURLINFO_STARTTRANSFER_TIME_T,
+  [kTicosdNetTimingPhase_Total] = CURLINFO_TOTAL_TIME_T,
+};
+
+static uint64_t prv_network_getinfo_off_t(CURL *curl, CURLINFO info) {
+  curl_off_t value = 0;
+  if (curl_easy_getinfo(curl, info, &value) != CURLE_OK || value < 0) {
+    return 0;
+  }
+  return (uint64_t)value;
+}
+
+/**
+ * @brief Accounts for a request that was just performed, whatever its result, and records its
+ * timing
+ *
+ * @param handle network object
+ * @param curl Easy handle the request was performed on
+ * @param endpoint Endpoint the request is accounted to
+ */
+static void prv_network_account_request(sTicosdNetwork *handle, CURL *curl,
+                                        eTicosdNetTimingEndpoint endpoint) {
+  prv_network_account_connects(handle, curl);
+  pthread_mutex_lock(&handle->lock);
+  handle->stats.request_count++;
+  pthread_mutex_unlock(&handle->lock);
+
+  sTicosdNetTimingSample sample = {
+    .bytes_up = prv_network_getinfo_off_t(curl, CURLINFO_SIZE_UPLOAD_T),
+    .bytes_down = prv_network_getinfo_off_t(curl, CURLINFO_SIZE_DOWNLOAD_T),
+  };
+  for (int phase = 0; phase < kTicosdNetTimingPhase_NumPhases; ++phase) {
+    sample.phase_us[phase] = prv_network_getinfo_off_t(curl, s_timing_infos[phase]);
+  }
+  ticosd_nettiming_record(handle->timing, endpoint, &sample);
+}
+
+static bool prv_network_append_header(struct curl_slist **headers, const char *header) {
+  struct curl_slist *list = curl_slist_append(*headers, header);
+  if (!list) {
+    fprintf(stderr, "network:: Failed to allocate memory for headers\n");
+    return false;
+  }
+  *headers = list;
+  return true;
+}
+
+/**
+ * @brief Builds the headers of all requests once, they do not change
+ *
+ * @param handle network object
+ * @return true Successfully built the headers
+ * @return false Failed to allocate them
+ */
+static bool prv_network_build_headers(sTicosdNetwork *handle) {
+  return prv_network_append_header(&handle->json_headers, "Accept: application/json") &&
+         prv_network_append_header(&handle->json_headers, "Content-Type: application/json") &&
+         prv_network_append_header(&handle->json_headers, "charset: utf-8") &&
+         prv_network_append_header(&handle->json_headers, "X-Tiwater-Debug: true") &&
+         prv_network_append_header(&handle->json_headers, handle->project_key_header) &&
+         prv_network_append_header(&handle->json_gzip_headers, "Accept: application/json") &&
+         prv_network_append_header(&handle->json_gzip_headers, "Content-Type: application/json") &&
+         prv_network_append_header(&handle->json_gzip_headers, "Content-Encoding: gzip") &&
+         prv_network_append_header(&handle->json_gzip_headers, "charset: utf-8") &&
+         prv_network_append_header(&handle->json_gzip_headers, "X-Tiwater-Debug: true") &&
+         prv_network_append_header(&handle->json_gzip_headers, handle->project_key_header) &&
+         prv_network_append_header(&handle->get_headers, "charset: utf-8") &&
+         prv_network_append_header(&handle->get_headers, "X-Tiwater-Debug: true") &&
+         prv_network_append_header(&handle->get_headers, handle->project_key_header) &&
+         prv_network_append_header(&handle->upload_headers[false], "X-Tiwater-Debug: true") &&
+         prv_network_append_header(&handle->upload_headers[true], "Content-Encoding: gzip") &&
+         prv_network_append_header(&handle->upload_headers[true], "X-Tiwater-Debug: true");
+}
+
 static void prv_log_first_failed_request(sTicosdNetwork *handle, const char *fmt, ...) {
+  pthread_mutex_lock(&handle->lock);
   if (!handle->during_network_failure) {
     va_list args;
 
@@ -79,9 +366,11 @@ static void prv_log_first_failed_request(sTicosdNetwork *handle, const char *fmt
 
     handle->during_network_failure = true;
   }
+  pthread_mutex_unlock(&handle->lock);
 }
 
 static void prv_log_first_succeeded_request(sTicosdNetwork *handle, const char *fmt, ...) {
+  pthread_mutex_lock(&handle->lock);
   if (handle->during_network_failure) {
     va_list args;
 
@@ -91,18 +380,35 @@ static void prv_log_first_succeeded_request(sTicosdNetwork *handle, const char *
 
     handle->during_network_failure = false;
   }
+  pthread_mutex_unlock(&handle->lock);
+}
+
+/**
+ * @brief Accounts for a request that failed with a retry-able error
+ *
+ * @param handle network object
+ * @param server_error Whether the server answered with an error other than throttling
+ */
+static void prv_network_account_error(sTicosdNetwork *handle, bool server_error) {
+  pthread_mutex_lock(&handle->lock);
+  handle->stats.retry_error_count++;
+  if (server_error) {
+    handle->stats.server_error_count++;
+  }
+  pthread_mutex_unlock(&handle->lock);
 }
 
-static eTicosdNetworkResult prv_check_error(sTicosdNetwork *handle, const CURLcode res,
+static eTicosdNetworkResult prv_check_error(sTicosdNetwork *handle, CURL *curl, const CURLcode res,
                                             const char *method, const char *url) {
   long http_code = 0;
-  curl_easy_getinfo(handle->curl, CURLINFO_HTTP_CODE, &http_code);
+  curl_easy_getinfo(curl, CURLINFO_HTTP_CODE, &http_code);
 
   // Note: assuming NOT using CURLOPT_FAILONERROR!
   if (res != CURLE_OK) {
     prv_log_first_failed_request(
       handle, "network:: Failed to perform %s request to %s, %d: %s (HTTP code %ld).\n", method,
       url, res, curl_easy_strerror(res), http_code);
+    prv_network_account_error(handle, false);
     return kTicosdNetworkResult_ErrorRetryLater;
   }
 
@@ -111,7 +417,20 @@ static eTicosdNetworkResult prv_check_error(sTicosdNetwork *handle, const CURLco
     "network:: Network recovered, successfully performed %s request to %s (HTTP code %ld).\n",
     method, url, http_code);
 
-  if (http_code >= 400 && http_code <= 499) {
+  if (http_code == 429 || http_code == 503) {
+    // Rate limited or overloaded, the server may say when to come back:
+    curl_off_t retry_after = 0;
+    curl_easy_getinfo(curl, CURLINFO_RETRY_AFTER, &retry_after);
+    pthread_mutex_lock(&handle->lock);
+    if (retry_after > (curl_off_t)handle->retry_after_s) {
+      handle->retry_after_s = retry_after > UINT32_MAX ? UINT32_MAX : (uint32_t)retry_after;
+    }
+    pthread_mutex_unlock(&handle->lock);
+    fprintf(stderr, "network:: %s request to %s throttled (HTTP code %ld, retry after %lds).\n",
+            method, url, http_code, (long)retry_after);
+    prv_network_account_error(handle, false);
+    return kTicosdNetworkResult_ErrorRetryLater;
+  } else if (http_code >= 400 && http_code <= 499) {
     // Client error:
     fprintf(stderr, "network:: client error for %s request to %s (HTTP code %ld).\n", method, url,
             http_code);
@@ -120,6 +439,7 @@ static eTicosdNetworkResult prv_check_error(sTicosdNetwork *handle, const CURLco
     // Server error:
     fprintf(stderr, "network:: server error for %s request to %s (HTTP code %ld).\n", method, url,
             http_code);
+    prv_network_account_error(handle, true);
     return kTicosdNetworkResult_ErrorRetryLater;
   }
   return kTicosdNetworkResult_OK;
@@ -185,108 +505,6 @@ cleanup:
   return false;
 }
 
-static eTicosdNetworkResult prv_file_upload_prepare(sTicosdNetwork *handle, const char *endpoint,
-                                                    const size_t filesize, char **upload_url,
-                                                    bool is_gzipped) {
-  char *recvdata = NULL;
-  size_t recvlen;
-  eTicosdNetworkResult rc;
-
-  rc = ticosd_network_post(handle, endpoint, kTicosdHttpMethod_GET, NULL, &recvdata, &recvlen);
-  if (rc != kTicosdNetworkResult_OK) {
-    goto cleanup;
-  }
-  // recvdata[recvlen - 1] = '\0';
-
-  if (!prv_parse_file_upload_prepare_response(recvdata, upload_url)) {
-    rc = kTicosdNetworkResult_ErrorRetryLater;
-    goto cleanup;
-  }
-
-  rc = kTicosdNetworkResult_OK;
-
-cleanup:
-  free(recvdata);
-  return rc;
-}
-
-static eTicosdNetworkResult prv_file_upload(sTicosdNetwork *handle, const char *url,
-                                            const char *filename, const size_t filesize, char **upload_url,
-                                            bool is_gzipped) {
-  eTicosdNetworkResult rc;
-  struct curl_slist *headers = NULL;
-
-  struct curl_httppost *post = NULL;
-  struct curl_httppost *last = NULL;
-
-  struct _write_callback recv_buf = {0};
-
-  recv_buf.buf = malloc(1);
-  recv_buf.size = 0;
-
-  char *recvdata = NULL;
-
-  curl_formadd(&post, &last, CURLFORM_COPYNAME, "type", CURLFORM_COPYCONTENTS,
-                 "COREDUMP", CURLFORM_END);
-
-  curl_formadd(&post, &last, CURLFORM_PTRNAME, "file", CURLFORM_FILE, filename,
-                 CURLFORM_END);
-
-  curl_easy_setopt(handle->curl, CURLOPT_URL, url);
-
-  if (is_gzipped) {
-    headers = curl_slist_append(headers, "Content-Encoding: gzip");
-  }
-  headers = curl_slist_append(headers, "X-Tiwater-Debug: true");
-
-  curl_easy_setopt(handle->curl, CURLOPT_HTTPHEADER, headers);
-  curl_easy_setopt(handle->curl, CURLOPT_NOPROGRESS, 1L);
-  curl_easy_setopt(handle->curl, CURLOPT_WRITEFUNCTION, prv_network_write_callback);
-  curl_easy_setopt(handle->curl, CURLOPT_WRITEDATA, (void *)&recv_buf);
-
-  curl_easy_setopt(handle->curl, CURLOPT_HTTPPOST, post);
-
-  const CURLcode res = curl_easy_perform(handle->curl);
-  rc = prv_check_error(handle, res, "POST", url);
-
-  recvdata = recv_buf.buf;
-
-  if (!prv_parse_file_upload_response(recvdata, upload_url)) {
-    rc = kTicosdNetworkResult_ErrorRetryLater;
-    goto cleanup;
-  }
-
-cleanup:
-  curl_slist_free_all(headers);
-  curl_easy_reset(handle->curl);
-  curl_formfree(post);
-  free(recv_buf.buf);
-  return rc;
-}
-
-static eTicosdNetworkResult prv_file_upload_commit(sTicosdNetwork *handle, const char *endpoint,
-                                                   const char *url, const size_t filesize) {
-  eTicosdNetworkResult rc;
-  char *payload = NULL;
-
-  const char *payload_fmt = "{"
-                            "  \"url\": \"%s\","
-                            "  \"kind\": \"COREDUMP\","
-                            "  \"size\": %d"
-                            "}";
-  if (ticos_asprintf(&payload, payload_fmt, url, (int64_t)filesize) == -1) {
-    rc = kTicosdNetworkResult_ErrorRetryLater;
-    goto cleanup;
-  }
-
-  rc = ticosd_network_post(handle, endpoint, kTicosdHttpMethod_POST, payload, NULL, 0);
-
-cleanup:
-  free(payload);
-
-  return rc;
-}
-
 static const char *prv_method_as_string(enum TicosdHttpMethod method) {
   switch (method) {
     case kTicosdHttpMethod_POST:
@@ -300,6 +518,83 @@ static const char *prv_method_as_string(enum TicosdHttpMethod method) {
   }
 }
 
+/**
+ * @brief Sets up an easy handle for a request to the ticos API
+ *
+ * @param handle network object
+ * @param curl Easy handle
+ * @param url URL of the request
+ * @param method HTTP method
+ * @param payload Data to send, unused for GET requests
+ * @param recv_buf Buffer receiving the response, discarded if its buf is NULL
+ * @return Compressed body, to be freed once the request is performed, NULL if the payload is sent
+ * as is
+ */
+static void *prv_network_setup_request(sTicosdNetwork *handle, CURL *curl, const char *url,
+                                       eTicosdHttpMethod method, const char *payload,
+                                       struct _write_callback *recv_buf) {
+  void *body = NULL;
+  prv_network_setup_connection(handle, curl);
+  curl_easy_setopt(curl, CURLOPT_URL, url);
+  if (method == kTicosdHttpMethod_GET) {
+    curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, handle->get_headers);
+  } else {
+    const size_t payload_len = strlen(payload);
+    size_t body_len = payload_len;
+    pthread_mutex_lock(&handle->lock);
+    const bool gzip_requests = handle->gzip_requests;
+    pthread_mutex_unlock(&handle->lock);
+    if (gzip_requests && payload_len >= handle->gzip_threshold_bytes &&
+        ticos_gzip_compress(payload, payload_len, &body, &body_len)) {
+      curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)body_len);
+      curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body);
+      curl_easy_setopt(curl, CURLOPT_HTTPHEADER, handle->json_gzip_headers);
+    } else {
+      curl_easy_setopt(curl, CURLOPT_POSTFIELDS, payload);
+      curl_easy_setopt(curl, CURLOPT_HTTPHEADER, handle->json_headers);
+    }
+    pthread_mutex_lock(&handle->lock);
+    handle->stats.payload_bytes += payload_len;
+    handle->stats.body_bytes += body_len;
+    pthread_mutex_unlock(&handle->lock);
+  }
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, prv_network_write_callback);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)recv_buf);
+  if (method == kTicosdHttpMethod_PATCH) {
+    curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "PATCH");
+  }
+  return body;
+}
+
+/**
+ * @brief Checks whether the server rejected a compressed request, and stops compressing them if so
+ *
+ * @param handle network object
+ * @param curl Easy handle the request was performed on
+ * @param res Result of the request
+ * @param compressed Whether the body of the request was compressed
+ * @return true The request must be sent again uncompressed
+ */
+static bool prv_network_is_compression_rejected(sTicosdNetwork *handle, CURL *curl,
+                                                CURLcode res, bool compressed) {
+  if (!compressed || res != CURLE_OK) {
+    return false;
+  }
+  long http_code = 0;
+  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+  if (http_code != 415) {
+    return false;
+  }
+  pthread_mutex_lock(&handle->lock);
+  if (handle->gzip_requests) {
+    fprintf(stderr, "network:: Server rejected a gzipped request, no longer compressing them.\n");
+    handle->gzip_requests = false;
+  }
+  pthread_mutex_unlock(&handle->lock);
+  return true;
+}
+
 /**
  * @brief Initialises the network object
  *
@@ -315,12 +610,81 @@ sTicosdNetwork *ticosd_network_init(sTicosd *ticosd) {
 
   handle->ticosd = ticosd;
   handle->during_network_failure = false;
+  pthread_mutex_init(&handle->lock, NULL);
+  for (int i = 0; i < CURL_LOCK_DATA_LAST; ++i) {
+    pthread_mutex_init(&handle->share_locks[i], NULL);
+  }
+
+  if (!(handle->timing = ticosd_nettiming_init())) {
+    goto cleanup;
+  }
 
   if (!(handle->curl = curl_easy_init())) {
     fprintf(stderr, "network:: Failed to initialise CURL.\n");
     goto cleanup;
   }
 
+  if (!(handle->share = curl_share_init()) ||
+      curl_share_setopt(handle->share, CURLSHOPT_LOCKFUNC, prv_network_share_lock) != CURLSHE_OK ||
+      curl_share_setopt(handle->share, CURLSHOPT_UNLOCKFUNC, prv_network_share_unlock) !=
+        CURLSHE_OK ||
+      curl_share_setopt(handle->share, CURLSHOPT_USERDATA, handle) != CURLSHE_OK ||
+      curl_share_setopt(handle->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS) != CURLSHE_OK ||
+      curl_share_setopt(handle->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION) !=
+        CURLSHE_OK) {
+    fprintf(stderr, "network:: Failed to initialise CURL share handle.\n");
+    goto cleanup;
+  }
+  // Sharing connections requires libcurl 7.57.0, the connections are still reused by each easy
+  // handle otherwise:
+  if (curl_share_setopt(handle->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT) != CURLSHE_OK) {
+    fprintf(stderr, "network:: Connection cache cannot be shared.\n");
+  }
+
+  ticosd_get_boolean(handle->ticosd, "network", "tcp_fastopen", &handle->tcp_fastopen);
+  ticosd_get_boolean(handle->ticosd, "network", "warm_up", &handle->warm_up);
+
+  const char *compression = NETWORK_REQUEST_COMPRESSION_DEFAULT;
+  ticosd_get_string(handle->ticosd, "network", "request_compression", &compression);
+  if (strcmp(compression, "gzip") == 0) {
+    handle->gzip_requests = true;
+  } else if (strcmp(compression, "none") != 0) {
+    fprintf(stderr,
+            "network:: Invalid configuration: network.request_compression value '%s' - Use "
+            "'none' or 'gzip'.\n",
+            compression);
+  }
+  int threshold = NETWORK_REQUEST_COMPRESSION_THRESHOLD_DEFAULT;
+  ticosd_get_integer(handle->ticosd, "network", "request_compression_threshold_bytes",
+                     &threshold);
+  handle->gzip_threshold_bytes = threshold > 0 ? threshold : 0;
+
+  int upload_part_size_kib = 0;
+  ticosd_get_integer(handle->ticosd, "network", "upload_part_size_kib", &upload_part_size_kib);
+  handle->upload_part_size = upload_part_size_kib > 0 ? upload_part_size_kib * 1024 : 0;
+
+  int max_concurrent_requests = NETWORK_MAX_CONCURRENT_REQUESTS_DEFAULT;
+  ticosd_get_integer(handle->ticosd, "network", "max_concurrent_requests",
+                     &max_concurrent_requests);
+  if (max_concurrent_requests < 1) {
+    max_concurrent_requests = 1;
+  }
+  if (!(handle->multi = curl_multi_init())) {
+    fprintf(stderr, "network:: Failed to initialise CURL multi handle.\n");
+    goto cleanup;
+  }
+  curl_multi_setopt(handle->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+  if (!(handle->transfers = calloc(max_concurrent_requests, sizeof(sTicosdNetworkTransfer)))) {
+    fprintf(stderr, "network:: Failed to allocate memory for transfers\n");
+    goto cleanup;
+  }
+  for (; handle->transfer_count < (uint32_t)max_concurrent_requests; ++handle->transfer_count) {
+    if (!(handle->transfers[handle->transfer_count].curl = curl_easy_init())) {
+      fprintf(stderr, "network:: Failed to initialise CURL.\n");
+      goto cleanup;
+    }
+  }
+
   if (!ticosd_get_string(handle->ticosd, "", "software_type", &handle->software_type) ||
       strlen(handle->software_type) == 0) {
     fprintf(stderr, "network:: Failed to get software_type\n");
@@ -351,11 +715,14 @@ sTicosdNetwork *ticosd_network_init(sTicosd *ticosd) {
     goto cleanup;
   }
 
+  if (!prv_network_build_headers(handle)) {
+    goto cleanup;
+  }
+
   return handle;
 
 cleanup:
-  free(handle->project_key_header);
-  free(handle);
+  ticosd_network_destroy(handle);
   return NULL;
 }
 
@@ -369,24 +736,47 @@ void ticosd_network_destroy(sTicosdNetwork *handle) {
     if (handle->curl) {
       curl_easy_cleanup(handle->curl);
     }
+    for (uint32_t i = 0; i < handle->transfer_count; ++i) {
+      curl_easy_cleanup(handle->transfers[i].curl);
+    }
+    free(handle->transfers);
+    if (handle->multi) {
+      curl_multi_cleanup(handle->multi);
+    }
+    // The share handle can only be cleaned up once no easy handle uses it anymore:
+    if (handle->share) {
+      curl_share_cleanup(handle->share);
+    }
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; ++i) {
+      pthread_mutex_destroy(&handle->share_locks[i]);
+    }
+    pthread_mutex_destroy(&handle->lock);
+    curl_slist_free_all(handle->json_headers);
+    curl_slist_free_all(handle->get_headers);
+    curl_slist_free_all(handle->json_gzip_headers);
+    curl_slist_free_all(handle->upload_headers[false]);
+    curl_slist_free_all(handle->upload_headers[true]);
     free(handle->project_key_header);
+    ticosd_nettiming_destroy(handle->timing);
     free(handle);
   }
 }
 
 /**
- * @brief Perform POST against a given endpoint
+ * @brief Performs a request to the ticos API on the given easy handle
  *
  * @param handle network object
+ * @param curl Easy handle, reset afterwards
  * @param endpoint Path
+ * @param method HTTP method
  * @param payload Data to send
  * @param data Data returned if available
  * @param len Length of data returned
- * @return A eTicosdNetworkResult value indicating whether the POST was successful or not.
+ * @return A eTicosdNetworkResult value indicating whether the request was successful or not.
  */
-eTicosdNetworkResult ticosd_network_post(sTicosdNetwork *handle, const char *endpoint,
-                                         enum TicosdHttpMethod method, const char *payload,
-                                         char **data, size_t *len) {
+static eTicosdNetworkResult prv_network_perform(sTicosdNetwork *handle, CURL *curl,
+                                                const char *endpoint, eTicosdHttpMethod method,
+                                                const char *payload, char **data, size_t *len) {
   char *url = prv_create_url(handle, endpoint);
   if (!url) {
     return kTicosdNetworkResult_ErrorRetryLater;
@@ -398,33 +788,19 @@ eTicosdNetworkResult ticosd_network_post(sTicosdNetwork *handle, const char *end
     recv_buf.size = 0;
   }
 
-  struct curl_slist *headers = NULL;
-  if (method != kTicosdHttpMethod_GET) {
-    headers = curl_slist_append(headers, "Accept: application/json");
-    headers = curl_slist_append(headers, "Content-Type: application/json");
-  }
-  headers = curl_slist_append(headers, "charset: utf-8");
-  headers = curl_slist_append(headers, "X-Tiwater-Debug: true");
-  headers = curl_slist_append(headers, handle->project_key_header);
-
-  curl_easy_setopt(handle->curl, CURLOPT_URL, url);
-  if (method == kTicosdHttpMethod_GET) {
-    curl_easy_setopt(handle->curl, CURLOPT_HTTPGET, 1L);
-  } else {
-    curl_easy_setopt(handle->curl, CURLOPT_POSTFIELDS, payload);
-  }
-  curl_easy_setopt(handle->curl, CURLOPT_HTTPHEADER, headers);
-  curl_easy_setopt(handle->curl, CURLOPT_NOPROGRESS, 1L);
-  curl_easy_setopt(handle->curl, CURLOPT_WRITEFUNCTION, prv_network_write_callback);
-  curl_easy_setopt(handle->curl, CURLOPT_WRITEDATA, (void *)&recv_buf);
-  if (method == kTicosdHttpMethod_PATCH) {
-    curl_easy_setopt(handle->curl, CURLOPT_CUSTOMREQUEST, "PATCH");
-  }
-  const CURLcode res = curl_easy_perform(handle->curl);
-  curl_slist_free_all(headers);
+  CURLcode res;
+  bool compressed;
+  do {
+    recv_buf.size = 0;
+    void *body = prv_network_setup_request(handle, curl, url, method, payload, &recv_buf);
+    compressed = body != NULL;
+    res = curl_easy_perform(curl);
+    prv_network_account_request(handle, curl, ticosd_nettiming_endpoint(endpoint));
+    free(body);
+  } while (prv_network_is_compression_rejected(handle, curl, res, compressed));
 
   const eTicosdNetworkResult result =
-    prv_check_error(handle, res, prv_method_as_string(method), url);
+    prv_check_error(handle, curl, res, prv_method_as_string(method), url);
 
   free(url);
 
@@ -439,56 +815,1129 @@ eTicosdNetworkResult ticosd_network_post(sTicosdNetwork *handle, const char *end
     }
   }
 
-  curl_easy_reset(handle->curl);
+  curl_easy_reset(curl);
   return result;
 }
 
-eTicosdNetworkResult ticosd_network_file_upload(sTicosdNetwork *handle, const char *commit_endpoint,
-                                                const char *filename, bool is_gzipped) {
-  eTicosdNetworkResult rc;
-  char *upload_url = NULL;
-  char *path = NULL;
-
-  const sTicosdDeviceSettings *settings = ticosd_get_device_settings(handle->ticosd);
+/**
+ * @brief Perform POST against a given endpoint
+ *
+ * @param handle network object
+ * @param endpoint Path
+ * @param payload Data to send
+ * @param data Data returned if available
+ * @param len Length of data returned
+ * @return A eTicosdNetworkResult value indicating whether the POST was successful or not.
+ */
+eTicosdNetworkResult ticosd_network_post(sTicosdNetwork *handle, const char *endpoint,
+                                         enum TicosdHttpMethod method, const char *payload,
+                                         char **data, size_t *len) {
+  return prv_network_perform(handle, handle->curl, endpoint, method, payload, data, len);
+}
 
-  struct stat st;
-  if (stat(filename, &st) == -1) {
-    fprintf(stderr, "network:: Failed to stat file '%s' : %s\n", filename, strerror(errno));
-    rc = kTicosdNetworkResult_ErrorNoRetry;
-    goto cleanup;
+/**
+ * @brief Starts a request of a batch on a free easy handle of the pool
+ *
+ * @param handle network object
+ * @param transfer Free transfer of the pool
+ * @param request Request to start
+ * @param index Index of the request in the batch
+ * @return true Successfully started the request
+ * @return false Failed to start, the transfer is left free
+ */
+static bool prv_network_start_transfer(sTicosdNetwork *handle, sTicosdNetworkTransfer *transfer,
+                                       const sTicosdNetworkRequest *request, uint32_t index) {
+  if (!(transfer->url = prv_create_url(handle, request->endpoint))) {
+    return false;
   }
-
-  if (ticos_asprintf(
-        &path,
-        "/chunks/%s/fileUrl?type=Coredump&hardwareVersion=%s&softwareType=%s&softwareVersion=%s",
-        settings->device_id, settings->hardware_version, handle->software_type,
-        handle->software_version) == -1) {
-    fprintf(stderr, "ticosd:: Unable to allocate memory for upload preparation path.\n");
-    rc = kTicosdNetworkResult_ErrorRetryLater;
-    goto cleanup;
+  transfer->request = request;
+  transfer->method = request->method;
+  transfer->index = index;
+  transfer->recv_buf = (struct _write_callback){0};
+  transfer->body = prv_network_setup_request(handle, transfer->curl, transfer->url,
+                                             request->method, request->payload,
+                                             &transfer->recv_buf);
+  curl_easy_setopt(transfer->curl, CURLOPT_PRIVATE, (void *)transfer);
+
+  if (curl_multi_add_handle(handle->multi, transfer->curl) != CURLM_OK) {
+    fprintf(stderr, "network:: Failed to start %s request to %s.\n",
+            prv_method_as_string(request->method), transfer->url);
+    curl_easy_reset(transfer->curl);
+    free(transfer->url);
+    free(transfer->body);
+    return false;
   }
+  transfer->in_flight = true;
+  return true;
+}
 
-  rc = prv_file_upload_prepare(handle, path, st.st_size, &upload_url, is_gzipped);
-  if (rc != kTicosdNetworkResult_OK) {
-    goto cleanup;
-  }
+/**
+ * @brief Returns a transfer of the pool to the free ones, keeping its connection for reuse
+ *
+ * @param handle network object
+ * @param transfer Transfer in flight
+ */
+static void prv_network_finish_transfer(sTicosdNetwork *handle, sTicosdNetworkTransfer *transfer) {
+  curl_multi_remove_handle(handle->multi, transfer->curl);
+  curl_easy_reset(transfer->curl);
+  free(transfer->url);
+  free(transfer->body);
+  transfer->url = NULL;
+  transfer->body = NULL;
+  transfer->in_flight = false;
+}
 
-  rc = prv_file_upload(handle, upload_url, filename, st.st_size, &upload_url, is_gzipped);
-  if (rc != kTicosdNetworkResult_OK) {
-    goto cleanup;
+static sTicosdNetworkTransfer *prv_network_free_transfer(sTicosdNetwork *handle) {
+  for (uint32_t i = 0; i < handle->transfer_count; ++i) {
+    if (!handle->transfers[i].in_flight) {
+      return &handle->transfers[i];
+    }
   }
+  return NULL;
+}
 
-  rc = prv_file_upload_commit(handle, commit_endpoint, upload_url, st.st_size);
-  if (rc != kTicosdNetworkResult_OK) {
-    goto cleanup;
+/**
+ * @brief Performs a batch of requests, with up to "max_concurrent_requests" of them in flight
+ *
+ * Requests are started in order, and their results reported as soon as they complete, in any
+ * order. No request is started after one fails with a retry-able error, so that the requests that
+ * succeeded always follow the same ones in the batch order, save for those already in flight: the
+ * caller must keep these from being sent again along with the failed one.
+ *
+ * @param handle network object
+ * @param requests Requests to perform
+ * @param count Number of requests
+ * @param[out] results Result of each request, kTicosdNetworkResult_ErrorRetryLater for those that
+ * were not started
+ * @param callback Called as each request completes, may be NULL
+ * @param ctx Context passed to the callback
+ */
+void ticosd_network_post_batch(sTicosdNetwork *handle, const sTicosdNetworkRequest *requests,
+                               uint32_t count, eTicosdNetworkResult *results,
+                               TicosdNetworkCompleteCallback callback, void *ctx) {
+  for (uint32_t i = 0; i < count; ++i) {
+    results[i] = kTicosdNetworkResult_ErrorRetryLater;
   }
 
-  fprintf(stderr, "network:: Successfully transmitted file '%s'\n", filename);
+  uint32_t next = 0;
+  uint32_t in_flight = 0;
+  bool stop = false;
+  while (true) {
+    sTicosdNetworkTransfer *transfer;
+    while (!stop && next < count && (transfer = prv_network_free_transfer(handle))) {
+      if (!prv_network_start_transfer(handle, transfer, &requests[next], next)) {
+        stop = true;
+        break;
+      }
+      next++;
+      in_flight++;
+    }
+    if (in_flight == 0) {
+      break;
+    }
 
-  unlink(filename);
-  rc = kTicosdNetworkResult_OK;
+    int running;
+    CURLMcode mc = curl_multi_perform(handle->multi, &running);
+    if (mc == CURLM_OK && running > 0) {
+      mc = curl_multi_wait(handle->multi, NULL, 0, 1000, NULL);
+    }
+    if (mc != CURLM_OK) {
+      // The requests in flight are left with kTicosdNetworkResult_ErrorRetryLater:
+      fprintf(stderr, "network:: Failed to perform requests: %s\n", curl_multi_strerror(mc));
+      for (uint32_t i = 0; i < handle->transfer_count; ++i) {
+        if (handle->transfers[i].in_flight) {
+          prv_network_finish_transfer(handle, &handle->transfers[i]);
+        }
+      }
+      break;
+    }
 
-cleanup:
-  free(upload_url);
+    CURLMsg *msg;
+    int msgs_left;
+    while ((msg = curl_multi_info_read(handle->multi, &msgs_left))) {
+      if (msg->msg != CURLMSG_DONE) {
+        continue;
+      }
+      char *private;
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &private);
+      transfer = (sTicosdNetworkTransfer *)private;
+      prv_network_account_request(handle, transfer->curl,
+                                  ticosd_nettiming_endpoint(transfer->request->endpoint));
+      if (prv_network_is_compression_rejected(handle, transfer->curl, msg->data.result,
+                                              transfer->body != NULL)) {
+        // Sent again uncompressed, on the same easy handle:
+        const sTicosdNetworkRequest *request = transfer->request;
+        const uint32_t index = transfer->index;
+        prv_network_finish_transfer(handle, transfer);
+        if (prv_network_start_transfer(handle, transfer, request, index)) {
+          continue;
+        }
+        stop = true;
+        if (callback) {
+          callback(ctx, index, kTicosdNetworkResult_ErrorRetryLater);
+        }
+        in_flight--;
+        continue;
+      }
+      const eTicosdNetworkResult result =
+        prv_check_error(handle, transfer->curl, msg->data.result,
+                        prv_method_as_string(transfer->method), transfer->url);
+      results[transfer->index] = result;
+      if (result == kTicosdNetworkResult_ErrorRetryLater) {
+        stop = true;
+      }
+      if (callback) {
+        callback(ctx, transfer->index, result);
+      }
+      prv_network_finish_transfer(handle, transfer);
+      in_flight--;
+    }
+  }
+}
+
+/**
+ * @brief Returns the longest Retry-After delay received with a 429 or 503 response since the last
+ * call, and forgets it
+ *
+ * @param handle network object
+ * @return Delay in seconds, 0 if none
+ */
+uint32_t ticosd_network_take_retry_after(sTicosdNetwork *handle) {
+  pthread_mutex_lock(&handle->lock);
+  const uint32_t retry_after_s = handle->retry_after_s;
+  handle->retry_after_s = 0;
+  pthread_mutex_unlock(&handle->lock);
+  return retry_after_s;
+}
+
+/**
+ * @brief Resolves the ticos API host and connects to it ahead of the requests, if the
+ * "network"/"warm_up" configuration key is set
+ *
+ * Meant to be called when entries start being queued, while they are held back for more to come,
+ * so that sending them does not wait for the DNS lookup and the TCP and TLS handshakes. A HEAD
+ * request is performed rather than a bare connect, as libcurl does not hand connect-only
+ * connections over to other requests. Nothing is done if a request was performed recently, its
+ * connection is still there.
+ *
+ * @param handle network object
+ */
+void ticosd_network_warm_up(sTicosdNetwork *handle) {
+  if (!handle->warm_up) {
+    return;
+  }
+  pthread_mutex_lock(&handle->lock);
+  const uint64_t last_activity_ms = handle->last_activity_ms;
+  pthread_mutex_unlock(&handle->lock);
+  if (last_activity_ms != 0 && prv_network_now_ms() - last_activity_ms < NETWORK_WARM_UP_IDLE_MS) {
+    return;
+  }
+
+  prv_network_setup_connection(handle, handle->curl);
+  curl_easy_setopt(handle->curl, CURLOPT_URL, handle->base_url);
+  curl_easy_setopt(handle->curl, CURLOPT_NOBODY, 1L);
+  curl_easy_setopt(handle->curl, CURLOPT_CONNECTTIMEOUT, NETWORK_WARM_UP_TIMEOUT_S);
+  // Failures are reported by the requests that follow:
+  curl_easy_perform(handle->curl);
+  prv_network_account_connects(handle, handle->curl);
+  curl_easy_reset(handle->curl);
+}
+
+/**
+ * @brief Returns the number of requests performed so far, and of connections made for them
+ *
+ * @param handle network object
+ * @param[out] stats Statistics
+ */
+void ticosd_network_get_stats(sTicosdNetwork *handle, sTicosdNetworkStats *stats) {
+  pthread_mutex_lock(&handle->lock);
+  *stats = handle->stats;
+  pthread_mutex_unlock(&handle->lock);
+}
+
+/**
+ * @brief Returns the timing statistics of the requests performed so far
+ *
+ * @param handle network object
+ * @return Statistics, valid as long as the network object
+ */
+sTicosdNetTiming *ticosd_network_get_timing(sTicosdNetwork *handle) { return handle->timing; }
+
+static char *prv_file_upload_prepare_path(sTicosdNetwork *handle) {
+  char *path;
+  const sTicosdDeviceSettings *settings = ticosd_get_device_settings(handle->ticosd);
+  if (ticos_asprintf(
+        &path,
+        "/chunks/%s/fileUrl?type=Coredump&hardwareVersion=%s&softwareType=%s&softwareVersion=%s",
+        settings->device_id, settings->hardware_version, handle->software_type,
+        handle->software_version) == -1) {
+    fprintf(stderr, "network:: Unable to allocate memory for upload preparation path.\n");
+    return NULL;
+  }
+  return path;
+}
+
+/**
+ * @brief Gets the URL to upload a coredump to
+ *
+ * @param handle network object
+ * @param curl Easy handle to perform the request on
+ * @param[out] upload_url URL to upload to, to be freed
+ * @return A eTicosdNetworkResult value indicating whether the request was successful or not.
+ */
+static eTicosdNetworkResult prv_file_upload_prepare(sTicosdNetwork *handle, CURL *curl,
+                                                    char **upload_url) {
+  char *path = NULL;
+  char *recvdata = NULL;
+  size_t recvlen;
+  eTicosdNetworkResult rc;
+  *upload_url = NULL;
+
+  if (!(path = prv_file_upload_prepare_path(handle))) {
+    return kTicosdNetworkResult_ErrorRetryLater;
+  }
+
+  rc = prv_network_perform(handle, curl, path, kTicosdHttpMethod_GET, NULL, &recvdata, &recvlen);
+  if (rc != kTicosdNetworkResult_OK) {
+    goto cleanup;
+  }
+
+  if (!prv_parse_file_upload_prepare_response(recvdata, upload_url)) {
+    rc = kTicosdNetworkResult_ErrorRetryLater;
+    goto cleanup;
+  }
+
+cleanup:
+  free(path);
+  free(recvdata);
   return rc;
 }
+
+/**
+ * @brief Creates the form of a coredump upload, with the coredump part left to the caller
+ *
+ * @param curl Easy handle the form is sent with
+ * @param[out] file_part Part to set the coredump data of
+ * @return Form, NULL on failure
+ */
+static curl_mime *prv_file_upload_create_form(CURL *curl, curl_mimepart **file_part) {
+  curl_mime *mime = curl_mime_init(curl);
+  if (!mime) {
+    return NULL;
+  }
+  curl_mimepart *part = curl_mime_addpart(mime);
+  if (!part || curl_mime_name(part, "type") != CURLE_OK ||
+      curl_mime_data(part, "COREDUMP", CURL_ZERO_TERMINATED) != CURLE_OK ||
+      !(*file_part = curl_mime_addpart(mime)) ||
+      curl_mime_name(*file_part, "file") != CURLE_OK) {
+    fprintf(stderr, "network:: Failed to create file upload form.\n");
+    curl_mime_free(mime);
+    return NULL;
+  }
+  return mime;
+}
+
+static void prv_file_upload_setup(sTicosdNetwork *handle, CURL *curl, const char *url,
+                                  curl_mime *mime, bool is_gzipped,
+                                  struct _write_callback *recv_buf) {
+  prv_network_setup_connection(handle, curl);
+  curl_easy_setopt(curl, CURLOPT_URL, url);
+  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, handle->upload_headers[is_gzipped]);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, prv_network_write_callback);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)recv_buf);
+  curl_easy_setopt(curl, CURLOPT_MIMEPOST, mime);
+}
+
+static eTicosdNetworkResult prv_file_upload_finish(sTicosdNetwork *handle, CURL *curl,
+                                                   CURLcode res, const char *url,
+                                                   const struct _write_callback *recv_buf,
+                                                   char **file_url) {
+  prv_network_account_request(handle, curl, kTicosdNetTimingEndpoint_Upload);
+  eTicosdNetworkResult rc = prv_check_error(handle, curl, res, "POST", url);
+  if (rc == kTicosdNetworkResult_OK && !prv_parse_file_upload_response(recv_buf->buf, file_url)) {
+    rc = kTicosdNetworkResult_ErrorRetryLater;
+  }
+  return rc;
+}
+
+static eTicosdNetworkResult prv_file_upload(sTicosdNetwork *handle, CURL *curl, const char *url,
+                                            curl_mime *mime, bool is_gzipped, char **file_url) {
+  struct _write_callback recv_buf = {0};
+  *file_url = NULL;
+
+  if (!(recv_buf.buf = malloc(1))) {
+    return kTicosdNetworkResult_ErrorRetryLater;
+  }
+
+  prv_file_upload_setup(handle, curl, url, mime, is_gzipped, &recv_buf);
+  const CURLcode res = curl_easy_perform(curl);
+  const eTicosdNetworkResult rc =
+    prv_file_upload_finish(handle, curl, res, url, &recv_buf, file_url);
+
+  curl_easy_reset(curl);
+  free(recv_buf.buf);
+  return rc;
+}
+
+static char *prv_file_upload_commit_payload(const char *url, uint64_t filesize) {
+  char *payload;
+  const char *payload_fmt = "{"
+                            "  \"url\": \"%s\","
+                            "  \"kind\": \"COREDUMP\","
+                            "  \"size\": %llu"
+                            "}";
+  if (ticos_asprintf(&payload, payload_fmt, url, (unsigned long long)filesize) == -1) {
+    return NULL;
+  }
+  return payload;
+}
+
+static eTicosdNetworkResult prv_file_upload_commit(sTicosdNetwork *handle, CURL *curl,
+                                                   const char *endpoint, const char *url,
+                                                   const size_t filesize) {
+  char *payload = prv_file_upload_commit_payload(url, filesize);
+  if (!payload) {
+    return kTicosdNetworkResult_ErrorRetryLater;
+  }
+  const eTicosdNetworkResult rc =
+    prv_network_perform(handle, curl, endpoint, kTicosdHttpMethod_POST, payload, NULL, 0);
+  free(payload);
+  return rc;
+}
+
+/**
+ * @brief Sets up an easy handle to upload a part of a file, see the protocol above
+ *
+ * @param handle network object
+ * @param curl Easy handle
+ * @param progress Progress of the upload, the part starts at its offset
+ * @param data Data of the part, kept until the part is uploaded
+ * @param size Size of the part
+ * @param is_gzipped Whether the file is gzipped
+ * @param[out] headers Headers of the request, to be freed once the part is uploaded
+ * @param recv_buf Buffer receiving the response
+ * @return true Successfully set up the request
+ * @return false Failed to allocate it
+ */
+static bool prv_file_upload_part_setup(sTicosdNetwork *handle, CURL *curl,
+                                       const sTicosdUploadProgress *progress, const void *data,
+                                       size_t size, bool is_gzipped, struct curl_slist **headers,
+                                       struct _write_callback *recv_buf) {
+  char *range = NULL;
+  char *checksum = NULL;
+  const bool is_last = progress->offset + size == progress->file_size;
+  bool result = false;
+
+  if (ticos_asprintf(&range, "Content-Range: bytes %llu-%llu/%llu",
+                     (unsigned long long)progress->offset,
+                     (unsigned long long)(progress->offset + size - 1),
+                     (unsigned long long)progress->file_size) == -1 ||
+      ticos_asprintf(&checksum, "X-Ticos-Part-CRC32C: %08x", ticos_crc32c(0, data, size)) == -1 ||
+      !prv_network_append_header(headers, "Content-Type: application/octet-stream") ||
+      !prv_network_append_header(headers, range) ||
+      !prv_network_append_header(headers, checksum) ||
+      (is_gzipped && !prv_network_append_header(headers, "Content-Encoding: gzip")) ||
+      !prv_network_append_header(headers, "X-Tiwater-Debug: true") ||
+      (is_last && !(recv_buf->buf = malloc(1)))) {
+    goto cleanup;
+  }
+
+  prv_network_setup_connection(handle, curl);
+  curl_easy_setopt(curl, CURLOPT_URL, progress->upload_url);
+  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, *headers);
+  curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)size);
+  curl_easy_setopt(curl, CURLOPT_POSTFIELDS, data);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, prv_network_write_callback);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)recv_buf);
+  result = true;
+
+cleanup:
+  free(checksum);
+  free(range);
+  return result;
+}
+
+/**
+ * @brief Processes the response to the upload of a part of a file
+ *
+ * @param handle network object
+ * @param curl Easy handle the part was uploaded on
+ * @param res Result of the request
+ * @param progress Progress of the upload, the part starts at its offset
+ * @param is_resumed Whether the upload URL was saved by an earlier attempt
+ * @param size Size of the part
+ * @param recv_buf Buffer that received the response
+ * @param[out] file_url URL of the uploaded file, once the last part is uploaded
+ * @param[out] restart Set if the server lost the preceding parts, or no longer accepts the saved
+ * upload URL
+ * @return A eTicosdNetworkResult value indicating whether the part was uploaded or not.
+ */
+static eTicosdNetworkResult prv_file_upload_part_finish(sTicosdNetwork *handle, CURL *curl,
+                                                        CURLcode res,
+                                                        const sTicosdUploadProgress *progress,
+                                                        bool is_resumed, size_t size,
+                                                        const struct _write_callback *recv_buf,
+                                                        char **file_url, bool *restart) {
+  eTicosdNetworkResult rc = kTicosdNetworkResult_ErrorRetryLater;
+  const bool is_last = progress->offset + size == progress->file_size;
+
+  prv_network_account_request(handle, curl, kTicosdNetTimingEndpoint_UploadPart);
+  long http_code = 0;
+  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+  if (res == CURLE_OK && (http_code == 409 || http_code == 416)) {
+    fprintf(stderr, "network:: Server lost the upload at byte %llu, starting over.\n",
+            (unsigned long long)progress->offset);
+    *restart = true;
+  } else if (res == CURLE_OK && http_code == 422) {
+    fprintf(stderr, "network:: Checksum mismatch at byte %llu, sending again later.\n",
+            (unsigned long long)progress->offset);
+  } else {
+    rc = prv_check_error(handle, curl, res, "POST", progress->upload_url);
+    if (rc == kTicosdNetworkResult_ErrorNoRetry && is_resumed) {
+      // Upload URLs expire, one saved by an earlier attempt may be rejected with 403 or 404:
+      fprintf(stderr, "network:: Saved upload URL rejected (HTTP code %ld), starting over.\n",
+              http_code);
+      *restart = true;
+      rc = kTicosdNetworkResult_ErrorRetryLater;
+    } else if (rc == kTicosdNetworkResult_OK && is_last &&
+               !prv_parse_file_upload_response(recv_buf->buf, file_url)) {
+      rc = kTicosdNetworkResult_ErrorRetryLater;
+    }
+  }
+  return rc;
+}
+
+/**
+ * @brief Initialises the upload of a file of a batch, resuming it if it was interrupted
+ *
+ * @param handle network object
+ * @param job Upload, zeroed
+ * @param file File to upload
+ * @return true The file can be uploaded
+ * @return false The file is gone
+ */
+static bool prv_file_upload_job_init(sTicosdNetwork *handle, sTicosdFileUploadJob *job,
+                                     const sTicosdNetworkFile *file) {
+  job->file = file;
+  job->fd = -1;
+
+  struct stat st;
+  if (stat(file->filename, &st) == -1) {
+    fprintf(stderr, "network:: Failed to stat file '%s' : %s\n", file->filename, strerror(errno));
+    return false;
+  }
+  job->file_size = st.st_size;
+  job->resumable = handle->upload_part_size > 0 && st.st_size > 0;
+
+  if (job->resumable && ticosd_upload_progress_load(file->filename, &job->progress) &&
+      job->progress.file_size == job->file_size &&
+      job->progress.part_size == handle->upload_part_size) {
+    fprintf(stderr, "network:: Resuming upload of '%s' at byte %llu of %llu\n", file->filename,
+            (unsigned long long)job->progress.offset, (unsigned long long)job->file_size);
+    job->stage = kFileUploadStage_Upload;
+    job->resumed = true;
+  } else {
+    ticosd_upload_progress_free(&job->progress);
+    job->progress.file_size = job->file_size;
+    job->progress.part_size = handle->upload_part_size;
+    job->progress.offset = 0;
+    job->stage = kFileUploadStage_Prepare;
+  }
+  return true;
+}
+
+/**
+ * @brief Frees the request of the current stage of an upload and resets its easy handle
+ */
+static void prv_file_upload_job_release(sTicosdFileUploadJob *job, CURL *curl) {
+  // The form and the headers can only be freed once the easy handle no longer uses them:
+  curl_easy_reset(curl);
+  curl_mime_free(job->mime);
+  curl_slist_free_all(job->part_headers);
+  free(job->url);
+  free(job->payload);
+  free(job->body);
+  free(job->recv_buf.buf);
+  job->mime = NULL;
+  job->part_headers = NULL;
+  job->url = NULL;
+  job->payload = NULL;
+  job->body = NULL;
+  job->recv_buf = (struct _write_callback){0};
+}
+
+/**
+ * @brief Starts the request of the current stage of an upload, on a free easy handle of the pool
+ *
+ * @param handle network object
+ * @param job Upload
+ * @param transfer Free transfer of the pool
+ * @param commit_endpoint Path to commit the upload to
+ * @return true Successfully started the request
+ * @return false Failed to start, the transfer is left free
+ */
+static bool prv_file_upload_job_start(sTicosdNetwork *handle, sTicosdFileUploadJob *job,
+                                      sTicosdNetworkTransfer *transfer,
+                                      const char *commit_endpoint) {
+  CURL *curl = transfer->curl;
+  const char *filename = job->file->filename;
+  bool result = false;
+
+  switch (job->stage) {
+    case kFileUploadStage_Prepare: {
+      char *path = prv_file_upload_prepare_path(handle);
+      job->url = path ? prv_create_url(handle, path) : NULL;
+      free(path);
+      if (!job->url || !(job->recv_buf.buf = malloc(1))) {
+        goto cleanup;
+      }
+      job->body = prv_network_setup_request(handle, curl, job->url, kTicosdHttpMethod_GET, NULL,
+                                            &job->recv_buf);
+      break;
+    }
+    case kFileUploadStage_Upload:
+      if (job->resumable) {
+        if ((!job->part && !(job->part = malloc(job->progress.part_size))) ||
+            (job->fd == -1 && (job->fd = open(filename, O_RDONLY | O_CLOEXEC)) == -1)) {
+          fprintf(stderr, "network:: Failed to read '%s'\n", filename);
+          goto cleanup;
+        }
+        job->part_size = TICOS_MIN(job->progress.part_size, job->file_size - job->progress.offset);
+        if (pread(job->fd, job->part, job->part_size, job->progress.offset) !=
+            (ssize_t)job->part_size) {
+          fprintf(stderr, "network:: Failed to read '%s'\n", filename);
+          goto cleanup;
+        }
+        if (!prv_file_upload_part_setup(handle, curl, &job->progress, job->part, job->part_size,
+                                        job->file->is_gzipped, &job->part_headers,
+                                        &job->recv_buf)) {
+          goto cleanup;
+        }
+      } else {
+        curl_mimepart *file_part;
+        if (!(job->mime = prv_file_upload_create_form(curl, &file_part)) ||
+            curl_mime_filedata(file_part, filename) != CURLE_OK ||
+            !(job->recv_buf.buf = malloc(1))) {
+          goto cleanup;
+        }
+        prv_file_upload_setup(handle, curl, job->progress.upload_url, job->mime,
+                              job->file->is_gzipped, &job->recv_buf);
+      }
+      break;
+    case kFileUploadStage_Commit:
+      if (!(job->payload = prv_file_upload_commit_payload(job->file_url, job->file_size)) ||
+          !(job->url = prv_create_url(handle, commit_endpoint))) {
+        goto cleanup;
+      }
+      job->body = prv_network_setup_request(handle, curl, job->url, kTicosdHttpMethod_POST,
+                                            job->payload, &job->recv_buf);
+      break;
+    default:
+      goto cleanup;
+  }
+
+  curl_easy_setopt(curl, CURLOPT_PRIVATE, (void *)job);
+  if (curl_multi_add_handle(handle->multi, curl) != CURLM_OK) {
+    fprintf(stderr, "network:: Failed to start upload of '%s'.\n", filename);
+    goto cleanup;
+  }
+  transfer->in_flight = true;
+  job->transfer = transfer;
+  if (job->start_ms[job->stage] == 0) {
+    job->start_ms[job->stage] = prv_network_now_ms();
+  }
+  result = true;
+
+cleanup:
+  if (!result) {
+    prv_file_upload_job_release(job, curl);
+  }
+  return result;
+}
+
+static void prv_file_upload_job_end_request(sTicosdNetwork *handle, sTicosdFileUploadJob *job) {
+  curl_multi_remove_handle(handle->multi, job->transfer->curl);
+  prv_file_upload_job_release(job, job->transfer->curl);
+  job->transfer->in_flight = false;
+  job->transfer = NULL;
+}
+
+/**
+ * @brief Processes the response to the request of the current stage of an upload, and moves on to
+ * the next stage if it succeeded
+ *
+ * @param handle network object
+ * @param job Upload
+ * @param res Result of the request
+ * @return kTicosdNetworkResult_OK if the upload goes on or completed, the error it failed with
+ * otherwise
+ */
+static eTicosdNetworkResult prv_file_upload_job_complete(sTicosdNetwork *handle,
+                                                         sTicosdFileUploadJob *job, CURLcode res) {
+  CURL *curl = job->transfer->curl;
+  const char *filename = job->file->filename;
+  eTicosdNetworkResult rc = kTicosdNetworkResult_ErrorRetryLater;
+  bool restart = false;
+  job->end_ms[job->stage] = prv_network_now_ms();
+
+  switch (job->stage) {
+    case kFileUploadStage_Prepare:
+      prv_network_account_request(handle, curl, kTicosdNetTimingEndpoint_UploadPrepare);
+      rc = prv_check_error(handle, curl, res, "GET", job->url);
+      if (rc == kTicosdNetworkResult_OK &&
+          !prv_parse_file_upload_prepare_response(job->recv_buf.buf, &job->progress.upload_url)) {
+        rc = kTicosdNetworkResult_ErrorRetryLater;
+      }
+      if (rc == kTicosdNetworkResult_OK) {
+        job->stage = kFileUploadStage_Upload;
+      }
+      break;
+    case kFileUploadStage_Upload:
+      if (job->resumable) {
+        rc = prv_file_upload_part_finish(handle, curl, res, &job->progress, job->resumed,
+                                         job->part_size, &job->recv_buf, &job->file_url, &restart);
+        if (rc != kTicosdNetworkResult_OK) {
+          break;
+        }
+        job->progress.offset += job->part_size;
+        // Not after the last part, whose response is needed to commit the upload. If committing
+        // fails, the last part is sent again to get it:
+        if (job->progress.offset < job->file_size) {
+          ticosd_upload_progress_save(filename, &job->progress);
+          break;
+        }
+      } else {
+        rc = prv_file_upload_finish(handle, curl, res, job->progress.upload_url, &job->recv_buf,
+                                    &job->file_url);
+        if (rc != kTicosdNetworkResult_OK) {
+          break;
+        }
+      }
+      job->stage = kFileUploadStage_Commit;
+      break;
+    case kFileUploadStage_Commit:
+      prv_network_account_request(handle, curl, kTicosdNetTimingEndpoint_UploadCommit);
+      if (prv_network_is_compression_rejected(handle, curl, res, job->body != NULL)) {
+        // Sent again uncompressed:
+        rc = kTicosdNetworkResult_OK;
+        break;
+      }
+      rc = prv_check_error(handle, curl, res, "POST", job->url);
+      if (rc == kTicosdNetworkResult_OK) {
+        fprintf(stderr, "network:: Successfully transmitted file '%s'\n", filename);
+        ticosd_upload_progress_remove(filename);
+        unlink(filename);
+        job->stage = kFileUploadStage_Done;
+      }
+      break;
+    default:
+      break;
+  }
+
+  prv_file_upload_job_end_request(handle, job);
+  if (restart || rc == kTicosdNetworkResult_ErrorNoRetry) {
+    ticosd_upload_progress_remove(filename);
+  }
+  return rc;
+}
+
+static void prv_file_upload_job_free(sTicosdFileUploadJob *job) {
+  if (job->fd != -1) {
+    close(job->fd);
+  }
+  free(job->part);
+  free(job->file_url);
+  ticosd_upload_progress_free(&job->progress);
+}
+
+/**
+ * @brief Returns how long a stage of an upload ran at the same time as stages of any upload of
+ * the batch
+ */
+static uint64_t prv_file_upload_overlap_ms(const sTicosdFileUploadJob *jobs, uint32_t count,
+                                           uint32_t index, eTicosdFileUploadStage stage) {
+  const uint64_t end = jobs[index].end_ms[stage];
+  uint64_t overlap = 0;
+  // Walks the stage in the pieces delimited by the bounds of the other stages, and sums those
+  // during which another stage ran:
+  uint64_t from = jobs[index].start_ms[stage];
+  while (from < end) {
+    uint64_t to = end;
+    bool covered = false;
+    for (uint32_t i = 0; i < count; ++i) {
+      for (int s = 0; s < kFileUploadStage_Done; ++s) {
+        const uint64_t start_ms = jobs[i].start_ms[s];
+        const uint64_t end_ms = jobs[i].end_ms[s];
+        if ((i == index && s == (int)stage) || end_ms == 0) {
+          continue;
+        }
+        if (start_ms > from && start_ms < to) {
+          to = start_ms;
+        }
+        if (end_ms > from && end_ms < to) {
+          to = end_ms;
+        }
+        covered |= start_ms <= from && end_ms > from;
+      }
+    }
+    if (covered) {
+      overlap += to - from;
+    }
+    from = to;
+  }
+  return overlap;
+}
+
+/**
+ * @brief Logs when each stage of the uploads of a batch ran, relative to the start of the batch,
+ * and how long it overlapped with the others
+ */
+static void prv_file_upload_trace(const sTicosdFileUploadJob *jobs, uint32_t count,
+                                  uint64_t batch_start_ms) {
+  static const char *const stage_names[kFileUploadStage_Done] = {"prepare", "upload", "commit"};
+  uint64_t busy_ms = 0;
+  uint64_t overlap_ms = 0;
+  for (uint32_t i = 0; i < count; ++i) {
+    for (int s = 0; s < kFileUploadStage_Done; ++s) {
+      if (jobs[i].end_ms[s] == 0) {
+        continue;
+      }
+      const uint64_t overlap = prv_file_upload_overlap_ms(jobs, count, i, s);
+      fprintf(stderr, "network:: Upload trace '%s' %s: %llu-%llu ms, %llu ms overlapped\n",
+              jobs[i].file->filename, stage_names[s],
+              (unsigned long long)(jobs[i].start_ms[s] - batch_start_ms),
+              (unsigned long long)(jobs[i].end_ms[s] - batch_start_ms),
+              (unsigned long long)overlap);
+      busy_ms += jobs[i].end_ms[s] - jobs[i].start_ms[s];
+      overlap_ms += overlap;
+    }
+  }
+  fprintf(stderr,
+          "network:: Upload trace: %u files in %llu ms, stages took %llu ms, %llu ms of which "
+          "overlapped\n",
+          count, (unsigned long long)(prv_network_now_ms() - batch_start_ms),
+          (unsigned long long)busy_ms, (unsigned long long)overlap_ms);
+}
+
+static void prv_file_upload_job_done(sTicosdFileUploadJob *jobs, uint32_t index,
+                                     eTicosdNetworkResult result, eTicosdNetworkResult *results,
+                                     TicosdNetworkCompleteCallback callback, void *ctx) {
+  jobs[index].stage = kFileUploadStage_Done;
+  results[index] = result;
+  if (callback) {
+    callback(ctx, index, result);
+  }
+}
+
+/**
+ * @brief Uploads a batch of files, pipelining the stages of their uploads
+ *
+ * Each file goes through three requests: getting an upload URL, uploading to it and committing
+ * the upload. The files are uploaded one at a time, in order, as they compete for the same uplink.
+ * Meanwhile, the upload URLs of the next NETWORK_UPLOAD_PREFETCH_COUNT files are requested, and
+ * the files already uploaded are committed, on the other easy handles of the pool. The ticos API
+ * has no request committing several uploads at once, the commits are sent concurrently instead.
+ *
+ * No upload is started after one fails with a retry-able error, so that the files that were
+ * uploaded always follow the same ones in the batch order, save for those already in flight.
+ * In developer mode, the times each stage ran are logged once the batch completes.
+ *
+ * @param handle network object
+ * @param commit_endpoint Path to commit the uploads to
+ * @param files Files to upload, deleted once uploaded
+ * @param count Number of files
+ * @param[out] results Result of each upload, kTicosdNetworkResult_ErrorRetryLater for those that
+ * were not completed
+ * @param callback Called as each upload completes, may be NULL
+ * @param ctx Context passed to the callback
+ */
+void ticosd_network_file_upload_batch(sTicosdNetwork *handle, const char *commit_endpoint,
+                                      const sTicosdNetworkFile *files, uint32_t count,
+                                      eTicosdNetworkResult *results,
+                                      TicosdNetworkCompleteCallback callback, void *ctx) {
+  for (uint32_t i = 0; i < count; ++i) {
+    results[i] = kTicosdNetworkResult_ErrorRetryLater;
+  }
+  sTicosdFileUploadJob *jobs = calloc(count, sizeof(sTicosdFileUploadJob));
+  if (!jobs) {
+    fprintf(stderr, "network:: Failed to allocate memory for uploads\n");
+    return;
+  }
+  const uint64_t batch_start_ms = prv_network_now_ms();
+  for (uint32_t i = 0; i < count; ++i) {
+    if (!prv_file_upload_job_init(handle, &jobs[i], &files[i])) {
+      prv_file_upload_job_done(jobs, i, kTicosdNetworkResult_ErrorNoRetry, results, callback, ctx);
+    }
+  }
+
+  uint32_t in_flight = 0;
+  bool stop = false;
+  while (true) {
+    sTicosdNetworkTransfer *transfer;
+    // Commits first, as they complete the uploads, then the upload of the current file and the
+    // preparation of the next ones:
+    for (uint32_t i = 0; i < count && (transfer = prv_network_free_transfer(handle)); ++i) {
+      if (jobs[i].stage != kFileUploadStage_Commit || jobs[i].transfer) {
+        continue;
+      }
+      if (prv_file_upload_job_start(handle, &jobs[i], transfer, commit_endpoint)) {
+        in_flight++;
+      } else {
+        prv_file_upload_job_done(jobs, i, kTicosdNetworkResult_ErrorRetryLater, results, callback,
+                                 ctx);
+        stop = true;
+      }
+    }
+    uint32_t current = 0;
+    while (current < count && jobs[current].stage != kFileUploadStage_Prepare &&
+           jobs[current].stage != kFileUploadStage_Upload) {
+      current++;
+    }
+    for (uint32_t i = current;
+         !stop && i < count && i <= current + NETWORK_UPLOAD_PREFETCH_COUNT &&
+         (transfer = prv_network_free_transfer(handle));
+         ++i) {
+      if (jobs[i].transfer || (jobs[i].stage != kFileUploadStage_Prepare &&
+                               (i != current || jobs[i].stage != kFileUploadStage_Upload))) {
+        continue;
+      }
+      if (prv_file_upload_job_start(handle, &jobs[i], transfer, commit_endpoint)) {
+        in_flight++;
+      } else {
+        prv_file_upload_job_done(jobs, i, kTicosdNetworkResult_ErrorRetryLater, results, callback,
+                                 ctx);
+        stop = true;
+      }
+    }
+    if (in_flight == 0) {
+      break;
+    }
+
+    int running;
+    CURLMcode mc = curl_multi_perform(handle->multi, &running);
+    if (mc == CURLM_OK && running > 0) {
+      mc = curl_multi_wait(handle->multi, NULL, 0, 1000, NULL);
+    }
+    if (mc != CURLM_OK) {
+      // The uploads in flight are left with kTicosdNetworkResult_ErrorRetryLater:
+      fprintf(stderr, "network:: Failed to perform uploads: %s\n", curl_multi_strerror(mc));
+      for (uint32_t i = 0; i < count; ++i) {
+        if (jobs[i].transfer) {
+          prv_file_upload_job_end_request(handle, &jobs[i]);
+        }
+      }
+      break;
+    }
+
+    CURLMsg *msg;
+    int msgs_left;
+    while ((msg = curl_multi_info_read(handle->multi, &msgs_left))) {
+      if (msg->msg != CURLMSG_DONE) {
+        continue;
+      }
+      char *private;
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &private);
+      sTicosdFileUploadJob *job = (sTicosdFileUploadJob *)private;
+      const uint32_t index = job - jobs;
+      in_flight--;
+      const eTicosdNetworkResult rc = prv_file_upload_job_complete(handle, job, msg->data.result);
+      if (rc != kTicosdNetworkResult_OK) {
+        prv_file_upload_job_done(jobs, index, rc, results, callback, ctx);
+        stop |= rc == kTicosdNetworkResult_ErrorRetryLater;
+      } else if (job->stage == kFileUploadStage_Done) {
+        prv_file_upload_job_done(jobs, index, rc, results, callback, ctx);
+      }
+    }
+  }
+
+  if (ticosd_is_dev_mode(handle->ticosd)) {
+    prv_file_upload_trace(jobs, count, batch_start_ms);
+  }
+  for (uint32_t i = 0; i < count; ++i) {
+    prv_file_upload_job_free(&jobs[i]);
+  }
+  free(jobs);
+}
+
+eTicosdNetworkResult ticosd_network_file_upload(sTicosdNetwork *handle, const char *commit_endpoint,
+                                                const char *filename, bool is_gzipped) {
+  const sTicosdNetworkFile file = {.filename = filename, .is_gzipped = is_gzipped};
+  eTicosdNetworkResult result;
+  ticosd_network_file_upload_batch(handle, commit_endpoint, &file, 1, &result, NULL, NULL);
+  return result;
+}
+
+/**
+ * @brief libCURL read callback of the coredump part of a stream upload
+ */
+static size_t prv_network_stream_read_callback(char *buffer, size_t size, size_t nitems,
+                                               void *userp) {
+  sTicosdNetworkStream *stream = userp;
+  ssize_t n;
+  do {
+    n = recv(stream->fds[0], buffer, size * nitems, 0);
+  } while (n == -1 && errno == EINTR);
+  if (n == -1) {
+    fprintf(stderr, "network:: Failed to read coredump stream : %s\n", strerror(errno));
+    return CURL_READFUNC_ABORT;
+  }
+  if (n == 0) {
+    // End of the coredump, unless it was cut short:
+    pthread_mutex_lock(&stream->lock);
+    const bool aborted = stream->aborted;
+    pthread_mutex_unlock(&stream->lock);
+    return aborted ? CURL_READFUNC_ABORT : 0;
+  }
+  stream->size += n;
+  return n;
+}
+
+static void *prv_network_stream_thread(void *arg) {
+  sTicosdNetworkStream *stream = arg;
+  char *file_url = NULL;
+
+  // The coredump is produced as fast as it is uploaded, give up if neither progresses:
+  curl_easy_setopt(stream->curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+  curl_easy_setopt(stream->curl, CURLOPT_LOW_SPEED_TIME, NETWORK_STREAM_STALL_TIMEOUT_S);
+  stream->result = prv_file_upload(stream->handle, stream->curl, stream->upload_url, stream->mime,
+                                   stream->is_gzipped, &file_url);
+  // Makes the writes fail if the upload stopped before the end of the coredump:
+  shutdown(stream->fds[0], SHUT_RD);
+
+  if (stream->result == kTicosdNetworkResult_OK) {
+    stream->result = prv_file_upload_commit(stream->handle, stream->curl, stream->commit_endpoint,
+                                            file_url, stream->size);
+  }
+  free(file_url);
+  return NULL;
+}
+
+static void prv_network_stream_free(sTicosdNetworkStream *stream) {
+  // The form can only be freed once the easy handle is gone:
+  if (stream->curl) {
+    curl_easy_cleanup(stream->curl);
+  }
+  curl_mime_free(stream->mime);
+  for (int i = 0; i < 2; ++i) {
+    if (stream->fds[i] != -1) {
+      close(stream->fds[i]);
+    }
+  }
+  pthread_mutex_destroy(&stream->lock);
+  free(stream->commit_endpoint);
+  free(stream->upload_url);
+  free(stream);
+}
+
+/**
+ * @brief Starts uploading a coredump that is yet to be produced
+ *
+ * The upload URL is requested first, so that no stream is opened when ticos cannot be reached and
+ * the coredump can be written to a file instead. The coredump is then sent as it is written, with
+ * chunked transfer encoding, and committed once the stream is closed.
+ *
+ * @param handle network object
+ * @param commit_endpoint Path to commit the upload to
+ * @param is_gzipped Whether the coredump is gzipped
+ * @return Stream to write the coredump to, NULL if it cannot be uploaded now
+ */
+sTicosdNetworkStream *ticosd_network_stream_open(sTicosdNetwork *handle,
+                                                 const char *commit_endpoint, bool is_gzipped) {
+  sTicosdNetworkStream *stream = calloc(sizeof(sTicosdNetworkStream), 1);
+  if (!stream) {
+    fprintf(stderr, "network:: Failed to allocate memory for stream\n");
+    return NULL;
+  }
+  stream->handle = handle;
+  stream->is_gzipped = is_gzipped;
+  stream->fds[0] = stream->fds[1] = -1;
+  pthread_mutex_init(&stream->lock, NULL);
+
+  if (!(stream->commit_endpoint = strdup(commit_endpoint)) ||
+      !(stream->curl = curl_easy_init())) {
+    fprintf(stderr, "network:: Failed to initialise stream.\n");
+    goto cleanup;
+  }
+
+  if (prv_file_upload_prepare(handle, stream->curl, &stream->upload_url) !=
+      kTicosdNetworkResult_OK) {
+    goto cleanup;
+  }
+
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, stream->fds) == -1) {
+    fprintf(stderr, "network:: Failed to create stream : %s\n", strerror(errno));
+    goto cleanup;
+  }
+
+  curl_mimepart *file_part;
+  if (!(stream->mime = prv_file_upload_create_form(stream->curl, &file_part)) ||
+      curl_mime_filename(file_part, is_gzipped ? "corefile.gz" : "corefile") != CURLE_OK ||
+      curl_mime_data_cb(file_part, -1, prv_network_stream_read_callback, NULL, NULL, stream) !=
+        CURLE_OK) {
+    goto cleanup;
+  }
+
+  if (pthread_create(&stream->thread, NULL, prv_network_stream_thread, stream) != 0) {
+    fprintf(stderr, "network:: Failed to create stream thread\n");
+    goto cleanup;
+  }
+  return stream;
+
+cleanup:
+  prv_network_stream_free(stream);
+  return NULL;
+}
+
+/**
+ * @brief Writes coredump data to a stream, blocking until the upload takes it
+ *
+ * @param stream Stream from ticosd_network_stream_open()
+ * @param data Data to write
+ * @param size Size of the data
+ * @return true Successfully written
+ * @return false The upload failed, the stream must be closed
+ */
+bool ticosd_network_stream_write(sTicosdNetworkStream *stream, const void *data, size_t size) {
+  while (size > 0) {
+    // MSG_NOSIGNAL: a failed upload must not raise SIGPIPE.
+    const ssize_t n = send(stream->fds[1], data, size, MSG_NOSIGNAL);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "network:: Coredump upload stopped : %s\n", strerror(errno));
+      return false;
+    }
+    data = (const uint8_t *)data + n;
+    size -= n;
+  }
+  return true;
+}
+
+/**
+ * @brief Ends a coredump stream, waits for the upload to complete and frees the stream
+ *
+ * @param stream Stream from ticosd_network_stream_open()
+ * @param complete Whether the whole coredump was written, the upload is cancelled otherwise
+ * @return A eTicosdNetworkResult value indicating whether the coredump was uploaded or not.
+ */
+eTicosdNetworkResult ticosd_network_stream_close(sTicosdNetworkStream *stream, bool complete) {
+  if (!complete) {
+    pthread_mutex_lock(&stream->lock);
+    stream->aborted = true;
+    pthread_mutex_unlock(&stream->lock);
+  }
+  close(stream->fds[1]);
+  stream->fds[1] = -1;
+  pthread_join(stream->thread, NULL);
+
+  eTicosdNetworkResult result = stream->result;
+  if (!complete && result == kTicosdNetworkResult_OK) {
+    result = kTicosdNetworkResult_ErrorNoRetry;
+  }
+  if (result == kTicosdNetworkResult_OK) {
+    fprintf(stderr, "network:: Successfully streamed coredump (%zu bytes)\n", stream->size);
+  }
+  prv_network_stream_free(stream);
+  return result;
+}
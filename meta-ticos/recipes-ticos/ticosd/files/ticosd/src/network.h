@@ -12,7 +12,9 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
+#include "nettiming.h"
 #include "ticosd.h"
 
 typedef enum TicosdHttpMethod {
@@ -40,14 +42,69 @@ typedef enum TicosdNetworkResult {
 
 typedef struct TicosdNetwork sTicosdNetwork;
 
+//! A request sent by ticosd_network_post_batch().
+typedef struct TicosdNetworkRequest {
+  const char *endpoint;
+  eTicosdHttpMethod method;
+  const char *payload;
+} sTicosdNetworkRequest;
+
+//! A file uploaded by ticosd_network_file_upload_batch().
+typedef struct TicosdNetworkFile {
+  const char *filename;
+  bool is_gzipped;
+} sTicosdNetworkFile;
+
+//! Statistics returned by ticosd_network_get_stats().
+typedef struct TicosdNetworkStats {
+  //! Requests performed.
+  uint64_t request_count;
+  //! New connections made, each with its TCP and TLS handshakes, warm-ups included.
+  uint64_t connect_count;
+  //! Size of the POST and PATCH payloads, and of the bodies actually sent for them.
+  uint64_t payload_bytes;
+  uint64_t body_bytes;
+  //! Requests that failed with a retry-able error, and those of them the server answered with an
+  //! error other than throttling (HTTP 5xx except 503).
+  uint64_t retry_error_count;
+  uint64_t server_error_count;
+} sTicosdNetworkStats;
+
+/**
+ * @brief Called by ticosd_network_post_batch() and ticosd_network_file_upload_batch() as soon as
+ * a request or an upload completes
+ *
+ * @param ctx Context passed to the batch function
+ * @param index Index of the request or file in the batch
+ * @param result Result of the request
+ */
+typedef void (*TicosdNetworkCompleteCallback)(void *ctx, uint32_t index,
+                                              eTicosdNetworkResult result);
+
 sTicosdNetwork *ticosd_network_init(sTicosd *ticosd);
 void ticosd_network_destroy(sTicosdNetwork *handle);
 eTicosdNetworkResult ticosd_network_post(sTicosdNetwork *handle, const char *endpoint,
                                                eTicosdHttpMethod method, const char *payload,
                                                char **data, size_t *len);
+void ticosd_network_post_batch(sTicosdNetwork *handle, const sTicosdNetworkRequest *requests,
+                               uint32_t count, eTicosdNetworkResult *results,
+                               TicosdNetworkCompleteCallback callback, void *ctx);
+uint32_t ticosd_network_take_retry_after(sTicosdNetwork *handle);
+void ticosd_network_warm_up(sTicosdNetwork *handle);
+void ticosd_network_get_stats(sTicosdNetwork *handle, sTicosdNetworkStats *stats);
+sTicosdNetTiming *ticosd_network_get_timing(sTicosdNetwork *handle);
 
 eTicosdNetworkResult ticosd_network_file_upload(sTicosdNetwork *handle,
                                                       const char *commit_endpoint,
                                                       const char *payload, bool is_gzipped);
+void ticosd_network_file_upload_batch(sTicosdNetwork *handle, const char *commit_endpoint,
+                                      const sTicosdNetworkFile *files, uint32_t count,
+                                      eTicosdNetworkResult *results,
+                                      TicosdNetworkCompleteCallback callback, void *ctx);
+
+sTicosdNetworkStream *ticosd_network_stream_open(sTicosdNetwork *handle,
+                                                 const char *commit_endpoint, bool is_gzipped);
+bool ticosd_network_stream_write(sTicosdNetworkStream *stream, const void *data, size_t size);
+eTicosdNetworkResult ticosd_network_stream_close(sTicosdNetworkStream *stream, bool complete);
 
 #endif
@@ -5,6 +5,10 @@
 //!
 //! @brief
 //! coredump plugin implementation
+//!
+//! Coredumps are written to a file in the core directory, which is queued for upload. With
+//! "coredump_plugin"/"streaming_upload", they are uploaded while they are being produced instead,
+//! and only written to a file when ticos cannot be reached.
 
 #include <errno.h>
 #include <fcntl.h>
@@ -39,8 +43,40 @@ struct TicosdPlugin {
   sTicosdRateLimiter *rate_limiter;
   char *core_dir;
   bool gzip_enabled;
+  bool streaming_upload;
 };
 
+/**
+ * Object that implements the sTicosCoreElfWriteIO interface by writing to a coredump upload
+ * stream.
+ */
+typedef struct TicosCoreElfWriteStreamIO {
+  sTicosCoreElfWriteIO io;
+  sTicosdNetworkStream *stream;
+  size_t max_size;
+  size_t written_size;
+} sTicosCoreElfWriteStreamIO;
+
+static ssize_t prv_stream_io_write(sTicosCoreElfWriteIO *io, const void *data, size_t size) {
+  sTicosCoreElfWriteStreamIO *sio = (sTicosCoreElfWriteStreamIO *)io;
+  if (sio->written_size + size > sio->max_size) {
+    fprintf(stderr, "coredump:: cannot stream corefile, max size reached\n");
+    errno = EFBIG;
+    return -1;
+  }
+  if (!ticosd_core_upload_stream_write(sio->stream, data, size)) {
+    errno = EPIPE;
+    return -1;
+  }
+  sio->written_size += size;
+  return (ssize_t)size;
+}
+
+static bool prv_stream_io_sync(const sTicosCoreElfWriteIO *io) {
+  // Whether the data made it is only known once the stream is closed:
+  return true;
+}
+
 static char *prv_create_dir(sTicosdPlugin *handle, const char *subdir) {
   const char *data_dir;
   if (!ticosd_get_string(handle->ticosd, "", "data_dir", &data_dir) ||
@@ -123,10 +159,18 @@ static bool prv_init_metadata(sTicosdPlugin *handle, sTicosCoreElfMetadata *meta
   return true;
 }
 
-static bool prv_transform_coredump_from_fd_to_file(sTicosdPlugin *handle, const char *path,
-                                                   int in_fd, pid_t pid, size_t max_size) {
+/**
+ * @brief Transforms the coredump read from the kernel, and writes it out gzipped if enabled
+ *
+ * @param handle coredump plugin handle
+ * @param in_fd Coredump from the kernel
+ * @param pid PID of the crashed process
+ * @param out_io Where to write the transformed coredump
+ * @return true Successfully transformed the coredump
+ */
+static bool prv_transform_coredump(sTicosdPlugin *handle, int in_fd, pid_t pid,
+                                   sTicosCoreElfWriteIO *out_io) {
   sTicosCoreElfReadFileIO reader_io;
-  sTicosCoreElfWriteFileIO writer_io;
   sTicosCoreElfWriteGzipIO gzip_io;
   bool gzip_io_initialized = false;
   sTicosCoreElfTransformer transformer;
@@ -134,7 +178,6 @@ static bool prv_transform_coredump_from_fd_to_file(sTicosdPlugin *handle, const
   sTicosCoreElfTransformerProcfsHandler transformer_handler;
 
   bool result = false;
-  int out_fd = -1;
 
   if (!prv_init_metadata(handle, &metadata)) {
     goto cleanup;
@@ -144,14 +187,8 @@ static bool prv_transform_coredump_from_fd_to_file(sTicosdPlugin *handle, const
     goto cleanup;
   }
 
-  if ((out_fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_TRUNC, S_IRUSR | S_IWUSR)) == -1) {
-    fprintf(stderr, "coredump:: Failed to open '%s'\n", path);
-    goto cleanup;
-  }
-
-  ticos_core_elf_write_file_io_init(&writer_io, out_fd, max_size);
   if (handle->gzip_enabled) {
-    gzip_io_initialized = ticos_core_elf_write_gzip_io_init(&gzip_io, &writer_io.io);
+    gzip_io_initialized = ticos_core_elf_write_gzip_io_init(&gzip_io, out_io);
     if (!gzip_io_initialized) {
       fprintf(stderr, "coredump:: Failed to init gzip io\n");
       goto cleanup;
@@ -159,7 +196,7 @@ static bool prv_transform_coredump_from_fd_to_file(sTicosdPlugin *handle, const
   }
   ticos_core_elf_read_file_io_init(&reader_io, in_fd);
   ticos_core_elf_transformer_init(&transformer, &reader_io.io,
-                                     handle->gzip_enabled ? &gzip_io.io : &writer_io.io, &metadata,
+                                     handle->gzip_enabled ? &gzip_io.io : out_io, &metadata,
                                      &transformer_handler.handler);
 
   result = ticos_core_elf_transformer_run(&transformer);
@@ -169,12 +206,47 @@ cleanup:
   if (gzip_io_initialized) {
     ticos_core_elf_write_gzip_io_deinit(&gzip_io);
   }
-  if (out_fd != -1) {
-    close(out_fd);
+  return result;
+}
+
+static bool prv_transform_coredump_from_fd_to_file(sTicosdPlugin *handle, const char *path,
+                                                   int in_fd, pid_t pid, size_t max_size) {
+  sTicosCoreElfWriteFileIO writer_io;
+  int out_fd;
+
+  if ((out_fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_TRUNC, S_IRUSR | S_IWUSR)) == -1) {
+    fprintf(stderr, "coredump:: Failed to open '%s'\n", path);
+    return false;
   }
+
+  ticos_core_elf_write_file_io_init(&writer_io, out_fd, max_size);
+  const bool result = prv_transform_coredump(handle, in_fd, pid, &writer_io.io);
+
+  close(out_fd);
   return result;
 }
 
+static bool prv_transform_coredump_from_fd_to_stream(sTicosdPlugin *handle,
+                                                     sTicosdNetworkStream *stream, int in_fd,
+                                                     pid_t pid) {
+  size_t max_size = 0;
+  ticosd_get_integer(handle->ticosd, "coredump_plugin", "coredump_max_size_kib",
+                        (int *)&max_size);
+  sTicosCoreElfWriteStreamIO writer_io = {
+    .io =
+      {
+        .write = prv_stream_io_write,
+        .sync = prv_stream_io_sync,
+      },
+    .stream = stream,
+    // The disk limits do not apply, nothing is written to it:
+    .max_size = max_size != 0 ? max_size * 1024 : SIZE_MAX,
+  };
+
+  const bool result = prv_transform_coredump(handle, in_fd, pid, &writer_io.io);
+  return ticosd_core_upload_stream_close(stream, result) && result;
+}
+
 static sTicosdTxData *prv_build_queue_entry(bool gzip_enabled, const char *filename,
                                                uint32_t *payload_size) {
   size_t filename_len = strlen(filename);
@@ -319,6 +391,22 @@ static bool prv_msg_handler(sTicosdPlugin *handle, struct msghdr *msg, size_t re
     goto cleanup;
   }
 
+  if (handle->streaming_upload) {
+    sTicosdNetworkStream *stream =
+      ticosd_core_upload_stream_open(handle->ticosd, handle->gzip_enabled);
+    if (stream) {
+      fprintf(stderr, "coredump:: streaming coredump for PID %d\n", pid);
+      if (!prv_transform_coredump_from_fd_to_stream(handle, stream, file_stream, pid)) {
+        // The coredump was read from the kernel already, it cannot be written to a file anymore:
+        fprintf(stderr, "coredump:: Failed to stream corefile for PID %d\n", pid);
+        goto cleanup;
+      }
+      ret = EXIT_SUCCESS;
+      goto cleanup;
+    }
+    fprintf(stderr, "coredump:: Cannot stream corefile, writing it to a file instead\n");
+  }
+
   const size_t max_size = prv_check_for_available_space(handle);
   if (max_size == 0) {
     fprintf(stderr, "coredump:: Not processing corefile, disk usage limits exceeded\n");
@@ -449,6 +537,9 @@ bool ticosd_coredump_init(sTicosd *ticosd, sTicosdPluginCallbackFns **fns) {
     handle->gzip_enabled = true;
   }
 
+  ticosd_get_boolean(handle->ticosd, "coredump_plugin", "streaming_upload",
+                     &handle->streaming_upload);
+
   return true;
 
 cleanup:
@@ -9,25 +9,33 @@
 
 #include "queue.h"
 
+#include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "queue_blob.h"
+#include "queue_compress.h"
+#include "queue_storage.h"
+#include "ticos/util/crc32c.h"
 #include "ticosd.h"
 
 struct TicosdQueue {
   sTicosd *ticosd;
-  //! @brief True if the buf memory is backed by a memory mapped file, false if it is backed by
-  //! a heap-allocated buffer.
+  //! @brief True if the buf memory is persisted to a file through storage, false if it is backed
+  //! by a heap-allocated buffer only.
   bool is_file_backed;
+  //! @brief Persistence of buf to the queue file, NULL if not file backed.
+  sTicosdQueueStorage *storage;
   //! @brief Size of buf in bytes.
   int size;
   //! @brief The queue buffer.
@@ -41,10 +49,98 @@ struct TicosdQueue {
   uint32_t write_ptr;
   //! @brief Index of the previously written message.
   uint32_t prev_ptr;
-  //! @brief Flag to indicate that a ticosd_queue_read_head() happened and a
-  //! ticosd_queue_complete_read() is expected to follow next. In case the read pointer is moved
-  //! before the ticosd_queue_complete_read(), the flag will be set to false.
-  bool can_complete_read;
+  //! @brief Number of messages from the read_ptr onwards that were returned by a
+  //! ticosd_queue_read_head() or ticosd_queue_peek_*() call and can be marked read by a
+  //! ticosd_queue_complete_*() call next. In case the read pointer is moved before the
+  //! ticosd_queue_complete_*() call, this will be set to 0.
+  uint32_t completable_count;
+  //! @brief True if the messages from lease_ptr up to lease_end were handed out by
+  //! ticosd_queue_peek_*() and must not be overwritten until they are released with
+  //! ticosd_queue_complete_*() or ticosd_queue_release_head().
+  bool lease_held;
+  //! @brief Index of the first leased message.
+  uint32_t lease_ptr;
+  //! @brief Index right after the end of the last leased message. Less than or equal to lease_ptr
+  //! if the leased messages wrap around the end of the buffer.
+  uint32_t lease_end;
+  //! @brief The checkpoint slots, stored right after the end of buf.
+  struct TicosQueueCheckpoint *checkpoints;
+  //! @brief Generation of the most recently written checkpoint.
+  uint32_t checkpoint_generation;
+  //! @brief Number of writes and completed reads since the last checkpoint was written.
+  uint32_t ops_since_checkpoint;
+  //! @brief Whether a write to a full queue drops its oldest unread messages, or fails instead.
+  bool overwrite;
+  //! @brief Payloads of at least this size are stored compressed, 0 if compression is disabled.
+  uint32_t compress_threshold;
+  //! @brief Payloads of at least this size are stored in side files, 0 if disabled.
+  uint32_t blob_threshold;
+  //! @brief Path of the directory of the side files, NULL if not file backed.
+  char *blob_dir;
+  //! @brief Side files, NULL until the directory is first used.
+  sTicosdQueueBlobs *blobs;
+  //! @brief Decompressed copies of the compressed messages and mappings of the side files leased
+  //! by the last peek, released along with the lease.
+  struct TicosQueueLeaseBuf *lease_bufs;
+  uint32_t lease_buf_count;
+  uint32_t lease_buf_capacity;
+  //! @brief Number of messages reserved with ticosd_queue_reserve() and not committed yet.
+  uint32_t pending_count;
+  //! @brief Index of the oldest message that has not been committed yet, if pending_count > 0.
+  uint32_t pending_ptr;
+  //! @brief Durability of operations on messages without a per-type override.
+  eTicosdQueueDurability durability;
+  //! @brief Per-type durability overrides, indexed by the first payload byte (eTicosdTxDataType).
+  //! -1 if the default durability applies.
+  int8_t type_durability[UINT8_MAX + 1];
+  //! @brief Maximum time a group commit change stays unflushed.
+  int group_commit_interval_ms;
+  //! @brief Number of changed bytes after which a group commit flush is started right away.
+  uint32_t group_commit_bytes;
+  //! @brief Byte range [dirty_start, dirty_end) relative to buf that has not been flushed yet.
+  size_t dirty_start;
+  size_t dirty_end;
+  //! @brief Number of bytes changed since the last flush.
+  uint32_t dirty_bytes;
+  //! @brief True if a group commit change is waiting for the flusher thread.
+  bool flush_scheduled;
+  //! @brief True if an async change is waiting for the flusher thread to write it back, with
+  //! storage backends that need it.
+  bool write_back_scheduled;
+  //! @brief True while the flusher thread is flushing, without holding the lock.
+  bool is_flushing;
+  bool flusher_started;
+  bool flusher_stop;
+  pthread_t flusher_thread;
+  //! @brief Signalled to wake up the flusher thread.
+  pthread_cond_t flusher_cond;
+  //! @brief Signalled when the flusher thread completed a flush.
+  pthread_cond_t flushed_cond;
+  //! @brief Signalled when the last pending message is committed.
+  pthread_cond_t committed_cond;
+  //! @brief Number of times the buffer was flushed to the backing file.
+  uint32_t sync_count;
+  //! @brief Number and total payload size of the unread messages dropped by writes to a full queue
+  //! since the queue was initialised.
+  uint32_t overwritten_count;
+  uint64_t overwritten_bytes;
+  //! @brief Per-type time-to-live in seconds, indexed by the first payload byte
+  //! (eTicosdTxDataType). 0 if messages of the type never expire.
+  uint32_t type_ttl[UINT8_MAX + 1];
+  //! @brief True if at least one type has a time-to-live.
+  bool has_ttl;
+  ticosd_queue_expired_callback expired_callback;
+  void *expired_callback_ctx;
+  //! @brief Number and total payload size of the messages dropped because their time-to-live
+  //! elapsed since the queue was initialised.
+  uint32_t expired_count;
+  uint64_t expired_bytes;
+#ifdef TICOS_UNITTEST
+  //! @brief Number of messages validated since the queue was initialised.
+  uint32_t msg_validation_count;
+  //! @brief Enqueue time given to new messages instead of the current time, if not 0.
+  time_t fake_time;
+#endif
   pthread_mutex_t lock;
 };
 
@@ -53,37 +149,135 @@ struct TicosdQueue {
  * uint32_t  flags :
  *           uint8_t  magic number, 0xa5
  *           uint8_t  version number
- *           uint8_t  crc8 of payload data (excl. padding bytes)
+ *           uint8_t  version 1: crc8 of payload data (excl. padding bytes), later versions: number
+ *                    of failed attempts to send the message, saturating at 255
  *           uint8_t  flags:
  *                    0x01  message read
+ *                    0x02  message reserved, payload not committed yet
+ *                    0x04  payload compressed, see queue_compress.c
+ *                    0x08  message expired before it could be sent, set along with 0x01
+ *                    0x10  payload stored in a side file, the message holding a reference to it
+ *                    0x20  message acknowledged while one before it was not, skipped once it
+ *                          gets to the head
  * uint32_t  previous header
  * uint32_t  payload size (in bytes)
+ * uint32_t  version 2 and later: crc32c of payload data (excl. padding bytes)
+ * uint32_t  version 3 only: enqueue time, in seconds since the epoch
  * uint8_t[] payload data, padded to 4-byte boundary with 0x00 bytes
+ *
+ * New messages are always written as version 3. Version 1 and 2 messages, which lack the crc32c
+ * and the enqueue time fields, are still read from queue files written by older versions.
  */
 typedef struct TicosQueueMsgHeader {
   uint8_t magic;
   uint8_t version;
-  uint8_t crc;
+  union {
+    uint8_t crc8;
+    uint8_t attempts;
+  };
   uint8_t flags;
   uint32_t prev_header;
   uint32_t payload_size_bytes;
-  uint8_t payload[];
+  uint32_t crc32c;
+  uint32_t timestamp;
 } sTicosQueueMsgHeader;
 
-_Static_assert(sizeof(sTicosQueueMsgHeader) == 12, "TicosQueueMsgHeader size mismatch");
+_Static_assert(sizeof(sTicosQueueMsgHeader) == 20, "TicosQueueMsgHeader size mismatch");
 
 #define HEADER_LEN (sizeof(sTicosQueueMsgHeader) / sizeof(uint32_t))
+#define HEADER_V1_LEN (offsetof(sTicosQueueMsgHeader, crc32c) / sizeof(uint32_t))
+#define HEADER_V2_LEN (offsetof(sTicosQueueMsgHeader, timestamp) / sizeof(uint32_t))
 
 #define HEADER_MAGIC_NUMBER 0xa5u
-#define HEADER_VERSION_NUMBER 0x01
+#define HEADER_VERSION_NUMBER_V1 0x01
+#define HEADER_VERSION_NUMBER_V2 0x02
+#define HEADER_VERSION_NUMBER 0x03
 #define HEADER_FLAGS_FLAG_READ_MASK (1 << 0)
+#define HEADER_FLAGS_FLAG_PENDING_MASK (1 << 1)
+#define HEADER_FLAGS_FLAG_COMPRESSED_MASK (1 << 2)
+#define HEADER_FLAGS_FLAG_EXPIRED_MASK (1 << 3)
+#define HEADER_FLAGS_FLAG_BLOB_MASK (1 << 4)
+#define HEADER_FLAGS_FLAG_ACKED_MASK (1 << 5)
 
 #define END_POINTER 0x5aa55aa5
 
+// Messages written before the clock was set, e.g. by NTP, have timestamps around 1970. Any
+// timestamp before 2024-01-01T00:00:00Z is treated as unknown, as it would make messages look
+// decades old once the clock is set:
+#define TIMESTAMP_MIN 1704067200
+
 #define QUEUE_SIZE_MIN (int)(sizeof(sTicosQueueMsgHeader) + 4)
 #define QUEUE_SIZE_MAX (1024 * 1024 * 1024)
 #define QUEUE_SIZE_ALIGNMENT 4
 
+/**
+ * Payload of a message stored in a side file (flag 0x10), packed structure containing:
+ * uint8_t   type of the payload, its first byte, so that it is known without the side file
+ * uint8_t[3] reserved, 0x00
+ * uint32_t  payload size (in bytes)
+ * uint32_t  crc32c of the payload
+ * uint64_t  identifier of the side file, see queue_blob.c
+ */
+typedef struct __attribute__((__packed__)) TicosQueueBlobRef {
+  uint8_t type;
+  uint8_t reserved[3];
+  uint32_t payload_size_bytes;
+  uint32_t crc32c;
+  uint64_t id;
+} sTicosQueueBlobRef;
+
+typedef struct TicosQueueLeaseBuf {
+  uint8_t *payload;
+  uint32_t payload_size_bytes;
+  //! @brief True if payload is a mapped side file, false if it is on the heap.
+  bool is_mapped;
+} sTicosQueueLeaseBuf;
+
+/**
+ * Checkpoint format, packed structure containing:
+ * uint32_t  magic number, 0x4b435154 ("TQCK")
+ * uint8_t   version number
+ * uint8_t   flags:
+ *           0x01  queue contained unread messages
+ * uint8_t[2] reserved, 0x00
+ * uint32_t  generation, incremented on every checkpoint
+ * uint32_t  size of the ring buffer (in bytes)
+ * uint32_t  read pointer
+ * uint32_t  write pointer
+ * uint32_t  previous pointer
+ * uint32_t  crc32c of the preceding fields
+ *
+ * Two checkpoint slots are stored back-to-back after the end of the ring buffer and written
+ * alternately, so that a torn checkpoint write always leaves the previous one intact.
+ */
+typedef struct TicosQueueCheckpoint {
+  uint32_t magic;
+  uint8_t version;
+  uint8_t flags;
+  uint8_t reserved[2];
+  uint32_t generation;
+  uint32_t queue_size;
+  uint32_t read_ptr;
+  uint32_t write_ptr;
+  uint32_t prev_ptr;
+  uint32_t checksum;
+} sTicosQueueCheckpoint;
+
+_Static_assert(sizeof(sTicosQueueCheckpoint) == 32, "TicosQueueCheckpoint size mismatch");
+
+#define CHECKPOINT_MAGIC_NUMBER 0x4b435154u
+#define CHECKPOINT_VERSION_NUMBER 0x01
+#define CHECKPOINT_FLAGS_HAS_UNREAD_MASK (1 << 0)
+#define CHECKPOINT_SLOT_COUNT 2
+#define CHECKPOINT_REGION_SIZE (CHECKPOINT_SLOT_COUNT * sizeof(sTicosQueueCheckpoint))
+
+//! Number of writes and completed reads after which a new checkpoint is written. This bounds the
+//! number of messages that need to be validated when recovering the queue at start of day.
+#define CHECKPOINT_INTERVAL_OPS 64
+
+#define GROUP_COMMIT_INTERVAL_MS_DEFAULT 100
+#define GROUP_COMMIT_BYTES_DEFAULT (64 * 1024)
+
 /**
  * @brief Calculates CRC8 of data
  *
@@ -110,6 +304,37 @@ static uint32_t prv_bytes_to_words_round_up(uint32_t size_bytes) {
   return (size_bytes + 3) / sizeof(uint32_t);
 }
 
+static uint32_t prv_header_len_words(const sTicosQueueMsgHeader *header) {
+  switch (header->version) {
+    case HEADER_VERSION_NUMBER_V1:
+      return HEADER_V1_LEN;
+    case HEADER_VERSION_NUMBER_V2:
+      return HEADER_V2_LEN;
+    default:
+      return HEADER_LEN;
+  }
+}
+
+static uint8_t *prv_msg_payload(const sTicosQueueMsgHeader *header) {
+  return (uint8_t *)header + prv_header_len_words(header) * sizeof(uint32_t);
+}
+
+static time_t prv_msg_timestamp(const sTicosQueueMsgHeader *header) {
+  if (header->version != HEADER_VERSION_NUMBER || header->timestamp < TIMESTAMP_MIN) {
+    return 0;
+  }
+  return (time_t)header->timestamp;
+}
+
+static time_t prv_queue_now(sTicosdQueue *handle) {
+#ifdef TICOS_UNITTEST
+  if (handle->fake_time != 0) {
+    return handle->fake_time;
+  }
+#endif
+  return time(NULL);
+}
+
 /**
  * @brief Get pointer of next message, wrapping around to the start when the END_POINTER or end of
  * the buffer has been reached.
@@ -121,11 +346,16 @@ static uint32_t prv_bytes_to_words_round_up(uint32_t size_bytes) {
 static uint32_t prv_get_next_message(sTicosdQueue *handle, uint32_t ptr) {
   sTicosQueueMsgHeader *header = (sTicosQueueMsgHeader *)&handle->buf[ptr];
   const uint32_t next_ptr =
-    ptr + HEADER_LEN + prv_bytes_to_words_round_up(header->payload_size_bytes);
+    ptr + prv_header_len_words(header) + prv_bytes_to_words_round_up(header->payload_size_bytes);
   if (next_ptr >= handle->size / sizeof(uint32_t)) {
     // Wrapped around end of queue
     return 0;
   }
+  if (next_ptr == handle->write_ptr) {
+    // Caught up with the writer. An end marker there is left over from a previous wrap-around,
+    // following it would go back to messages already read:
+    return next_ptr;
+  }
   if (handle->buf[next_ptr] == END_POINTER) {
     // Reached end pointer
     return 0;
@@ -140,15 +370,61 @@ static uint32_t prv_get_next_message(sTicosdQueue *handle, uint32_t ptr) {
  * @return true if payload size is within bounds, false otherwise
  */
 static bool prv_is_msg_in_bounds(sTicosdQueue *handle, const sTicosQueueMsgHeader *header) {
-  return ((uint8_t *)header >= (uint8_t *)handle->buf) &&
-         (((uint8_t *)header) + sizeof(*header) + header->payload_size_bytes <
-          ((uint8_t *)handle->buf) + handle->size);
+  if ((uint8_t *)header < (uint8_t *)handle->buf) {
+    return false;
+  }
+  const size_t offset = (uint8_t *)header - (uint8_t *)handle->buf;
+  const size_t header_size = prv_header_len_words(header) * sizeof(uint32_t);
+  return offset + header_size <= (size_t)handle->size &&
+         header->payload_size_bytes <= handle->size - offset - header_size;
 }
 
 static bool prv_is_msg_read(const sTicosQueueMsgHeader *header) {
   return header->flags & HEADER_FLAGS_FLAG_READ_MASK;
 }
 
+static bool prv_is_msg_pending(const sTicosQueueMsgHeader *header) {
+  return header->flags & HEADER_FLAGS_FLAG_PENDING_MASK;
+}
+
+static bool prv_is_msg_compressed(const sTicosQueueMsgHeader *header) {
+  return header->flags & HEADER_FLAGS_FLAG_COMPRESSED_MASK;
+}
+
+static bool prv_is_msg_blob(const sTicosQueueMsgHeader *header) {
+  return header->flags & HEADER_FLAGS_FLAG_BLOB_MASK;
+}
+
+static bool prv_is_msg_acked(const sTicosQueueMsgHeader *header) {
+  return header->flags & HEADER_FLAGS_FLAG_ACKED_MASK;
+}
+
+/**
+ * @brief Reads the side file reference held by a message
+ *
+ * @param header Message stored in a side file
+ * @param[out] ref Reference
+ * @return false if the message does not hold a valid reference
+ */
+static bool prv_msg_blob_ref(const sTicosQueueMsgHeader *header, sTicosQueueBlobRef *ref) {
+  if (header->payload_size_bytes != sizeof(*ref)) {
+    return false;
+  }
+  memcpy(ref, prv_msg_payload(header), sizeof(*ref));
+  return true;
+}
+
+/**
+ * @brief Returns the size of the payload of a message as stored, in the queue or in a side file
+ */
+static uint32_t prv_msg_stored_size(const sTicosQueueMsgHeader *header) {
+  sTicosQueueBlobRef ref;
+  if (prv_is_msg_blob(header) && prv_msg_blob_ref(header, &ref)) {
+    return ref.payload_size_bytes;
+  }
+  return header->payload_size_bytes;
+}
+
 /**
  * @brief Validates a message
  *
@@ -158,19 +434,111 @@ static bool prv_is_msg_read(const sTicosQueueMsgHeader *header) {
  * @return false No valid
  */
 static bool prv_is_msg_valid(sTicosdQueue *handle, const sTicosQueueMsgHeader *header) {
+#ifdef TICOS_UNITTEST
+  handle->msg_validation_count++;
+#endif
   if (!prv_is_msg_in_bounds(handle, header)) {
     return false;
   }
 
-  if (header->magic != HEADER_MAGIC_NUMBER) {
+  if (header->magic != HEADER_MAGIC_NUMBER || prv_is_msg_pending(header)) {
     return false;
   }
 
-  const uint8_t crc = prv_queue_crc8(&header->payload, header->payload_size_bytes);
-  if (crc != header->crc) {
-    return false;
+  const uint8_t *payload = prv_msg_payload(header);
+  switch (header->version) {
+    case HEADER_VERSION_NUMBER_V1:
+      return header->crc8 == prv_queue_crc8(payload, header->payload_size_bytes);
+    case HEADER_VERSION_NUMBER_V2:
+    case HEADER_VERSION_NUMBER:
+      return header->crc32c == ticos_crc32c(0, payload, header->payload_size_bytes);
+    default:
+      return false;
+  }
+}
+
+/**
+ * @brief Frees the decompressed copies and unmaps the side files of the messages leased by the last
+ * peek
+ *
+ * @param handle Queue handle
+ */
+static void prv_queue_free_lease_bufs(sTicosdQueue *handle) {
+  for (uint32_t i = 0; i < handle->lease_buf_count; ++i) {
+    const sTicosQueueLeaseBuf *lease_buf = &handle->lease_bufs[i];
+    if (lease_buf->is_mapped) {
+      ticosd_queue_blobs_unmap(lease_buf->payload, lease_buf->payload_size_bytes);
+    } else {
+      free(lease_buf->payload);
+    }
+  }
+  handle->lease_buf_count = 0;
+}
+
+/**
+ * @brief Decompresses the payload of a compressed message into a newly allocated buffer
+ *
+ * A payload that cannot be decompressed, e.g. one compressed with a dictionary that is unknown to
+ * this version, is returned as stored rather than left to block the head of the queue forever.
+ *
+ * @param header Compressed message
+ * @param[out] payload_size_bytes Size of the returned payload in bytes
+ * @return Payload, to be freed by the caller, or NULL if out of memory
+ */
+static uint8_t *prv_msg_decompress(const sTicosQueueMsgHeader *header,
+                                   uint32_t *payload_size_bytes) {
+  const uint8_t *compressed = prv_msg_payload(header);
+  const uint32_t size = ticosd_queue_get_decompressed_size(compressed, header->payload_size_bytes);
+  uint8_t *payload = malloc(size > 0 ? size : header->payload_size_bytes);
+  if (!payload) {
+    return NULL;
+  }
+  if (size > 0 && ticosd_queue_decompress(compressed, header->payload_size_bytes, payload, size)) {
+    *payload_size_bytes = size;
+  } else {
+    fprintf(stderr, "queue:: failed to decompress message, passing it on as is.\n");
+    memcpy(payload, compressed, header->payload_size_bytes);
+    *payload_size_bytes = header->payload_size_bytes;
+  }
+  return payload;
+}
+
+/**
+ * @brief Maps the side file holding the payload of a message
+ *
+ * @param handle Queue handle
+ * @param header Message stored in a side file
+ * @param[out] payload_size_bytes Size of the returned payload in bytes
+ * @return Payload, to be unmapped with ticosd_queue_blobs_unmap(), or NULL if the side file is
+ * missing or damaged
+ */
+static uint8_t *prv_queue_map_blob(sTicosdQueue *handle, const sTicosQueueMsgHeader *header,
+                                   uint32_t *payload_size_bytes) {
+  sTicosQueueBlobRef ref;
+  if (!handle->blobs || !prv_msg_blob_ref(header, &ref)) {
+    return NULL;
+  }
+  uint8_t *payload = ticosd_queue_blobs_map(handle->blobs, ref.id, ref.payload_size_bytes);
+  if (payload && ticos_crc32c(0, payload, ref.payload_size_bytes) != ref.crc32c) {
+    fprintf(stderr, "queue:: side file %llx is corrupted.\n", (unsigned long long)ref.id);
+    ticosd_queue_blobs_unmap(payload, ref.payload_size_bytes);
+    return NULL;
+  }
+  *payload_size_bytes = ref.payload_size_bytes;
+  return payload;
+}
+
+/**
+ * @brief Removes the side file of a message that will not be read any more, if it has one
+ *
+ * @param handle Queue handle
+ * @param header Message
+ */
+static void prv_queue_remove_blob(sTicosdQueue *handle, const sTicosQueueMsgHeader *header) {
+  sTicosQueueBlobRef ref;
+  if (handle->blobs && prv_is_msg_blob(header) && prv_msg_blob_ref(header, &ref)) {
+    ticosd_queue_blobs_remove(handle->blobs, ref.id);
   }
-  return true;
 }
 
 /**
@@ -249,202 +617,1505 @@ static void prv_queue_find_read_write_ptr(sTicosdQueue *handle) {
   handle->prev_ptr = prev_ptr;
 }
 
-static bool prv_check_queue_size(int *queue_size) {
-  if (*queue_size % QUEUE_SIZE_ALIGNMENT != 0) {
-    const int aligned_queue_size = (*queue_size / QUEUE_SIZE_ALIGNMENT) * QUEUE_SIZE_ALIGNMENT;
-    fprintf(stderr, "queue:: queue_size (%i) must be a multiple of 4. Rounding down to %i.\n",
-            *queue_size, aligned_queue_size);
-    *queue_size = aligned_queue_size;
-  }
-  if (*queue_size < QUEUE_SIZE_MIN) {
-    fprintf(stderr,
-            "queue:: queue_size (%i) too small, minimum size is %i. Falling back to default "
-            "size.\n",
-            *queue_size, QUEUE_SIZE_MIN);
-    return false;
-  }
-  if (*queue_size > QUEUE_SIZE_MAX) {
-    fprintf(
-      stderr,
-      "queue:: queue_size (%i) too large, maximum size is %i. Falling back to default size.\n",
-      *queue_size, QUEUE_SIZE_MAX);
-    return false;
-  }
-  return true;
+static size_t prv_queue_storage_size(sTicosdQueue *handle) {
+  return handle->size + CHECKPOINT_REGION_SIZE;
 }
 
 /**
- * @brief Initialises the queue object
+ * @brief Waits for an ongoing flush or write back to complete, then starts a new one. Must be
+ * called with the lock held, the lock is released until prv_queue_end_flush() is called.
  *
- * @param ticosd Main ticosd handle
- * @return ticosd_queue_h queue object
+ * @param handle Queue handle
  */
-sTicosdQueue *ticosd_queue_init(sTicosd *ticosd, int size) {
-  sTicosdQueue *handle = calloc(sizeof(sTicosdQueue), 1);
-
-  handle->ticosd = ticosd;
-  handle->size = size;
-
-  if (pthread_mutex_init(&handle->lock, NULL) != 0) {
-    fprintf(stderr, "queue:: Failed to initialise queue mutex.\n");
-    free(handle);
-    return NULL;
-  }
-
-  if (!prv_check_queue_size(&handle->size)) {
-    /* Default to 1MiB */
-    handle->size = 1024 * 1024;
+static void prv_queue_begin_flush(sTicosdQueue *handle) {
+  // Changes taken by an ongoing flush must reach the file before the ones that follow:
+  while (handle->is_flushing) {
+    pthread_cond_wait(&handle->flushed_cond, &handle->lock);
   }
+  handle->is_flushing = true;
+  pthread_mutex_unlock(&handle->lock);
+}
 
-  char *queue_file = ticosd_generate_rw_filename(handle->ticosd, "queue");
+static void prv_queue_end_flush(sTicosdQueue *handle) {
+  pthread_mutex_lock(&handle->lock);
+  handle->is_flushing = false;
+  pthread_cond_broadcast(&handle->flushed_cond);
+}
 
-  int fd = -1;
-  if (queue_file) {
-    if ((fd = open(queue_file, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR)) == -1) {
-      fprintf(stderr, "queue:: Failed to open '%s', falling back to non-persistent queue.\n",
-              queue_file);
-    } else {
-      if (ftruncate(fd, handle->size) == -1) {
-        close(fd);
-        fd = -1;
-        fprintf(stderr, "queue:: Failed to resize '%s', falling back to non-persistent queue.\n",
-                queue_file);
-      } else {
-        if ((handle->buf = mmap(NULL, handle->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) ==
-            (void *)-1) {
-          close(fd);
-          fd = -1;
-          fprintf(stderr, "queue:: Failed to mmap '%s', falling back to non-persistent queue.\n",
-                  queue_file);
-        } else {
-          close(fd);
-        }
-      }
-    }
-    free(queue_file);
+/**
+ * @brief Flushes all pending changes to the backing file. Must be called with the lock held.
+ *
+ * The lock is released while flushing, so that other producers and the consumer are not blocked
+ * on the storage. Changes made by other threads in the meantime are picked up by the next flush,
+ * which coalesces concurrent strict operations into a single msync() call.
+ *
+ * @param handle Queue handle
+ */
+static void prv_queue_flush_locked(sTicosdQueue *handle) {
+  while (handle->is_flushing) {
+    pthread_cond_wait(&handle->flushed_cond, &handle->lock);
   }
-  if (fd == -1) {
-    handle->buf = calloc(handle->size, 1);
-    handle->is_file_backed = false;
-  } else {
-    handle->is_file_backed = true;
+  if (handle->dirty_end <= handle->dirty_start) {
+    return;
   }
 
-  prv_queue_find_read_write_ptr(handle);
+  const size_t start = handle->dirty_start;
+  const size_t end = handle->dirty_end;
+  handle->dirty_start = handle->dirty_end = 0;
+  handle->dirty_bytes = 0;
+  handle->flush_scheduled = false;
+  // The flush writes all the changes of the range, which covers all the pending ones:
+  handle->write_back_scheduled = false;
+
+  prv_queue_begin_flush(handle);
+  if (!ticosd_queue_storage_sync(handle->storage, start, end)) {
+    fprintf(stderr, "queue:: Failed to flush queue file.\n");
+  }
+  prv_queue_end_flush(handle);
 
-  return handle;
+  handle->sync_count++;
 }
 
 /**
- * @brief Destroys the queue handle
+ * @brief Writes all pending changes to the backing file without flushing them. Must be called
+ * with the lock held.
+ *
+ * The pending changes stay pending, so that the next flush makes them durable.
  *
  * @param handle Queue handle
  */
-void ticosd_queue_destroy(sTicosdQueue *handle) {
-  if (handle) {
-    if (handle->is_file_backed) {
-      munmap(handle->buf, handle->size);
-    } else if (handle->buf) {
-      free(handle->buf);
-    }
+static void prv_queue_write_back_locked(sTicosdQueue *handle) {
+  handle->write_back_scheduled = false;
 
-    pthread_mutex_destroy(&handle->lock);
-    free(handle);
+  prv_queue_begin_flush(handle);
+  if (!ticosd_queue_storage_write_back(handle->storage, 0, prv_queue_storage_size(handle))) {
+    fprintf(stderr, "queue:: Failed to write back queue file.\n");
   }
+  prv_queue_end_flush(handle);
 }
 
 /**
- * @brief Resets the internal queue state to empty
+ * @brief Records a change to a range of the queue buffer, without flushing it
+ *
+ * Pending changes are tracked as a single range covering all of them, so that a flush needs just
+ * one msync() call. Storage backends that write changed blocks themselves also track them.
  *
  * @param handle Queue handle
+ * @param addr Start of the range
+ * @param len Length of the range in bytes
  */
-void ticosd_queue_reset(sTicosdQueue *handle) {
-  pthread_mutex_lock(&handle->lock);
-  handle->read_ptr = 0;
-  handle->write_ptr = 0;
-  handle->prev_ptr = 0;
-
-  memset(handle->buf, 0, HEADER_LEN * sizeof(uint32_t));
-  msync(handle->buf, HEADER_LEN * sizeof(uint32_t), MS_SYNC);
-
-  pthread_mutex_unlock(&handle->lock);
+static void prv_queue_mark_dirty(sTicosdQueue *handle, const void *addr, size_t len) {
+  const size_t start = (const uint8_t *)addr - (const uint8_t *)handle->buf;
+  const size_t end = start + len;
+  if (handle->dirty_end == handle->dirty_start) {
+    handle->dirty_start = start;
+    handle->dirty_end = end;
+  } else {
+    handle->dirty_start = start < handle->dirty_start ? start : handle->dirty_start;
+    handle->dirty_end = end > handle->dirty_end ? end : handle->dirty_end;
+  }
+  handle->dirty_bytes += len;
+  ticosd_queue_storage_mark_dirty(handle->storage, start, len);
 }
 
 /**
- * @brief Returns copies of head of the queue
+ * @brief Flushes the pending changes according to the durability of the operation that made them
+ *
+ * A strict flush also flushes all earlier changes, so that a message never becomes durable before
+ * the messages written before it.
  *
  * @param handle Queue handle
- * @param[out] payload Payload string
- * @param[out] payload_size_bytes Payload size in bytes
- * @return Pointer to heap-allocated message found on head of queue, or NULL if queue is empty or
- * memory failed to be allocated.
+ * @param durability Durability of the operation
  */
-uint8_t *ticosd_queue_read_head(sTicosdQueue *handle, uint32_t *payload_size_bytes) {
-  uint8_t *payload = NULL;
-  pthread_mutex_lock(&handle->lock);
-
-  sTicosQueueMsgHeader *header = (sTicosQueueMsgHeader *)&handle->buf[handle->read_ptr];
-  if (handle->read_ptr == handle->write_ptr) {
-    if (!prv_is_msg_valid(handle, header) || prv_is_msg_read(header)) {
-      // read_ptr is caught up, nothing to read!
-      goto unlock;
-    }
+static void prv_queue_commit(sTicosdQueue *handle, eTicosdQueueDurability durability) {
+  if (!handle->is_file_backed) {
+    return;
   }
 
-  payload = malloc(header->payload_size_bytes);
-  if (!payload) {
-    goto unlock;
+  switch (durability) {
+    case kTicosdQueueDurability_Strict:
+      prv_queue_flush_locked(handle);
+      break;
+    case kTicosdQueueDurability_Group:
+      handle->flush_scheduled = true;
+      pthread_cond_signal(&handle->flusher_cond);
+      break;
+    case kTicosdQueueDurability_Async:
+    default:
+      if (ticosd_queue_storage_needs_write_back(handle->storage) && !handle->write_back_scheduled) {
+        handle->write_back_scheduled = true;
+        pthread_cond_signal(&handle->flusher_cond);
+      }
+      break;
   }
-  memcpy(payload, header->payload, header->payload_size_bytes);
-  *payload_size_bytes = header->payload_size_bytes;
-
-  // Allow a ticosd_queue_complete_read() call now:
-  handle->can_complete_read = true;
-
-unlock:
-  pthread_mutex_unlock(&handle->lock);
-  return payload;
 }
 
 /**
- * @brief Removes message from head of the queue
+ * @brief Records a change to a range of the queue buffer and flushes it according to durability
  *
  * @param handle Queue handle
- * @return true if a message was removed, false if not
+ * @param addr Start of the range
+ * @param len Length of the range in bytes
+ * @param durability Durability of the operation that made the change
  */
-bool ticosd_queue_complete_read(sTicosdQueue *handle) {
-  pthread_mutex_lock(&handle->lock);
-
-  if (!handle->can_complete_read) {
-    pthread_mutex_unlock(&handle->lock);
-    return false;
+static void prv_queue_sync_range(sTicosdQueue *handle, const void *addr, size_t len,
+                                 eTicosdQueueDurability durability) {
+  if (!handle->is_file_backed) {
+    return;
   }
+  prv_queue_mark_dirty(handle, addr, len);
+  prv_queue_commit(handle, durability);
+}
 
-  sTicosQueueMsgHeader *header = (sTicosQueueMsgHeader *)&handle->buf[handle->read_ptr];
-  header->flags |= HEADER_FLAGS_FLAG_READ_MASK;
-  msync(&header->flags, sizeof(header->flags), MS_SYNC);
-
-  handle->read_ptr = prv_get_next_message(handle, handle->read_ptr);
+static void *prv_queue_flusher_thread(void *arg) {
+  sTicosdQueue *handle = arg;
 
-  // Flip to false, to make another ..complete_read() call -- before a ..read_head() call -- bail:
-  handle->can_complete_read = false;
+  pthread_mutex_lock(&handle->lock);
+  while (!handle->flusher_stop) {
+    if (!handle->flush_scheduled && !handle->write_back_scheduled) {
+      pthread_cond_wait(&handle->flusher_cond, &handle->lock);
+      continue;
+    }
 
+    // Give more changes the chance to join this flush, up to the group commit interval or size:
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += handle->group_commit_interval_ms / 1000;
+    deadline.tv_nsec += (handle->group_commit_interval_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    while (!handle->flusher_stop && (handle->flush_scheduled || handle->write_back_scheduled) &&
+           handle->dirty_bytes < handle->group_commit_bytes) {
+      if (pthread_cond_timedwait(&handle->flusher_cond, &handle->lock, &deadline) == ETIMEDOUT) {
+        break;
+      }
+    }
+    // Unless stopping (the remaining changes are flushed by ticosd_queue_destroy()), or a strict
+    // operation flushed the changes in the meantime:
+    if (handle->flusher_stop) {
+      continue;
+    }
+    if (handle->flush_scheduled) {
+      prv_queue_flush_locked(handle);
+    } else if (handle->write_back_scheduled) {
+      prv_queue_write_back_locked(handle);
+    }
+  }
   pthread_mutex_unlock(&handle->lock);
-  return true;
+  return NULL;
 }
 
 /**
- * @brief Adds message to queue
+ * @brief Starts the group commit flusher thread, if not started yet
  *
  * @param handle Queue handle
- * @param payload Payload data
- * @param payload_size_bytes Payload size in bytes
- * @return true Successfully added message to queue
- * @return false Failed to add
+ * @return true if the flusher thread is running, false if it failed to start
+ */
+static bool prv_queue_start_flusher(sTicosdQueue *handle) {
+  if (handle->flusher_started) {
+    return true;
+  }
+  if (pthread_create(&handle->flusher_thread, NULL, prv_queue_flusher_thread, handle) != 0) {
+    fprintf(stderr, "queue:: Failed to create flusher thread, using strict durability.\n");
+    return false;
+  }
+  handle->flusher_started = true;
+  return true;
+}
+
+/**
+ * @brief Returns whether changes made with the given durability need the flusher thread
+ */
+static bool prv_queue_needs_flusher(sTicosdQueue *handle, eTicosdQueueDurability durability) {
+  if (!handle->is_file_backed) {
+    return false;
+  }
+  return durability == kTicosdQueueDurability_Group ||
+         (durability == kTicosdQueueDurability_Async &&
+          ticosd_queue_storage_needs_write_back(handle->storage));
+}
+
+static eTicosdQueueDurability prv_queue_get_durability(sTicosdQueue *handle, uint8_t type) {
+  const int8_t durability = handle->type_durability[type];
+  return durability >= 0 ? (eTicosdQueueDurability)durability : handle->durability;
+}
+
+static uint32_t prv_checkpoint_checksum(const sTicosQueueCheckpoint *checkpoint) {
+  return ticos_crc32c(0, checkpoint, offsetof(sTicosQueueCheckpoint, checksum));
+}
+
+static bool prv_has_unread_msgs(sTicosdQueue *handle) {
+  if (handle->read_ptr != handle->write_ptr) {
+    return true;
+  }
+  const sTicosQueueMsgHeader *header = (sTicosQueueMsgHeader *)&handle->buf[handle->read_ptr];
+  return !prv_is_msg_read(header) && prv_is_msg_valid(handle, header);
+}
+
+/**
+ * @brief Persists the current read, write and previous pointers into the next checkpoint slot
+ *
+ * @param handle Queue handle
+ * @param durability Durability of the operation that triggered the checkpoint
+ */
+static void prv_checkpoint_write(sTicosdQueue *handle, eTicosdQueueDurability durability) {
+  const uint32_t generation = handle->checkpoint_generation + 1;
+  sTicosQueueCheckpoint *const checkpoint =
+    &handle->checkpoints[generation % CHECKPOINT_SLOT_COUNT];
+
+  *checkpoint = (sTicosQueueCheckpoint){
+    .magic = CHECKPOINT_MAGIC_NUMBER,
+    .version = CHECKPOINT_VERSION_NUMBER,
+    .flags = prv_has_unread_msgs(handle) ? CHECKPOINT_FLAGS_HAS_UNREAD_MASK : 0,
+    .generation = generation,
+    .queue_size = handle->size,
+    .read_ptr = handle->read_ptr,
+    .write_ptr = handle->write_ptr,
+    .prev_ptr = handle->prev_ptr,
+  };
+  checkpoint->checksum = prv_checkpoint_checksum(checkpoint);
+  // Update before flushing, the lock may be released while flushing:
+  handle->checkpoint_generation = generation;
+  handle->ops_since_checkpoint = 0;
+
+  prv_queue_sync_range(handle, checkpoint, sizeof(*checkpoint), durability);
+}
+
+/**
+ * @brief Counts writes or completed reads and writes a checkpoint every CHECKPOINT_INTERVAL_OPS
+ *
+ * @param handle Queue handle
+ * @param count Number of operations
+ * @param durability Durability of the operations
+ */
+static void prv_checkpoint_count_ops(sTicosdQueue *handle, uint32_t count,
+                                     eTicosdQueueDurability durability) {
+  handle->ops_since_checkpoint += count;
+  if (handle->ops_since_checkpoint >= CHECKPOINT_INTERVAL_OPS) {
+    prv_checkpoint_write(handle, durability);
+  }
+}
+
+static bool prv_is_checkpoint_valid(sTicosdQueue *handle,
+                                    const sTicosQueueCheckpoint *checkpoint) {
+  const uint32_t size_words = handle->size / sizeof(uint32_t);
+  return checkpoint->magic == CHECKPOINT_MAGIC_NUMBER &&
+         checkpoint->version == CHECKPOINT_VERSION_NUMBER &&
+         checkpoint->checksum == prv_checkpoint_checksum(checkpoint) &&
+         checkpoint->queue_size == (uint32_t)handle->size && checkpoint->read_ptr < size_words &&
+         checkpoint->write_ptr < size_words && checkpoint->prev_ptr < size_words;
+}
+
+/**
+ * @brief Finds the most recent valid checkpoint
+ *
+ * @param handle Queue handle
+ * @return Pointer to the most recent valid checkpoint, or NULL if no slot holds a valid one
+ */
+static const sTicosQueueCheckpoint *prv_checkpoint_find_latest(sTicosdQueue *handle) {
+  const sTicosQueueCheckpoint *latest = NULL;
+  for (unsigned int i = 0; i < CHECKPOINT_SLOT_COUNT; ++i) {
+    const sTicosQueueCheckpoint *checkpoint = &handle->checkpoints[i];
+    if (!prv_is_checkpoint_valid(handle, checkpoint)) {
+      continue;
+    }
+    if (!latest || (int32_t)(checkpoint->generation - latest->generation) > 0) {
+      latest = checkpoint;
+    }
+  }
+  return latest;
+}
+
+/**
+ * @brief Find read & write pointers at start of day, using the latest checkpoint
+ *
+ * Only the messages written and read after the checkpoint was taken are validated. Any write that
+ * wraps around or overwrites unread messages writes a checkpoint immediately, so messages written
+ * after the checkpoint never overwrite each other nor extend past the checkpoint's read pointer.
+ *
+ * @param handle Queue handle
+ * @return true if the pointers were recovered, false if no usable checkpoint was found
+ */
+static bool prv_queue_recover_from_checkpoint(sTicosdQueue *handle) {
+  const sTicosQueueCheckpoint *checkpoint = prv_checkpoint_find_latest(handle);
+  if (!checkpoint) {
+    return false;
+  }
+
+  const bool had_unread = checkpoint->flags & CHECKPOINT_FLAGS_HAS_UNREAD_MASK;
+  if (had_unread &&
+      !prv_is_msg_valid(handle, (sTicosQueueMsgHeader *)&handle->buf[checkpoint->read_ptr])) {
+    // The oldest unread message can only disappear by being overwritten, which would have written
+    // a newer checkpoint:
+    return false;
+  }
+
+  /*
+   * Walk the messages written after the checkpoint, starting at the checkpointed write_ptr. A
+   * message belongs to this tail if it is valid and its prev_header links to the message before
+   * it. Like the full scan, stop when moving from an unread to a read message. Never walk past the
+   * checkpointed read_ptr (if there was unread data) or around the entire buffer.
+   */
+  const bool was_full = had_unread && checkpoint->read_ptr == checkpoint->write_ptr;
+  uint32_t ptr = checkpoint->write_ptr;
+  uint32_t prev_ptr = checkpoint->prev_ptr;
+  uint32_t first_unread_ptr = 0;
+  bool seen_unread = false;
+  bool moved = false;
+  while (!was_full) {
+    if (moved && (ptr == checkpoint->write_ptr || (had_unread && ptr == checkpoint->read_ptr))) {
+      break;
+    }
+    if (handle->buf[ptr] == END_POINTER && ptr != 0) {
+      ptr = 0;
+      moved = true;
+      continue;
+    }
+    const sTicosQueueMsgHeader *header = (sTicosQueueMsgHeader *)&handle->buf[ptr];
+    if (!prv_is_msg_valid(handle, header) || header->prev_header != prev_ptr) {
+      break;
+    }
+    const bool is_msg_read = prv_is_msg_read(header);
+    if (is_msg_read && seen_unread) {
+      break;
+    }
+    if (!is_msg_read && !seen_unread) {
+      seen_unread = true;
+      first_unread_ptr = ptr;
+    }
+    prev_ptr = ptr;
+    ptr = prv_get_next_message(handle, ptr);
+    moved = true;
+  }
+  const uint32_t write_ptr = ptr;
+
+  uint32_t read_ptr;
+  if (had_unread) {
+    // Skip over the messages that were read after the checkpoint was taken:
+    read_ptr = checkpoint->read_ptr;
+    do {
+      const sTicosQueueMsgHeader *header = (sTicosQueueMsgHeader *)&handle->buf[read_ptr];
+      if (!prv_is_msg_valid(handle, header) || !prv_is_msg_read(header)) {
+        break;
+      }
+      read_ptr = prv_get_next_message(handle, read_ptr);
+    } while (read_ptr != write_ptr);
+  } else {
+    read_ptr = seen_unread ? first_unread_ptr : write_ptr;
+  }
+
+  handle->read_ptr = read_ptr;
+  handle->write_ptr = write_ptr;
+  handle->prev_ptr = prev_ptr;
+  handle->checkpoint_generation = checkpoint->generation;
+  return true;
+}
+
+/**
+ * @brief Returns the message at the head of the queue
+ *
+ * @param handle Queue handle
+ * @return Pointer to the header of the oldest unread message, or NULL if the queue is empty
+ */
+static sTicosQueueMsgHeader *prv_queue_get_head(sTicosdQueue *handle) {
+  sTicosQueueMsgHeader *header = (sTicosQueueMsgHeader *)&handle->buf[handle->read_ptr];
+  if (handle->read_ptr == handle->write_ptr) {
+    if (!prv_is_msg_valid(handle, header) || prv_is_msg_read(header)) {
+      // read_ptr is caught up, nothing to read!
+      return NULL;
+    }
+  }
+  if (prv_is_msg_pending(header)) {
+    // Oldest message is still being written:
+    return NULL;
+  }
+  return header;
+}
+
+static bool prv_is_expired(sTicosdQueue *handle, uint8_t type, time_t timestamp, time_t now) {
+  const uint32_t ttl = handle->type_ttl[type];
+  // Messages of unknown age are kept, as are messages from the future after the clock went back:
+  return ttl > 0 && timestamp >= TIMESTAMP_MIN && now >= timestamp &&
+         (uint64_t)(now - timestamp) >= ttl;
+}
+
+static bool prv_is_msg_expired(sTicosdQueue *handle, const sTicosQueueMsgHeader *header,
+                               time_t now) {
+  return handle->has_ttl && header->payload_size_bytes > 0 &&
+         prv_is_expired(handle, prv_msg_payload(header)[0], prv_msg_timestamp(header), now);
+}
+
+/**
+ * @brief Accounts for an expired message and lets the owner release what it references
+ *
+ * @param handle Queue handle
+ * @param payload Payload of the message, decompressed
+ * @param payload_size_bytes Size of payload in bytes
+ * @param stored_size_bytes Size of the payload as stored
+ */
+static void prv_queue_report_expired(sTicosdQueue *handle, const uint8_t *payload,
+                                     uint32_t payload_size_bytes, uint32_t stored_size_bytes) {
+  handle->expired_count++;
+  handle->expired_bytes += stored_size_bytes;
+  if (handle->expired_callback) {
+    handle->expired_callback(handle->expired_callback_ctx, payload, payload_size_bytes);
+  }
+}
+
+/**
+ * @brief Marks the message at the head of the queue read without returning it, and moves on
+ *
+ * @param handle Queue handle
+ * @param header Message at the head of the queue
+ * @param flags Flags to set along with the read flag
+ */
+static void prv_queue_skip_head(sTicosdQueue *handle, sTicosQueueMsgHeader *header,
+                                uint8_t flags) {
+  header->flags |= HEADER_FLAGS_FLAG_READ_MASK | flags;
+  if (handle->is_file_backed) {
+    prv_queue_mark_dirty(handle, &header->flags, sizeof(header->flags));
+  }
+  prv_queue_remove_blob(handle, header);
+  handle->read_ptr = prv_get_next_message(handle, handle->read_ptr);
+}
+
+/**
+ * @brief Commits the messages skipped with prv_queue_skip_head()
+ *
+ * @param handle Queue handle
+ * @param count Number of messages skipped
+ */
+static void prv_queue_commit_skipped(sTicosdQueue *handle, uint32_t count) {
+  // Skipped messages are skipped again if the change is lost:
+  handle->completable_count = 0;
+  prv_checkpoint_count_ops(handle, count, kTicosdQueueDurability_Async);
+  prv_queue_commit(handle, kTicosdQueueDurability_Async);
+}
+
+/**
+ * @brief Drops the message at the head of the queue of which the side file cannot be read
+ *
+ * @param handle Queue handle
+ * @return true if there is another message at the head of the queue
+ */
+static bool prv_queue_drop_lost_head(sTicosdQueue *handle) {
+  sTicosQueueMsgHeader *header = prv_queue_get_head(handle);
+  fprintf(stderr, "queue:: dropping %u bytes message, its side file cannot be read.\n",
+          prv_msg_stored_size(header));
+  prv_queue_skip_head(handle, header, 0);
+  prv_queue_commit_skipped(handle, 1);
+  return prv_queue_get_head(handle) != NULL;
+}
+
+/**
+ * @brief Marks the expired and the already acknowledged messages at the head of the queue read,
+ * so that they are not returned
+ *
+ * Only the head is looked at: an expired or acknowledged message behind one that is neither is
+ * dropped once it gets to the head.
+ *
+ * @param handle Queue handle
+ */
+static void prv_queue_expire_head(sTicosdQueue *handle) {
+  if (handle->lease_held) {
+    return;
+  }
+
+  const time_t now = prv_queue_now(handle);
+  uint32_t count = 0;
+  sTicosQueueMsgHeader *header;
+  while ((header = prv_queue_get_head(handle)) != NULL) {
+    if (prv_is_msg_acked(header)) {
+      prv_queue_skip_head(handle, header, 0);
+      count++;
+      continue;
+    }
+    if (!prv_is_msg_expired(handle, header, now)) {
+      break;
+    }
+    uint32_t payload_size_bytes;
+    if (prv_is_msg_blob(header)) {
+      uint8_t *payload = prv_queue_map_blob(handle, header, &payload_size_bytes);
+      if (payload) {
+        prv_queue_report_expired(handle, payload, payload_size_bytes, payload_size_bytes);
+        ticosd_queue_blobs_unmap(payload, payload_size_bytes);
+      }
+    } else if (prv_is_msg_compressed(header)) {
+      uint8_t *payload = prv_msg_decompress(header, &payload_size_bytes);
+      if (payload) {
+        prv_queue_report_expired(handle, payload, payload_size_bytes, header->payload_size_bytes);
+        free(payload);
+      }
+    } else {
+      prv_queue_report_expired(handle, prv_msg_payload(header), header->payload_size_bytes,
+                               header->payload_size_bytes);
+    }
+
+    prv_queue_skip_head(handle, header, HEADER_FLAGS_FLAG_EXPIRED_MASK);
+    count++;
+  }
+
+  if (count > 0) {
+    prv_queue_commit_skipped(handle, count);
+  }
+}
+
+/**
+ * @brief Checks whether the range [start, end) overlaps [region_start, region_end)
+ *
+ * The region wraps around the end of the buffer if region_end <= region_start.
+ */
+static bool prv_ranges_overlap(uint32_t start, uint32_t end, uint32_t region_start,
+                               uint32_t region_end) {
+  if (region_start < region_end) {
+    return start < region_end && region_start < end;
+  }
+  return end > region_start || start < region_end;
+}
+
+static bool prv_is_range_in_use(sTicosdQueue *handle, uint32_t start, uint32_t end) {
+  return (handle->lease_held &&
+          prv_ranges_overlap(start, end, handle->lease_ptr, handle->lease_end)) ||
+         (handle->pending_count > 0 &&
+          prv_ranges_overlap(start, end, handle->pending_ptr, handle->write_ptr));
+}
+
+static bool prv_is_range_unread(sTicosdQueue *handle, uint32_t start, uint32_t end) {
+  return prv_has_unread_msgs(handle) &&
+         prv_ranges_overlap(start, end, handle->read_ptr, handle->write_ptr);
+}
+
+/**
+ * @brief Checks whether writing a message at write_ptr would overwrite part of the buffer
+ *
+ * @param handle Queue handle
+ * @param message_size_words Size of the message to write (header and padded payload) in words
+ * @param is_range_taken Checks whether a range of the buffer must not be overwritten
+ * @return true if the write would overwrite a range that is taken
+ */
+static bool prv_write_overlaps(sTicosdQueue *handle, uint32_t message_size_words,
+                               bool (*is_range_taken)(sTicosdQueue *, uint32_t, uint32_t)) {
+  if (handle->write_ptr + message_size_words > handle->size / sizeof(uint32_t)) {
+    // END_POINTER is written at write_ptr and the message at the start of the buffer:
+    return is_range_taken(handle, handle->write_ptr, handle->write_ptr + 1) ||
+           is_range_taken(handle, 0, message_size_words);
+  }
+  return is_range_taken(handle, handle->write_ptr, handle->write_ptr + message_size_words);
+}
+
+static bool prv_check_queue_size(int *queue_size) {
+  if (*queue_size % QUEUE_SIZE_ALIGNMENT != 0) {
+    const int aligned_queue_size = (*queue_size / QUEUE_SIZE_ALIGNMENT) * QUEUE_SIZE_ALIGNMENT;
+    fprintf(stderr, "queue:: queue_size (%i) must be a multiple of 4. Rounding down to %i.\n",
+            *queue_size, aligned_queue_size);
+    *queue_size = aligned_queue_size;
+  }
+  if (*queue_size < QUEUE_SIZE_MIN) {
+    fprintf(stderr,
+            "queue:: queue_size (%i) too small, minimum size is %i. Falling back to default "
+            "size.\n",
+            *queue_size, QUEUE_SIZE_MIN);
+    return false;
+  }
+  if (*queue_size > QUEUE_SIZE_MAX) {
+    fprintf(
+      stderr,
+      "queue:: queue_size (%i) too large, maximum size is %i. Falling back to default size.\n",
+      *queue_size, QUEUE_SIZE_MAX);
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Opens the side files directory, removing the side files that no unread message refers to
+ *
+ * @param handle Queue handle
+ * @return true if side files can be used
+ */
+static bool prv_queue_open_blobs(sTicosdQueue *handle) {
+  if (handle->blobs) {
+    return true;
+  }
+  if (!handle->blob_dir || !(handle->blobs = ticosd_queue_blobs_open(handle->blob_dir))) {
+    return false;
+  }
+
+  uint64_t *ids = NULL;
+  uint32_t count = 0;
+  uint32_t capacity = 0;
+  if (prv_queue_get_head(handle)) {
+    // Walks once around the buffer at most, in case the chain is damaged:
+    uint32_t max_count = handle->size / (HEADER_LEN * sizeof(uint32_t));
+    uint32_t ptr = handle->read_ptr;
+    do {
+      const sTicosQueueMsgHeader *header = (sTicosQueueMsgHeader *)&handle->buf[ptr];
+      if (prv_is_msg_pending(header)) {
+        break;
+      }
+      sTicosQueueBlobRef ref;
+      if (prv_is_msg_blob(header) && prv_msg_blob_ref(header, &ref)) {
+        if (count == capacity) {
+          capacity = capacity ? 2 * capacity : 64;
+          uint64_t *new_ids = realloc(ids, capacity * sizeof(*ids));
+          if (!new_ids) {
+            fprintf(stderr, "queue:: Failed to allocate side file references.\n");
+            goto cleanup;
+          }
+          ids = new_ids;
+        }
+        ids[count++] = ref.id;
+      }
+      ptr = prv_get_next_message(handle, ptr);
+    } while (ptr != handle->write_ptr && --max_count > 0);
+  }
+
+  const uint32_t removed = ticosd_queue_blobs_reconcile(handle->blobs, ids, count);
+  if (removed > 0) {
+    fprintf(stderr, "queue:: Removed %u unreferenced side files.\n", removed);
+  }
+  free(ids);
+  return true;
+
+cleanup:
+  free(ids);
+  ticosd_queue_blobs_close(handle->blobs);
+  handle->blobs = NULL;
+  return false;
+}
+
+/**
+ * @brief Initialises the queue object
+ *
+ * @param ticosd Main ticosd handle
+ * @return ticosd_queue_h queue object
+ */
+sTicosdQueue *ticosd_queue_init(sTicosd *ticosd, int size) {
+  return ticosd_queue_init_with_name(ticosd, "queue", size);
+}
+
+/**
+ * @brief Initialises a queue object backed by the given file in the data directory
+ *
+ * @param ticosd Main ticosd handle
+ * @param name Name of the queue file
+ * @param size Size of the queue in bytes
+ * @return ticosd_queue_h queue object
+ */
+sTicosdQueue *ticosd_queue_init_with_name(sTicosd *ticosd, const char *name, int size) {
+  return ticosd_queue_init_with_backend(ticosd, name, size, kTicosdQueueBackend_Mmap);
+}
+
+/**
+ * @brief Initialises a queue object backed by the given file in the data directory, persisted
+ * with the given storage backend
+ *
+ * @param ticosd Main ticosd handle
+ * @param name Name of the queue file
+ * @param size Size of the queue in bytes
+ * @param backend Storage backend
+ * @return ticosd_queue_h queue object
+ */
+sTicosdQueue *ticosd_queue_init_with_backend(sTicosd *ticosd, const char *name, int size,
+                                             eTicosdQueueBackend backend) {
+  sTicosdQueue *handle = calloc(sizeof(sTicosdQueue), 1);
+
+  handle->ticosd = ticosd;
+  handle->size = size;
+  handle->durability = kTicosdQueueDurability_Strict;
+  handle->overwrite = true;
+  memset(handle->type_durability, -1, sizeof(handle->type_durability));
+  handle->group_commit_interval_ms = GROUP_COMMIT_INTERVAL_MS_DEFAULT;
+  handle->group_commit_bytes = GROUP_COMMIT_BYTES_DEFAULT;
+
+  if (pthread_mutex_init(&handle->lock, NULL) != 0) {
+    fprintf(stderr, "queue:: Failed to initialise queue mutex.\n");
+    free(handle);
+    return NULL;
+  }
+
+  pthread_condattr_t condattr;
+  pthread_condattr_init(&condattr);
+  pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+  if (pthread_cond_init(&handle->flusher_cond, &condattr) != 0 ||
+      pthread_cond_init(&handle->flushed_cond, NULL) != 0 ||
+      pthread_cond_init(&handle->committed_cond, NULL) != 0) {
+    fprintf(stderr, "queue:: Failed to initialise queue condition variables.\n");
+    pthread_condattr_destroy(&condattr);
+    pthread_mutex_destroy(&handle->lock);
+    free(handle);
+    return NULL;
+  }
+  pthread_condattr_destroy(&condattr);
+
+  if (!prv_check_queue_size(&handle->size)) {
+    /* Default to 1MiB */
+    handle->size = 1024 * 1024;
+  }
+
+  char *queue_file = ticosd_generate_rw_filename(handle->ticosd, name);
+
+  int fd = -1;
+  if (queue_file) {
+    if ((fd = open(queue_file, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR)) == -1) {
+      fprintf(stderr, "queue:: Failed to open '%s', falling back to non-persistent queue.\n",
+              queue_file);
+    } else {
+      if (ftruncate(fd, handle->size + CHECKPOINT_REGION_SIZE) == -1) {
+        close(fd);
+        fd = -1;
+        fprintf(stderr, "queue:: Failed to resize '%s', falling back to non-persistent queue.\n",
+                queue_file);
+      } else {
+        // The storage owns fd from now on:
+        if (!(handle->storage =
+                ticosd_queue_storage_open(backend, fd, prv_queue_storage_size(handle)))) {
+          close(fd);
+          fd = -1;
+          fprintf(stderr, "queue:: Failed to load '%s', falling back to non-persistent queue.\n",
+                  queue_file);
+        } else {
+          handle->buf = ticosd_queue_storage_get_buf(handle->storage);
+          const size_t blob_dir_len = strlen(queue_file) + sizeof(".blobs");
+          if ((handle->blob_dir = malloc(blob_dir_len))) {
+            snprintf(handle->blob_dir, blob_dir_len, "%s.blobs", queue_file);
+          }
+        }
+      }
+    }
+    free(queue_file);
+  }
+  if (fd == -1) {
+    handle->buf = calloc(prv_queue_storage_size(handle), 1);
+    handle->is_file_backed = false;
+  } else {
+    handle->is_file_backed = true;
+  }
+  handle->checkpoints = (sTicosQueueCheckpoint *)((uint8_t *)handle->buf + handle->size);
+
+  if (!prv_queue_recover_from_checkpoint(handle)) {
+    if (handle->is_file_backed) {
+      fprintf(stderr, "queue:: No valid checkpoint found, scanning entire queue.\n");
+    }
+    prv_queue_find_read_write_ptr(handle);
+  }
+  pthread_mutex_lock(&handle->lock);
+  prv_checkpoint_write(handle, kTicosdQueueDurability_Strict);
+  // Side files left by a previous run are still read, even if they are not written any more:
+  struct stat st;
+  if (handle->blob_dir && stat(handle->blob_dir, &st) == 0) {
+    prv_queue_open_blobs(handle);
+  }
+  pthread_mutex_unlock(&handle->lock);
+
+  return handle;
+}
+
+/**
+ * @brief Destroys the queue handle
+ *
+ * @param handle Queue handle
+ */
+void ticosd_queue_destroy(sTicosdQueue *handle) {
+  if (handle) {
+    if (handle->flusher_started) {
+      pthread_mutex_lock(&handle->lock);
+      handle->flusher_stop = true;
+      pthread_cond_signal(&handle->flusher_cond);
+      pthread_mutex_unlock(&handle->lock);
+      pthread_join(handle->flusher_thread, NULL);
+    }
+
+    // Also flushes any pending group commit and async changes:
+    pthread_mutex_lock(&handle->lock);
+    prv_checkpoint_write(handle, kTicosdQueueDurability_Strict);
+    pthread_mutex_unlock(&handle->lock);
+    if (handle->is_file_backed) {
+      ticosd_queue_storage_close(handle->storage);
+    } else if (handle->buf) {
+      free(handle->buf);
+    }
+
+    prv_queue_free_lease_bufs(handle);
+    free(handle->lease_bufs);
+    ticosd_queue_blobs_close(handle->blobs);
+    free(handle->blob_dir);
+    pthread_cond_destroy(&handle->flusher_cond);
+    pthread_cond_destroy(&handle->flushed_cond);
+    pthread_cond_destroy(&handle->committed_cond);
+    pthread_mutex_destroy(&handle->lock);
+    free(handle);
+  }
+}
+
+/**
+ * @brief Sets the durability of operations on messages without a per-type override
+ *
+ * @param handle Queue handle
+ * @param durability Durability
+ */
+void ticosd_queue_set_durability(sTicosdQueue *handle, eTicosdQueueDurability durability) {
+  pthread_mutex_lock(&handle->lock);
+  if (prv_queue_needs_flusher(handle, durability) && !prv_queue_start_flusher(handle)) {
+    durability = kTicosdQueueDurability_Strict;
+  }
+  handle->durability = durability;
+  pthread_mutex_unlock(&handle->lock);
+}
+
+/**
+ * @brief Overrides the durability of operations on messages of the given type
+ *
+ * @param handle Queue handle
+ * @param type Message type, the first byte of the payload (eTicosdTxDataType)
+ * @param durability Durability
+ */
+void ticosd_queue_set_type_durability(sTicosdQueue *handle, uint8_t type,
+                                      eTicosdQueueDurability durability) {
+  pthread_mutex_lock(&handle->lock);
+  if (prv_queue_needs_flusher(handle, durability) && !prv_queue_start_flusher(handle)) {
+    durability = kTicosdQueueDurability_Strict;
+  }
+  handle->type_durability[type] = (int8_t)durability;
+  pthread_mutex_unlock(&handle->lock);
+}
+
+/**
+ * @brief Configures when group commit changes are flushed
+ *
+ * @param handle Queue handle
+ * @param interval_ms Maximum time a change stays unflushed, in milliseconds
+ * @param size_bytes Number of changed bytes after which a flush is started right away
+ */
+void ticosd_queue_set_group_commit(sTicosdQueue *handle, int interval_ms, int size_bytes) {
+  pthread_mutex_lock(&handle->lock);
+  if (interval_ms > 0) {
+    handle->group_commit_interval_ms = interval_ms;
+  }
+  if (size_bytes > 0) {
+    handle->group_commit_bytes = size_bytes;
+  }
+  pthread_mutex_unlock(&handle->lock);
+}
+
+/**
+ * @brief Sets what happens when writing to a full queue
+ *
+ * @param handle Queue handle
+ * @param overwrite true to drop the oldest unread messages (the default), false to fail the write
+ */
+void ticosd_queue_set_overwrite(sTicosdQueue *handle, bool overwrite) {
+  pthread_mutex_lock(&handle->lock);
+  handle->overwrite = overwrite;
+  pthread_mutex_unlock(&handle->lock);
+}
+
+/**
+ * @brief Sets the payload size from which messages are stored compressed
+ *
+ * Messages are only stored compressed if that makes them smaller. They are decompressed when read,
+ * peeked messages included, so readers never see the compressed form.
+ *
+ * @param handle Queue handle
+ * @param threshold_bytes Minimum payload size in bytes, 0 to disable compression (the default)
+ */
+void ticosd_queue_set_compression(sTicosdQueue *handle, uint32_t threshold_bytes) {
+  pthread_mutex_lock(&handle->lock);
+  handle->compress_threshold = threshold_bytes;
+  pthread_mutex_unlock(&handle->lock);
+}
+
+/**
+ * @brief Sets the payload size from which messages are stored in side files
+ *
+ * The queue then only holds a small reference to the payload, so that a few large messages do not
+ * take the space of many small ones. Side files are stored next to the queue file, a queue that is
+ * not file backed keeps all payloads in its buffer.
+ *
+ * @param handle Queue handle
+ * @param threshold_bytes Minimum payload size in bytes, 0 to disable side files (the default)
+ */
+void ticosd_queue_set_blob_threshold(sTicosdQueue *handle, uint32_t threshold_bytes) {
+  pthread_mutex_lock(&handle->lock);
+  if (threshold_bytes == 0 || prv_queue_open_blobs(handle)) {
+    handle->blob_threshold = threshold_bytes;
+  }
+  pthread_mutex_unlock(&handle->lock);
+}
+
+/**
+ * @brief Returns the durability of operations on messages of the given type
+ *
+ * @param handle Queue handle
+ * @param type Message type, the first byte of the payload (eTicosdTxDataType)
+ */
+eTicosdQueueDurability ticosd_queue_get_type_durability(sTicosdQueue *handle, uint8_t type) {
+  pthread_mutex_lock(&handle->lock);
+  const eTicosdQueueDurability durability = prv_queue_get_durability(handle, type);
+  pthread_mutex_unlock(&handle->lock);
+  return durability;
+}
+
+/**
+ * @brief Sets how long messages of the given type are kept before being dropped unsent
+ *
+ * Expired messages are dropped when they get to the head of the queue. Messages written by
+ * versions that did not record the enqueue time never expire.
+ *
+ * @param handle Queue handle
+ * @param type Message type, the first byte of the payload (eTicosdTxDataType)
+ * @param ttl_seconds Time-to-live in seconds, 0 to keep messages until they are sent
+ */
+void ticosd_queue_set_type_ttl(sTicosdQueue *handle, uint8_t type, uint32_t ttl_seconds) {
+  pthread_mutex_lock(&handle->lock);
+  handle->type_ttl[type] = ttl_seconds;
+  handle->has_ttl = false;
+  for (unsigned int i = 0; i <= UINT8_MAX; ++i) {
+    handle->has_ttl |= handle->type_ttl[i] > 0;
+  }
+  pthread_mutex_unlock(&handle->lock);
+}
+
+/**
+ * @brief Sets the function called with the payload of each expired message
+ *
+ * The callback runs with the queue lock held and must not call back into the queue.
+ *
+ * @param handle Queue handle
+ * @param callback Callback, NULL for none
+ * @param ctx Passed to the callback
+ */
+void ticosd_queue_set_expired_callback(sTicosdQueue *handle,
+                                       ticosd_queue_expired_callback callback, void *ctx) {
+  pthread_mutex_lock(&handle->lock);
+  handle->expired_callback = callback;
+  handle->expired_callback_ctx = ctx;
+  pthread_mutex_unlock(&handle->lock);
+}
+
+/**
+ * @brief Drops a message that is not in the queue yet if its time-to-live elapsed
+ *
+ * Used for messages stored elsewhere before being written to the queue, e.g. spilled ones. They
+ * are accounted for and passed to the expired callback like the queue's own.
+ *
+ * @param handle Queue handle
+ * @param payload Payload of the message
+ * @param payload_size_bytes Payload size in bytes
+ * @param timestamp Time the message was enqueued at, or a later time, 0 if unknown
+ * @return true if the message expired and must not be written, false if not
+ */
+bool ticosd_queue_expire_entry(sTicosdQueue *handle, const uint8_t *payload,
+                               uint32_t payload_size_bytes, time_t timestamp) {
+  if (payload_size_bytes == 0 || payload == NULL) {
+    return false;
+  }
+  pthread_mutex_lock(&handle->lock);
+  const bool expired = prv_is_expired(handle, payload[0], timestamp, prv_queue_now(handle));
+  if (expired) {
+    prv_queue_report_expired(handle, payload, payload_size_bytes, payload_size_bytes);
+  }
+  pthread_mutex_unlock(&handle->lock);
+  return expired;
+}
+
+/**
+ * @brief Returns the size of the largest payload that fits in the queue
+ *
+ * @param handle Queue handle
+ * @return Maximum payload size in bytes, UINT32_MAX if larger payloads go to side files
+ */
+uint32_t ticosd_queue_get_max_payload_size(sTicosdQueue *handle) {
+  const uint32_t max_size = handle->size - HEADER_LEN * sizeof(uint32_t);
+  pthread_mutex_lock(&handle->lock);
+  const uint32_t blob_threshold = handle->blob_threshold;
+  pthread_mutex_unlock(&handle->lock);
+  // Any payload from the threshold on is stored in a side file:
+  return blob_threshold > 0 && blob_threshold <= max_size ? UINT32_MAX : max_size;
+}
+
+/**
+ * @brief Returns the current depth of the queue and how many messages it had to drop
+ *
+ * The depth is computed by walking the unread messages, this is meant for occasional monitoring,
+ * not for every operation.
+ *
+ * @param handle Queue handle
+ * @param[out] stats Queue statistics
+ */
+void ticosd_queue_get_stats(sTicosdQueue *handle, sTicosdQueueStats *stats) {
+  pthread_mutex_lock(&handle->lock);
+
+  *stats = (sTicosdQueueStats){
+    .overwritten_count = handle->overwritten_count,
+    .overwritten_bytes = handle->overwritten_bytes,
+    .expired_count = handle->expired_count,
+    .expired_bytes = handle->expired_bytes,
+  };
+
+  const sTicosQueueMsgHeader *header = prv_queue_get_head(handle);
+  if (header) {
+    stats->oldest_unread_timestamp = prv_msg_timestamp(header);
+    // Walks once around the buffer at most, in case the chain is damaged:
+    uint32_t max_count = handle->size / (HEADER_LEN * sizeof(uint32_t));
+    uint32_t ptr = handle->read_ptr;
+    do {
+      header = (sTicosQueueMsgHeader *)&handle->buf[ptr];
+      if (prv_is_msg_pending(header)) {
+        break;
+      }
+      stats->unread_count++;
+      stats->unread_bytes +=
+        (prv_header_len_words(header) + prv_bytes_to_words_round_up(header->payload_size_bytes)) *
+        sizeof(uint32_t);
+      ptr = prv_get_next_message(handle, ptr);
+    } while (ptr != handle->write_ptr && --max_count > 0);
+  }
+
+  pthread_mutex_unlock(&handle->lock);
+}
+
+/**
+ * @brief Resets the internal queue state to empty
+ *
+ * Waits for the messages reserved with ticosd_queue_reserve() to be committed first, so that no
+ * producer is left filling in a message that is gone. The caller must not hold a reservation.
+ *
+ * @param handle Queue handle
+ */
+void ticosd_queue_reset(sTicosdQueue *handle) {
+  pthread_mutex_lock(&handle->lock);
+  while (handle->pending_count > 0) {
+    pthread_cond_wait(&handle->committed_cond, &handle->lock);
+  }
+  handle->read_ptr = 0;
+  handle->write_ptr = 0;
+  handle->prev_ptr = 0;
+  handle->completable_count = 0;
+  handle->lease_held = false;
+  prv_queue_free_lease_bufs(handle);
+
+  memset(handle->buf, 0, HEADER_LEN * sizeof(uint32_t));
+  prv_queue_sync_range(handle, handle->buf, HEADER_LEN * sizeof(uint32_t),
+                       kTicosdQueueDurability_Strict);
+  prv_checkpoint_write(handle, kTicosdQueueDurability_Strict);
+  if (handle->blobs) {
+    // No message refers to any side file any more:
+    ticosd_queue_blobs_reconcile(handle->blobs, NULL, 0);
+  }
+
+  pthread_mutex_unlock(&handle->lock);
+}
+
+/**
+ * @brief Returns copies of head of the queue
+ *
+ * @param handle Queue handle
+ * @param[out] payload Payload string
+ * @param[out] payload_size_bytes Payload size in bytes
+ * @return Pointer to heap-allocated message found on head of queue, or NULL if queue is empty or
+ * memory failed to be allocated.
+ */
+uint8_t *ticosd_queue_read_head(sTicosdQueue *handle, uint32_t *payload_size_bytes) {
+  uint8_t *payload = NULL;
+  pthread_mutex_lock(&handle->lock);
+
+  prv_queue_expire_head(handle);
+  const sTicosQueueMsgHeader *header = prv_queue_get_head(handle);
+  uint8_t *blob = NULL;
+  uint32_t blob_size_bytes;
+  while (header && prv_is_msg_blob(header) &&
+         !(blob = prv_queue_map_blob(handle, header, &blob_size_bytes))) {
+    header = prv_queue_drop_lost_head(handle) ? prv_queue_get_head(handle) : NULL;
+  }
+  if (!header) {
+    goto unlock;
+  }
+
+  if (blob) {
+    payload = malloc(blob_size_bytes);
+    if (payload) {
+      memcpy(payload, blob, blob_size_bytes);
+      *payload_size_bytes = blob_size_bytes;
+    }
+    ticosd_queue_blobs_unmap(blob, blob_size_bytes);
+    if (!payload) {
+      goto unlock;
+    }
+  } else if (prv_is_msg_compressed(header)) {
+    payload = prv_msg_decompress(header, payload_size_bytes);
+    if (!payload) {
+      goto unlock;
+    }
+  } else {
+    payload = malloc(header->payload_size_bytes);
+    if (!payload) {
+      goto unlock;
+    }
+    memcpy(payload, prv_msg_payload(header), header->payload_size_bytes);
+    *payload_size_bytes = header->payload_size_bytes;
+  }
+
+  // Allow a ticosd_queue_complete_read() call now:
+  handle->completable_count = 1;
+
+unlock:
+  pthread_mutex_unlock(&handle->lock);
+  return payload;
+}
+
+/**
+ * @brief Makes room for one more buffer to release along with the lease
+ *
+ * @param handle Queue handle
+ * @return true on success, false if out of memory
  */
-bool ticosd_queue_write(sTicosdQueue *handle, const uint8_t *payload,
-                           uint32_t payload_size_bytes) {
-  if (payload_size_bytes == 0 || payload == NULL) {
+static bool prv_queue_reserve_lease_buf(sTicosdQueue *handle) {
+  if (handle->lease_buf_count == handle->lease_buf_capacity) {
+    const uint32_t capacity = handle->lease_buf_capacity ? 2 * handle->lease_buf_capacity : 8;
+    sTicosQueueLeaseBuf *lease_bufs = realloc(handle->lease_bufs, capacity * sizeof(*lease_bufs));
+    if (!lease_bufs) {
+      return false;
+    }
+    handle->lease_bufs = lease_bufs;
+    handle->lease_buf_capacity = capacity;
+  }
+  return true;
+}
+
+/**
+ * @brief Decompresses a message being peeked, keeping the copy until the lease is released
+ *
+ * @param handle Queue handle
+ * @param header Compressed message
+ * @param[out] entry Entry to point at the decompressed payload
+ * @return true on success, false if out of memory
+ */
+static bool prv_queue_peek_decompress(sTicosdQueue *handle, const sTicosQueueMsgHeader *header,
+                                      sTicosdQueueEntry *entry) {
+  if (!prv_queue_reserve_lease_buf(handle)) {
+    return false;
+  }
+  uint8_t *payload = prv_msg_decompress(header, &entry->payload_size_bytes);
+  if (!payload) {
+    return false;
+  }
+  handle->lease_bufs[handle->lease_buf_count++] = (sTicosQueueLeaseBuf){
+    .payload = payload,
+    .payload_size_bytes = entry->payload_size_bytes,
+  };
+  entry->payload = payload;
+  return true;
+}
+
+/**
+ * @brief Maps the side file of a message being peeked, keeping the mapping until the lease is
+ * released
+ *
+ * @param handle Queue handle
+ * @param header Message stored in a side file
+ * @param[out] entry Entry to point at the mapped payload
+ * @param[out] is_lost Set if the side file cannot be read, as opposed to running out of memory
+ * @return true on success
+ */
+static bool prv_queue_peek_blob(sTicosdQueue *handle, const sTicosQueueMsgHeader *header,
+                                sTicosdQueueEntry *entry, bool *is_lost) {
+  *is_lost = false;
+  if (!prv_queue_reserve_lease_buf(handle)) {
+    return false;
+  }
+  uint8_t *payload = prv_queue_map_blob(handle, header, &entry->payload_size_bytes);
+  if (!payload) {
+    *is_lost = true;
+    return false;
+  }
+  handle->lease_bufs[handle->lease_buf_count++] = (sTicosQueueLeaseBuf){
+    .payload = payload,
+    .payload_size_bytes = entry->payload_size_bytes,
+    .is_mapped = true,
+  };
+  entry->payload = payload;
+  return true;
+}
+
+/**
+ * @brief Returns messages from the head of the queue without copying them
+ *
+ * The messages are leased to the caller: they are not overwritten by subsequent writes, which fail
+ * instead if they would need their space, until they are released with
+ * ticosd_queue_complete_batch(), ticosd_queue_complete_read() or ticosd_queue_release_head().
+ *
+ * @param handle Queue handle
+ * @param[out] entries Payloads of the messages, pointing into the queue buffer, or into a
+ * decompressed copy owned by the queue for compressed messages
+ * @param max_count Maximum number of messages to return, size of entries
+ * @param max_bytes Maximum total payload size to return. The first message is always returned,
+ * even if it is larger.
+ * @return Number of messages returned, 0 if the queue is empty
+ */
+uint32_t ticosd_queue_peek_batch(sTicosdQueue *handle, sTicosdQueueEntry *entries,
+                                 uint32_t max_count, uint32_t max_bytes) {
+  uint32_t count = 0;
+  pthread_mutex_lock(&handle->lock);
+
+  prv_queue_free_lease_bufs(handle);
+  prv_queue_expire_head(handle);
+  if (max_count == 0 || !prv_queue_get_head(handle)) {
+    goto unlock;
+  }
+
+  const time_t now = prv_queue_now(handle);
+  uint32_t ptr = handle->read_ptr;
+  uint32_t total_bytes = 0;
+  while (true) {
+    const sTicosQueueMsgHeader *header = (sTicosQueueMsgHeader *)&handle->buf[ptr];
+    // The stored size is what counts towards max_bytes, the decompressed payloads are transient:
+    const uint32_t stored_size_bytes = prv_msg_stored_size(header);
+    // An expired or acknowledged message ends the batch, to be dropped once it gets to the head:
+    if (count > 0 &&
+        (prv_is_msg_pending(header) || total_bytes + stored_size_bytes > max_bytes ||
+         prv_is_msg_acked(header) || prv_is_msg_expired(handle, header, now))) {
+      break;
+    }
+    entries[count] = (sTicosdQueueEntry){
+      .payload = prv_msg_payload(header),
+      .payload_size_bytes = header->payload_size_bytes,
+      .timestamp = prv_msg_timestamp(header),
+    };
+    if (prv_is_msg_compressed(header) &&
+        !prv_queue_peek_decompress(handle, header, &entries[count])) {
+      break;
+    }
+    bool is_lost;
+    if (prv_is_msg_blob(header) &&
+        !prv_queue_peek_blob(handle, header, &entries[count], &is_lost)) {
+      // A message that cannot be read ends the batch, to be dropped once it gets to the head:
+      if (count > 0 || !is_lost || !prv_queue_drop_lost_head(handle)) {
+        break;
+      }
+      ptr = handle->read_ptr;
+      continue;
+    }
+    total_bytes += stored_size_bytes;
+    count++;
+
+    handle->lease_end =
+      ptr + prv_header_len_words(header) + prv_bytes_to_words_round_up(header->payload_size_bytes);
+    ptr = prv_get_next_message(handle, ptr);
+    if (count == max_count || ptr == handle->write_ptr) {
+      break;
+    }
+  }
+
+  if (count == 0) {
+    goto unlock;
+  }
+  handle->lease_held = true;
+  handle->lease_ptr = handle->read_ptr;
+
+  // Allow a ticosd_queue_complete_batch() call now:
+  handle->completable_count = count;
+
+unlock:
+  pthread_mutex_unlock(&handle->lock);
+  return count;
+}
+
+/**
+ * @brief Returns the head of the queue without copying it
+ *
+ * The message is leased to the caller: it is not overwritten by subsequent writes, which fail
+ * instead if they would need its space, until it is released with ticosd_queue_complete_read()
+ * or ticosd_queue_release_head().
+ *
+ * @param handle Queue handle
+ * @param[out] payload_size_bytes Payload size in bytes
+ * @return Pointer to the payload of the message on head of queue, within the queue buffer, or NULL
+ * if queue is empty.
+ */
+const uint8_t *ticosd_queue_peek_head(sTicosdQueue *handle, uint32_t *payload_size_bytes) {
+  sTicosdQueueEntry entry;
+  if (ticosd_queue_peek_batch(handle, &entry, 1, UINT32_MAX) == 0) {
+    return NULL;
+  }
+  *payload_size_bytes = entry.payload_size_bytes;
+  return entry.payload;
+}
+
+/**
+ * @brief Releases the messages leased by ticosd_queue_peek_*(), leaving them on head of the queue
+ *
+ * @param handle Queue handle
+ */
+void ticosd_queue_release_head(sTicosdQueue *handle) {
+  pthread_mutex_lock(&handle->lock);
+  handle->lease_held = false;
+  handle->completable_count = 0;
+  prv_queue_free_lease_bufs(handle);
+  pthread_mutex_unlock(&handle->lock);
+}
+
+/**
+ * @brief Counts a failed attempt to send the message at the head of the queue, releasing the lease
+ * on the messages returned by the last peek
+ *
+ * The number of attempts is kept in the message, and survives restarts unless the change is lost
+ * in a crash. Messages written by the oldest versions of the queue have no room for it.
+ *
+ * @param handle Queue handle
+ * @return Number of failed attempts to send the message so far, 0 if the queue is empty or the
+ * message cannot keep count
+ */
+uint32_t ticosd_queue_fail_head(sTicosdQueue *handle) {
+  uint32_t attempts = 0;
+  pthread_mutex_lock(&handle->lock);
+  handle->lease_held = false;
+  handle->completable_count = 0;
+  prv_queue_free_lease_bufs(handle);
+
+  sTicosQueueMsgHeader *header = prv_queue_get_head(handle);
+  if (header && header->version != HEADER_VERSION_NUMBER_V1) {
+    if (header->attempts < UINT8_MAX) {
+      header->attempts++;
+      // Losing the count on a crash only gives the message a few more attempts:
+      prv_queue_sync_range(handle, &header->attempts, sizeof(header->attempts),
+                           kTicosdQueueDurability_Async);
+    }
+    attempts = header->attempts;
+  }
+  pthread_mutex_unlock(&handle->lock);
+  return attempts;
+}
+
+/**
+ * @brief Acknowledges a message returned by the last ticosd_queue_peek_batch() that cannot be
+ * removed yet, because one before it has to be sent again
+ *
+ * The message is dropped without being returned again once it gets to the head of the queue, also
+ * after a restart. The lease on the messages is kept.
+ *
+ * @param handle Queue handle
+ * @param index Index of the message in the batch
+ * @return true if the message was acknowledged, false if not
+ */
+bool ticosd_queue_ack_entry(sTicosdQueue *handle, uint32_t index) {
+  pthread_mutex_lock(&handle->lock);
+
+  if (index >= handle->completable_count) {
+    pthread_mutex_unlock(&handle->lock);
+    return false;
+  }
+
+  uint32_t ptr = handle->read_ptr;
+  for (uint32_t i = 0; i < index; ++i) {
+    ptr = prv_get_next_message(handle, ptr);
+  }
+  sTicosQueueMsgHeader *header = (sTicosQueueMsgHeader *)&handle->buf[ptr];
+  header->flags |= HEADER_FLAGS_FLAG_ACKED_MASK;
+  prv_queue_sync_range(handle, &header->flags, sizeof(header->flags),
+                       prv_queue_get_durability(handle, prv_msg_payload(header)[0]));
+
+  pthread_mutex_unlock(&handle->lock);
+  return true;
+}
+
+/**
+ * @brief Removes messages returned by the last ticosd_queue_peek_batch() from the head of the queue
+ *
+ * The read flags of all removed messages are flushed at once, with the strictest durability of
+ * their types. The lease on any remaining messages is released.
+ *
+ * @param handle Queue handle
+ * @param count Number of messages to remove, at most the number returned by the last peek
+ * @return true if the messages were removed, false if not
+ */
+bool ticosd_queue_complete_batch(sTicosdQueue *handle, uint32_t count) {
+  pthread_mutex_lock(&handle->lock);
+
+  if (count == 0 || count > handle->completable_count) {
+    pthread_mutex_unlock(&handle->lock);
+    return false;
+  }
+
+  // The durability modes are ordered from strictest to most relaxed:
+  eTicosdQueueDurability durability = kTicosdQueueDurability_Async;
+  const uint32_t first_ptr = handle->read_ptr;
+  bool has_blobs = false;
+  for (uint32_t i = 0; i < count; ++i) {
+    sTicosQueueMsgHeader *header = (sTicosQueueMsgHeader *)&handle->buf[handle->read_ptr];
+    const eTicosdQueueDurability msg_durability =
+      prv_queue_get_durability(handle, prv_msg_payload(header)[0]);
+    if (msg_durability < durability) {
+      durability = msg_durability;
+    }
+    header->flags |= HEADER_FLAGS_FLAG_READ_MASK;
+    if (handle->is_file_backed) {
+      prv_queue_mark_dirty(handle, &header->flags, sizeof(header->flags));
+    }
+    has_blobs |= prv_is_msg_blob(header);
+
+    handle->read_ptr = prv_get_next_message(handle, handle->read_ptr);
+  }
+
+  // Set to 0, to make another ..complete_*() call -- before a ..read_head() or ..peek_*() call --
+  // bail:
+  handle->completable_count = 0;
+  handle->lease_held = false;
+  prv_queue_free_lease_bufs(handle);
+
+  prv_checkpoint_count_ops(handle, count, durability);
+  prv_queue_commit(handle, durability);
+
+  // Side files are removed once the messages are marked read, the mappings of the peeked ones are
+  // gone by now:
+  for (uint32_t i = 0, ptr = first_ptr; has_blobs && i < count; ++i) {
+    prv_queue_remove_blob(handle, (sTicosQueueMsgHeader *)&handle->buf[ptr]);
+    ptr = prv_get_next_message(handle, ptr);
+  }
+
+  pthread_mutex_unlock(&handle->lock);
+  return true;
+}
+
+/**
+ * @brief Removes message from head of the queue, releasing the lease if it was peeked
+ *
+ * @param handle Queue handle
+ * @return true if a message was removed, false if not
+ */
+bool ticosd_queue_complete_read(sTicosdQueue *handle) {
+  return ticosd_queue_complete_batch(handle, 1);
+}
+
+/**
+ * @brief Accounts for an unread message about to be overwritten by a write to a full queue, and
+ * removes its side file
+ *
+ * @param handle Queue handle
+ * @param ptr Index of the message in the queue buffer
+ */
+static void prv_count_overwritten_msg(sTicosdQueue *handle, uint32_t ptr) {
+  const sTicosQueueMsgHeader *header = (sTicosQueueMsgHeader *)&handle->buf[ptr];
+  handle->overwritten_count++;
+  handle->overwritten_bytes += prv_msg_stored_size(header);
+  prv_queue_remove_blob(handle, header);
+}
+
+/**
+ * @brief Reserves space for a message, see ticosd_queue_reserve()
+ *
+ * @param handle Queue handle
+ * @param payload_size_bytes Payload size in bytes
+ * @param flags Header flags describing the payload, e.g. HEADER_FLAGS_FLAG_COMPRESSED_MASK
+ * @param[out] reservation Reserved message
+ * @return true Successfully reserved space
+ * @return false Failed to reserve
+ */
+static bool prv_queue_reserve(sTicosdQueue *handle, uint32_t payload_size_bytes, uint8_t flags,
+                              sTicosdQueueReservation *reservation) {
+  if (payload_size_bytes == 0) {
     return false;
   }
 
@@ -459,30 +2130,68 @@ bool ticosd_queue_write(sTicosdQueue *handle, const uint8_t *payload,
     return false;
   }
 
+  if (!handle->overwrite && prv_write_overlaps(handle, message_size_words, prv_is_range_unread)) {
+    // Queue full, leave it to the caller to store the message elsewhere:
+    pthread_mutex_unlock(&handle->lock);
+    return false;
+  }
+
+  if (prv_write_overlaps(handle, message_size_words, prv_is_range_in_use)) {
+    fprintf(stderr,
+            "queue:: queue full while its oldest messages are in use, dropping %u bytes payload.\n",
+            payload_size_bytes);
+    pthread_mutex_unlock(&handle->lock);
+    return false;
+  }
+
   uint32_t *ptr = &handle->buf[handle->write_ptr];
   const bool read_ptr_equals_write_ptr = (handle->read_ptr == handle->write_ptr);
+  const bool has_unread_msgs = prv_has_unread_msgs(handle);
+
+  // Wrapping around and overwriting unread messages must be checkpointed right away, so that the
+  // messages written after a checkpoint never overwrite each other nor pass the checkpointed
+  // read_ptr. prv_queue_recover_from_checkpoint() relies on this.
+  bool needs_checkpoint = false;
+
+  if (read_ptr_equals_write_ptr && has_unread_msgs) {
+    // Queue is entirely full: the new message becomes the only unread one, all the others are
+    // dropped. Count them before the end marker is written over the chain, walking once around the
+    // buffer at most in case the chain is damaged:
+    uint32_t ptr = handle->write_ptr;
+    uint32_t max_count = handle->size / (HEADER_LEN * sizeof(uint32_t));
+    do {
+      prv_count_overwritten_msg(handle, ptr);
+      ptr = prv_get_next_message(handle, ptr);
+    } while (ptr != handle->write_ptr && --max_count > 0);
+  }
 
   if (handle->write_ptr + message_size_words > handle->size / sizeof(uint32_t)) {
     // Message is too big, add end marker and loop back around to start
     *ptr = END_POINTER;
-    msync(ptr, sizeof(uint32_t), MS_SYNC);
+    prv_queue_sync_range(handle, ptr, sizeof(uint32_t), kTicosdQueueDurability_Async);
     handle->write_ptr = 0;
     ptr = &handle->buf[0];
+    needs_checkpoint = true;
   }
 
   const uint32_t write_end = handle->write_ptr + message_size_words;
   const uint32_t next_write_ptr = write_end % (handle->size / sizeof(uint32_t));
+  if (next_write_ptr == 0) {
+    needs_checkpoint = true;
+  }
 
   if (read_ptr_equals_write_ptr) {
+    needs_checkpoint |= has_unread_msgs;
     // Note: either the read_ptr is caught up, or queue is entirely full and the write_ptr caught
     // up with the read_ptr (wrapping around). In both cases, we'll move the read_ptr along with
     // the new write:
     handle->read_ptr = handle->write_ptr;
-  } else if (handle->read_ptr > handle->write_ptr && handle->read_ptr < write_end) {
-    // Read pointer is after write pointer and new message will overwrite read pointer, move it
-    // forwards:
+  } else if (handle->read_ptr >= handle->write_ptr && handle->read_ptr < write_end) {
+    // Read pointer is after write pointer, or at the start of the queue the write just wrapped
+    // around to, and the new message will overwrite read pointer, move it forwards:
     uint32_t read_ptr = handle->read_ptr;
     while (true) {
+      prv_count_overwritten_msg(handle, read_ptr);
       read_ptr = prv_get_next_message(handle, read_ptr);
       const bool did_wrap = (read_ptr == 0);
       if (read_ptr >= write_end || did_wrap) {
@@ -493,36 +2202,177 @@ bool ticosd_queue_write(sTicosdQueue *handle, const uint8_t *payload,
 
     // In case ticosd_queue_read_head() had just been called, flag to avoid marking the wrong
     // message as sent in a subsequent ticosd_queue_complete_read() call:
-    handle->can_complete_read = false;
+    handle->completable_count = 0;
+    needs_checkpoint = true;
   }
 
   sTicosQueueMsgHeader *const header = (sTicosQueueMsgHeader *)ptr;
   *header = (sTicosQueueMsgHeader){
     .magic = HEADER_MAGIC_NUMBER,
     .version = HEADER_VERSION_NUMBER,
-    .crc = prv_queue_crc8(payload, payload_size_bytes),
-    .flags = 0,
+    .flags = HEADER_FLAGS_FLAG_PENDING_MASK | flags,
     .prev_header = handle->prev_ptr,
     .payload_size_bytes = payload_size_bytes,
+    .timestamp = (uint32_t)prv_queue_now(handle),
   };
-  memcpy(header->payload, payload, payload_size_bytes);
+  uint8_t *const msg_payload = prv_msg_payload(header);
 
   // Zero-out padding bytes:
   const size_t padding_size_bytes =
     payload_padded_size_words * sizeof(uint32_t) - payload_size_bytes;
   if (padding_size_bytes > 0) {
-    memset(header->payload + payload_size_bytes, 0, padding_size_bytes);
+    memset(msg_payload + payload_size_bytes, 0, padding_size_bytes);
   }
 
-  msync(header, message_size_words * sizeof(uint32_t), MS_SYNC);
+  if (handle->pending_count++ == 0) {
+    handle->pending_ptr = handle->write_ptr;
+  }
+  *reservation = (sTicosdQueueReservation){
+    .payload = msg_payload,
+    .payload_size_bytes = payload_size_bytes,
+    .ptr = handle->write_ptr,
+  };
 
   handle->prev_ptr = handle->write_ptr;
   handle->write_ptr = next_write_ptr;
 
+  // The changes are flushed by ticosd_queue_commit(), with the durability of the message's type:
+  if (needs_checkpoint) {
+    prv_checkpoint_write(handle, kTicosdQueueDurability_Async);
+  } else {
+    prv_checkpoint_count_ops(handle, 1, kTicosdQueueDurability_Async);
+  }
+
+  pthread_mutex_unlock(&handle->lock);
+  return true;
+}
+
+/**
+ * @brief Reserves space for a message at the end of the queue
+ *
+ * Only the bookkeeping is done while holding the queue lock. The caller then fills in the payload
+ * in place, without holding any lock, and must always call ticosd_queue_commit() afterwards. The
+ * consumer does not see the message, nor any message reserved after it, until it is committed.
+ *
+ * @param handle Queue handle
+ * @param payload_size_bytes Payload size in bytes
+ * @param[out] reservation Reserved message, with a pointer to its payload within the queue buffer
+ * @return true Successfully reserved space
+ * @return false Failed to reserve
+ */
+bool ticosd_queue_reserve(sTicosdQueue *handle, uint32_t payload_size_bytes,
+                          sTicosdQueueReservation *reservation) {
+  return prv_queue_reserve(handle, payload_size_bytes, 0, reservation);
+}
+
+/**
+ * @brief Commits a message reserved with ticosd_queue_reserve(), making it visible to the consumer
+ *
+ * @param handle Queue handle
+ * @param reservation Reserved message, of which the payload has been filled in
+ * @return true Successfully committed the message
+ * @return false Failed to commit
+ */
+bool ticosd_queue_commit(sTicosdQueue *handle, const sTicosdQueueReservation *reservation) {
+  sTicosQueueMsgHeader *const header = (sTicosQueueMsgHeader *)&handle->buf[reservation->ptr];
+  if (reservation->payload != prv_msg_payload(header) || !prv_is_msg_pending(header)) {
+    return false;
+  }
+
+  // The message is not touched by anyone else until it is committed, checksum it without the lock:
+  header->crc32c = ticos_crc32c(0, reservation->payload, reservation->payload_size_bytes);
+
+  pthread_mutex_lock(&handle->lock);
+
+  const eTicosdQueueDurability durability =
+    prv_queue_get_durability(handle, reservation->payload[0]);
+  header->flags &= ~HEADER_FLAGS_FLAG_PENDING_MASK;
+
+  if (--handle->pending_count == 0) {
+    pthread_cond_broadcast(&handle->committed_cond);
+  } else if (reservation->ptr == handle->pending_ptr) {
+    // Move on to the next message that is still pending. There is at least one:
+    uint32_t ptr = handle->pending_ptr;
+    do {
+      ptr = prv_get_next_message(handle, ptr);
+    } while (!prv_is_msg_pending((sTicosQueueMsgHeader *)&handle->buf[ptr]));
+    handle->pending_ptr = ptr;
+  }
+
+  const uint32_t message_size_words =
+    HEADER_LEN + prv_bytes_to_words_round_up(reservation->payload_size_bytes);
+  prv_queue_sync_range(handle, header, message_size_words * sizeof(uint32_t), durability);
+
   pthread_mutex_unlock(&handle->lock);
   return true;
 }
 
+/**
+ * @brief Adds message to queue
+ *
+ * @param handle Queue handle
+ * @param payload Payload data
+ * @param payload_size_bytes Payload size in bytes
+ * @return true Successfully added message to queue
+ * @return false Failed to add
+ */
+bool ticosd_queue_write(sTicosdQueue *handle, const uint8_t *payload,
+                           uint32_t payload_size_bytes) {
+  if (payload_size_bytes == 0 || payload == NULL) {
+    return false;
+  }
+
+  pthread_mutex_lock(&handle->lock);
+  const uint32_t compress_threshold = handle->compress_threshold;
+  const uint32_t blob_threshold = handle->blob_threshold;
+  // Only ever set once, and closed when the queue is destroyed:
+  sTicosdQueueBlobs *const blobs = handle->blobs;
+  const bool sync = prv_queue_get_durability(handle, payload[0]) != kTicosdQueueDurability_Async;
+  pthread_mutex_unlock(&handle->lock);
+
+  uint8_t *compressed = NULL;
+  uint8_t flags = 0;
+  sTicosQueueBlobRef ref;
+  if (blob_threshold > 0 && payload_size_bytes >= blob_threshold) {
+    // Stored as is, so that it can be mapped when peeked. The side file is written before the
+    // reference to it, an unreferenced file left by a crash is removed on the next start:
+    uint64_t id;
+    ref = (sTicosQueueBlobRef){
+      .type = payload[0],
+      .payload_size_bytes = payload_size_bytes,
+      .crc32c = ticos_crc32c(0, payload, payload_size_bytes),
+    };
+    if (ticosd_queue_blobs_write(blobs, payload, payload_size_bytes, sync, &id)) {
+      ref.id = id;
+      payload = (const uint8_t *)&ref;
+      payload_size_bytes = sizeof(ref);
+      flags = HEADER_FLAGS_FLAG_BLOB_MASK;
+    }
+  } else if (compress_threshold > 0 && payload_size_bytes >= compress_threshold) {
+    // Only worth storing compressed if it comes out smaller:
+    uint32_t compressed_size_bytes;
+    compressed = malloc(payload_size_bytes);
+    if (compressed && ticosd_queue_compress(payload, payload_size_bytes, compressed,
+                                            payload_size_bytes, &compressed_size_bytes)) {
+      payload = compressed;
+      payload_size_bytes = compressed_size_bytes;
+      flags = HEADER_FLAGS_FLAG_COMPRESSED_MASK;
+    }
+  }
+
+  bool success = false;
+  sTicosdQueueReservation reservation;
+  if (prv_queue_reserve(handle, payload_size_bytes, flags, &reservation)) {
+    memcpy(reservation.payload, payload, payload_size_bytes);
+    success = ticosd_queue_commit(handle, &reservation);
+  }
+  if (!success && (flags & HEADER_FLAGS_FLAG_BLOB_MASK)) {
+    ticosd_queue_blobs_remove(blobs, ref.id);
+  }
+  free(compressed);
+  return success;
+}
+
 #ifdef TICOS_UNITTEST
 
 bool ticosd_queue_is_file_backed(sTicosdQueue *handle) { return handle->is_file_backed; }
@@ -530,5 +2380,17 @@ int ticosd_queue_get_size(sTicosdQueue *handle) { return handle->size; }
 uint32_t ticosd_queue_get_read_ptr(sTicosdQueue *handle) { return handle->read_ptr; }
 uint32_t ticosd_queue_get_write_ptr(sTicosdQueue *handle) { return handle->write_ptr; }
 uint32_t ticosd_queue_get_prev_ptr(sTicosdQueue *handle) { return handle->prev_ptr; }
+void ticosd_queue_set_fake_time(sTicosdQueue *handle, time_t fake_time) {
+  handle->fake_time = fake_time;
+}
+uint32_t ticosd_queue_get_msg_validation_count(sTicosdQueue *handle) {
+  return handle->msg_validation_count;
+}
+uint32_t ticosd_queue_get_sync_count(sTicosdQueue *handle) {
+  pthread_mutex_lock(&handle->lock);
+  const uint32_t sync_count = handle->sync_count;
+  pthread_mutex_unlock(&handle->lock);
+  return sync_count;
+}
 
 #endif
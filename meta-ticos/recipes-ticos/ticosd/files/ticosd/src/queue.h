@@ -14,19 +14,110 @@
 extern "C" {
 #endif
 
+#include <stdbool.h>
 #include <stdint.h>
+#include <time.h>
 
 #include "ticosd.h"
 
 typedef struct TicosdQueue sTicosdQueue;
 
+typedef struct TicosdQueueEntry {
+  const uint8_t *payload;
+  uint32_t payload_size_bytes;
+  //! Time the message was written to the queue, 0 if unknown (written by an older version).
+  time_t timestamp;
+} sTicosdQueueEntry;
+
+typedef struct TicosdQueueReservation {
+  //! Payload of the reserved message, within the queue buffer, to be filled in by the caller.
+  uint8_t *payload;
+  uint32_t payload_size_bytes;
+  //! Index of the reserved message in the queue buffer.
+  uint32_t ptr;
+} sTicosdQueueReservation;
+
+typedef struct TicosdQueueStats {
+  //! Number of messages not read yet.
+  uint32_t unread_count;
+  //! Space taken by the messages not read yet in the queue buffer, headers included.
+  uint64_t unread_bytes;
+  //! Time the oldest message not read yet was written, 0 if there is none or if it is unknown.
+  time_t oldest_unread_timestamp;
+  //! Number and total payload size of the unread messages dropped to make room for new ones since
+  //! the queue was initialised.
+  uint32_t overwritten_count;
+  uint64_t overwritten_bytes;
+  //! Number and total payload size of the messages dropped because their time-to-live elapsed
+  //! since the queue was initialised.
+  uint32_t expired_count;
+  uint64_t expired_bytes;
+} sTicosdQueueStats;
+
+//! When the changes made to the queue are flushed to the backing file.
+typedef enum {
+  //! Every write and completed read is flushed before returning.
+  kTicosdQueueDurability_Strict = 0,
+  //! Changes are flushed in the background, every group commit interval or as soon as the group
+  //! commit size has been written, whichever comes first.
+  kTicosdQueueDurability_Group,
+  //! Changes are written back in the background without being flushed (by the kernel's writeback
+  //! with the mmap backend, every group commit interval with the others), or flushed along with
+  //! the next strict operation.
+  kTicosdQueueDurability_Async,
+} eTicosdQueueDurability;
+
+//! How changes made to the queue buffer reach the backing file, see queue_storage.c.
+typedef enum {
+  //! The buffer is a shared mapping of the file, flushed with msync().
+  kTicosdQueueBackend_Mmap = 0,
+  //! The buffer is on the heap, changed blocks are written with pwrite() and flushed with
+  //! fdatasync().
+  kTicosdQueueBackend_Pwrite,
+  //! As pwrite, with the writes and flushes submitted asynchronously through an io_uring. Falls
+  //! back to pwrite if io_uring is not available.
+  kTicosdQueueBackend_IoUring,
+} eTicosdQueueBackend;
+
+//! Called with the payload of each message dropped because its time-to-live elapsed.
+typedef void (*ticosd_queue_expired_callback)(void *ctx, const uint8_t *payload,
+                                              uint32_t payload_size_bytes);
+
 sTicosdQueue *ticosd_queue_init(sTicosd *ticosd, int size);
+sTicosdQueue *ticosd_queue_init_with_name(sTicosd *ticosd, const char *name, int size);
+sTicosdQueue *ticosd_queue_init_with_backend(sTicosd *ticosd, const char *name, int size,
+                                           eTicosdQueueBackend backend);
 void ticosd_queue_destroy(sTicosdQueue *handle);
+void ticosd_queue_set_durability(sTicosdQueue *handle, eTicosdQueueDurability durability);
+void ticosd_queue_set_type_durability(sTicosdQueue *handle, uint8_t type,
+                                      eTicosdQueueDurability durability);
+void ticosd_queue_set_group_commit(sTicosdQueue *handle, int interval_ms, int size_bytes);
+void ticosd_queue_set_overwrite(sTicosdQueue *handle, bool overwrite);
+void ticosd_queue_set_compression(sTicosdQueue *handle, uint32_t threshold_bytes);
+void ticosd_queue_set_blob_threshold(sTicosdQueue *handle, uint32_t threshold_bytes);
+void ticosd_queue_set_type_ttl(sTicosdQueue *handle, uint8_t type, uint32_t ttl_seconds);
+void ticosd_queue_set_expired_callback(sTicosdQueue *handle,
+                                       ticosd_queue_expired_callback callback, void *ctx);
+bool ticosd_queue_expire_entry(sTicosdQueue *handle, const uint8_t *payload,
+                               uint32_t payload_size_bytes, time_t timestamp);
+eTicosdQueueDurability ticosd_queue_get_type_durability(sTicosdQueue *handle, uint8_t type);
+uint32_t ticosd_queue_get_max_payload_size(sTicosdQueue *handle);
+void ticosd_queue_get_stats(sTicosdQueue *handle, sTicosdQueueStats *stats);
 void ticosd_queue_reset(sTicosdQueue *handle);
 bool ticosd_queue_write(sTicosdQueue *handle, const uint8_t *payload,
                            uint32_t payload_size_bytes);
+bool ticosd_queue_reserve(sTicosdQueue *handle, uint32_t payload_size_bytes,
+                          sTicosdQueueReservation *reservation);
+bool ticosd_queue_commit(sTicosdQueue *handle, const sTicosdQueueReservation *reservation);
 uint8_t *ticosd_queue_read_head(sTicosdQueue *handle, uint32_t *payload_size_bytes);
+const uint8_t *ticosd_queue_peek_head(sTicosdQueue *handle, uint32_t *payload_size_bytes);
+uint32_t ticosd_queue_peek_batch(sTicosdQueue *handle, sTicosdQueueEntry *entries,
+                                 uint32_t max_count, uint32_t max_bytes);
+void ticosd_queue_release_head(sTicosdQueue *handle);
+uint32_t ticosd_queue_fail_head(sTicosdQueue *handle);
+bool ticosd_queue_ack_entry(sTicosdQueue *handle, uint32_t index);
 bool ticosd_queue_complete_read(sTicosdQueue *handle);
+bool ticosd_queue_complete_batch(sTicosdQueue *handle, uint32_t count);
 
 #ifdef __cplusplus
 }
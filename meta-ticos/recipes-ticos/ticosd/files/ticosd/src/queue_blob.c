@@ -0,0 +1,253 @@
+//! @file
+//!
+//! Copyright (c) Ticos, Inc.
+//! See License.txt for details
+//!
+//! @brief
+//! Side files holding the payloads of large queue messages
+//!
+//! A payload that would take a large share of the queue buffer is written to its own file in a
+//! directory next to the queue file, and the queue only holds a small reference to it. The file is
+//! removed once the message is completed, dropped or overwritten, and the files that no message
+//! refers to any more, e.g. after a crash, are removed when the queue is loaded.
+//!
+//! Files are named after their identifier, as 16 hexadecimal digits, and only contain the payload.
+//! Identifiers are never reused: a new file gets an identifier greater than any file or reference
+//! seen when the queue was loaded.
+//!
+
+#include "queue_blob.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BLOB_NAME_LEN 16
+
+struct TicosdQueueBlobs {
+  char *dir;
+  //! @brief Directory file descriptor, to flush the creation of new files.
+  int dir_fd;
+  //! @brief Identifier of the next file to create.
+  _Atomic uint64_t next_id;
+};
+
+static void prv_blob_path(sTicosdQueueBlobs *blobs, uint64_t id, char *path, size_t len) {
+  snprintf(path, len, "%s/%016llx", blobs->dir, (unsigned long long)id);
+}
+
+/**
+ * @brief Opens the directory of the side files of a queue, creating it if needed
+ *
+ * ticosd_queue_blobs_reconcile() must be called before any file is written.
+ *
+ * @param dir Path of the directory
+ * @return Side files object, NULL if the directory cannot be used
+ */
+sTicosdQueueBlobs *ticosd_queue_blobs_open(const char *dir) {
+  sTicosdQueueBlobs *blobs = calloc(sizeof(sTicosdQueueBlobs), 1);
+  if (!blobs) {
+    fprintf(stderr, "queue_blob:: Failed to allocate handle.\n");
+    return NULL;
+  }
+  blobs->dir_fd = -1;
+
+  if (!(blobs->dir = strdup(dir))) {
+    goto cleanup;
+  }
+  if (mkdir(blobs->dir, 0755) == -1 && errno != EEXIST) {
+    fprintf(stderr, "queue_blob:: Failed to create '%s': %s\n", blobs->dir, strerror(errno));
+    goto cleanup;
+  }
+  if ((blobs->dir_fd = open(blobs->dir, O_RDONLY | O_DIRECTORY)) == -1) {
+    fprintf(stderr, "queue_blob:: Failed to open '%s': %s\n", blobs->dir, strerror(errno));
+    goto cleanup;
+  }
+  return blobs;
+
+cleanup:
+  free(blobs->dir);
+  free(blobs);
+  return NULL;
+}
+
+/**
+ * @brief Closes the side files object, keeping the files for the next run
+ *
+ * @param blobs Side files object
+ */
+void ticosd_queue_blobs_close(sTicosdQueueBlobs *blobs) {
+  if (blobs) {
+    close(blobs->dir_fd);
+    free(blobs->dir);
+    free(blobs);
+  }
+}
+
+/**
+ * @brief Writes a payload to a new side file
+ *
+ * Safe to call without holding the queue lock.
+ *
+ * @param blobs Side files object
+ * @param payload Payload data
+ * @param payload_size_bytes Payload size in bytes
+ * @param sync Whether to flush the file, and its directory entry, to storage before returning
+ * @param[out] id Identifier of the new file
+ * @return true Successfully written the file
+ * @return false Failed to write, no file is left behind
+ */
+bool ticosd_queue_blobs_write(sTicosdQueueBlobs *blobs, const uint8_t *payload,
+                              uint32_t payload_size_bytes, bool sync, uint64_t *id) {
+  *id = atomic_fetch_add(&blobs->next_id, 1);
+  char path[PATH_MAX];
+  prv_blob_path(blobs, *id, path, sizeof(path));
+
+  const int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+  if (fd == -1) {
+    fprintf(stderr, "queue_blob:: Failed to create '%s': %s\n", path, strerror(errno));
+    return false;
+  }
+
+  uint32_t written = 0;
+  while (written < payload_size_bytes) {
+    const ssize_t rv = write(fd, payload + written, payload_size_bytes - written);
+    if (rv == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      goto cleanup;
+    }
+    written += rv;
+  }
+  if (sync && (fdatasync(fd) == -1 || fsync(blobs->dir_fd) == -1)) {
+    goto cleanup;
+  }
+  close(fd);
+  return true;
+
+cleanup:
+  fprintf(stderr, "queue_blob:: Failed to write '%s': %s\n", path, strerror(errno));
+  close(fd);
+  unlink(path);
+  return false;
+}
+
+/**
+ * @brief Maps the payload held by a side file in memory
+ *
+ * The mapping stays valid after the file is removed, until ticosd_queue_blobs_unmap() is called.
+ *
+ * @param blobs Side files object
+ * @param id Identifier of the file
+ * @param payload_size_bytes Expected payload size in bytes
+ * @return Read-only payload, NULL if the file is missing, has another size or cannot be mapped
+ */
+uint8_t *ticosd_queue_blobs_map(sTicosdQueueBlobs *blobs, uint64_t id,
+                                uint32_t payload_size_bytes) {
+  char path[PATH_MAX];
+  prv_blob_path(blobs, id, path, sizeof(path));
+
+  const int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    fprintf(stderr, "queue_blob:: Failed to open '%s': %s\n", path, strerror(errno));
+    return NULL;
+  }
+  uint8_t *payload = NULL;
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size != payload_size_bytes || payload_size_bytes == 0) {
+    fprintf(stderr, "queue_blob:: '%s' is truncated.\n", path);
+    goto cleanup;
+  }
+  void *addr = mmap(NULL, payload_size_bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (addr == MAP_FAILED) {
+    fprintf(stderr, "queue_blob:: Failed to map '%s': %s\n", path, strerror(errno));
+    goto cleanup;
+  }
+  payload = addr;
+
+cleanup:
+  close(fd);
+  return payload;
+}
+
+/**
+ * @brief Unmaps a payload returned by ticosd_queue_blobs_map()
+ *
+ * @param payload Payload
+ * @param payload_size_bytes Payload size in bytes
+ */
+void ticosd_queue_blobs_unmap(uint8_t *payload, uint32_t payload_size_bytes) {
+  munmap(payload, payload_size_bytes);
+}
+
+/**
+ * @brief Removes a side file
+ *
+ * @param blobs Side files object
+ * @param id Identifier of the file
+ */
+void ticosd_queue_blobs_remove(sTicosdQueueBlobs *blobs, uint64_t id) {
+  char path[PATH_MAX];
+  prv_blob_path(blobs, id, path, sizeof(path));
+  if (unlink(path) == -1 && errno != ENOENT) {
+    fprintf(stderr, "queue_blob:: Failed to delete '%s': %s\n", path, strerror(errno));
+  }
+}
+
+static int prv_compare_ids(const void *a, const void *b) {
+  const uint64_t id_a = *(const uint64_t *)a;
+  const uint64_t id_b = *(const uint64_t *)b;
+  return (id_a > id_b) - (id_a < id_b);
+}
+
+/**
+ * @brief Removes the side files that are not referenced any more
+ *
+ * @param blobs Side files object
+ * @param ids Identifiers of the files referenced by the queue, sorted in place
+ * @param count Number of identifiers
+ * @return Number of files removed
+ */
+uint32_t ticosd_queue_blobs_reconcile(sTicosdQueueBlobs *blobs, uint64_t *ids, uint32_t count) {
+  uint64_t next_id = 0;
+  if (count > 0) {
+    qsort(ids, count, sizeof(*ids), prv_compare_ids);
+    next_id = ids[count - 1] + 1;
+  }
+
+  uint32_t removed = 0;
+  DIR *dir = opendir(blobs->dir);
+  if (dir) {
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+      char *end;
+      const uint64_t id = strtoull(entry->d_name, &end, 16);
+      if (strlen(entry->d_name) != BLOB_NAME_LEN || *end != '\0') {
+        continue;
+      }
+      if (id >= next_id) {
+        next_id = id + 1;
+      }
+      if (count == 0 || !bsearch(&id, ids, count, sizeof(*ids), prv_compare_ids)) {
+        ticosd_queue_blobs_remove(blobs, id);
+        removed++;
+      }
+    }
+    closedir(dir);
+  }
+
+  // Never goes back, in case references to removed files are left in the queue:
+  if (next_id > atomic_load(&blobs->next_id)) {
+    atomic_store(&blobs->next_id, next_id);
+  }
+  return removed;
+}
@@ -0,0 +1,36 @@
+//! @file
+//!
+//! Copyright (c) Ticos, Inc.
+//! See License.txt for details
+//!
+//! @brief
+//! Side files holding the payloads of large queue messages
+//!
+
+#ifndef __TICOS_QUEUE_BLOB_H
+#define __TICOS_QUEUE_BLOB_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct TicosdQueueBlobs sTicosdQueueBlobs;
+
+sTicosdQueueBlobs *ticosd_queue_blobs_open(const char *dir);
+void ticosd_queue_blobs_close(sTicosdQueueBlobs *blobs);
+bool ticosd_queue_blobs_write(sTicosdQueueBlobs *blobs, const uint8_t *payload,
+                              uint32_t payload_size_bytes, bool sync, uint64_t *id);
+uint8_t *ticosd_queue_blobs_map(sTicosdQueueBlobs *blobs, uint64_t id,
+                                uint32_t payload_size_bytes);
+void ticosd_queue_blobs_unmap(uint8_t *payload, uint32_t payload_size_bytes);
+void ticosd_queue_blobs_remove(sTicosdQueueBlobs *blobs, uint64_t id);
+uint32_t ticosd_queue_blobs_reconcile(sTicosdQueueBlobs *blobs, uint64_t *ids, uint32_t count);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
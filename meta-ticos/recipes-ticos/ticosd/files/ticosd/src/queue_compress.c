@@ -0,0 +1,184 @@
+//! @file
+//!
+//! Copyright (c) Ticos, Inc.
+//! See License.txt for details
+//!
+//! @brief
+//! Compression of queued payloads with a built-in preset dictionary
+//!
+//! Queued payloads are small JSON documents that repeat the same keys over and over, but each one
+//! is too short for deflate to find much redundancy within itself. Priming deflate with a preset
+//! dictionary made of those keys lets even a single record reference them.
+//!
+//! Compressed payload format:
+//! uint8_t   type, the first byte of the original payload, left uncompressed so that it can still
+//!           be used to pick the durability and lane of the message
+//! uint8_t   dictionary version
+//! uint32_t  size of the original payload in bytes, little-endian
+//! uint8_t[] raw deflate stream of the rest of the original payload
+//!
+
+#include "queue_compress.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+
+#define COMPRESSED_HEADER_SIZE 6
+#define DICTIONARY_VERSION 1
+
+// Payloads are small, a 4KiB window covers them along with the dictionary. This keeps the deflate
+// state at (1 << (12 + 2)) + (1 << (5 + 9)) = 32KiB instead of the default 256KiB.
+#define WINDOW_BITS 12
+#define MEM_LEVEL 5
+
+/**
+ * Strings found in the payloads queued by ticosd: the reboot event and attributes JSON documents
+ * and the core upload file paths. deflate finds matches closer to the end of the dictionary with
+ * shorter codes, so the most frequent strings come last.
+ *
+ * Records compressed with a dictionary can only be decompressed with the very same dictionary.
+ * Never change it in place: add a new one along with a new DICTIONARY_VERSION, and keep the old
+ * one around to read records queued by older versions.
+ */
+static const char s_dictionary_v1[] =
+  "/media/ticos/core/corefile-.gz"
+  "\"MemoryUsage\"\"CpuUsage\"\"DiskUsage\"\"Uptime\""
+  "\"SoftwareType\": \"main\",\"SoftwareVersion\": \"1.0.0\",\"HardwareVersion\": \""
+  "{\"Type\": \"Trace\",\"SoftwareType\": \"\",\"SoftwareVersion\": \"\",\"HardwareVersion\": \""
+  "\",\"SdkVersion\": \"0.2.0\",\"EventInfo\": {\"Reason\": 0},\"UserInfo\": {}}"
+  "\"value\": true}, {\"string_key\": \"\", \"value\": false}, {\"string_key\": \""
+  "\", \"value\": 0}, {\"string_key\": \"\", \"value\": \"\"}, {\"string_key\": \""
+  "[{\"string_key\": \"\", \"value\": \"\"}, {\"string_key\": \"";
+
+static bool prv_deflate_init(z_stream *zs) {
+  *zs = (z_stream){
+    .zalloc = Z_NULL,
+    .zfree = Z_NULL,
+    .opaque = Z_NULL,
+  };
+  // Negative windowBits: raw deflate stream, the format above carries the size instead:
+  int rv = deflateInit2(zs, Z_BEST_COMPRESSION, Z_DEFLATED, -WINDOW_BITS, MEM_LEVEL,
+                        Z_DEFAULT_STRATEGY);
+  if (rv != Z_OK) {
+    fprintf(stderr, "queue_compress:: deflateInit2 error %d\n", rv);
+    return false;
+  }
+  rv = deflateSetDictionary(zs, (const Bytef *)s_dictionary_v1, sizeof(s_dictionary_v1) - 1);
+  if (rv != Z_OK) {
+    fprintf(stderr, "queue_compress:: deflateSetDictionary error %d\n", rv);
+    deflateEnd(zs);
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Compresses a payload
+ *
+ * @param payload Payload to compress, of which the first byte is the type
+ * @param payload_size_bytes Payload size in bytes
+ * @param out Buffer for the compressed payload
+ * @param out_size_bytes Size of out, pass payload_size_bytes to only get a compressed payload if it
+ * is smaller than the original
+ * @param[out] compressed_size_bytes Size of the compressed payload in bytes
+ * @return true if the payload was compressed, false if it did not fit in out or on error
+ */
+bool ticosd_queue_compress(const uint8_t *payload, uint32_t payload_size_bytes, uint8_t *out,
+                           uint32_t out_size_bytes, uint32_t *compressed_size_bytes) {
+  if (payload_size_bytes < 2 || out_size_bytes <= COMPRESSED_HEADER_SIZE) {
+    return false;
+  }
+
+  z_stream zs;
+  if (!prv_deflate_init(&zs)) {
+    return false;
+  }
+
+  zs.next_in = (Bytef *)payload + 1;
+  zs.avail_in = payload_size_bytes - 1;
+  zs.next_out = out + COMPRESSED_HEADER_SIZE;
+  zs.avail_out = out_size_bytes - COMPRESSED_HEADER_SIZE;
+  const int rv = deflate(&zs, Z_FINISH);
+  deflateEnd(&zs);
+  if (rv != Z_STREAM_END) {
+    // Z_OK or Z_BUF_ERROR: out is full, compressing is not worth it.
+    return false;
+  }
+
+  out[0] = payload[0];
+  out[1] = DICTIONARY_VERSION;
+  for (int i = 0; i < 4; ++i) {
+    out[2 + i] = (uint8_t)(payload_size_bytes >> (8 * i));
+  }
+  *compressed_size_bytes = out_size_bytes - zs.avail_out;
+  return true;
+}
+
+/**
+ * @brief Returns the size of a payload compressed by ticosd_queue_compress() once decompressed
+ *
+ * @param compressed Compressed payload
+ * @param compressed_size_bytes Size of the compressed payload in bytes
+ * @return Size in bytes, 0 if the compressed payload is not valid
+ */
+uint32_t ticosd_queue_get_decompressed_size(const uint8_t *compressed,
+                                            uint32_t compressed_size_bytes) {
+  if (compressed_size_bytes <= COMPRESSED_HEADER_SIZE || compressed[1] != DICTIONARY_VERSION) {
+    return 0;
+  }
+  uint32_t size = 0;
+  for (int i = 0; i < 4; ++i) {
+    size |= (uint32_t)compressed[2 + i] << (8 * i);
+  }
+  return size;
+}
+
+/**
+ * @brief Decompresses a payload compressed by ticosd_queue_compress()
+ *
+ * @param compressed Compressed payload
+ * @param compressed_size_bytes Size of the compressed payload in bytes
+ * @param out Buffer for the original payload
+ * @param out_size_bytes Size of out, as returned by ticosd_queue_get_decompressed_size()
+ * @return true if the payload was decompressed, false if not
+ */
+bool ticosd_queue_decompress(const uint8_t *compressed, uint32_t compressed_size_bytes,
+                             uint8_t *out, uint32_t out_size_bytes) {
+  const uint32_t size = ticosd_queue_get_decompressed_size(compressed, compressed_size_bytes);
+  if (size == 0 || size != out_size_bytes) {
+    fprintf(stderr, "queue_compress:: invalid compressed payload\n");
+    return false;
+  }
+
+  z_stream zs = {
+    .next_in = (Bytef *)compressed + COMPRESSED_HEADER_SIZE,
+    .avail_in = compressed_size_bytes - COMPRESSED_HEADER_SIZE,
+    .zalloc = Z_NULL,
+    .zfree = Z_NULL,
+    .opaque = Z_NULL,
+  };
+  int rv = inflateInit2(&zs, -WINDOW_BITS);
+  if (rv != Z_OK) {
+    fprintf(stderr, "queue_compress:: inflateInit2 error %d\n", rv);
+    return false;
+  }
+  // With a raw stream, the dictionary can be set right away:
+  rv = inflateSetDictionary(&zs, (const Bytef *)s_dictionary_v1, sizeof(s_dictionary_v1) - 1);
+  if (rv != Z_OK) {
+    fprintf(stderr, "queue_compress:: inflateSetDictionary error %d\n", rv);
+    inflateEnd(&zs);
+    return false;
+  }
+
+  out[0] = compressed[0];
+  zs.next_out = out + 1;
+  zs.avail_out = out_size_bytes - 1;
+  rv = inflate(&zs, Z_FINISH);
+  inflateEnd(&zs);
+  if (rv != Z_STREAM_END || zs.avail_out != 0) {
+    fprintf(stderr, "queue_compress:: inflate error %d\n", rv);
+    return false;
+  }
+  return true;
+}
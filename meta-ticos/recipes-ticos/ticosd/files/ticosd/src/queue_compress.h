@@ -0,0 +1,30 @@
+//! @file
+//!
+//! Copyright (c) Ticos, Inc.
+//! See License.txt for details
+//!
+//! @brief
+//! Compression of queued payloads with a built-in preset dictionary
+//!
+
+#ifndef __TICOS_QUEUE_COMPRESS_H
+#define __TICOS_QUEUE_COMPRESS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+
+bool ticosd_queue_compress(const uint8_t *payload, uint32_t payload_size_bytes, uint8_t *out,
+                           uint32_t out_size_bytes, uint32_t *compressed_size_bytes);
+uint32_t ticosd_queue_get_decompressed_size(const uint8_t *compressed,
+                                            uint32_t compressed_size_bytes);
+bool ticosd_queue_decompress(const uint8_t *compressed, uint32_t compressed_size_bytes,
+                             uint8_t *out, uint32_t out_size_bytes);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,633 @@
+//! @file
+//!
+//! Copyright (c) Ticos, Inc.
+//! See License.txt for details
+//!
+//! @brief
+//! Overflow storage of a queue, as a chain of segment files
+//!
+//! Messages that do not fit in a full queue are appended to the newest segment file of a directory
+//! in data_dir, and read back from the oldest one, which is the only one mapped in memory. A new
+//! segment is started once the newest one reaches the segment size, and the oldest one is unlinked
+//! once all of its messages have been read.
+//!
+//! Segment files are named after their sequence number, as 8 hexadecimal digits:
+//!
+//! Segment header:
+//! uint32_t  magic number
+//! uint32_t  version
+//! uint32_t  offset of the first message not read yet
+//! uint32_t  time of the last append, in seconds since the epoch. Written once the next segment
+//!           is started or the spill is closed, 0 until then (and in segments of older versions).
+//!
+//! Followed by the messages:
+//! uint32_t  payload size in bytes
+//! uint32_t  payload CRC-32C
+//! uint8_t[] payload, padded to a multiple of 4 bytes
+//!
+//! The read offset is updated in the mapping of the oldest segment and left to the kernel's
+//! writeback: after a crash, the last messages read may be read again.
+//!
+//! Messages do not record when they were spilled, the time of the last append to their segment
+//! bounds it instead, for age-based eviction.
+//!
+
+#include "queue_spill.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ticos/util/crc32c.h"
+
+#define SEGMENT_MAGIC_NUMBER 0x47535154u
+#define SEGMENT_VERSION_NUMBER 0x01
+#define SEGMENT_NAME_LEN 8
+
+typedef struct __attribute__((__packed__)) TicosQueueSpillSegmentHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t read_offset;
+  uint32_t last_append_time;
+} sTicosQueueSpillSegmentHeader;
+
+typedef struct __attribute__((__packed__)) TicosQueueSpillRecordHeader {
+  uint32_t payload_size_bytes;
+  uint32_t crc32c;
+} sTicosQueueSpillRecordHeader;
+
+struct TicosdQueueSpill {
+  char *dir;
+  uint32_t segment_size;
+  //! @brief Whether there is at least one segment, from first_seq to last_seq.
+  bool has_segments;
+  uint32_t first_seq;
+  uint32_t last_seq;
+  //! @brief Sequence number of the next segment to create.
+  uint32_t next_seq;
+  //! @brief File descriptor of the newest segment, -1 if there is none.
+  int write_fd;
+  //! @brief Size of the newest segment.
+  uint32_t write_offset;
+  //! @brief Time of the last append to the newest segment, 0 if unknown.
+  time_t last_append_time;
+  //! @brief Mapping of the oldest segment, NULL if not mapped yet.
+  uint8_t *read_map;
+  size_t read_map_size;
+  //! @brief Offset of the first message not read yet in the oldest segment.
+  uint32_t read_offset;
+  //! @brief Number of messages not read yet.
+  uint32_t count;
+  //! @brief Total size of the segment files.
+  uint64_t disk_usage;
+};
+
+/**
+ * @brief Returns the size a message takes in a segment
+ *
+ * @param payload_size_bytes Payload size in bytes
+ */
+uint32_t ticosd_queue_spill_get_record_size(uint32_t payload_size_bytes) {
+  return sizeof(sTicosQueueSpillRecordHeader) + ((payload_size_bytes + 3) & ~3u);
+}
+
+static void prv_segment_path(sTicosdQueueSpill *handle, uint32_t seq, char *path, size_t len) {
+  snprintf(path, len, "%s/%08x", handle->dir, seq);
+}
+
+/**
+ * @brief Checks whether a valid message starts at the given offset of a segment
+ *
+ * @param segment Segment contents
+ * @param segment_size Segment size
+ * @param offset Offset of the message
+ * @return Size of the message in the segment, 0 if there is no valid message
+ */
+static uint32_t prv_validate_record(const uint8_t *segment, size_t segment_size, uint32_t offset) {
+  if (offset + sizeof(sTicosQueueSpillRecordHeader) > segment_size) {
+    return 0;
+  }
+  const sTicosQueueSpillRecordHeader *header =
+    (const sTicosQueueSpillRecordHeader *)&segment[offset];
+  const uint32_t record_size = ticosd_queue_spill_get_record_size(header->payload_size_bytes);
+  if (header->payload_size_bytes == 0 || record_size > segment_size - offset) {
+    return 0;
+  }
+  if (ticos_crc32c(0, header + 1, header->payload_size_bytes) != header->crc32c) {
+    return 0;
+  }
+  return record_size;
+}
+
+/**
+ * @brief Counts the valid messages of a segment, from the given offset
+ *
+ * @param segment Segment contents
+ * @param segment_size Segment size
+ * @param[in,out] offset Offset of the first message, set to the end of the last valid one
+ * @return Number of valid messages
+ */
+static uint32_t prv_count_records(const uint8_t *segment, size_t segment_size, uint32_t *offset) {
+  uint32_t count = 0;
+  uint32_t record_size;
+  while ((record_size = prv_validate_record(segment, segment_size, *offset)) != 0) {
+    *offset += record_size;
+    count++;
+  }
+  return count;
+}
+
+static void prv_unmap_first_segment(sTicosdQueueSpill *handle) {
+  if (handle->read_map) {
+    munmap(handle->read_map, handle->read_map_size);
+    handle->read_map = NULL;
+    handle->read_map_size = 0;
+  }
+}
+
+/**
+ * @brief Maps the oldest segment, to read its messages and update its read offset
+ *
+ * @param handle Spill handle
+ * @return true Successfully mapped the segment
+ * @return false Failed to map
+ */
+static bool prv_map_first_segment(sTicosdQueueSpill *handle) {
+  char path[PATH_MAX];
+  prv_segment_path(handle, handle->first_seq, path, sizeof(path));
+
+  const int fd = open(path, O_RDWR);
+  if (fd == -1) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(sTicosQueueSpillSegmentHeader)) {
+    close(fd);
+    return false;
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "queue_spill:: Failed to mmap '%s'.\n", path);
+    return false;
+  }
+
+  handle->read_map = map;
+  handle->read_map_size = st.st_size;
+  return true;
+}
+
+/**
+ * @brief Unlinks the oldest segment, dropping the messages of it that have not been read yet
+ *
+ * @param handle Spill handle
+ * @return Number of messages dropped
+ */
+static uint32_t prv_remove_first_segment(sTicosdQueueSpill *handle) {
+  char path[PATH_MAX];
+  prv_segment_path(handle, handle->first_seq, path, sizeof(path));
+
+  uint32_t dropped;
+  uint64_t size;
+  if (handle->first_seq == handle->last_seq) {
+    dropped = handle->count;
+    size = handle->write_offset;
+    close(handle->write_fd);
+    handle->write_fd = -1;
+    handle->has_segments = false;
+  } else {
+    if (!handle->read_map) {
+      prv_map_first_segment(handle);
+    }
+    uint32_t offset = handle->read_offset;
+    dropped =
+      handle->read_map ? prv_count_records(handle->read_map, handle->read_map_size, &offset) : 0;
+    size = handle->read_map_size;
+    handle->first_seq++;
+  }
+  prv_unmap_first_segment(handle);
+  unlink(path);
+
+  handle->read_offset = sizeof(sTicosQueueSpillSegmentHeader);
+  handle->count -= dropped < handle->count ? dropped : handle->count;
+  handle->disk_usage -= size < handle->disk_usage ? size : handle->disk_usage;
+  return dropped;
+}
+
+/**
+ * @brief Records the time of the last append in the header of the newest segment
+ *
+ * @param handle Spill handle
+ */
+static void prv_write_last_append_time(sTicosdQueueSpill *handle) {
+  const uint32_t last_append_time = (uint32_t)handle->last_append_time;
+  if (last_append_time != 0 &&
+      pwrite(handle->write_fd, &last_append_time, sizeof(last_append_time),
+             offsetof(sTicosQueueSpillSegmentHeader, last_append_time)) == -1) {
+    perror("queue_spill:: Failed to write segment header");
+  }
+}
+
+/**
+ * @brief Starts a new segment, to append messages to
+ *
+ * @param handle Spill handle
+ * @return true Successfully created the segment
+ * @return false Failed to create
+ */
+static bool prv_create_segment(sTicosdQueueSpill *handle) {
+  char path[PATH_MAX];
+  const uint32_t seq = handle->next_seq;
+  prv_segment_path(handle, seq, path, sizeof(path));
+
+  const int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  if (fd == -1) {
+    fprintf(stderr, "queue_spill:: Failed to create '%s': %s\n", path, strerror(errno));
+    return false;
+  }
+  const sTicosQueueSpillSegmentHeader header = {
+    .magic = SEGMENT_MAGIC_NUMBER,
+    .version = SEGMENT_VERSION_NUMBER,
+    .read_offset = sizeof(sTicosQueueSpillSegmentHeader),
+  };
+  if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+    fprintf(stderr, "queue_spill:: Failed to write '%s'.\n", path);
+    close(fd);
+    unlink(path);
+    return false;
+  }
+
+  if (handle->has_segments) {
+    if (handle->first_seq == handle->last_seq &&
+        handle->read_map_size < handle->write_offset) {
+      // The oldest segment will not grow any more, map it again in full when reading it:
+      prv_unmap_first_segment(handle);
+    }
+    prv_write_last_append_time(handle);
+    close(handle->write_fd);
+  } else {
+    handle->first_seq = seq;
+    handle->read_offset = sizeof(sTicosQueueSpillSegmentHeader);
+    handle->has_segments = true;
+  }
+  handle->last_seq = seq;
+  handle->next_seq = seq + 1;
+  handle->write_fd = fd;
+  handle->write_offset = sizeof(header);
+  handle->last_append_time = 0;
+  handle->disk_usage += sizeof(header);
+  return true;
+}
+
+/**
+ * @brief Loads a segment left by a previous run, counting its messages
+ *
+ * A torn message at the end of the segment is truncated, so that appending can continue.
+ *
+ * @param handle Spill handle
+ * @param seq Sequence number of the segment
+ */
+static void prv_load_segment(sTicosdQueueSpill *handle, uint32_t seq) {
+  char path[PATH_MAX];
+  prv_segment_path(handle, seq, path, sizeof(path));
+
+  const int fd = open(path, O_RDWR);
+  if (fd == -1) {
+    return;
+  }
+  struct stat st;
+  uint8_t *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(sTicosQueueSpillSegmentHeader)) {
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  const sTicosQueueSpillSegmentHeader *header = (const sTicosQueueSpillSegmentHeader *)map;
+  if (map == MAP_FAILED || header->magic != SEGMENT_MAGIC_NUMBER ||
+      header->version != SEGMENT_VERSION_NUMBER) {
+    fprintf(stderr, "queue_spill:: Ignoring invalid segment '%s'.\n", path);
+    if (map != MAP_FAILED) {
+      munmap(map, st.st_size);
+    }
+    close(fd);
+    unlink(path);
+    return;
+  }
+
+  uint32_t offset = header->read_offset;
+  const uint32_t count = prv_count_records(map, st.st_size, &offset);
+  const uint32_t read_offset = header->read_offset;
+  const time_t last_append_time = header->last_append_time;
+  munmap(map, st.st_size);
+
+  if (!handle->has_segments) {
+    handle->first_seq = seq;
+    handle->read_offset = read_offset;
+    handle->has_segments = true;
+  }
+  handle->last_seq = seq;
+  handle->last_append_time = last_append_time;
+  handle->count += count;
+
+  if (offset < st.st_size && ftruncate(fd, offset) == 0) {
+    st.st_size = offset;
+  }
+  close(fd);
+  handle->write_offset = st.st_size;
+  handle->disk_usage += st.st_size;
+}
+
+/**
+ * @brief Loads the segments left by a previous run
+ *
+ * @param handle Spill handle
+ */
+static void prv_load_segments(sTicosdQueueSpill *handle) {
+  DIR *dir = opendir(handle->dir);
+  if (!dir) {
+    return;
+  }
+
+  bool found = false;
+  uint32_t first_seq = 0;
+  uint32_t last_seq = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    char *end;
+    const unsigned long seq = strtoul(entry->d_name, &end, 16);
+    if (strlen(entry->d_name) != SEGMENT_NAME_LEN || *end != '\0') {
+      continue;
+    }
+    if (!found || seq < first_seq) {
+      first_seq = seq;
+    }
+    if (!found || seq > last_seq) {
+      last_seq = seq;
+    }
+    found = true;
+  }
+  closedir(dir);
+
+  if (!found) {
+    return;
+  }
+  for (uint32_t seq = first_seq;; ++seq) {
+    prv_load_segment(handle, seq);
+    if (seq == last_seq) {
+      break;
+    }
+  }
+  handle->next_seq = last_seq + 1;
+
+  if (handle->has_segments) {
+    // Keep appending to the newest valid segment:
+    char path[PATH_MAX];
+    prv_segment_path(handle, handle->last_seq, path, sizeof(path));
+    if ((handle->write_fd = open(path, O_RDWR)) == -1) {
+      fprintf(stderr, "queue_spill:: Failed to open '%s', dropping %u messages.\n", path,
+              handle->count);
+      ticosd_queue_spill_reset(handle);
+    }
+  }
+}
+
+/**
+ * @brief Initialises the overflow storage of a queue
+ *
+ * @param ticosd Main ticosd handle
+ * @param name Name of the directory of the segment files, in data_dir
+ * @param segment_size Size of a segment file in bytes
+ * @return Spill object, NULL if there is no data_dir to store the segments in
+ */
+sTicosdQueueSpill *ticosd_queue_spill_init(sTicosd *ticosd, const char *name,
+                                           uint32_t segment_size) {
+  sTicosdQueueSpill *handle = calloc(sizeof(sTicosdQueueSpill), 1);
+  if (!handle) {
+    fprintf(stderr, "queue_spill:: Failed to allocate handle.\n");
+    return NULL;
+  }
+  handle->write_fd = -1;
+  handle->segment_size = segment_size;
+  handle->read_offset = sizeof(sTicosQueueSpillSegmentHeader);
+
+  if (!(handle->dir = ticosd_generate_rw_filename(ticosd, name))) {
+    goto cleanup;
+  }
+  if (mkdir(handle->dir, 0755) == -1 && errno != EEXIST) {
+    fprintf(stderr, "queue_spill:: Failed to create '%s': %s\n", handle->dir, strerror(errno));
+    goto cleanup;
+  }
+
+  prv_load_segments(handle);
+  return handle;
+
+cleanup:
+  free(handle->dir);
+  free(handle);
+  return NULL;
+}
+
+/**
+ * @brief Destroys the spill handle, keeping the segment files for the next run
+ *
+ * @param handle Spill handle
+ */
+void ticosd_queue_spill_destroy(sTicosdQueueSpill *handle) {
+  if (handle) {
+    prv_unmap_first_segment(handle);
+    if (handle->write_fd != -1) {
+      prv_write_last_append_time(handle);
+      fdatasync(handle->write_fd);
+      close(handle->write_fd);
+    }
+    free(handle->dir);
+    free(handle);
+  }
+}
+
+/**
+ * @brief Appends a message to the newest segment
+ *
+ * @param handle Spill handle
+ * @param payload Payload data
+ * @param payload_size_bytes Payload size in bytes
+ * @param sync Whether to flush the message to storage before returning
+ * @return true Successfully appended the message
+ * @return false Failed to append
+ */
+bool ticosd_queue_spill_append(sTicosdQueueSpill *handle, const uint8_t *payload,
+                               uint32_t payload_size_bytes, bool sync) {
+  if (payload_size_bytes == 0 || payload == NULL) {
+    return false;
+  }
+
+  const uint32_t record_size = ticosd_queue_spill_get_record_size(payload_size_bytes);
+  if (!handle->has_segments || (handle->write_offset + record_size > handle->segment_size &&
+                                handle->write_offset > sizeof(sTicosQueueSpillSegmentHeader))) {
+    if (!prv_create_segment(handle)) {
+      return false;
+    }
+  }
+
+  const sTicosQueueSpillRecordHeader header = {
+    .payload_size_bytes = payload_size_bytes,
+    .crc32c = ticos_crc32c(0, payload, payload_size_bytes),
+  };
+  static const uint8_t padding[3] = {0};
+  const struct iovec iov[] = {
+    {.iov_base = (void *)&header, .iov_len = sizeof(header)},
+    {.iov_base = (void *)payload, .iov_len = payload_size_bytes},
+    {.iov_base = (void *)padding, .iov_len = record_size - sizeof(header) - payload_size_bytes},
+  };
+  if (pwritev(handle->write_fd, iov, sizeof(iov) / sizeof(iov[0]), handle->write_offset) !=
+      (ssize_t)record_size) {
+    fprintf(stderr, "queue_spill:: Failed to append %u bytes payload: %s\n", payload_size_bytes,
+            strerror(errno));
+    if (ftruncate(handle->write_fd, handle->write_offset) == -1) {
+      perror("queue_spill:: ftruncate");
+    }
+    return false;
+  }
+  if (sync && fdatasync(handle->write_fd) == -1) {
+    perror("queue_spill:: fdatasync");
+  }
+
+  handle->write_offset += record_size;
+  handle->disk_usage += record_size;
+  handle->count++;
+  handle->last_append_time = time(NULL);
+  return true;
+}
+
+/**
+ * @brief Returns the oldest message that has not been read yet
+ *
+ * @param handle Spill handle
+ * @param[out] payload_size_bytes Payload size in bytes
+ * @return Payload within the mapping of the oldest segment, valid until the next call, NULL if
+ * there is no message
+ */
+const uint8_t *ticosd_queue_spill_peek(sTicosdQueueSpill *handle, uint32_t *payload_size_bytes) {
+  while (handle->has_segments) {
+    if (!handle->read_map && !prv_map_first_segment(handle)) {
+      prv_remove_first_segment(handle);
+      continue;
+    }
+
+    if (prv_validate_record(handle->read_map, handle->read_map_size, handle->read_offset) != 0) {
+      const sTicosQueueSpillRecordHeader *header =
+        (const sTicosQueueSpillRecordHeader *)&handle->read_map[handle->read_offset];
+      *payload_size_bytes = header->payload_size_bytes;
+      return (const uint8_t *)(header + 1);
+    }
+
+    if (handle->first_seq == handle->last_seq) {
+      if (handle->read_offset >= handle->write_offset) {
+        return NULL;
+      }
+      if (handle->read_map_size < handle->write_offset) {
+        // Messages were appended after the segment was mapped:
+        prv_unmap_first_segment(handle);
+        continue;
+      }
+      fprintf(stderr, "queue_spill:: Corrupt message in '%s', dropping %u messages.\n",
+              handle->dir, handle->count);
+    }
+    // Done with the oldest segment, or the rest of it is corrupt:
+    prv_remove_first_segment(handle);
+  }
+  return NULL;
+}
+
+/**
+ * @brief Returns the latest time the message returned by ticosd_queue_spill_peek() can have been
+ * spilled at
+ *
+ * @param handle Spill handle
+ * @return Time of the last append to the segment of the message, 0 if unknown
+ */
+time_t ticosd_queue_spill_get_peek_time(sTicosdQueueSpill *handle) {
+  if (handle->first_seq == handle->last_seq) {
+    return handle->last_append_time;
+  }
+  if (!handle->read_map) {
+    return 0;
+  }
+  return ((const sTicosQueueSpillSegmentHeader *)handle->read_map)->last_append_time;
+}
+
+/**
+ * @brief Marks the message returned by ticosd_queue_spill_peek() as read
+ *
+ * @param handle Spill handle
+ */
+void ticosd_queue_spill_pop(sTicosdQueueSpill *handle) {
+  if (!handle->read_map) {
+    return;
+  }
+  const uint32_t record_size =
+    prv_validate_record(handle->read_map, handle->read_map_size, handle->read_offset);
+  if (record_size == 0) {
+    return;
+  }
+
+  handle->read_offset += record_size;
+  ((sTicosQueueSpillSegmentHeader *)handle->read_map)->read_offset = handle->read_offset;
+  handle->count--;
+
+  const bool is_last = handle->first_seq == handle->last_seq;
+  if ((is_last && handle->read_offset >= handle->write_offset) ||
+      (!is_last && handle->read_offset >= handle->read_map_size)) {
+    // Unlink segments as soon as they are read entirely:
+    prv_remove_first_segment(handle);
+  }
+}
+
+/**
+ * @brief Unlinks the oldest segment, dropping the messages of it that have not been read yet
+ *
+ * @param handle Spill handle
+ * @param[out] dropped_bytes Disk space freed in bytes
+ * @return Number of messages dropped
+ */
+uint32_t ticosd_queue_spill_drop_oldest_segment(sTicosdQueueSpill *handle,
+                                                uint64_t *dropped_bytes) {
+  const uint64_t disk_usage = handle->disk_usage;
+  const uint32_t dropped = handle->has_segments ? prv_remove_first_segment(handle) : 0;
+  *dropped_bytes = disk_usage - handle->disk_usage;
+  return dropped;
+}
+
+/**
+ * @brief Unlinks all segments
+ *
+ * @param handle Spill handle
+ */
+void ticosd_queue_spill_reset(sTicosdQueueSpill *handle) {
+  while (handle->has_segments) {
+    handle->count = 0;
+    prv_remove_first_segment(handle);
+  }
+  handle->count = 0;
+  handle->disk_usage = 0;
+}
+
+/**
+ * @brief Returns the number of messages that have not been read yet
+ */
+uint32_t ticosd_queue_spill_get_count(sTicosdQueueSpill *handle) { return handle->count; }
+
+/**
+ * @brief Returns the total size of the segment files in bytes
+ */
+uint64_t ticosd_queue_spill_get_disk_usage(sTicosdQueueSpill *handle) {
+  return handle->disk_usage;
+}
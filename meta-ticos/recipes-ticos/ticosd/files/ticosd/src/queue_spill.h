@@ -0,0 +1,43 @@
+//! @file
+//!
+//! Copyright (c) Ticos, Inc.
+//! See License.txt for details
+//!
+//! @brief
+//! Overflow storage of a queue, as a chain of segment files
+//!
+
+#ifndef __TICOS_QUEUE_SPILL_H
+#define __TICOS_QUEUE_SPILL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "ticosd.h"
+
+typedef struct TicosdQueueSpill sTicosdQueueSpill;
+
+sTicosdQueueSpill *ticosd_queue_spill_init(sTicosd *ticosd, const char *name,
+                                           uint32_t segment_size);
+void ticosd_queue_spill_destroy(sTicosdQueueSpill *handle);
+bool ticosd_queue_spill_append(sTicosdQueueSpill *handle, const uint8_t *payload,
+                               uint32_t payload_size_bytes, bool sync);
+const uint8_t *ticosd_queue_spill_peek(sTicosdQueueSpill *handle, uint32_t *payload_size_bytes);
+time_t ticosd_queue_spill_get_peek_time(sTicosdQueueSpill *handle);
+void ticosd_queue_spill_pop(sTicosdQueueSpill *handle);
+uint32_t ticosd_queue_spill_drop_oldest_segment(sTicosdQueueSpill *handle,
+                                                uint64_t *dropped_bytes);
+void ticosd_queue_spill_reset(sTicosdQueueSpill *handle);
+uint32_t ticosd_queue_spill_get_count(sTicosdQueueSpill *handle);
+uint64_t ticosd_queue_spill_get_disk_usage(sTicosdQueueSpill *handle);
+uint32_t ticosd_queue_spill_get_record_size(uint32_t payload_size_bytes);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,648 @@
+//! @file
+//!
+//! Copyright (c) Ticos, Inc.
+//! See License.txt for details
+//!
+//! @brief
+//! Persistence of a queue buffer to its backing file, with interchangeable backends
+//!
+//! The queue always works on an in-memory image of its file, backends only differ in how changes
+//! to that image reach the file:
+//! - mmap: the image is a shared mapping of the file, flushed with msync(). Dirty pages also reach
+//!   the file through the kernel's writeback, and survive a crash of ticosd.
+//! - pwrite: the image is a heap buffer. Changed blocks are tracked in a bitmap and written with
+//!   one pwrite() per run of consecutive blocks, aligned to the file system block size, then
+//!   flushed with fdatasync(). The file only sees the writes ticosd asks for, in large aligned
+//!   chunks, instead of whatever pages the kernel's writeback picks.
+//! - io_uring: same image and bitmap as pwrite, but the writes and the fdatasync() are submitted
+//!   to an io_uring in one system call, and writes that do not need to be durable yet are not
+//!   waited for.
+//!
+//! With the pwrite and io_uring backends, changes only reach the file when the queue writes them
+//! back, see ticosd_queue_storage_needs_write_back().
+//!
+
+#include "queue_storage.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+//! Number of submission queue entries of the io_uring.
+#define URING_ENTRIES 64
+//! user_data of the fdatasync() request, write requests carry their offset and length.
+#define URING_FSYNC_USER_DATA UINT64_MAX
+
+typedef struct QueueUring {
+  int fd;
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned sq_entries;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+  //! Requests queued but not submitted yet.
+  unsigned to_submit;
+  //! Requests submitted or queued, whose completion has not been reaped yet.
+  unsigned inflight;
+  //! Whether a request failed since the last write back or sync.
+  bool failed;
+} sQueueUring;
+
+typedef struct TicosdQueueStorageOps {
+  bool (*open)(sTicosdQueueStorage *storage);
+  //! NULL if changes reach the file without being written back.
+  bool (*write_back)(sTicosdQueueStorage *storage, size_t start, size_t end);
+  bool (*sync)(sTicosdQueueStorage *storage, size_t start, size_t end);
+  void (*close)(sTicosdQueueStorage *storage);
+} sTicosdQueueStorageOps;
+
+struct TicosdQueueStorage {
+  const sTicosdQueueStorageOps *ops;
+  eTicosdQueueBackend backend;
+  int fd;
+  uint8_t *buf;
+  size_t size;
+  //! Size of the blocks tracked in dirty, the file system's preferred I/O size.
+  size_t block_size;
+  //! One bit per block of buf changed since it was last written to the file.
+  _Atomic uint64_t *dirty;
+  sQueueUring uring;
+};
+
+static const char *const s_backend_names[] = {
+  [kTicosdQueueBackend_Mmap] = "mmap",
+  [kTicosdQueueBackend_Pwrite] = "pwrite",
+  [kTicosdQueueBackend_IoUring] = "io_uring",
+};
+
+/*
+ * mmap backend
+ */
+
+static bool prv_mmap_open(sTicosdQueueStorage *storage) {
+  void *buf = mmap(NULL, storage->size, PROT_READ | PROT_WRITE, MAP_SHARED, storage->fd, 0);
+  if (buf == MAP_FAILED) {
+    perror("queue_storage:: Failed to mmap queue file");
+    return false;
+  }
+  // The mapping keeps the file open:
+  close(storage->fd);
+  storage->fd = -1;
+  storage->buf = buf;
+  return true;
+}
+
+static bool prv_mmap_sync(sTicosdQueueStorage *storage, size_t start, size_t end) {
+  // msync() requires a page-aligned start address. buf itself is page-aligned:
+  const size_t aligned_start = start & ~((size_t)sysconf(_SC_PAGESIZE) - 1);
+  if (msync(storage->buf + aligned_start, end - aligned_start, MS_SYNC) == -1) {
+    perror("queue_storage:: Failed to flush queue file");
+    return false;
+  }
+  return true;
+}
+
+static void prv_mmap_close(sTicosdQueueStorage *storage) { munmap(storage->buf, storage->size); }
+
+/*
+ * Heap buffer and dirty block bitmap, shared by the pwrite and io_uring backends
+ */
+
+static size_t prv_num_blocks(sTicosdQueueStorage *storage) {
+  return (storage->size + storage->block_size - 1) / storage->block_size;
+}
+
+static void prv_buffered_free(sTicosdQueueStorage *storage) {
+  free((void *)storage->dirty);
+  storage->dirty = NULL;
+  free(storage->buf);
+  storage->buf = NULL;
+}
+
+static bool prv_buffered_open(sTicosdQueueStorage *storage) {
+  struct stat st;
+  const long page_size = sysconf(_SC_PAGESIZE);
+  storage->block_size = (fstat(storage->fd, &st) == 0 && st.st_blksize > 0 &&
+                         (st.st_blksize & (st.st_blksize - 1)) == 0)
+                          ? (size_t)st.st_blksize
+                          : (size_t)page_size;
+
+  if (posix_memalign((void **)&storage->buf, page_size, storage->size) != 0) {
+    fprintf(stderr, "queue_storage:: Failed to allocate queue buffer\n");
+    storage->buf = NULL;
+    return false;
+  }
+  const size_t num_words = (prv_num_blocks(storage) + 63) / 64;
+  if (!(storage->dirty = calloc(num_words, sizeof(uint64_t)))) {
+    fprintf(stderr, "queue_storage:: Failed to allocate dirty block bitmap\n");
+    goto cleanup;
+  }
+
+  size_t offset = 0;
+  while (offset < storage->size) {
+    const ssize_t rv = pread(storage->fd, storage->buf + offset, storage->size - offset, offset);
+    if (rv == -1 && errno == EINTR) {
+      continue;
+    }
+    if (rv <= 0) {
+      perror("queue_storage:: Failed to read queue file");
+      goto cleanup;
+    }
+    offset += rv;
+  }
+  return true;
+
+cleanup:
+  prv_buffered_free(storage);
+  return false;
+}
+
+static void prv_buffered_close(sTicosdQueueStorage *storage) {
+  close(storage->fd);
+  prv_buffered_free(storage);
+}
+
+static void prv_mark_blocks_dirty(sTicosdQueueStorage *storage, size_t first, size_t last) {
+  for (size_t block = first; block < last; ++block) {
+    atomic_fetch_or(&storage->dirty[block / 64], 1ull << (block % 64));
+  }
+}
+
+typedef bool (*prv_run_handler)(sTicosdQueueStorage *storage, size_t offset, size_t len);
+
+static bool prv_handle_run(sTicosdQueueStorage *storage, size_t first, size_t last,
+                           prv_run_handler handler) {
+  const size_t offset = first * storage->block_size;
+  const size_t end = last * storage->block_size;
+  if (!handler(storage, offset, (end < storage->size ? end : storage->size) - offset)) {
+    // Written again by the next write back or sync:
+    prv_mark_blocks_dirty(storage, first, last);
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Clears the dirty blocks of a range, calling handler for each run of consecutive ones
+ *
+ * Blocks changed again while being written are marked dirty again, and written the next time.
+ *
+ * @param storage Storage handle
+ * @param start Start of the range in bytes
+ * @param end End of the range in bytes
+ * @param handler Called with the offset and length in bytes of each run
+ * @return true if all the handler calls succeeded, false if not
+ */
+static bool prv_for_each_dirty_run(sTicosdQueueStorage *storage, size_t start, size_t end,
+                                   prv_run_handler handler) {
+  if (end <= start) {
+    return true;
+  }
+  const size_t first = start / storage->block_size;
+  const size_t last = (end + storage->block_size - 1) / storage->block_size;
+  bool success = true;
+  size_t run_start = SIZE_MAX;
+
+  for (size_t word = first / 64; word <= (last - 1) / 64; ++word) {
+    uint64_t mask = UINT64_MAX;
+    if (word == first / 64) {
+      mask &= UINT64_MAX << (first % 64);
+    }
+    if (word == (last - 1) / 64 && last % 64 != 0) {
+      mask &= UINT64_MAX >> (64 - last % 64);
+    }
+    const uint64_t taken = atomic_fetch_and(&storage->dirty[word], ~mask) & mask;
+    if (taken == 0 && run_start == SIZE_MAX) {
+      continue;
+    }
+    for (unsigned int bit = 0; bit < 64; ++bit) {
+      const size_t block = word * 64 + bit;
+      if ((mask & (1ull << bit)) == 0) {
+        continue;
+      }
+      if (taken & (1ull << bit)) {
+        if (run_start == SIZE_MAX) {
+          run_start = block;
+        }
+      } else if (run_start != SIZE_MAX) {
+        success &= prv_handle_run(storage, run_start, block, handler);
+        run_start = SIZE_MAX;
+      }
+    }
+  }
+  if (run_start != SIZE_MAX) {
+    success &= prv_handle_run(storage, run_start, last, handler);
+  }
+  return success;
+}
+
+/*
+ * pwrite backend
+ */
+
+static bool prv_pwrite_run(sTicosdQueueStorage *storage, size_t offset, size_t len) {
+  while (len > 0) {
+    const ssize_t rv = pwrite(storage->fd, storage->buf + offset, len, offset);
+    if (rv == -1 && errno == EINTR) {
+      continue;
+    }
+    if (rv <= 0) {
+      perror("queue_storage:: Failed to write queue file");
+      return false;
+    }
+    offset += rv;
+    len -= rv;
+  }
+  return true;
+}
+
+static bool prv_pwrite_write_back(sTicosdQueueStorage *storage, size_t start, size_t end) {
+  return prv_for_each_dirty_run(storage, start, end, prv_pwrite_run);
+}
+
+static bool prv_pwrite_sync(sTicosdQueueStorage *storage, size_t start, size_t end) {
+  bool success = prv_pwrite_write_back(storage, start, end);
+  if (fdatasync(storage->fd) == -1) {
+    perror("queue_storage:: Failed to flush queue file");
+    success = false;
+  }
+  return success;
+}
+
+/*
+ * io_uring backend, on top of the raw system calls to avoid a dependency on liburing
+ */
+
+static int prv_uring_enter(sQueueUring *uring, unsigned to_submit, unsigned min_complete) {
+  int rv;
+  do {
+    rv = (int)syscall(__NR_io_uring_enter, uring->fd, to_submit, min_complete,
+                      min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  } while (rv == -1 && errno == EINTR);
+  return rv;
+}
+
+static bool prv_uring_setup(sQueueUring *uring) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  uring->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+  if (uring->fd == -1) {
+    fprintf(stderr, "queue_storage:: io_uring is not available : %s\n", strerror(errno));
+    return false;
+  }
+
+  uring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  uring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  const bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single_mmap) {
+    if (uring->cq_ring_size > uring->sq_ring_size) {
+      uring->sq_ring_size = uring->cq_ring_size;
+    }
+    uring->cq_ring_size = uring->sq_ring_size;
+  }
+
+  uring->sq_ring = mmap(NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+  uring->cq_ring = single_mmap ? uring->sq_ring
+                               : mmap(NULL, uring->cq_ring_size, PROT_READ | PROT_WRITE,
+                                      MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_CQ_RING);
+  uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     uring->fd, IORING_OFF_SQES);
+  if (uring->sq_ring == MAP_FAILED || uring->cq_ring == MAP_FAILED || uring->sqes == MAP_FAILED) {
+    perror("queue_storage:: Failed to map io_uring");
+    if (uring->sqes != MAP_FAILED) {
+      munmap(uring->sqes, uring->sqes_size);
+    }
+    if (!single_mmap && uring->cq_ring != MAP_FAILED) {
+      munmap(uring->cq_ring, uring->cq_ring_size);
+    }
+    if (uring->sq_ring != MAP_FAILED) {
+      munmap(uring->sq_ring, uring->sq_ring_size);
+    }
+    close(uring->fd);
+    return false;
+  }
+
+  uint8_t *sq = uring->sq_ring;
+  uring->sq_head = (unsigned *)(sq + params.sq_off.head);
+  uring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  uring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  uring->sq_array = (unsigned *)(sq + params.sq_off.array);
+  uring->sq_entries = params.sq_entries;
+  uint8_t *cq = uring->cq_ring;
+  uring->cq_head = (unsigned *)(cq + params.cq_off.head);
+  uring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  uring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  uring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  return true;
+}
+
+/**
+ * @brief Processes the completed requests, marking the blocks of failed writes dirty again
+ */
+static void prv_uring_reap(sTicosdQueueStorage *storage) {
+  sQueueUring *uring = &storage->uring;
+  unsigned head = *uring->cq_head;
+  const unsigned tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; ++head) {
+    const struct io_uring_cqe *cqe = &uring->cqes[head & *uring->cq_mask];
+    uring->inflight--;
+    if (cqe->user_data == URING_FSYNC_USER_DATA) {
+      if (cqe->res < 0) {
+        fprintf(stderr, "queue_storage:: Failed to flush queue file : %s\n", strerror(-cqe->res));
+        uring->failed = true;
+      }
+      continue;
+    }
+    const size_t offset = (uint32_t)cqe->user_data;
+    const size_t len = cqe->user_data >> 32;
+    if (cqe->res < 0 || (size_t)cqe->res < len) {
+      fprintf(stderr, "queue_storage:: Failed to write queue file : %s\n",
+              cqe->res < 0 ? strerror(-cqe->res) : "short write");
+      const size_t written = cqe->res < 0 ? 0 : (size_t)cqe->res;
+      prv_mark_blocks_dirty(storage, (offset + written) / storage->block_size,
+                            (offset + len + storage->block_size - 1) / storage->block_size);
+      uring->failed = true;
+    }
+  }
+  __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Submits the queued requests and waits for completions until at most max_inflight
+ * requests are left
+ */
+static bool prv_uring_submit_and_wait(sTicosdQueueStorage *storage, unsigned max_inflight) {
+  sQueueUring *uring = &storage->uring;
+  prv_uring_reap(storage);
+  while (uring->to_submit > 0 || uring->inflight > max_inflight) {
+    const unsigned wait = uring->inflight > max_inflight ? 1 : 0;
+    const int rv = prv_uring_enter(uring, uring->to_submit, wait);
+    if (rv == -1) {
+      perror("queue_storage:: io_uring_enter failed");
+      return false;
+    }
+    uring->to_submit -= (unsigned)rv;
+    prv_uring_reap(storage);
+  }
+  return true;
+}
+
+static struct io_uring_sqe *prv_uring_get_sqe(sTicosdQueueStorage *storage) {
+  sQueueUring *uring = &storage->uring;
+  // Keep room for the completions of all requests, the completion queue is twice as large:
+  if (uring->inflight >= uring->sq_entries &&
+      !prv_uring_submit_and_wait(storage, uring->sq_entries - 1)) {
+    return NULL;
+  }
+  const unsigned tail = *uring->sq_tail;
+  const unsigned index = tail & *uring->sq_mask;
+  struct io_uring_sqe *sqe = &uring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  uring->sq_array[index] = index;
+  return sqe;
+}
+
+static void prv_uring_queue_sqe(sQueueUring *uring) {
+  __atomic_store_n(uring->sq_tail, *uring->sq_tail + 1, __ATOMIC_RELEASE);
+  uring->to_submit++;
+  uring->inflight++;
+}
+
+static bool prv_uring_write_run(sTicosdQueueStorage *storage, size_t offset, size_t len) {
+  struct io_uring_sqe *sqe = prv_uring_get_sqe(storage);
+  if (!sqe) {
+    return false;
+  }
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->fd = storage->fd;
+  sqe->addr = (uintptr_t)(storage->buf + offset);
+  sqe->len = len;
+  sqe->off = offset;
+  // Queue files are at most QUEUE_SIZE_MAX plus the checkpoints, offsets fit in 32 bits:
+  sqe->user_data = ((uint64_t)len << 32) | offset;
+  prv_uring_queue_sqe(&storage->uring);
+  return true;
+}
+
+static bool prv_uring_open(sTicosdQueueStorage *storage) {
+  if (!prv_buffered_open(storage)) {
+    return false;
+  }
+  if (!prv_uring_setup(&storage->uring)) {
+    prv_buffered_free(storage);
+    return false;
+  }
+  return true;
+}
+
+static bool prv_uring_write_back(sTicosdQueueStorage *storage, size_t start, size_t end) {
+  sQueueUring *uring = &storage->uring;
+  bool success = prv_for_each_dirty_run(storage, start, end, prv_uring_write_run);
+  // Submit without waiting, the buffer stays valid until the requests complete:
+  success &= prv_uring_submit_and_wait(storage, UINT32_MAX);
+  success &= !uring->failed;
+  uring->failed = false;
+  return success;
+}
+
+static bool prv_uring_sync(sTicosdQueueStorage *storage, size_t start, size_t end) {
+  sQueueUring *uring = &storage->uring;
+  bool success = prv_for_each_dirty_run(storage, start, end, prv_uring_write_run);
+
+  struct io_uring_sqe *sqe = prv_uring_get_sqe(storage);
+  if (sqe) {
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fd = storage->fd;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    // Only starts once all the writes submitted before it, including earlier write backs, are done:
+    sqe->flags = IOSQE_IO_DRAIN;
+    sqe->user_data = URING_FSYNC_USER_DATA;
+    prv_uring_queue_sqe(uring);
+  } else {
+    success = false;
+  }
+
+  success &= prv_uring_submit_and_wait(storage, 0);
+  success &= !uring->failed;
+  uring->failed = false;
+  return success;
+}
+
+static void prv_uring_close(sTicosdQueueStorage *storage) {
+  sQueueUring *uring = &storage->uring;
+  prv_uring_submit_and_wait(storage, 0);
+  munmap(uring->sqes, uring->sqes_size);
+  if (uring->cq_ring != uring->sq_ring) {
+    munmap(uring->cq_ring, uring->cq_ring_size);
+  }
+  munmap(uring->sq_ring, uring->sq_ring_size);
+  close(uring->fd);
+  prv_buffered_close(storage);
+}
+
+static const sTicosdQueueStorageOps s_backend_ops[] = {
+  [kTicosdQueueBackend_Mmap] =
+    {
+      .open = prv_mmap_open,
+      .sync = prv_mmap_sync,
+      .close = prv_mmap_close,
+    },
+  [kTicosdQueueBackend_Pwrite] =
+    {
+      .open = prv_buffered_open,
+      .write_back = prv_pwrite_write_back,
+      .sync = prv_pwrite_sync,
+      .close = prv_buffered_close,
+    },
+  [kTicosdQueueBackend_IoUring] =
+    {
+      .open = prv_uring_open,
+      .write_back = prv_uring_write_back,
+      .sync = prv_uring_sync,
+      .close = prv_uring_close,
+    },
+};
+
+/**
+ * @brief Loads a queue file into memory with the given backend
+ *
+ * Falls back to the pwrite backend if io_uring is not available, e.g. blocked by a seccomp filter
+ * or by the kernel.io_uring_disabled sysctl.
+ *
+ * @param backend Backend to use
+ * @param fd Queue file, of at least size bytes. Owned by the storage if opened successfully.
+ * @param size Size of the queue file in bytes
+ * @return Storage handle, NULL on error
+ */
+sTicosdQueueStorage *ticosd_queue_storage_open(eTicosdQueueBackend backend, int fd, size_t size) {
+  sTicosdQueueStorage *storage = calloc(sizeof(sTicosdQueueStorage), 1);
+  if (!storage) {
+    fprintf(stderr, "queue_storage:: Failed to allocate storage handle\n");
+    return NULL;
+  }
+  storage->fd = fd;
+  storage->size = size;
+
+  if (!s_backend_ops[backend].open(storage)) {
+    if (backend != kTicosdQueueBackend_IoUring ||
+        !s_backend_ops[kTicosdQueueBackend_Pwrite].open(storage)) {
+      free(storage);
+      return NULL;
+    }
+    fprintf(stderr, "queue_storage:: Falling back to the pwrite backend.\n");
+    backend = kTicosdQueueBackend_Pwrite;
+  }
+
+  storage->backend = backend;
+  storage->ops = &s_backend_ops[backend];
+  return storage;
+}
+
+/**
+ * @brief Closes the queue file, without writing back pending changes
+ *
+ * @param storage Storage handle
+ */
+void ticosd_queue_storage_close(sTicosdQueueStorage *storage) {
+  if (!storage) {
+    return;
+  }
+  storage->ops->close(storage);
+  free(storage);
+}
+
+eTicosdQueueBackend ticosd_queue_storage_get_backend(sTicosdQueueStorage *storage) {
+  return storage->backend;
+}
+
+const char *ticosd_queue_backend_name(eTicosdQueueBackend backend) {
+  return s_backend_names[backend];
+}
+
+/**
+ * @brief Returns the in-memory image of the queue file
+ *
+ * @param storage Storage handle
+ * @return Page-aligned buffer of the size of the file
+ */
+void *ticosd_queue_storage_get_buf(sTicosdQueueStorage *storage) { return storage->buf; }
+
+/**
+ * @brief Returns whether changes must be written back to reach the file
+ *
+ * Changes made through the mmap backend reach the file through the kernel's writeback. With the
+ * other backends, changes that do not need to be durable yet must still be written back from
+ * time to time with ticosd_queue_storage_write_back(), or they are lost if ticosd crashes.
+ *
+ * @param storage Storage handle
+ * @return true if ticosd_queue_storage_write_back() must be called
+ */
+bool ticosd_queue_storage_needs_write_back(sTicosdQueueStorage *storage) {
+  return storage->ops->write_back != NULL;
+}
+
+/**
+ * @brief Records a change to the in-memory image, to be written by the next write back or sync
+ *
+ * Can be called concurrently with ticosd_queue_storage_write_back() and
+ * ticosd_queue_storage_sync().
+ *
+ * @param storage Storage handle
+ * @param start Start of the change in bytes
+ * @param len Length of the change in bytes
+ */
+void ticosd_queue_storage_mark_dirty(sTicosdQueueStorage *storage, size_t start, size_t len) {
+  if (!storage->dirty || len == 0) {
+    return;
+  }
+  prv_mark_blocks_dirty(storage, start / storage->block_size,
+                        (start + len + storage->block_size - 1) / storage->block_size);
+}
+
+/**
+ * @brief Writes the changes of a range to the file, without waiting for them to be durable
+ *
+ * Must not be called concurrently with itself or ticosd_queue_storage_sync().
+ *
+ * @param storage Storage handle
+ * @param start Start of the range in bytes
+ * @param end End of the range in bytes
+ * @return true if the changes were written, false on error
+ */
+bool ticosd_queue_storage_write_back(sTicosdQueueStorage *storage, size_t start, size_t end) {
+  return storage->ops->write_back ? storage->ops->write_back(storage, start, end) : true;
+}
+
+/**
+ * @brief Makes the changes of a range durable, along with all changes written back before
+ *
+ * Must not be called concurrently with itself or ticosd_queue_storage_write_back().
+ *
+ * @param storage Storage handle
+ * @param start Start of the range in bytes
+ * @param end End of the range in bytes
+ * @return true if the changes are durable, false on error
+ */
+bool ticosd_queue_storage_sync(sTicosdQueueStorage *storage, size_t start, size_t end) {
+  return storage->ops->sync(storage, start, end);
+}
@@ -0,0 +1,37 @@
+//! @file
+//!
+//! Copyright (c) Ticos, Inc.
+//! See License.txt for details
+//!
+//! @brief
+//! Persistence of a queue buffer to its backing file, with interchangeable backends
+//!
+
+#ifndef __TICOS_QUEUE_STORAGE_H
+#define __TICOS_QUEUE_STORAGE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "queue.h"
+
+typedef struct TicosdQueueStorage sTicosdQueueStorage;
+
+sTicosdQueueStorage *ticosd_queue_storage_open(eTicosdQueueBackend backend, int fd, size_t size);
+void ticosd_queue_storage_close(sTicosdQueueStorage *storage);
+eTicosdQueueBackend ticosd_queue_storage_get_backend(sTicosdQueueStorage *storage);
+const char *ticosd_queue_backend_name(eTicosdQueueBackend backend);
+void *ticosd_queue_storage_get_buf(sTicosdQueueStorage *storage);
+bool ticosd_queue_storage_needs_write_back(sTicosdQueueStorage *storage);
+void ticosd_queue_storage_mark_dirty(sTicosdQueueStorage *storage, size_t start, size_t len);
+bool ticosd_queue_storage_write_back(sTicosdQueueStorage *storage, size_t start, size_t end);
+bool ticosd_queue_storage_sync(sTicosdQueueStorage *storage, size_t start, size_t end);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
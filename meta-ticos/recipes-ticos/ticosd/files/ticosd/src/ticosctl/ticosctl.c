@@ -215,6 +215,34 @@ cleanup:
   return success ? 0 : -1;
 }
 
+static int prv_cmd_stats(sTicosCtl *h) {
+  // Enough for the timing histograms of every network endpoint, as large as their counts get:
+  char reply[32768];
+  if (!ticosd_ipc_request((const uint8_t *)TICOSD_IPC_STATS_NAME, sizeof(TICOSD_IPC_STATS_NAME),
+                          reply, sizeof(reply))) {
+    return -1;
+  }
+
+  json_object *json = json_tokener_parse(reply);
+  if (!json) {
+    fprintf(stderr, "Unable to parse statistics from ticosd.\n");
+    return -1;
+  }
+  printf("%s\n", json_object_to_json_string_ext(json, JSON_C_TO_STRING_PRETTY));
+  json_object_put(json);
+  return 0;
+}
+
+static int prv_cmd_retry_dead_letter(sTicosCtl *h) {
+  char reply[sizeof("4294967295")];
+  if (!ticosd_ipc_request((const uint8_t *)TICOSD_IPC_RETRY_DEAD_LETTER_NAME,
+                          sizeof(TICOSD_IPC_RETRY_DEAD_LETTER_NAME), reply, sizeof(reply))) {
+    return -1;
+  }
+  printf("%s dead-letter entries queued again.\n", reply);
+  return 0;
+}
+
 typedef struct TicosCmd {
   const char *name;
   int (*cmd)(sTicosCtl *);
@@ -243,7 +271,11 @@ static const sTicosCmd cmds[] = {
   {.name = "request-metrics",
    .cmd = prv_cmd_request_metrics,
    .help = "Flush collectd metrics to Ticos now"},
+  {.name = "retry-dead-letter",
+   .cmd = prv_cmd_retry_dead_letter,
+   .help = "Queue the entries ticosd gave up on again"},
   {.name = "show-settings", .cmd = prv_cmd_show_settings, .help = "Show ticosd settings"},
+  {.name = "stats", .cmd = prv_cmd_stats, .help = "Show ticosd queue and network statistics"},
   {.name = "sync", .cmd = prv_cmd_sync, .help = "Flush ticosd queue to Ticos now"},
   {.name = "trigger-coredump",
    .cmd = prv_cmd_trigger_coredump,
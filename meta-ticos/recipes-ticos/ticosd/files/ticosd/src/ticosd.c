@@ -12,15 +12,18 @@
 #include <fcntl.h>
 #include <getopt.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/param.h>
+#include <sys/epoll.h>
 #include <sys/prctl.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
-#include <sys/time.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/un.h>
 #include <time.h>
@@ -38,14 +41,30 @@
 #include "ticos/util/string.h"
 #include "ticos/util/systemd.h"
 #include "ticos/util/version.h"
+#include "nettiming.h"
 #include "network.h"
 #include "queue.h"
+#include "txbatch.h"
+#include "txqueue.h"
+#include "txretry.h"
+#include "txstats.h"
+#include "txtrigger.h"
 
 #define RX_BUFFER_SIZE 1024
 #define PID_FILE "/var/run/ticosd.pid"
 
 struct Ticosd {
-  sTicosdQueue *queue;
+  sTicosdTxQueue *txqueue;
+  sTicosdTxStats *txstats;
+  sTicosdTxTrigger *txtrigger;
+  sTicosdTxRetry *txretry;
+  //! Failed attempts after which a TX queue entry is given up on, 0 for never.
+  uint32_t tx_max_attempts;
+  //! Connections made by the network object as of the end of the last transmission.
+  uint64_t tx_connect_count;
+  //! Limits of the entries combined into a single request, from "tx_batching".
+  uint32_t tx_batch_max_count;
+  uint32_t tx_batch_max_bytes;
   sTicosdNetwork *network;
   sTicosdConfig *config;
   sTicosdDeviceSettings *settings;
@@ -59,7 +78,20 @@ struct Ticosd {
 static sTicosd *s_handle;
 
 #define NETWORK_FAILURE_FIRST_BACKOFF_SECONDS 60
-#define NETWORK_FAILURE_BACKOFF_MULTIPLIER 2
+
+//! Default number of consecutive failures from which an endpoint is not tried until a cooldown
+#define TX_RETRY_BREAKER_THRESHOLD_DEFAULT 5
+//! Default number of failed attempts after which a TX queue entry is given up on
+#define TX_RETRY_MAX_ATTEMPTS_DEFAULT 24
+
+//! Maximum number of TX queue entries sent before their read flags are flushed
+#define TX_QUEUE_BATCH_SIZE 16
+
+//! Default maximum size of the body of a request combining several TX queue entries
+#define TX_BATCH_MAX_BYTES_DEFAULT (64 * 1024)
+
+//! Default time queued entries are held back for more entries to send along with them
+#define TX_COALESCING_DELAY_MS_DEFAULT 5000
 
 /**
  * @brief Displays usage information
@@ -81,112 +113,454 @@ static void prv_ticosd_usage(void) {
 }
 
 /**
- * @brief Signal handler
+ * @brief Fills in the signals handled by the main loop: SIGUSR1 to service the TX queue, the
+ * others to shut down
  *
- * @param sig Signal number
+ * @param mask Signal set
  */
-static void prv_ticosd_sig_handler(int sig) {
-  if (sig == SIGUSR1) {
-    // Used to service the TX queue
-    // The signal has already woken up the main thread from its sleep(), can simply exit here
-    return;
+static void prv_ticosd_signal_mask(sigset_t *mask) {
+  sigemptyset(mask);
+  sigaddset(mask, SIGTERM);
+  sigaddset(mask, SIGHUP);
+  sigaddset(mask, SIGINT);
+  sigaddset(mask, SIGUSR1);
+}
+
+/**
+ * @brief Handles the signals received by the main loop
+ *
+ * @param handle Main ticosd handle
+ * @param signal_fd signalfd of the signals
+ * @return true if the TX queue must be serviced right away
+ */
+static bool prv_ticosd_process_signals(sTicosd *handle, int signal_fd) {
+  bool sync_requested = false;
+  struct signalfd_siginfo info;
+  while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+    if (info.ssi_signo == SIGUSR1) {
+      sync_requested = true;
+      continue;
+    }
+
+    fprintf(stderr, "ticosd:: Received signal %u, shutting down.\n", info.ssi_signo);
+    handle->terminate = true;
+
+    // shutdown() the read-side of the socket to abort any in-progress recv() calls
+    shutdown(handle->ipc_socket_fd, SHUT_RD);
+  }
+  return sync_requested;
+}
+
+/**
+ * @brief Builds the request sending TX queue entries that are not file uploads
+ *
+ * @param handle Main ticosd handle
+ * @param entries Entries to send in a single request, as counted by ticosd_txbatch_count()
+ * @param count Number of entries
+ * @param[out] request Request to send
+ * @param[out] endpoint Endpoint of the request, to be freed by the caller if the request was built
+ * @param[out] body Body combining the entries if there are several, to be freed by the caller if
+ * the request was built
+ * @return kTicosdNetworkResult_OK if the request was built, the error to handle the entries with
+ * otherwise
+ */
+static eTicosdNetworkResult prv_ticosd_build_request(sTicosd *handle,
+                                                    const sTicosdQueueEntry *entries,
+                                                    uint32_t count, sTicosdNetworkRequest *request,
+                                                    char **endpoint, char **body) {
+  const sTicosdTxData *txdata = (const sTicosdTxData *)entries[0].payload;
+  eTicosdHttpMethod method;
+  const char *payload;
+  switch (txdata->type) {
+    case kTicosdTxDataType_RebootEvent:
+      if (ticos_asprintf(endpoint, "/chunks/%s/json", handle->settings->device_id) == -1) {
+        fprintf(stderr, "ticosd:: Unable to allocate memory for event path.\n");
+        return kTicosdNetworkResult_ErrorRetryLater;
+      }
+      method = kTicosdHttpMethod_POST;
+      payload = (const char *)txdata->payload;
+      break;
+    case kTicosdTxDataType_Attributes: {
+      const sTicosdTxDataAttributes *data_attributes = (const sTicosdTxDataAttributes *)txdata;
+
+      time_t timestamp;
+      memcpy(&timestamp, &data_attributes->timestamp, sizeof(time_t));
+      char iso_timestamp[sizeof("2022-11-30T11:24:00Z")];
+      strftime(iso_timestamp, sizeof(iso_timestamp), "%FT%TZ", gmtime(&timestamp));
+
+      if (ticos_asprintf(endpoint, "/api/v0/attributes?device_serial=%s&captured_date=%s",
+                         handle->settings->device_id, iso_timestamp) == -1) {
+        fprintf(stderr, "ticosd:: Unable to allocate memory for attribute endpoint.\n");
+        return kTicosdNetworkResult_ErrorRetryLater;
+      }
+      method = kTicosdHttpMethod_PATCH;
+      payload = data_attributes->json;
+      break;
+    }
+    default:
+      fprintf(stderr, "ticosd:: Unrecognised queue type '%d'\n", txdata->type);
+      return kTicosdNetworkResult_ErrorNoRetry;
+  }
+
+  *body = NULL;
+  if (count > 1 && !(payload = *body = ticosd_txbatch_join(entries, count))) {
+    free(*endpoint);
+    return kTicosdNetworkResult_ErrorRetryLater;
+  }
+  *request = (sTicosdNetworkRequest){
+    .endpoint = *endpoint,
+    .method = method,
+    .payload = payload,
+  };
+  return kTicosdNetworkResult_OK;
+}
+
+//! A batch of TX queue entries being sent.
+typedef struct TicosdTxBatch {
+  sTicosd *handle;
+  const sTicosdQueueEntry *entries;
+  //! Result of each entry, kTicosdNetworkResult_ErrorRetryLater until it is sent.
+  eTicosdNetworkResult results[TX_QUEUE_BATCH_SIZE];
+  //! Requests waiting to be sent concurrently. Each one sends request_counts[i] consecutive
+  //! entries, from index request_entries[i] on.
+  sTicosdNetworkRequest requests[TX_QUEUE_BATCH_SIZE];
+  char *endpoints[TX_QUEUE_BATCH_SIZE];
+  char *bodies[TX_QUEUE_BATCH_SIZE];
+  uint32_t request_entries[TX_QUEUE_BATCH_SIZE];
+  uint32_t request_counts[TX_QUEUE_BATCH_SIZE];
+  uint32_t request_count;
+  //! Index of the first entry of the coredump files being uploaded.
+  uint32_t upload_first;
+} sTicosdTxBatch;
+
+/**
+ * @brief Records the acknowledgement of an entry of a batch, in the order the responses arrive
+ *
+ * @param batch Batch
+ * @param index Index of the entry in the batch
+ * @param result Result of sending the entry
+ */
+static void prv_ticosd_tx_batch_acked(sTicosdTxBatch *batch, uint32_t index,
+                                      eTicosdNetworkResult result) {
+  batch->results[index] = result;
+  // Entries dropped with a non-retry-able error were not acknowledged, keep them out of the
+  // latencies. Spilled entries get the time they were moved back into the queue:
+  if (result == kTicosdNetworkResult_OK) {
+    const sTicosdQueueEntry *entry = &batch->entries[index];
+    ticosd_txstats_record_ack(batch->handle->txstats, entry->payload[0], entry->timestamp,
+                              time(NULL));
+  }
+}
+
+static void prv_ticosd_tx_request_complete(void *ctx, uint32_t index,
+                                           eTicosdNetworkResult result) {
+  sTicosdTxBatch *batch = ctx;
+  for (uint32_t i = 0; i < batch->request_counts[index]; ++i) {
+    prv_ticosd_tx_batch_acked(batch, batch->request_entries[index] + i, result);
+  }
+}
+
+/**
+ * @brief Adds a request sending consecutive entries of a batch to the requests waiting to be sent
+ *
+ * @param batch Batch
+ * @param first Index of the first entry to send
+ * @param count Number of entries to send in the request
+ * @return kTicosdNetworkResult_OK if the request was added, the result of the entries otherwise
+ */
+static eTicosdNetworkResult prv_ticosd_tx_batch_add(sTicosdTxBatch *batch, uint32_t first,
+                                                    uint32_t count) {
+  const uint32_t n = batch->request_count;
+  const eTicosdNetworkResult rc =
+    prv_ticosd_build_request(batch->handle, &batch->entries[first], count, &batch->requests[n],
+                             &batch->endpoints[n], &batch->bodies[n]);
+  if (rc != kTicosdNetworkResult_OK) {
+    for (uint32_t i = 0; i < count; ++i) {
+      batch->results[first + i] = rc;
+    }
+    return rc;
+  }
+  batch->request_entries[n] = first;
+  batch->request_counts[n] = count;
+  batch->request_count++;
+  return kTicosdNetworkResult_OK;
+}
+
+/**
+ * @brief Sends the requests of a batch waiting to be sent, concurrently
+ *
+ * @param batch Batch
+ * @return false if a request failed with a retry-able error
+ */
+static bool prv_ticosd_tx_batch_flush(sTicosdTxBatch *batch) {
+  if (batch->request_count == 0) {
+    return true;
+  }
+  eTicosdNetworkResult results[TX_QUEUE_BATCH_SIZE];
+  ticosd_network_post_batch(batch->handle->network, batch->requests, batch->request_count, results,
+                            prv_ticosd_tx_request_complete, batch);
+
+  bool ok = true;
+  uint32_t rejected_count = 0;
+  uint32_t rejected_entries[TX_QUEUE_BATCH_SIZE];
+  uint32_t rejected_counts[TX_QUEUE_BATCH_SIZE];
+  for (uint32_t i = 0; i < batch->request_count; ++i) {
+    ok &= results[i] != kTicosdNetworkResult_ErrorRetryLater;
+    // A client error on a combined request may come from a single one of its entries: they are
+    // sent again one by one, so that only the faulty ones are dropped:
+    if (results[i] == kTicosdNetworkResult_ErrorNoRetry && batch->request_counts[i] > 1) {
+      rejected_entries[rejected_count] = batch->request_entries[i];
+      rejected_counts[rejected_count++] = batch->request_counts[i];
+      for (uint32_t j = 0; j < batch->request_counts[i]; ++j) {
+        batch->results[batch->request_entries[i] + j] = kTicosdNetworkResult_ErrorRetryLater;
+      }
+    }
+    free(batch->endpoints[i]);
+    free(batch->bodies[i]);
+  }
+  batch->request_count = 0;
+  if (!ok || rejected_count == 0) {
+    return ok;
+  }
+
+  for (uint32_t i = 0; i < rejected_count; ++i) {
+    for (uint32_t j = 0; j < rejected_counts[i]; ++j) {
+      if (prv_ticosd_tx_batch_add(batch, rejected_entries[i] + j, 1) ==
+          kTicosdNetworkResult_ErrorRetryLater) {
+        prv_ticosd_tx_batch_flush(batch);
+        return false;
+      }
+    }
+  }
+  return prv_ticosd_tx_batch_flush(batch);
+}
+
+static bool prv_ticosd_is_core_upload(const sTicosdQueueEntry *entry) {
+  const sTicosdTxData *txdata = (const sTicosdTxData *)entry->payload;
+  return txdata->type == kTicosdTxDataType_CoreUpload ||
+         txdata->type == kTicosdTxDataType_CoreUploadWithGzip;
+}
+
+static void prv_ticosd_tx_upload_complete(void *ctx, uint32_t index,
+                                          eTicosdNetworkResult result) {
+  sTicosdTxBatch *batch = ctx;
+  prv_ticosd_tx_batch_acked(batch, batch->upload_first + index, result);
+}
+
+/**
+ * @brief Uploads the coredump files of consecutive TX queue entries of a batch
+ *
+ * @param batch Batch
+ * @param first Index of the first entry, of type kTicosdTxDataType_CoreUpload(WithGzip)
+ * @param count Number of entries
+ * @return false if an upload failed with a retry-able error
+ */
+static bool prv_ticosd_tx_batch_upload_cores(sTicosdTxBatch *batch, uint32_t first,
+                                             uint32_t count) {
+  sTicosd *handle = batch->handle;
+  char *path;
+  if (ticos_asprintf(&path, "/chunks/%s/url", handle->settings->device_id) == -1) {
+    fprintf(stderr, "ticosd:: Unable to allocate memory for upload coredump path.\n");
+    return false;
+  }
+
+  sTicosdNetworkFile files[TX_QUEUE_BATCH_SIZE];
+  for (uint32_t i = 0; i < count; ++i) {
+    const sTicosdTxData *txdata = (const sTicosdTxData *)batch->entries[first + i].payload;
+    files[i].filename = (const char *)txdata->payload;
+    files[i].is_gzipped = txdata->type == kTicosdTxDataType_CoreUploadWithGzip;
+  }
+  eTicosdNetworkResult results[TX_QUEUE_BATCH_SIZE];
+  batch->upload_first = first;
+  ticosd_network_file_upload_batch(handle->network, path, files, count, results,
+                                   prv_ticosd_tx_upload_complete, batch);
+  free(path);
+
+  for (uint32_t i = 0; i < count; ++i) {
+    if (results[i] == kTicosdNetworkResult_ErrorRetryLater) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Sends a batch of TX queue entries
+ *
+ * Consecutive events, or attributes captured at the same time, are combined into single requests,
+ * within the "tx_batching" limits, and these requests are sent concurrently. Consecutive file
+ * uploads are pipelined, see ticosd_network_file_upload_batch(). Nothing more is sent once an
+ * entry fails with a retry-able error.
+ *
+ * @param batch Batch, with the results of the entries set on return
+ * @param count Number of entries in the batch
+ */
+static void prv_ticosd_tx_batch_send(sTicosdTxBatch *batch, uint32_t count) {
+  for (uint32_t i = 0; i < count; ++i) {
+    batch->results[i] = kTicosdNetworkResult_ErrorRetryLater;
   }
 
-  fprintf(stderr, "ticosd:: Received signal %u, shutting down.\n", sig);
-  s_handle->terminate = true;
+  sTicosd *handle = batch->handle;
+  uint32_t i = 0;
+  while (i < count) {
+    if (prv_ticosd_is_core_upload(&batch->entries[i])) {
+      if (!prv_ticosd_tx_batch_flush(batch)) {
+        return;
+      }
+      uint32_t n = 1;
+      while (i + n < count && prv_ticosd_is_core_upload(&batch->entries[i + n])) {
+        n++;
+      }
+      if (!prv_ticosd_tx_batch_upload_cores(batch, i, n)) {
+        return;
+      }
+      i += n;
+      continue;
+    }
 
-  // shutdown() the read-side of the socket to abort any in-progress recv() calls
-  shutdown(s_handle->ipc_socket_fd, SHUT_RD);
+    const uint32_t n = ticosd_txbatch_count(&batch->entries[i], count - i,
+                                            handle->tx_batch_max_count, handle->tx_batch_max_bytes);
+    if (prv_ticosd_tx_batch_add(batch, i, n) == kTicosdNetworkResult_ErrorRetryLater) {
+      break;
+    }
+    i += n;
+  }
+  prv_ticosd_tx_batch_flush(batch);
 }
 
 /**
  * @brief Process TX queue and transmit messages
  *
+ * The lanes of the queue are sent to different endpoints. A lane that fails with a retry-able
+ * error is paused until its endpoint's backoff elapses, and the other lanes keep being sent. The
+ * entry at the head of the failed lane is moved to the dead-letter queue once it has failed too
+ * many times. Only the failures the server answered with an error other than throttling, while
+ * it accepted other entries in the same pass, count: an outage or a rate limit is not the fault of
+ * the entry.
+ *
  * @param handle Main ticosd handle
- * @return true Successfully processed the queue, sending all valid entries
- * @return false Failed to process
+ * @param force Send the lanes that are backing off too
+ * @return Time of the next retry of a lane that failed, as ticosd_txtrigger_now_ms(), 0 if none
  */
-static bool prv_ticosd_process_tx_queue(sTicosd *handle) {
+static uint64_t prv_ticosd_process_tx_queue(sTicosd *handle, bool force) {
   bool allowed;
   if (!ticosd_get_boolean(handle, NULL, "enable_data_collection", &allowed) || !allowed) {
-    return true;
+    return 0;
+  }
+
+  sTicosdNetworkStats stats_before;
+  ticosd_network_get_stats(handle->network, &stats_before);
+
+  const uint64_t now_ms = ticosd_txtrigger_now_ms();
+  for (int lane = 0; lane < kTicosdTxQueueLane_NumLanes; ++lane) {
+    ticosd_txqueue_set_lane_paused(handle->txqueue, lane,
+                                   !force && !ticosd_txretry_is_eligible(handle->txretry, lane,
+                                                                         now_ms));
   }
 
   uint32_t count = 0;
-  uint32_t queue_entry_size_bytes;
-  uint8_t *queue_entry;
-  while ((queue_entry = ticosd_queue_read_head(handle->queue, &queue_entry_size_bytes))) {
-    const sTicosdTxData *txdata = (const sTicosdTxData *)queue_entry;
-
-    const char *payload = (const char *)txdata->payload;
-    char *path;
-
-    eTicosdNetworkResult rc = kTicosdNetworkResult_ErrorNoRetry;
-    switch (txdata->type) {
-      case kTicosdTxDataType_RebootEvent:
-        if (ticos_asprintf(&path, "/chunks/%s/json",
-                      handle->settings->device_id) == -1) {
-          fprintf(stderr, "ticosd:: Unable to allocate memory for event path.\n");
-          rc = kTicosdNetworkResult_ErrorRetryLater;
-          break;
-        }
-        rc = ticosd_network_post(handle->network, path, kTicosdHttpMethod_POST,
-                                    payload, NULL, 0);
-        free(path);
-        break;
-      case kTicosdTxDataType_CoreUpload:
-      case kTicosdTxDataType_CoreUploadWithGzip: {
-        const bool is_gzipped = txdata->type == kTicosdTxDataType_CoreUploadWithGzip;
-        if (ticos_asprintf(&path, "/chunks/%s/url",
-                      handle->settings->device_id) == -1) {
-          fprintf(stderr, "ticosd:: Unable to allocate memory for upload coredump path.\n");
-          rc = kTicosdNetworkResult_ErrorRetryLater;
-          break;
-        }
-        rc = ticosd_network_file_upload(handle->network, path, payload,
-                                          is_gzipped);
-        break;
-      }
-      case kTicosdTxDataType_Attributes: {
-        char *endpoint;
-        sTicosdTxDataAttributes *data_attributes = (sTicosdTxDataAttributes *)txdata;
-
-        time_t timestamp;
-        memcpy(&timestamp, &data_attributes->timestamp, sizeof(time_t));
-        char iso_timestamp[sizeof("2022-11-30T11:24:00Z")];
-        strftime(iso_timestamp, sizeof(iso_timestamp), "%FT%TZ", gmtime(&timestamp));
-
-        if (ticos_asprintf(&endpoint, "/api/v0/attributes?device_serial=%s&captured_date=%s",
-                              handle->settings->device_id, iso_timestamp) == -1) {
-          fprintf(stderr, "ticosd:: Unable to allocate memory for attribute endpoint.\n");
-          rc = kTicosdNetworkResult_ErrorRetryLater;
-          break;
-        }
-        rc = ticosd_network_post(handle->network, endpoint, kTicosdHttpMethod_PATCH,
-                                    data_attributes->json, NULL, 0);
-        free(endpoint);
-        break;
-      }
-      default:
-        fprintf(stderr, "ticosd:: Unrecognised queue type '%d'\n", txdata->type);
-        break;
+  // Whether the server accepted any entry, and the lanes it failed with a server error:
+  bool accepted = false;
+  bool server_failed[kTicosdTxQueueLane_NumLanes] = {false};
+  sTicosdQueueEntry entries[TX_QUEUE_BATCH_SIZE];
+  sTicosdTxBatch batch = {.handle = handle, .entries = entries};
+  uint32_t batch_count;
+  // The entries are sent straight from the queue buffer, the queue keeps them from being
+  // overwritten until they are completed or released. All entries of a batch come from the same
+  // lane, and are acknowledged in whatever order their responses arrive, but only the leading
+  // entries that were all sent are completed, so that the read pointer advances in order:
+  while ((batch_count =
+            ticosd_txqueue_peek_batch(handle->txqueue, entries, TX_QUEUE_BATCH_SIZE, UINT32_MAX))) {
+    const eTicosdTxQueueLane lane = ticosd_txqueue_get_peeked_lane(handle->txqueue);
+    sTicosdNetworkStats batch_before;
+    ticosd_network_get_stats(handle->network, &batch_before);
+    prv_ticosd_tx_batch_send(&batch, batch_count);
+    const uint32_t retry_after_s = ticosd_network_take_retry_after(handle->network);
+
+    uint32_t sent = 0;
+    while (sent < batch_count && batch.results[sent] != kTicosdNetworkResult_ErrorRetryLater) {
+      sent++;
+    }
+    count += sent;
+    accepted |= sent > 0;
+    if (sent == batch_count) {
+      ticosd_txqueue_complete_batch(handle->txqueue, batch_count);
+      ticosd_txretry_record_success(handle->txretry, lane);
+      continue;
     }
 
-    free(queue_entry);
-    if (rc == kTicosdNetworkResult_OK || rc == kTicosdNetworkResult_ErrorNoRetry) {
-      ticosd_queue_complete_read(handle->queue);
+    // Retry-able error, complete the entries sent so far. Those sent after the failed one are
+    // acknowledged, to be dropped once they get to the head of the lane rather than sent again:
+    for (uint32_t i = sent + 1; i < batch_count; ++i) {
+      if (batch.results[i] != kTicosdNetworkResult_ErrorRetryLater) {
+        ticosd_txqueue_ack_entry(handle->txqueue, i);
+        accepted = true;
+      }
+    }
+    if (sent > 0) {
+      ticosd_txqueue_complete_batch(handle->txqueue, sent);
+      ticosd_txretry_record_success(handle->txretry, lane);
     } else {
-      fprintf(stderr, "ticosd:: Network error while processing queue. Will retry...\n");
-      // Retry-able error
-      return false;
+      ticosd_txqueue_release_head(handle->txqueue);
+    }
+    // The failures of the batch were all server errors, rather than network errors or throttling:
+    sTicosdNetworkStats batch_after;
+    ticosd_network_get_stats(handle->network, &batch_after);
+    const uint64_t server_errors = batch_after.server_error_count - batch_before.server_error_count;
+    server_failed[lane] =
+      server_errors > 0 &&
+      server_errors == batch_after.retry_error_count - batch_before.retry_error_count;
+
+    const bool was_open = ticosd_txretry_is_open(handle->txretry, lane);
+    const uint64_t retry_ms =
+      ticosd_txretry_record_failure(handle->txretry, lane, now_ms, retry_after_s * 1000);
+    ticosd_txqueue_set_lane_paused(handle->txqueue, lane, true);
+
+    const char *name = ticosd_txqueue_lane_name(lane);
+    if (!was_open && ticosd_txretry_is_open(handle->txretry, lane)) {
+      fprintf(stderr, "ticosd:: Too many network errors sending %s entries, pausing them.\n",
+              name);
+    }
+    fprintf(stderr, "ticosd:: Network error while sending %s entries. Will retry in %llus...\n",
+            name, (unsigned long long)(retry_ms - now_ms) / 1000);
+  }
+
+  // The server accepted other entries, so an entry it keeps failing on is likely at fault:
+  for (int lane = 0; lane < kTicosdTxQueueLane_NumLanes && accepted; ++lane) {
+    if (!server_failed[lane]) {
+      continue;
+    }
+    const uint32_t attempts = ticosd_txqueue_fail_head(handle->txqueue, lane);
+    if (handle->tx_max_attempts > 0 && attempts >= handle->tx_max_attempts &&
+        ticosd_txqueue_dead_letter_head(handle->txqueue, lane)) {
+      fprintf(stderr, "ticosd:: Gave up on %s entry after %u attempts.\n",
+              ticosd_txqueue_lane_name(lane), attempts);
     }
-    count++;
   }
 
+  // The connections counted include those of the warm-ups since the last time, made for these
+  // messages too:
+  sTicosdNetworkStats stats;
+  ticosd_network_get_stats(handle->network, &stats);
   if (ticosd_is_dev_mode(handle)) {
-    fprintf(stderr, "ticosd:: Transmitted %i messages to ticos.\n", count);
+    fprintf(stderr,
+            "ticosd:: Transmitted %i messages to ticos (%llu requests, %llu connections, %llu of "
+            "%llu payload bytes).\n",
+            count, (unsigned long long)(stats.request_count - stats_before.request_count),
+            (unsigned long long)(stats.connect_count - handle->tx_connect_count),
+            (unsigned long long)(stats.body_bytes - stats_before.body_bytes),
+            (unsigned long long)(stats.payload_bytes - stats_before.payload_bytes));
   }
-  return true;
+  handle->tx_connect_count = stats.connect_count;
+
+  uint64_t next_retry_ms = 0;
+  for (int lane = 0; lane < kTicosdTxQueueLane_NumLanes; ++lane) {
+    const uint64_t retry_ms = ticosd_txretry_get_next_attempt(handle->txretry, lane);
+    if (retry_ms > now_ms && (next_retry_ms == 0 || retry_ms < next_retry_ms)) {
+      next_retry_ms = retry_ms;
+    }
+  }
+  return next_retry_ms;
 }
 
 /**
@@ -230,42 +604,187 @@ static bool prv_ticosd_daemonize_process(void) {
   return true;
 }
 
+/**
+ * @brief Queues attributes of ticosd itself
+ *
+ * @param handle Main ticosd handle
+ * @param json Attributes JSON array, freed by this function, nothing is queued if NULL
+ * @param now Time the attributes were captured
+ */
+static void prv_ticosd_queue_attributes(sTicosd *handle, char *json, time_t now) {
+  if (!json) {
+    return;
+  }
+
+  const uint32_t payload_size = sizeof(time_t) + strlen(json) + 1;
+  sTicosdTxDataAttributes *data = malloc(sizeof(sTicosdTxDataAttributes) + payload_size);
+  if (!data) {
+    fprintf(stderr, "ticosd:: Failed to allocate telemetry entry\n");
+    goto cleanup;
+  }
+  data->type = kTicosdTxDataType_Attributes;
+  data->timestamp = now;
+  strcpy(data->json, json);
+
+  if (!ticosd_txdata(handle, (const sTicosdTxData *)data, payload_size)) {
+    fprintf(stderr, "ticosd:: Failed to queue telemetry\n");
+  }
+
+cleanup:
+  free(data);
+  free(json);
+}
+
+/**
+ * @brief Queues the statistics of the TX queue as attributes, for the queue to monitor itself, and
+ * those of the network requests if "network"/"enable_timing_telemetry" is set
+ *
+ * @param handle Main ticosd handle
+ */
+static void prv_ticosd_queue_telemetry(sTicosd *handle) {
+  const time_t now = time(NULL);
+
+  bool enabled = false;
+  ticosd_get_boolean(handle, NULL, "enable_queue_telemetry", &enabled);
+  if (enabled) {
+    prv_ticosd_queue_attributes(
+      handle, ticosd_txstats_to_attributes_json(handle->txstats, handle->txqueue, now), now);
+  }
+
+  enabled = false;
+  ticosd_get_boolean(handle, "network", "enable_timing_telemetry", &enabled);
+  if (enabled) {
+    char *json = ticosd_nettiming_to_attributes_json(ticosd_network_get_timing(handle->network));
+    // Nothing to report before the first request:
+    if (json && strcmp(json, "[]") == 0) {
+      free(json);
+      json = NULL;
+    }
+    prv_ticosd_queue_attributes(handle, json, now);
+  }
+}
+
+/**
+ * @brief Arms the timer of the main loop
+ *
+ * @param timer_fd timerfd on CLOCK_MONOTONIC
+ * @param wakeup_ms Time to expire at, as ticosd_txtrigger_now_ms()
+ */
+static void prv_ticosd_arm_timer(int timer_fd, uint64_t wakeup_ms) {
+  // A zero it_value would disarm the timer instead:
+  wakeup_ms = MAX(wakeup_ms, 1);
+  const struct itimerspec spec = {
+    .it_value = {.tv_sec = wakeup_ms / 1000, .tv_nsec = (wakeup_ms % 1000) * 1000000},
+  };
+  if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) == -1) {
+    fprintf(stderr, "ticosd:: Failed to arm timer : %s\n", strerror(errno));
+  }
+}
+
 /**
  * @brief Main process loop
  *
+ * Waits on signals, on entries being queued and on a timer for the next refresh, the end of the
+ * coalescing window of the queued entries or the next retry after a network failure, whichever
+ * comes first. New entries are not sent before the retry.
+ *
  * @param handle Main ticosd handle
  */
 static void prv_ticosd_process_loop(sTicosd *handle) {
-  time_t next_telemetry_poll = 0;
-  int override_interval = NETWORK_FAILURE_FIRST_BACKOFF_SECONDS;
+  int epoll_fd = -1;
+  int signal_fd = -1;
+  int timer_fd = -1;
+
+  sigset_t mask;
+  prv_ticosd_signal_mask(&mask);
+  if ((signal_fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK)) == -1 ||
+      (timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK)) == -1 ||
+      (epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+    fprintf(stderr, "ticosd:: Failed to create main loop : %s\n", strerror(errno));
+    goto cleanup;
+  }
+  const int fds[] = {signal_fd, timer_fd, ticosd_txtrigger_get_fd(handle->txtrigger)};
+  for (unsigned int i = 0; i < sizeof(fds) / sizeof(fds[0]); ++i) {
+    struct epoll_event event = {.events = EPOLLIN, .data.fd = fds[i]};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fds[i], &event) == -1) {
+      fprintf(stderr, "ticosd:: Failed to create main loop : %s\n", strerror(errno));
+      goto cleanup;
+    }
+  }
+
+  uint64_t next_refresh_ms = 0;
+  // Time of the next retry of a lane after a network failure, 0 if none is backing off:
+  uint64_t retry_ms = 0;
+  bool sync_requested = false;
+  // Set once entries start being queued, to get a connection ready while they are held back:
+  bool warm_up = false;
   while (!handle->terminate) {
-    struct timeval last_wakeup;
-    gettimeofday(&last_wakeup, NULL);
+    const uint64_t now_ms = ticosd_txtrigger_now_ms();
 
     int interval = 1 * 60 * 60;
     ticosd_get_integer(handle, NULL, "refresh_interval_seconds", &interval);
 
-    if (next_telemetry_poll + interval >= last_wakeup.tv_sec) {
-      next_telemetry_poll = last_wakeup.tv_sec + interval;
-      // Unimplemented: Perform data collection calls
+    bool process = sync_requested;
+    if (now_ms >= next_refresh_ms) {
+      next_refresh_ms = now_ms + (uint64_t)interval * 1000;
+      prv_ticosd_queue_telemetry(handle);
+      process = true;
     }
-
-    if (prv_ticosd_process_tx_queue(handle)) {
-      // Reset override in preparation of next failure
-      override_interval = NETWORK_FAILURE_FIRST_BACKOFF_SECONDS;
-    } else {
-      // call failed, back off up to the entire update interval
-      interval = MIN(override_interval, interval);
-      override_interval *= NETWORK_FAILURE_BACKOFF_MULTIPLIER;
+    // Lanes backing off are skipped, entries queued in the other lanes are still sent on time:
+    process |= retry_ms != 0 && now_ms >= retry_ms;
+    process |= ticosd_txtrigger_is_due(handle->txtrigger, now_ms);
+
+    if (process) {
+      // Entries queued from now on open a new coalescing window:
+      ticosd_txtrigger_reset(handle->txtrigger);
+      // A sync request sends the lanes backing off too:
+      retry_ms = prv_ticosd_process_tx_queue(handle, sync_requested);
+      sync_requested = false;
+    } else if (warm_up) {
+      ticosd_network_warm_up(handle->network);
     }
+    warm_up = false;
 
-    struct timeval now;
-    gettimeofday(&now, NULL);
+    const uint64_t send_ms = MIN(retry_ms != 0 ? retry_ms : UINT64_MAX,
+                                 ticosd_txtrigger_get_deadline(handle->txtrigger));
+    prv_ticosd_arm_timer(timer_fd, MIN(next_refresh_ms, send_ms));
 
-    if (!handle->terminate && last_wakeup.tv_sec + interval > now.tv_sec) {
-      sleep(last_wakeup.tv_sec + interval - now.tv_sec);
+    struct epoll_event events[sizeof(fds) / sizeof(fds[0])];
+    const int count = epoll_wait(epoll_fd, events, sizeof(events) / sizeof(events[0]), -1);
+    if (count == -1 && errno != EINTR) {
+      fprintf(stderr, "ticosd:: Failed to wait for events : %s\n", strerror(errno));
+      break;
+    }
+    for (int i = 0; i < count; ++i) {
+      if (events[i].data.fd == signal_fd) {
+        sync_requested |= prv_ticosd_process_signals(handle, signal_fd);
+      } else if (events[i].data.fd == timer_fd) {
+        uint64_t expirations;
+        if (read(timer_fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN) {
+          fprintf(stderr, "ticosd:: Failed to read timer : %s\n", strerror(errno));
+        }
+      } else {
+        ticosd_txtrigger_clear_fd(handle->txtrigger);
+        warm_up = true;
+      }
     }
   }
+
+cleanup:
+  if (epoll_fd != -1) {
+    close(epoll_fd);
+  }
+  if (timer_fd != -1) {
+    close(timer_fd);
+  }
+  if (signal_fd != -1) {
+    close(signal_fd);
+  }
+  if (!handle->terminate) {
+    // Cannot run without a main loop, shut the IPC thread down too:
+    handle->terminate = true;
+    shutdown(handle->ipc_socket_fd, SHUT_RD);
+  }
 }
 
 static void ticosd_create_data_dir(sTicosd *handle) {
@@ -285,6 +804,371 @@ static void ticosd_create_data_dir(sTicosd *handle) {
   }
 }
 
+static bool prv_ticosd_parse_queue_durability(const char *str,
+                                               eTicosdQueueDurability *durability) {
+  if (strcmp(str, "strict") == 0) {
+    *durability = kTicosdQueueDurability_Strict;
+  } else if (strcmp(str, "group") == 0) {
+    *durability = kTicosdQueueDurability_Group;
+  } else if (strcmp(str, "async") == 0) {
+    *durability = kTicosdQueueDurability_Async;
+  } else {
+    fprintf(stderr, "ticosd:: Invalid queue durability '%s', must be strict, group or async.\n",
+            str);
+    return false;
+  }
+  return true;
+}
+
+//! Keys of the per-type settings of the queue configuration.
+static const struct {
+  eTicosdTxDataType type;
+  const char *key;
+} s_queue_type_keys[] = {
+  {kTicosdTxDataType_RebootEvent, "reboot_event"},
+  {kTicosdTxDataType_CoreUpload, "core_upload"},
+  {kTicosdTxDataType_CoreUploadWithGzip, "core_upload"},
+  {kTicosdTxDataType_Attributes, "attributes"},
+};
+
+/**
+ * @brief Applies the queue_durability configuration to the queues of all lanes
+ *
+ * @param handle Main ticosd handle
+ */
+static void prv_ticosd_configure_queue_durability(sTicosd *handle) {
+
+  int interval_ms = 0;
+  int size_kib = 0;
+  ticosd_get_integer(handle, "queue_durability", "group_commit_interval_ms", &interval_ms);
+  ticosd_get_integer(handle, "queue_durability", "group_commit_size_kib", &size_kib);
+
+  const char *mode;
+  eTicosdQueueDurability durability;
+  const bool has_mode = ticosd_get_string(handle, "queue_durability", "mode", &mode) &&
+                        prv_ticosd_parse_queue_durability(mode, &durability);
+  for (int lane = 0; lane < kTicosdTxQueueLane_NumLanes; ++lane) {
+    sTicosdQueue *queue = ticosd_txqueue_get_lane(handle->txqueue, lane);
+    ticosd_queue_set_group_commit(queue, interval_ms, size_kib * 1024);
+    if (has_mode) {
+      ticosd_queue_set_durability(queue, durability);
+    }
+  }
+
+  for (unsigned int i = 0; i < sizeof(s_queue_type_keys) / sizeof(s_queue_type_keys[0]); ++i) {
+    const uint8_t type = s_queue_type_keys[i].type;
+    if (ticosd_get_string(handle, "queue_durability", s_queue_type_keys[i].key, &mode) &&
+        prv_ticosd_parse_queue_durability(mode, &durability)) {
+      sTicosdQueue *queue =
+        ticosd_txqueue_get_lane(handle->txqueue, ticosd_txqueue_lane_for_type(type));
+      ticosd_queue_set_type_durability(queue, type, durability);
+    }
+  }
+}
+
+/**
+ * @brief Deletes the coredump referenced by an expired queue entry, which would never be uploaded
+ *
+ * @param ctx Main ticosd handle
+ * @param payload Expired entry
+ * @param payload_size_bytes Size of the entry in bytes
+ */
+static void prv_ticosd_queue_expired(void *ctx, const uint8_t *payload,
+                                     uint32_t payload_size_bytes) {
+  sTicosd *handle = ctx;
+  const sTicosdTxData *txdata = (const sTicosdTxData *)payload;
+  if ((txdata->type != kTicosdTxDataType_CoreUpload &&
+       txdata->type != kTicosdTxDataType_CoreUploadWithGzip) ||
+      payload_size_bytes < sizeof(sTicosdTxData) + 1 || payload[payload_size_bytes - 1] != '\0') {
+    return;
+  }
+
+  // Only ever delete files the coredump plugin wrote:
+  const char *filename = (const char *)txdata->payload;
+  char *core_dir = ticosd_generate_rw_filename(handle, "core");
+  const size_t core_dir_len = core_dir ? strlen(core_dir) : 0;
+  if (core_dir && strncmp(filename, core_dir, core_dir_len) == 0 &&
+      filename[core_dir_len] == '/' && !strstr(filename, "/../")) {
+    fprintf(stderr, "ticosd:: Deleting expired coredump '%s'.\n", filename);
+    if (unlink(filename) == -1 && errno != ENOENT) {
+      fprintf(stderr, "ticosd:: Failed to delete '%s' : %s\n", filename, strerror(errno));
+    }
+  }
+  free(core_dir);
+}
+
+/**
+ * @brief Applies the queue_ttl_seconds configuration to the queues of all lanes
+ *
+ * @param handle Main ticosd handle
+ */
+static void prv_ticosd_configure_queue_ttl(sTicosd *handle) {
+  for (unsigned int i = 0; i < sizeof(s_queue_type_keys) / sizeof(s_queue_type_keys[0]); ++i) {
+    const uint8_t type = s_queue_type_keys[i].type;
+    int ttl_seconds = 0;
+    if (ticosd_get_integer(handle, "queue_ttl_seconds", s_queue_type_keys[i].key, &ttl_seconds) &&
+        ttl_seconds > 0) {
+      sTicosdQueue *queue =
+        ticosd_txqueue_get_lane(handle->txqueue, ticosd_txqueue_lane_for_type(type));
+      ticosd_queue_set_type_ttl(queue, type, ttl_seconds);
+    }
+  }
+  for (int lane = 0; lane < kTicosdTxQueueLane_NumLanes; ++lane) {
+    ticosd_queue_set_expired_callback(ticosd_txqueue_get_lane(handle->txqueue, lane),
+                                      prv_ticosd_queue_expired, handle);
+  }
+}
+
+/**
+ * @brief Applies the queue_compression configuration to the queues of all lanes
+ *
+ * @param handle Main ticosd handle
+ */
+static void prv_ticosd_configure_queue_compression(sTicosd *handle) {
+  int threshold_bytes = 0;
+  ticosd_get_integer(handle, "queue_compression", "threshold_bytes", &threshold_bytes);
+  if (threshold_bytes < 0) {
+    threshold_bytes = 0;
+  }
+  for (int lane = 0; lane < kTicosdTxQueueLane_NumLanes; ++lane) {
+    ticosd_queue_set_compression(ticosd_txqueue_get_lane(handle->txqueue, lane), threshold_bytes);
+  }
+}
+
+/**
+ * @brief Applies the queue_blobs configuration to the queues of all lanes
+ *
+ * @param handle Main ticosd handle
+ */
+static void prv_ticosd_configure_queue_blobs(sTicosd *handle) {
+  int threshold_bytes = 0;
+  ticosd_get_integer(handle, "queue_blobs", "threshold_bytes", &threshold_bytes);
+  if (threshold_bytes < 0) {
+    threshold_bytes = 0;
+  }
+  for (int lane = 0; lane < kTicosdTxQueueLane_NumLanes; ++lane) {
+    ticosd_queue_set_blob_threshold(ticosd_txqueue_get_lane(handle->txqueue, lane),
+                                    threshold_bytes);
+  }
+}
+
+/**
+ * @brief Creates the backoff state of the TX queue lanes from the tx_retry configuration
+ *
+ * @param handle Main ticosd handle
+ * @return true Successfully created the backoff state
+ * @return false Failed to create
+ */
+static bool prv_ticosd_init_txretry(sTicosd *handle) {
+  int first_backoff_seconds = NETWORK_FAILURE_FIRST_BACKOFF_SECONDS;
+  // Backing off up to the entire update interval by default:
+  int max_backoff_seconds = 1 * 60 * 60;
+  ticosd_get_integer(handle, NULL, "refresh_interval_seconds", &max_backoff_seconds);
+  int breaker_threshold = TX_RETRY_BREAKER_THRESHOLD_DEFAULT;
+  int breaker_cooldown_seconds = max_backoff_seconds;
+  int max_attempts = TX_RETRY_MAX_ATTEMPTS_DEFAULT;
+  ticosd_get_integer(handle, "tx_retry", "first_backoff_seconds", &first_backoff_seconds);
+  ticosd_get_integer(handle, "tx_retry", "max_backoff_seconds", &max_backoff_seconds);
+  ticosd_get_integer(handle, "tx_retry", "breaker_threshold", &breaker_threshold);
+  ticosd_get_integer(handle, "tx_retry", "breaker_cooldown_seconds", &breaker_cooldown_seconds);
+  ticosd_get_integer(handle, "tx_retry", "max_attempts", &max_attempts);
+
+  const sTicosdTxRetryConfig config = {
+    .first_backoff_ms = MAX(first_backoff_seconds, 1) * 1000U,
+    .max_backoff_ms = MAX(max_backoff_seconds, 1) * 1000U,
+    .breaker_threshold = MAX(breaker_threshold, 0),
+    .breaker_cooldown_ms = MAX(breaker_cooldown_seconds, 1) * 1000U,
+  };
+  handle->tx_max_attempts = MAX(max_attempts, 0);
+  return (handle->txretry = ticosd_txretry_init(&config, kTicosdTxQueueLane_NumLanes)) != NULL;
+}
+
+/**
+ * @brief Sets the limits of the TX queue entries combined into a single request from the
+ * tx_batching configuration
+ *
+ * @param handle Main ticosd handle
+ */
+static void prv_ticosd_configure_tx_batching(sTicosd *handle) {
+  int max_count = TX_QUEUE_BATCH_SIZE;
+  int max_bytes = TX_BATCH_MAX_BYTES_DEFAULT;
+  ticosd_get_integer(handle, "tx_batching", "max_count", &max_count);
+  ticosd_get_integer(handle, "tx_batching", "max_bytes", &max_bytes);
+  handle->tx_batch_max_count = MAX(max_count, 1);
+  handle->tx_batch_max_bytes = MAX(max_bytes, 0);
+}
+
+/**
+ * @brief Creates the trigger of the TX queue from the tx_coalescing and tx_max_latency_ms
+ * configuration
+ *
+ * @param handle Main ticosd handle
+ * @return true Successfully created the trigger
+ * @return false Failed to create
+ */
+static bool prv_ticosd_init_txtrigger(sTicosd *handle) {
+  int delay_ms = TX_COALESCING_DELAY_MS_DEFAULT;
+  int batch_count = TX_QUEUE_BATCH_SIZE;
+  ticosd_get_integer(handle, "tx_coalescing", "delay_ms", &delay_ms);
+  ticosd_get_integer(handle, "tx_coalescing", "batch_count", &batch_count);
+  if (!(handle->txtrigger = ticosd_txtrigger_init(MAX(delay_ms, 0), MAX(batch_count, 0)))) {
+    return false;
+  }
+
+  for (unsigned int i = 0; i < sizeof(s_queue_type_keys) / sizeof(s_queue_type_keys[0]); ++i) {
+    int max_latency_ms = 0;
+    if (ticosd_get_integer(handle, "tx_max_latency_ms", s_queue_type_keys[i].key,
+                           &max_latency_ms) &&
+        max_latency_ms > 0) {
+      ticosd_txtrigger_set_type_max_latency(handle->txtrigger, s_queue_type_keys[i].type,
+                                            max_latency_ms);
+    }
+  }
+  return true;
+}
+
+static bool prv_ticosd_parse_drop_policy(const char *str, eTicosdTxQueueDropPolicy *policy) {
+  if (strcmp(str, "drop_oldest") == 0) {
+    *policy = kTicosdTxQueueDropPolicy_DropOldest;
+  } else if (strcmp(str, "drop_newest") == 0) {
+    *policy = kTicosdTxQueueDropPolicy_DropNewest;
+  } else if (strcmp(str, "drop_by_lane") == 0) {
+    *policy = kTicosdTxQueueDropPolicy_DropByLane;
+  } else {
+    fprintf(stderr,
+            "ticosd:: Invalid queue drop policy '%s', must be drop_oldest, drop_newest or "
+            "drop_by_lane.\n",
+            str);
+    return false;
+  }
+  return true;
+}
+
+static bool prv_ticosd_parse_queue_backend(const char *str, eTicosdQueueBackend *backend) {
+  if (strcmp(str, "mmap") == 0) {
+    *backend = kTicosdQueueBackend_Mmap;
+  } else if (strcmp(str, "pwrite") == 0) {
+    *backend = kTicosdQueueBackend_Pwrite;
+  } else if (strcmp(str, "io_uring") == 0) {
+    *backend = kTicosdQueueBackend_IoUring;
+  } else {
+    fprintf(stderr,
+            "ticosd:: Invalid queue storage backend '%s', must be mmap, pwrite or io_uring.\n",
+            str);
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Creates the transmit queue, with its lanes, spilling and storage configuration
+ *
+ * The events lane uses queue_size_kib, the size of the single queue of previous versions, so that
+ * its queue file is kept as is.
+ *
+ * @param handle Main ticosd handle
+ * @return true Successfully created the transmit queue
+ * @return false Failed to create
+ */
+static bool prv_ticosd_init_txqueue(sTicosd *handle) {
+  sTicosdTxQueueConfig config = {0};
+  ticosd_get_integer(handle, NULL, "queue_size_kib",
+                     &config.lanes[kTicosdTxQueueLane_Events].size);
+
+  for (int lane = 0; lane < kTicosdTxQueueLane_NumLanes; ++lane) {
+    const char *name = ticosd_txqueue_lane_name(lane);
+    char key[64];
+    if (lane != kTicosdTxQueueLane_Events) {
+      snprintf(key, sizeof(key), "%s_size_kib", name);
+      ticosd_get_integer(handle, "queue_lanes", key, &config.lanes[lane].size);
+    }
+    config.lanes[lane].size *= 1024;
+    snprintf(key, sizeof(key), "%s_weight", name);
+    ticosd_get_integer(handle, "queue_lanes", key, &config.lanes[lane].weight);
+  }
+
+  int budget_kib = 0;
+  int segment_size_kib = 0;
+  const char *drop_policy;
+  ticosd_get_integer(handle, "queue_spill", "budget_kib", &budget_kib);
+  ticosd_get_integer(handle, "queue_spill", "segment_size_kib", &segment_size_kib);
+  if (budget_kib > 0 && segment_size_kib > 0) {
+    config.spill_budget = (uint64_t)budget_kib * 1024;
+    config.spill_segment_size = segment_size_kib * 1024;
+  }
+  if (ticosd_get_string(handle, "queue_spill", "drop_policy", &drop_policy)) {
+    prv_ticosd_parse_drop_policy(drop_policy, &config.drop_policy);
+  }
+
+  const char *backend;
+  if (ticosd_get_string(handle, "queue_storage", "backend", &backend)) {
+    prv_ticosd_parse_queue_backend(backend, &config.backend);
+  }
+
+  int dead_letter_size_kib = 0;
+  ticosd_get_integer(handle, "tx_retry", "dead_letter_size_kib", &dead_letter_size_kib);
+  config.dead_letter_size = MAX(dead_letter_size_kib, 0) * 1024;
+
+  return (handle->txqueue = ticosd_txqueue_init(handle, &config)) != NULL;
+}
+
+/**
+ * @brief Replies to a STATS IPC request with the statistics of the TX queue and of the network
+ * requests as JSON
+ *
+ * @param handle Main ticosd handle
+ * @param addr Address of the requester
+ * @param addr_len Size of addr
+ */
+static void prv_ipc_reply_stats(sTicosd *handle, const struct sockaddr_un *addr,
+                                socklen_t addr_len) {
+  char *json = NULL;
+  char *txstats = ticosd_txstats_to_json(handle->txstats, handle->txqueue, time(NULL));
+  char *nettiming = ticosd_nettiming_to_json(ticosd_network_get_timing(handle->network));
+  if (!txstats || !nettiming) {
+    goto cleanup;
+  }
+  // Both are JSON objects, the timing goes in the object of the TX queue statistics:
+  if (ticos_asprintf(&json, "%.*s, \"network_timing_ms\": %s}", (int)strlen(txstats) - 1, txstats,
+                     nettiming) == -1) {
+    fprintf(stderr, "ticosd:: Failed to allocate stats reply\n");
+    json = NULL;
+    goto cleanup;
+  }
+  if (sendto(handle->ipc_socket_fd, json, strlen(json) + 1, 0, (const struct sockaddr *)addr,
+             addr_len) == -1) {
+    fprintf(stderr, "ticosd:: Failed to reply to stats request : %s\n", strerror(errno));
+  }
+
+cleanup:
+  free(json);
+  free(nettiming);
+  free(txstats);
+}
+
+/**
+ * @brief Replies to a RETRY_DEAD_LETTER IPC request, after moving the entries of the dead-letter
+ * queue back into the TX queue
+ *
+ * @param handle Main ticosd handle
+ * @param addr Address of the requester
+ * @param addr_len Size of addr
+ */
+static void prv_ipc_reply_retry_dead_letter(sTicosd *handle, const struct sockaddr_un *addr,
+                                            socklen_t addr_len) {
+  const uint32_t count = ticosd_txqueue_requeue_dead_letter(handle->txqueue);
+  if (count > 0) {
+    fprintf(stderr, "ticosd:: Queued %u dead-letter entries again.\n", count);
+  }
+  char reply[sizeof("4294967295")];
+  snprintf(reply, sizeof(reply), "%u", count);
+  if (sendto(handle->ipc_socket_fd, reply, strlen(reply) + 1, 0, (const struct sockaddr *)addr,
+             addr_len) == -1) {
+    fprintf(stderr, "ticosd:: Failed to reply to retry-dead-letter request : %s\n",
+            strerror(errno));
+  }
+}
+
 static void *prv_ipc_process_thread(void *arg) {
   sTicosd *handle = arg;
 
@@ -327,6 +1211,17 @@ static void *prv_ipc_process_thread(void *arg) {
       continue;
     }
 
+    if (received_size == sizeof(TICOSD_IPC_STATS_NAME) &&
+        memcmp(handle->ipc_rx_buffer, TICOSD_IPC_STATS_NAME, received_size) == 0) {
+      prv_ipc_reply_stats(handle, &src_addr, msg.msg_namelen);
+      continue;
+    }
+    if (received_size == sizeof(TICOSD_IPC_RETRY_DEAD_LETTER_NAME) &&
+        memcmp(handle->ipc_rx_buffer, TICOSD_IPC_RETRY_DEAD_LETTER_NAME, received_size) == 0) {
+      prv_ipc_reply_retry_dead_letter(handle, &src_addr, msg.msg_namelen);
+      continue;
+    }
+
     if (!ticosd_plugins_process_ipc(&msg, received_size)) {
       fprintf(stderr, "ticosd:: Failed to process IPC message (no plugin).\n");
     }
@@ -451,22 +1346,40 @@ int ticosd_main(int argc, char *argv[]) {
   //! Disable coredumping of this process
   prctl(PR_SET_DUMPABLE, 0, 0, 0);
 
-  signal(SIGTERM, prv_ticosd_sig_handler);
-  signal(SIGHUP, prv_ticosd_sig_handler);
-  signal(SIGINT, prv_ticosd_sig_handler);
-  signal(SIGUSR1, prv_ticosd_sig_handler);
+  // Handled by the main loop through a signalfd. Blocked before any other thread is started, so
+  // that they all inherit the mask and the signals are never delivered to them:
+  sigset_t mask;
+  prv_ticosd_signal_mask(&mask);
+  pthread_sigmask(SIG_BLOCK, &mask, NULL);
 
-  int queue_size = 0;
-  ticosd_get_integer(s_handle, NULL, "queue_size_kib", &queue_size);
-
-  if (!(s_handle->queue = ticosd_queue_init(s_handle, queue_size * 1024))) {
+  if (!prv_ticosd_init_txqueue(s_handle)) {
     fprintf(stderr, "ticosd:: Failed to create queue object, aborting.\n");
     exit(EXIT_FAILURE);
   }
+  prv_ticosd_configure_queue_durability(s_handle);
+  prv_ticosd_configure_queue_compression(s_handle);
+  prv_ticosd_configure_queue_blobs(s_handle);
+  prv_ticosd_configure_queue_ttl(s_handle);
+
+  if (!(s_handle->txstats = ticosd_txstats_init())) {
+    fprintf(stderr, "ticosd:: Failed to create queue statistics object, aborting.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (!prv_ticosd_init_txtrigger(s_handle)) {
+    fprintf(stderr, "ticosd:: Failed to create queue trigger object, aborting.\n");
+    exit(EXIT_FAILURE);
+  }
+  prv_ticosd_configure_tx_batching(s_handle);
+
+  if (!prv_ticosd_init_txretry(s_handle)) {
+    fprintf(stderr, "ticosd:: Failed to create queue retry object, aborting.\n");
+    exit(EXIT_FAILURE);
+  }
 
   bool allowed;
   if (!ticosd_get_boolean(s_handle, NULL, "enable_data_collection", &allowed) || !allowed) {
-    ticosd_queue_reset(s_handle->queue);
+    ticosd_txqueue_reset(s_handle->txqueue);
   }
 
   if (!(s_handle->network = ticosd_network_init(s_handle))) {
@@ -500,7 +1413,10 @@ int ticosd_main(int argc, char *argv[]) {
   ticosd_destroy_plugins();
 
   ticosd_network_destroy(s_handle->network);
-  ticosd_queue_destroy(s_handle->queue);
+  ticosd_txstats_destroy(s_handle->txstats);
+  ticosd_txtrigger_destroy(s_handle->txtrigger);
+  ticosd_txretry_destroy(s_handle->txretry);
+  ticosd_txqueue_destroy(s_handle->txqueue);
   ticosd_config_destroy(s_handle->config);
   ticosd_device_settings_destroy(s_handle->settings);
   free(s_handle);
@@ -525,8 +1441,47 @@ bool ticosd_txdata(sTicosd *handle, const sTicosdTxData *data, uint32_t payload_
   if (!ticosd_get_boolean(handle, "", "enable_data_collection", &allowed) || !allowed) {
     return true;
   }
-  return ticosd_queue_write(handle->queue, (const uint8_t *)data,
-                              sizeof(sTicosdTxData) + payload_size);
+  if (!ticosd_txqueue_write(handle->txqueue, (const uint8_t *)data,
+                            sizeof(sTicosdTxData) + payload_size)) {
+    return false;
+  }
+  ticosd_txtrigger_notify(handle->txtrigger, data->type, ticosd_txtrigger_now_ms());
+  return true;
+}
+
+/**
+ * @brief Plugin API impl for uploading a coredump as it is produced, rather than from a file
+ *
+ * @param handle Main ticosd handle
+ * @param is_gzipped Whether the coredump is gzipped
+ * @return Stream to write the coredump to, NULL if ticos cannot be reached
+ */
+sTicosdNetworkStream *ticosd_core_upload_stream_open(sTicosd *handle, bool is_gzipped) {
+  char *path;
+  if (ticos_asprintf(&path, "/chunks/%s/url", handle->settings->device_id) == -1) {
+    fprintf(stderr, "ticosd:: Unable to allocate memory for upload coredump path.\n");
+    return NULL;
+  }
+  sTicosdNetworkStream *stream = ticosd_network_stream_open(handle->network, path, is_gzipped);
+  free(path);
+  return stream;
+}
+
+bool ticosd_core_upload_stream_write(sTicosdNetworkStream *stream, const void *data,
+                                     size_t size) {
+  return ticosd_network_stream_write(stream, data, size);
+}
+
+/**
+ * @brief Plugin API impl for ending a coredump upload stream
+ *
+ * @param stream Stream from ticosd_core_upload_stream_open()
+ * @param complete Whether the whole coredump was written, the upload is cancelled otherwise
+ * @return true The coredump was uploaded
+ * @return false It was not, and cannot be anymore
+ */
+bool ticosd_core_upload_stream_close(sTicosdNetworkStream *stream, bool complete) {
+  return ticosd_network_stream_close(stream, complete) == kTicosdNetworkResult_OK;
 }
 
 bool ticosd_get_boolean(sTicosd *handle, const char *parent_key, const char *key, bool *val) {
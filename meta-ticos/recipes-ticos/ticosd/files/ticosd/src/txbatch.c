@@ -0,0 +1,162 @@
+//! @file
+//!
+//! Copyright (c) Ticos, Inc.
+//! See License.txt for details
+//!
+//! @brief
+//! Combines consecutive queued events or attributes into the body of a single request
+//!
+//! Reboot events are JSON objects, several of them are posted to the same endpoint as a JSON
+//! array. Attributes are JSON arrays of key/value objects, captured at a time given in the URL of
+//! their PATCH: those captured at the same time are merged into a single array.
+//!
+//! Each entry keeps its own place in the queue, the request only succeeds or fails for all of them
+//! at once.
+//!
+
+#include "txbatch.h"
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ticosd.h"
+
+/**
+ * @brief Returns the JSON document of an entry that can be combined with others
+ *
+ * @param entry Queue entry
+ * @param[out] len Length of the document, without the brackets of an attributes array
+ * @return Start of the document, or of the contents of an attributes array, NULL if the entry
+ * cannot be combined
+ */
+static const char *prv_txbatch_json(const sTicosdQueueEntry *entry, size_t *len) {
+  const sTicosdTxData *txdata = (const sTicosdTxData *)entry->payload;
+  const char *end = (const char *)entry->payload + entry->payload_size_bytes;
+
+  switch (txdata->type) {
+    case kTicosdTxDataType_RebootEvent: {
+      const char *json = (const char *)txdata->payload;
+      *len = strnlen(json, end - json);
+      return *len > 0 ? json : NULL;
+    }
+    case kTicosdTxDataType_Attributes: {
+      if (entry->payload_size_bytes < sizeof(sTicosdTxDataAttributes)) {
+        return NULL;
+      }
+      const char *json = ((const sTicosdTxDataAttributes *)txdata)->json;
+      const char *json_end = json + strnlen(json, end - json);
+      while (json < json_end && isspace((unsigned char)*json)) {
+        json++;
+      }
+      while (json_end > json && isspace((unsigned char)json_end[-1])) {
+        json_end--;
+      }
+      if (json_end - json < 2 || *json != '[' || json_end[-1] != ']') {
+        return NULL;
+      }
+      *len = json_end - json - 2;
+      return json + 1;
+    }
+    default:
+      return NULL;
+  }
+}
+
+static bool prv_txbatch_compatible(const sTicosdQueueEntry *first,
+                                   const sTicosdQueueEntry *entry) {
+  const sTicosdTxData *a = (const sTicosdTxData *)first->payload;
+  const sTicosdTxData *b = (const sTicosdTxData *)entry->payload;
+  if (a->type != b->type) {
+    return false;
+  }
+  if (a->type == kTicosdTxDataType_Attributes) {
+    // Attributes are combined only if they share the captured_date of the request:
+    time_t a_timestamp;
+    time_t b_timestamp;
+    memcpy(&a_timestamp, &((const sTicosdTxDataAttributes *)a)->timestamp, sizeof(time_t));
+    memcpy(&b_timestamp, &((const sTicosdTxDataAttributes *)b)->timestamp, sizeof(time_t));
+    return a_timestamp == b_timestamp;
+  }
+  return true;
+}
+
+/**
+ * @brief Returns how many leading entries can be sent in a single request
+ *
+ * @param entries Queue entries, in queue order
+ * @param count Number of entries
+ * @param max_count Maximum number of entries to combine
+ * @param max_bytes Maximum size of the combined body. The first entry is always returned, even if
+ * it is larger.
+ * @return Number of entries to combine, at least 1 if count > 0. 1 if the first entry cannot be
+ * combined with others.
+ */
+uint32_t ticosd_txbatch_count(const sTicosdQueueEntry *entries, uint32_t count,
+                              uint32_t max_count, uint32_t max_bytes) {
+  if (count == 0) {
+    return 0;
+  }
+  size_t len;
+  if (!prv_txbatch_json(&entries[0], &len)) {
+    return 1;
+  }
+  // Brackets of the array:
+  size_t total_bytes = len + 2;
+
+  uint32_t n = 1;
+  while (n < count && n < max_count && prv_txbatch_compatible(&entries[0], &entries[n]) &&
+         prv_txbatch_json(&entries[n], &len)) {
+    // Separating comma:
+    if (total_bytes + len + 1 > max_bytes) {
+      break;
+    }
+    total_bytes += len + 1;
+    n++;
+  }
+  return n;
+}
+
+/**
+ * @brief Builds the body of a request sending several entries at once
+ *
+ * @param entries Queue entries, as accepted by ticosd_txbatch_count()
+ * @param count Number of entries, at least 1
+ * @return JSON array to free() by the caller, NULL on error
+ */
+char *ticosd_txbatch_join(const sTicosdQueueEntry *entries, uint32_t count) {
+  size_t total_bytes = 2;
+  for (uint32_t i = 0; i < count; ++i) {
+    size_t len;
+    if (!prv_txbatch_json(&entries[i], &len)) {
+      return NULL;
+    }
+    total_bytes += len + 1;
+  }
+
+  char *body = malloc(total_bytes + 1);
+  if (!body) {
+    fprintf(stderr, "txbatch:: Failed to allocate request body\n");
+    return NULL;
+  }
+  char *ptr = body;
+  *ptr++ = '[';
+  for (uint32_t i = 0; i < count; ++i) {
+    size_t len;
+    const char *json = prv_txbatch_json(&entries[i], &len);
+    // Empty attributes arrays must not leave a dangling comma:
+    if (len == 0) {
+      continue;
+    }
+    if (ptr != body + 1) {
+      *ptr++ = ',';
+    }
+    memcpy(ptr, json, len);
+    ptr += len;
+  }
+  *ptr++ = ']';
+  *ptr = '\0';
+  return body;
+}
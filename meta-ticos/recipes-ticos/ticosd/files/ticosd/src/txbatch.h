@@ -0,0 +1,28 @@
+//! @file
+//!
+//! Copyright (c) Ticos, Inc.
+//! See License.txt for details
+//!
+//! @brief
+//! Combines consecutive queued events or attributes into the body of a single request
+//!
+
+#ifndef __TICOS_TXBATCH_H
+#define __TICOS_TXBATCH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include "queue.h"
+
+uint32_t ticosd_txbatch_count(const sTicosdQueueEntry *entries, uint32_t count,
+                              uint32_t max_count, uint32_t max_bytes);
+char *ticosd_txbatch_join(const sTicosdQueueEntry *entries, uint32_t count);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
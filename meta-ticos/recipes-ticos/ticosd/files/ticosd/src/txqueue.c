@@ -0,0 +1,580 @@
+//! @file
+//!
+//! Copyright (c) Ticos, Inc.
+//! See License.txt for details
+//!
+//! @brief
+//! Transmit queue with one queue per priority lane, dequeued with weighted fair scheduling
+//!
+//! Every lane is backed by its own queue file, so that a lane filling up (e.g. with coredump
+//! uploads waiting for the network) never drops the entries of another lane.
+//!
+//! Lanes are dequeued with deficit round-robin, where every entry costs one unit: in each round,
+//! a lane gets to send up to its weight in entries before the next lane's turn. Lanes are visited
+//! in order of priority, and a lane with nothing to send gives up its turn right away.
+//!
+//! When spilling is enabled, a full lane does not drop its oldest entries. New entries are
+//! appended to the lane's spill segments instead (see queue_spill.c), and moved back into the
+//! lane's queue as it gets sent. Once a lane has spilled, all its new entries are spilled until
+//! the spill segments are empty again, so that the entries stay in order. The spill segments of
+//! all lanes share a disk budget, enforced according to the drop policy.
+//!
+//! A lane can be paused, e.g. while its endpoint is backing off after a failure, and is then
+//! skipped as if it had nothing to send. An entry that keeps failing is moved from its lane to the
+//! dead-letter queue, so that it does not hold back the entries behind it forever.
+//!
+//! The scheduling state is only used by the thread that sends the entries. Writes can come from
+//! any thread, they are serialised by the lanes' queues, and by spill_lock once spilling.
+//!
+
+#include "txqueue.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "queue_spill.h"
+
+struct TicosdTxQueue {
+  sTicosdQueue *lanes[kTicosdTxQueueLane_NumLanes];
+  //! Spill segments of each lane, NULL if spilling is disabled.
+  sTicosdQueueSpill *spills[kTicosdTxQueueLane_NumLanes];
+  //! Whether new entries of the lane must be spilled, to stay behind the spilled ones.
+  atomic_bool spilling[kTicosdTxQueueLane_NumLanes];
+  //! Protects the spill segments, the spilling flags, the drop statistics and the dead-letter
+  //! counts.
+  pthread_mutex_t spill_lock;
+  uint64_t spill_budget;
+  eTicosdTxQueueDropPolicy drop_policy;
+  sTicosdTxQueueDropStats drops[kTicosdTxQueueLane_NumLanes];
+  uint32_t weights[kTicosdTxQueueLane_NumLanes];
+  //! Entries the lane can still send in its current turn, 0 if its turn has not started.
+  uint32_t deficits[kTicosdTxQueueLane_NumLanes];
+  //! Lane of which it is the turn.
+  eTicosdTxQueueLane current_lane;
+  //! Lane of the last batch peeked, which completing or releasing applies to.
+  eTicosdTxQueueLane peeked_lane;
+  //! Lanes skipped by ticosd_txqueue_peek_batch().
+  bool paused[kTicosdTxQueueLane_NumLanes];
+  //! Entries given up on, NULL if they are dropped instead.
+  sTicosdQueue *dead_letter;
+  uint32_t dead_letter_counts[kTicosdTxQueueLane_NumLanes];
+};
+
+static const char *const s_lane_names[kTicosdTxQueueLane_NumLanes] = {
+  [kTicosdTxQueueLane_Events] = "events",
+  [kTicosdTxQueueLane_Attributes] = "attributes",
+  [kTicosdTxQueueLane_Bulk] = "bulk",
+};
+
+//! Names of the lanes' queue files. The events lane keeps using the file of the single queue
+//! of previous versions, so that its entries are still sent after an upgrade.
+static const char *const s_lane_files[kTicosdTxQueueLane_NumLanes] = {
+  [kTicosdTxQueueLane_Events] = "queue",
+  [kTicosdTxQueueLane_Attributes] = "queue_attributes",
+  [kTicosdTxQueueLane_Bulk] = "queue_bulk",
+};
+
+//! Names of the directories of the lanes' spill segments.
+static const char *const s_lane_spill_dirs[kTicosdTxQueueLane_NumLanes] = {
+  [kTicosdTxQueueLane_Events] = "queue_spill",
+  [kTicosdTxQueueLane_Attributes] = "queue_attributes_spill",
+  [kTicosdTxQueueLane_Bulk] = "queue_bulk_spill",
+};
+
+static void prv_txqueue_next_lane(sTicosdTxQueue *handle) {
+  handle->deficits[handle->current_lane] = 0;
+  handle->current_lane = (handle->current_lane + 1) % kTicosdTxQueueLane_NumLanes;
+}
+
+static uint64_t prv_txqueue_spill_disk_usage(sTicosdTxQueue *handle) {
+  uint64_t disk_usage = 0;
+  for (int i = 0; i < kTicosdTxQueueLane_NumLanes; ++i) {
+    if (handle->spills[i]) {
+      disk_usage += ticosd_queue_spill_get_disk_usage(handle->spills[i]);
+    }
+  }
+  return disk_usage;
+}
+
+static bool prv_txqueue_has_spilled(sTicosdTxQueue *handle, int lane) {
+  return handle->spills[lane] && ticosd_queue_spill_get_disk_usage(handle->spills[lane]) > 0;
+}
+
+/**
+ * @brief Picks the lane of which to drop the oldest spilled entries, to make room for an entry
+ *
+ * @param handle Transmit queue handle
+ * @param lane Lane of the entry to make room for
+ * @return Lane to drop entries of, -1 to drop the entry instead
+ */
+static int prv_txqueue_drop_victim(sTicosdTxQueue *handle, eTicosdTxQueueLane lane) {
+  switch (handle->drop_policy) {
+    case kTicosdTxQueueDropPolicy_DropOldest:
+      return prv_txqueue_has_spilled(handle, lane) ? (int)lane : -1;
+    case kTicosdTxQueueDropPolicy_DropByLane:
+      for (int i = kTicosdTxQueueLane_NumLanes - 1; i >= (int)lane; --i) {
+        if (prv_txqueue_has_spilled(handle, i)) {
+          return i;
+        }
+      }
+      return -1;
+    case kTicosdTxQueueDropPolicy_DropNewest:
+    default:
+      return -1;
+  }
+}
+
+/**
+ * @brief Appends an entry to the spill segments of its lane, within the disk budget
+ *
+ * @param handle Transmit queue handle
+ * @param lane Lane of the entry
+ * @param payload Entry
+ * @param payload_size_bytes Entry size in bytes
+ * @return true Successfully spilled the entry
+ * @return false Failed to spill, or dropped the entry
+ */
+static bool prv_txqueue_spill(sTicosdTxQueue *handle, eTicosdTxQueueLane lane,
+                              const uint8_t *payload, uint32_t payload_size_bytes) {
+  const uint32_t record_size = ticosd_queue_spill_get_record_size(payload_size_bytes);
+  while (prv_txqueue_spill_disk_usage(handle) + record_size > handle->spill_budget) {
+    const int victim = prv_txqueue_drop_victim(handle, lane);
+    if (victim < 0) {
+      handle->drops[lane].entries++;
+      handle->drops[lane].bytes += payload_size_bytes;
+      fprintf(stderr, "txqueue:: Spill budget reached, dropping %u bytes %s entry.\n",
+              payload_size_bytes, s_lane_names[lane]);
+      return false;
+    }
+
+    uint64_t dropped_bytes;
+    const uint32_t dropped =
+      ticosd_queue_spill_drop_oldest_segment(handle->spills[victim], &dropped_bytes);
+    handle->drops[victim].entries += dropped;
+    handle->drops[victim].bytes += dropped_bytes;
+    fprintf(stderr, "txqueue:: Spill budget reached, dropped %u oldest %s entries.\n", dropped,
+            s_lane_names[victim]);
+    if (ticosd_queue_spill_get_count(handle->spills[victim]) == 0) {
+      atomic_store(&handle->spilling[victim], false);
+    }
+  }
+
+  const bool sync = ticosd_queue_get_type_durability(handle->lanes[lane], payload[0]) ==
+                    kTicosdQueueDurability_Strict;
+  if (!ticosd_queue_spill_append(handle->spills[lane], payload, payload_size_bytes, sync)) {
+    return false;
+  }
+  atomic_store(&handle->spilling[lane], true);
+  return true;
+}
+
+/**
+ * @brief Moves spilled entries of a lane back into its queue, as far as they fit
+ *
+ * Spilled entries whose time-to-live elapsed are dropped instead.
+ *
+ * @param handle Transmit queue handle
+ * @param lane Lane
+ */
+static void prv_txqueue_refill(sTicosdTxQueue *handle, eTicosdTxQueueLane lane) {
+  if (!atomic_load(&handle->spilling[lane])) {
+    return;
+  }
+
+  pthread_mutex_lock(&handle->spill_lock);
+  sTicosdQueueSpill *spill = handle->spills[lane];
+  const uint8_t *payload;
+  uint32_t payload_size_bytes;
+  while ((payload = ticosd_queue_spill_peek(spill, &payload_size_bytes)) != NULL &&
+         (ticosd_queue_expire_entry(handle->lanes[lane], payload, payload_size_bytes,
+                                    ticosd_queue_spill_get_peek_time(spill)) ||
+          ticosd_queue_write(handle->lanes[lane], payload, payload_size_bytes))) {
+    ticosd_queue_spill_pop(spill);
+  }
+  if (!payload) {
+    atomic_store(&handle->spilling[lane], false);
+  }
+  pthread_mutex_unlock(&handle->spill_lock);
+}
+
+/**
+ * @brief Initialises the transmit queue, opening the queue and spill segments of every lane
+ *
+ * @param ticosd Main ticosd handle
+ * @param config Lanes and spilling configuration
+ * @return Transmit queue object, NULL if a lane failed to initialise
+ */
+sTicosdTxQueue *ticosd_txqueue_init(sTicosd *ticosd, const sTicosdTxQueueConfig *config) {
+  sTicosdTxQueue *handle = calloc(sizeof(sTicosdTxQueue), 1);
+  if (!handle) {
+    fprintf(stderr, "txqueue:: Failed to allocate transmit queue.\n");
+    return NULL;
+  }
+  if (pthread_mutex_init(&handle->spill_lock, NULL) != 0) {
+    fprintf(stderr, "txqueue:: Failed to initialise spill mutex.\n");
+    free(handle);
+    return NULL;
+  }
+  handle->spill_budget = config->spill_budget;
+  handle->drop_policy = config->drop_policy;
+
+  for (int i = 0; i < kTicosdTxQueueLane_NumLanes; ++i) {
+    const sTicosdTxQueueLaneConfig *lane_config = &config->lanes[i];
+    handle->lanes[i] =
+      ticosd_queue_init_with_backend(ticosd, s_lane_files[i], lane_config->size, config->backend);
+    if (!handle->lanes[i]) {
+      fprintf(stderr, "txqueue:: Failed to initialise %s lane.\n", s_lane_names[i]);
+      ticosd_txqueue_destroy(handle);
+      return NULL;
+    }
+    handle->weights[i] = lane_config->weight > 0 ? lane_config->weight : 1;
+
+    if (config->spill_budget > 0 &&
+        (handle->spills[i] =
+           ticosd_queue_spill_init(ticosd, s_lane_spill_dirs[i], config->spill_segment_size))) {
+      ticosd_queue_set_overwrite(handle->lanes[i], false);
+      atomic_init(&handle->spilling[i], ticosd_queue_spill_get_count(handle->spills[i]) > 0);
+    }
+  }
+
+  if (config->dead_letter_size > 0 &&
+      !(handle->dead_letter = ticosd_queue_init_with_backend(
+          ticosd, "queue_dead_letter", config->dead_letter_size, config->backend))) {
+    fprintf(stderr, "txqueue:: Failed to initialise dead-letter queue, dropping instead.\n");
+  }
+  return handle;
+}
+
+/**
+ * @brief Destroys the transmit queue and the queues of its lanes
+ *
+ * @param handle Transmit queue handle
+ */
+void ticosd_txqueue_destroy(sTicosdTxQueue *handle) {
+  if (handle) {
+    for (int i = 0; i < kTicosdTxQueueLane_NumLanes; ++i) {
+      ticosd_queue_destroy(handle->lanes[i]);
+      ticosd_queue_spill_destroy(handle->spills[i]);
+    }
+    ticosd_queue_destroy(handle->dead_letter);
+    pthread_mutex_destroy(&handle->spill_lock);
+    free(handle);
+  }
+}
+
+/**
+ * @brief Returns the lane that entries of the given type are queued in
+ *
+ * @param type Entry type (eTicosdTxDataType)
+ */
+eTicosdTxQueueLane ticosd_txqueue_lane_for_type(uint8_t type) {
+  switch (type) {
+    case kTicosdTxDataType_Attributes:
+      return kTicosdTxQueueLane_Attributes;
+    case kTicosdTxDataType_CoreUpload:
+    case kTicosdTxDataType_CoreUploadWithGzip:
+      return kTicosdTxQueueLane_Bulk;
+    case kTicosdTxDataType_RebootEvent:
+    default:
+      return kTicosdTxQueueLane_Events;
+  }
+}
+
+/**
+ * @brief Returns the name of a lane, as used in the configuration
+ */
+const char *ticosd_txqueue_lane_name(eTicosdTxQueueLane lane) { return s_lane_names[lane]; }
+
+/**
+ * @brief Returns the queue of a lane, e.g. to configure its durability
+ *
+ * @param handle Transmit queue handle
+ * @param lane Lane
+ */
+sTicosdQueue *ticosd_txqueue_get_lane(sTicosdTxQueue *handle, eTicosdTxQueueLane lane) {
+  return handle->lanes[lane];
+}
+
+/**
+ * @brief Resets all lanes to empty
+ *
+ * @param handle Transmit queue handle
+ */
+void ticosd_txqueue_reset(sTicosdTxQueue *handle) {
+  pthread_mutex_lock(&handle->spill_lock);
+  for (int i = 0; i < kTicosdTxQueueLane_NumLanes; ++i) {
+    ticosd_queue_reset(handle->lanes[i]);
+    if (handle->spills[i]) {
+      ticosd_queue_spill_reset(handle->spills[i]);
+    }
+    atomic_store(&handle->spilling[i], false);
+    handle->deficits[i] = 0;
+  }
+  pthread_mutex_unlock(&handle->spill_lock);
+  handle->current_lane = kTicosdTxQueueLane_Events;
+}
+
+/**
+ * @brief Adds an entry to the lane of its type, or to its spill segments if the lane is full
+ *
+ * @param handle Transmit queue handle
+ * @param payload Entry, starting with its type (eTicosdTxDataType)
+ * @param payload_size_bytes Entry size in bytes
+ * @return true Successfully added the entry
+ * @return false Failed to add
+ */
+bool ticosd_txqueue_write(sTicosdTxQueue *handle, const uint8_t *payload,
+                          uint32_t payload_size_bytes) {
+  if (payload_size_bytes == 0 || payload == NULL) {
+    return false;
+  }
+  const eTicosdTxQueueLane lane = ticosd_txqueue_lane_for_type(payload[0]);
+  sTicosdQueue *queue = handle->lanes[lane];
+  if (!handle->spills[lane]) {
+    return ticosd_queue_write(queue, payload, payload_size_bytes);
+  }
+
+  if (payload_size_bytes > ticosd_queue_get_max_payload_size(queue)) {
+    // It could never be moved back into the queue:
+    fprintf(stderr, "txqueue:: %u bytes %s entry is too large for its queue.\n",
+            payload_size_bytes, s_lane_names[lane]);
+    return false;
+  }
+  if (!atomic_load(&handle->spilling[lane]) &&
+      ticosd_queue_write(queue, payload, payload_size_bytes)) {
+    return true;
+  }
+
+  pthread_mutex_lock(&handle->spill_lock);
+  // The spill segments may have been emptied in the meantime:
+  const bool success = (!atomic_load(&handle->spilling[lane]) &&
+                        ticosd_queue_write(queue, payload, payload_size_bytes)) ||
+                       prv_txqueue_spill(handle, lane, payload, payload_size_bytes);
+  pthread_mutex_unlock(&handle->spill_lock);
+  return success;
+}
+
+/**
+ * @brief Peeks at the next entries to send, from the lane of which it is the turn
+ *
+ * All entries of a batch come from the same lane. Like ticosd_queue_peek_batch(), the batch must
+ * be completed with ticosd_txqueue_complete_batch() or released with
+ * ticosd_txqueue_release_head() before peeking again.
+ *
+ * @param handle Transmit queue handle
+ * @param[out] entries Entries of the batch
+ * @param max_count Maximum number of entries to return
+ * @param max_bytes Maximum total payload size of the batch
+ * @return Number of entries in the batch, 0 if all lanes are empty
+ */
+uint32_t ticosd_txqueue_peek_batch(sTicosdTxQueue *handle, sTicosdQueueEntry *entries,
+                                   uint32_t max_count, uint32_t max_bytes) {
+  for (int i = 0; i <= kTicosdTxQueueLane_NumLanes; ++i) {
+    const eTicosdTxQueueLane lane = handle->current_lane;
+    if (handle->paused[lane]) {
+      prv_txqueue_next_lane(handle);
+      continue;
+    }
+    if (handle->spills[lane]) {
+      prv_txqueue_refill(handle, lane);
+    }
+    if (handle->deficits[lane] == 0) {
+      // Start of the lane's turn:
+      handle->deficits[lane] = handle->weights[lane];
+    }
+
+    const uint32_t count = ticosd_queue_peek_batch(
+      handle->lanes[lane], entries,
+      max_count < handle->deficits[lane] ? max_count : handle->deficits[lane], max_bytes);
+    if (count > 0) {
+      handle->peeked_lane = lane;
+      return count;
+    }
+    // Nothing to send, the lane gives up the rest of its turn:
+    prv_txqueue_next_lane(handle);
+  }
+  return 0;
+}
+
+/**
+ * @brief Leaves the entries of the last peeked batch on the queue, to be sent again later
+ *
+ * The lane keeps its turn, so that its entries are retried first.
+ *
+ * @param handle Transmit queue handle
+ */
+void ticosd_txqueue_release_head(sTicosdTxQueue *handle) {
+  ticosd_queue_release_head(handle->lanes[handle->peeked_lane]);
+}
+
+/**
+ * @brief Removes the first count entries of the last peeked batch, which have been sent
+ *
+ * @param handle Transmit queue handle
+ * @param count Number of entries to remove
+ * @return true Successfully removed the entries
+ * @return false Failed to remove
+ */
+bool ticosd_txqueue_complete_batch(sTicosdTxQueue *handle, uint32_t count) {
+  const eTicosdTxQueueLane lane = handle->peeked_lane;
+  if (!ticosd_queue_complete_batch(handle->lanes[lane], count)) {
+    return false;
+  }
+
+  if (lane == handle->current_lane) {
+    handle->deficits[lane] -= count < handle->deficits[lane] ? count : handle->deficits[lane];
+    if (handle->deficits[lane] == 0) {
+      prv_txqueue_next_lane(handle);
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Returns the lane of the last peeked batch
+ *
+ * @param handle Transmit queue handle
+ */
+eTicosdTxQueueLane ticosd_txqueue_get_peeked_lane(sTicosdTxQueue *handle) {
+  return handle->peeked_lane;
+}
+
+/**
+ * @brief Pauses or resumes a lane, a paused lane is skipped by ticosd_txqueue_peek_batch()
+ *
+ * @param handle Transmit queue handle
+ * @param lane Lane
+ * @param paused Whether the lane is paused
+ */
+void ticosd_txqueue_set_lane_paused(sTicosdTxQueue *handle, eTicosdTxQueueLane lane,
+                                    bool paused) {
+  handle->paused[lane] = paused;
+}
+
+/**
+ * @brief Counts a failed attempt to send the entry at the head of a lane
+ *
+ * The last peeked batch must have been released if it is from this lane.
+ *
+ * @param handle Transmit queue handle
+ * @param lane Lane
+ * @return Number of failed attempts to send the entry so far, see ticosd_queue_fail_head()
+ */
+uint32_t ticosd_txqueue_fail_head(sTicosdTxQueue *handle, eTicosdTxQueueLane lane) {
+  return ticosd_queue_fail_head(handle->lanes[lane]);
+}
+
+/**
+ * @brief Acknowledges an entry of the last peeked batch sent after one that has to be sent again,
+ * so that it is not sent again with it
+ *
+ * @param handle Transmit queue handle
+ * @param index Index of the entry in the batch
+ * @return true if the entry was acknowledged, see ticosd_queue_ack_entry()
+ */
+bool ticosd_txqueue_ack_entry(sTicosdTxQueue *handle, uint32_t index) {
+  return ticosd_queue_ack_entry(handle->lanes[handle->peeked_lane], index);
+}
+
+/**
+ * @brief Moves the entry at the head of a lane to the dead-letter queue
+ *
+ * The last peeked batch must have been released if it is from this lane. The dead-letter queue
+ * overwrites its oldest entries when full, the entry is dropped if there is none.
+ *
+ * @param handle Transmit queue handle
+ * @param lane Lane
+ * @return true if an entry was moved
+ */
+bool ticosd_txqueue_dead_letter_head(sTicosdTxQueue *handle, eTicosdTxQueueLane lane) {
+  sTicosdQueueEntry entry;
+  if (ticosd_queue_peek_batch(handle->lanes[lane], &entry, 1, UINT32_MAX) == 0) {
+    return false;
+  }
+  if (handle->dead_letter &&
+      !ticosd_queue_write(handle->dead_letter, entry.payload, entry.payload_size_bytes)) {
+    fprintf(stderr, "txqueue:: Failed to keep %u bytes %s entry, dropping it.\n",
+            entry.payload_size_bytes, s_lane_names[lane]);
+  }
+  if (!ticosd_queue_complete_batch(handle->lanes[lane], 1)) {
+    return false;
+  }
+  pthread_mutex_lock(&handle->spill_lock);
+  handle->dead_letter_counts[lane]++;
+  pthread_mutex_unlock(&handle->spill_lock);
+  return true;
+}
+
+/**
+ * @brief Moves the entries of the dead-letter queue back into their lanes, to be sent again
+ *
+ * The entries start over with no failed attempts. Those that do not fit in their lane are left in
+ * the dead-letter queue.
+ *
+ * @param handle Transmit queue handle
+ * @return Number of entries moved
+ */
+uint32_t ticosd_txqueue_requeue_dead_letter(sTicosdTxQueue *handle) {
+  if (!handle->dead_letter) {
+    return 0;
+  }
+  uint32_t count = 0;
+  sTicosdQueueEntry entry;
+  while (ticosd_queue_peek_batch(handle->dead_letter, &entry, 1, UINT32_MAX) == 1) {
+    if (!ticosd_txqueue_write(handle, entry.payload, entry.payload_size_bytes)) {
+      ticosd_queue_release_head(handle->dead_letter);
+      break;
+    }
+    if (!ticosd_queue_complete_batch(handle->dead_letter, 1)) {
+      break;
+    }
+    count++;
+  }
+  return count;
+}
+
+/**
+ * @brief Returns the number of entries of a lane moved to the dead-letter queue
+ *
+ * @param handle Transmit queue handle
+ * @param lane Lane
+ */
+uint32_t ticosd_txqueue_get_dead_letter_count(sTicosdTxQueue *handle, eTicosdTxQueueLane lane) {
+  pthread_mutex_lock(&handle->spill_lock);
+  const uint32_t count = handle->dead_letter_counts[lane];
+  pthread_mutex_unlock(&handle->spill_lock);
+  return count;
+}
+
+/**
+ * @brief Returns the number of entries of a lane waiting in its spill segments
+ *
+ * @param handle Transmit queue handle
+ * @param lane Lane
+ */
+uint32_t ticosd_txqueue_get_spill_count(sTicosdTxQueue *handle, eTicosdTxQueueLane lane) {
+  if (!handle->spills[lane]) {
+    return 0;
+  }
+  pthread_mutex_lock(&handle->spill_lock);
+  const uint32_t count = ticosd_queue_spill_get_count(handle->spills[lane]);
+  pthread_mutex_unlock(&handle->spill_lock);
+  return count;
+}
+
+/**
+ * @brief Returns the number and size of the entries of a lane dropped because of the spill budget
+ *
+ * @param handle Transmit queue handle
+ * @param lane Lane
+ * @param[out] stats Dropped entries
+ */
+void ticosd_txqueue_get_drop_stats(sTicosdTxQueue *handle, eTicosdTxQueueLane lane,
+                                   sTicosdTxQueueDropStats *stats) {
+  pthread_mutex_lock(&handle->spill_lock);
+  *stats = handle->drops[lane];
+  pthread_mutex_unlock(&handle->spill_lock);
+}
@@ -0,0 +1,100 @@
+//! @file
+//!
+//! Copyright (c) Ticos, Inc.
+//! See License.txt for details
+//!
+//! @brief
+//! Transmit queue with one queue per priority lane, dequeued with weighted fair scheduling
+//!
+
+#ifndef __TICOS_TXQUEUE_H
+#define __TICOS_TXQUEUE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "queue.h"
+#include "ticosd.h"
+
+typedef struct TicosdTxQueue sTicosdTxQueue;
+
+//! Lanes of the transmit queue, each backed by its own queue file.
+typedef enum {
+  //! Small, latency-sensitive events: reboot events and unrecognised types.
+  kTicosdTxQueueLane_Events = 0,
+  //! Attributes PATCHes.
+  kTicosdTxQueueLane_Attributes,
+  //! Bulk uploads: coredumps.
+  kTicosdTxQueueLane_Bulk,
+  kTicosdTxQueueLane_NumLanes,
+} eTicosdTxQueueLane;
+
+typedef struct TicosdTxQueueLaneConfig {
+  //! Size of the lane's queue in bytes.
+  int size;
+  //! Number of entries dequeued from the lane in each scheduling round, at least 1.
+  int weight;
+} sTicosdTxQueueLaneConfig;
+
+//! What is dropped when the spill segments of the lanes reach their disk budget.
+typedef enum {
+  //! The oldest spilled entries of the lane being written to.
+  kTicosdTxQueueDropPolicy_DropOldest = 0,
+  //! The entry being written.
+  kTicosdTxQueueDropPolicy_DropNewest,
+  //! The oldest spilled entries of the lowest priority lane, but never of a lane with a higher
+  //! priority than the one being written to.
+  kTicosdTxQueueDropPolicy_DropByLane,
+} eTicosdTxQueueDropPolicy;
+
+typedef struct TicosdTxQueueConfig {
+  sTicosdTxQueueLaneConfig lanes[kTicosdTxQueueLane_NumLanes];
+  //! Disk budget of the spill segments of all lanes in bytes. 0 disables spilling, a full lane then
+  //! drops its oldest entries to make room.
+  uint64_t spill_budget;
+  //! Size of a spill segment file in bytes.
+  uint32_t spill_segment_size;
+  eTicosdTxQueueDropPolicy drop_policy;
+  //! How the queues of the lanes are persisted to their files.
+  eTicosdQueueBackend backend;
+  //! Size of the queue keeping the entries given up on in bytes, 0 to drop them instead.
+  int dead_letter_size;
+} sTicosdTxQueueConfig;
+
+typedef struct TicosdTxQueueDropStats {
+  uint32_t entries;
+  uint64_t bytes;
+} sTicosdTxQueueDropStats;
+
+sTicosdTxQueue *ticosd_txqueue_init(sTicosd *ticosd, const sTicosdTxQueueConfig *config);
+void ticosd_txqueue_destroy(sTicosdTxQueue *handle);
+eTicosdTxQueueLane ticosd_txqueue_lane_for_type(uint8_t type);
+const char *ticosd_txqueue_lane_name(eTicosdTxQueueLane lane);
+sTicosdQueue *ticosd_txqueue_get_lane(sTicosdTxQueue *handle, eTicosdTxQueueLane lane);
+void ticosd_txqueue_reset(sTicosdTxQueue *handle);
+bool ticosd_txqueue_write(sTicosdTxQueue *handle, const uint8_t *payload,
+                          uint32_t payload_size_bytes);
+uint32_t ticosd_txqueue_peek_batch(sTicosdTxQueue *handle, sTicosdQueueEntry *entries,
+                                   uint32_t max_count, uint32_t max_bytes);
+void ticosd_txqueue_release_head(sTicosdTxQueue *handle);
+bool ticosd_txqueue_complete_batch(sTicosdTxQueue *handle, uint32_t count);
+eTicosdTxQueueLane ticosd_txqueue_get_peeked_lane(sTicosdTxQueue *handle);
+void ticosd_txqueue_set_lane_paused(sTicosdTxQueue *handle, eTicosdTxQueueLane lane,
+                                    bool paused);
+uint32_t ticosd_txqueue_fail_head(sTicosdTxQueue *handle, eTicosdTxQueueLane lane);
+bool ticosd_txqueue_ack_entry(sTicosdTxQueue *handle, uint32_t index);
+bool ticosd_txqueue_dead_letter_head(sTicosdTxQueue *handle, eTicosdTxQueueLane lane);
+uint32_t ticosd_txqueue_requeue_dead_letter(sTicosdTxQueue *handle);
+uint32_t ticosd_txqueue_get_dead_letter_count(sTicosdTxQueue *handle, eTicosdTxQueueLane lane);
+uint32_t ticosd_txqueue_get_spill_count(sTicosdTxQueue *handle, eTicosdTxQueueLane lane);
+void ticosd_txqueue_get_drop_stats(sTicosdTxQueue *handle, eTicosdTxQueueLane lane,
+                                   sTicosdTxQueueDropStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,158 @@
+//! @file
+//!
+//! Copyright (c) Ticos, Inc.
+//! See License.txt for details
+//!
+//! @brief
+//! Backoff and circuit breaking of the endpoints the TX queue entries are sent to
+//!
+//! Each endpoint backs off on its own, so that an endpoint failing does not hold back the entries
+//! sent to the others. After a failure, the endpoint is retried after an exponential backoff with
+//! jitter: a random delay between half and all of the backoff, so that devices that failed
+//! together do not retry together. A Retry-After delay given by the server is honoured if it is
+//! longer.
+//!
+//! After breaker_threshold consecutive failures, the circuit of the endpoint opens: it is only
+//! tried again after the cooldown, and goes back to the regular backoff once a request succeeds.
+//!
+//! Only used by the thread that sends the entries.
+//!
+
+#include "txretry.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct TicosdTxRetryEndpoint {
+  //! @brief Number of consecutive failures.
+  uint32_t failures;
+  //! @brief Time before which the endpoint must not be tried, 0 if it can be tried right away.
+  uint64_t next_attempt_ms;
+} sTicosdTxRetryEndpoint;
+
+struct TicosdTxRetry {
+  sTicosdTxRetryConfig config;
+  unsigned int seed;
+  uint32_t endpoint_count;
+  sTicosdTxRetryEndpoint endpoints[];
+};
+
+/**
+ * @brief Initialises the backoff state of the endpoints
+ *
+ * @param config Backoff and circuit breaker settings
+ * @param endpoint_count Number of endpoints, identified by their index
+ * @return Retry object, NULL on failure
+ */
+sTicosdTxRetry *ticosd_txretry_init(const sTicosdTxRetryConfig *config, uint32_t endpoint_count) {
+  sTicosdTxRetry *handle =
+    calloc(sizeof(sTicosdTxRetry) + endpoint_count * sizeof(sTicosdTxRetryEndpoint), 1);
+  if (!handle) {
+    fprintf(stderr, "txretry:: Failed to allocate handle.\n");
+    return NULL;
+  }
+  handle->config = *config;
+  if (handle->config.max_backoff_ms < handle->config.first_backoff_ms) {
+    handle->config.max_backoff_ms = handle->config.first_backoff_ms;
+  }
+  handle->seed = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+  handle->endpoint_count = endpoint_count;
+  return handle;
+}
+
+/**
+ * @brief Destroys the retry object
+ *
+ * @param handle Retry object
+ */
+void ticosd_txretry_destroy(sTicosdTxRetry *handle) { free(handle); }
+
+/**
+ * @brief Accounts for a request to the endpoint that succeeded, closing its circuit
+ *
+ * @param handle Retry object
+ * @param endpoint Endpoint index
+ */
+void ticosd_txretry_record_success(sTicosdTxRetry *handle, uint32_t endpoint) {
+  handle->endpoints[endpoint] = (sTicosdTxRetryEndpoint){0};
+}
+
+/**
+ * @brief Accounts for a request to the endpoint that failed with a retry-able error
+ *
+ * @param handle Retry object
+ * @param endpoint Endpoint index
+ * @param now_ms Current time, on a monotonic clock
+ * @param retry_after_ms Delay requested by the server, 0 if none
+ * @return Time from which the endpoint can be tried again
+ */
+uint64_t ticosd_txretry_record_failure(sTicosdTxRetry *handle, uint32_t endpoint, uint64_t now_ms,
+                                       uint32_t retry_after_ms) {
+  const sTicosdTxRetryConfig *config = &handle->config;
+  sTicosdTxRetryEndpoint *state = &handle->endpoints[endpoint];
+  if (state->failures < UINT32_MAX) {
+    state->failures++;
+  }
+
+  uint64_t backoff_ms;
+  if (config->breaker_threshold > 0 && state->failures >= config->breaker_threshold) {
+    backoff_ms = config->breaker_cooldown_ms;
+  } else {
+    backoff_ms = config->first_backoff_ms;
+    for (uint32_t i = 1; i < state->failures && backoff_ms < config->max_backoff_ms; ++i) {
+      backoff_ms *= 2;
+    }
+    if (backoff_ms > config->max_backoff_ms) {
+      backoff_ms = config->max_backoff_ms;
+    }
+  }
+  uint64_t delay_ms = backoff_ms / 2 + (uint64_t)rand_r(&handle->seed) % (backoff_ms / 2 + 1);
+
+  // The server knows better, but must not be able to stall the endpoint for longer than an open
+  // circuit would:
+  uint64_t max_delay_ms = config->max_backoff_ms;
+  if (config->breaker_cooldown_ms > max_delay_ms) {
+    max_delay_ms = config->breaker_cooldown_ms;
+  }
+  if (retry_after_ms > delay_ms) {
+    delay_ms = retry_after_ms < max_delay_ms ? retry_after_ms : max_delay_ms;
+  }
+
+  state->next_attempt_ms = now_ms + delay_ms;
+  return state->next_attempt_ms;
+}
+
+/**
+ * @brief Returns whether a request can be sent to the endpoint
+ *
+ * @param handle Retry object
+ * @param endpoint Endpoint index
+ * @param now_ms Current time, on a monotonic clock
+ */
+bool ticosd_txretry_is_eligible(sTicosdTxRetry *handle, uint32_t endpoint, uint64_t now_ms) {
+  return now_ms >= handle->endpoints[endpoint].next_attempt_ms;
+}
+
+/**
+ * @brief Returns the time from which the endpoint can be tried again
+ *
+ * @param handle Retry object
+ * @param endpoint Endpoint index
+ * @return Time on a monotonic clock, 0 if the last request to the endpoint succeeded
+ */
+uint64_t ticosd_txretry_get_next_attempt(sTicosdTxRetry *handle, uint32_t endpoint) {
+  return handle->endpoints[endpoint].next_attempt_ms;
+}
+
+/**
+ * @brief Returns whether the circuit of the endpoint is open, after too many consecutive failures
+ *
+ * @param handle Retry object
+ * @param endpoint Endpoint index
+ */
+bool ticosd_txretry_is_open(sTicosdTxRetry *handle, uint32_t endpoint) {
+  return handle->config.breaker_threshold > 0 &&
+         handle->endpoints[endpoint].failures >= handle->config.breaker_threshold;
+}
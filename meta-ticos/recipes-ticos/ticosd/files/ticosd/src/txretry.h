@@ -0,0 +1,45 @@
+//! @file
+//!
+//! Copyright (c) Ticos, Inc.
+//! See License.txt for details
+//!
+//! @brief
+//! Backoff and circuit breaking of the endpoints the TX queue entries are sent to
+//!
+
+#ifndef __TICOS_TXRETRY_H
+#define __TICOS_TXRETRY_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct TicosdTxRetry sTicosdTxRetry;
+
+typedef struct TicosdTxRetryConfig {
+  //! Delay before retrying after a first failure, doubled with each consecutive failure.
+  uint32_t first_backoff_ms;
+  //! Maximum delay between retries.
+  uint32_t max_backoff_ms;
+  //! Number of consecutive failures from which the circuit of the endpoint opens, 0 for never.
+  uint32_t breaker_threshold;
+  //! Delay before an open circuit lets a request through again.
+  uint32_t breaker_cooldown_ms;
+} sTicosdTxRetryConfig;
+
+sTicosdTxRetry *ticosd_txretry_init(const sTicosdTxRetryConfig *config, uint32_t endpoint_count);
+void ticosd_txretry_destroy(sTicosdTxRetry *handle);
+void ticosd_txretry_record_success(sTicosdTxRetry *handle, uint32_t endpoint);
+uint64_t ticosd_txretry_record_failure(sTicosdTxRetry *handle, uint32_t endpoint, uint64_t now_ms,
+                                       uint32_t retry_after_ms);
+bool ticosd_txretry_is_eligible(sTicosdTxRetry *handle, uint32_t endpoint, uint64_t now_ms);
+uint64_t ticosd_txretry_get_next_attempt(sTicosdTxRetry *handle, uint32_t endpoint);
+bool ticosd_txretry_is_open(sTicosdTxRetry *handle, uint32_t endpoint);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,315 @@
+//! @file
+//!
+//! Copyright (c) Ticos, Inc.
+//! See License.txt for details
+//!
+//! @brief
+//! Statistics of the transmit queue: depth, age and losses of its lanes, and enqueue-to-ack
+//! latency of the entries sent
+//!
+//! The lane statistics are read from the queues when formatting, only the latencies are recorded
+//! here. Latencies are kept in fixed histograms per entry type, from one second to a week: an
+//! entry can sit in the queue for days while the device is offline.
+//!
+
+#include "txstats.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ticos/core/compiler.h"
+#include "ticos/core/math.h"
+#include "ticosd.h"
+
+//! Upper bounds of the latency buckets in seconds, the last bucket has no bound.
+static const uint32_t s_bucket_bounds[] = {1, 10, 60, 600, 3600, 21600, 86400, 604800};
+#define NUM_BUCKETS (TICOS_ARRAY_SIZE(s_bucket_bounds) + 1)
+
+typedef enum {
+  kTxStatsType_RebootEvent = 0,
+  kTxStatsType_CoreUpload,
+  kTxStatsType_CoreUploadWithGzip,
+  kTxStatsType_Attributes,
+  kTxStatsType_Other,
+  kTxStatsType_NumTypes,
+} eTxStatsType;
+
+static const char *const s_type_names[kTxStatsType_NumTypes] = {
+  [kTxStatsType_RebootEvent] = "reboot_event",
+  [kTxStatsType_CoreUpload] = "core_upload",
+  [kTxStatsType_CoreUploadWithGzip] = "core_upload_gzip",
+  [kTxStatsType_Attributes] = "attributes",
+  [kTxStatsType_Other] = "other",
+};
+
+typedef struct TxStatsHistogram {
+  uint32_t buckets[NUM_BUCKETS];
+  uint32_t count;
+  uint64_t max_s;
+} sTxStatsHistogram;
+
+struct TicosdTxStats {
+  pthread_mutex_t lock;
+  sTxStatsHistogram latency[kTxStatsType_NumTypes];
+};
+
+typedef struct TxStatsBuffer {
+  char *str;
+  size_t len;
+  size_t capacity;
+  bool failed;
+} sTxStatsBuffer;
+
+static eTxStatsType prv_txstats_type(uint8_t type) {
+  switch (type) {
+    case kTicosdTxDataType_RebootEvent:
+      return kTxStatsType_RebootEvent;
+    case kTicosdTxDataType_CoreUpload:
+      return kTxStatsType_CoreUpload;
+    case kTicosdTxDataType_CoreUploadWithGzip:
+      return kTxStatsType_CoreUploadWithGzip;
+    case kTicosdTxDataType_Attributes:
+      return kTxStatsType_Attributes;
+    default:
+      return kTxStatsType_Other;
+  }
+}
+
+TICOS_PRINTF_LIKE_FUNC(2, 3)
+static void prv_append(sTxStatsBuffer *buf, const char *fmt, ...) {
+  if (buf->failed) {
+    return;
+  }
+  va_list args;
+  va_start(args, fmt);
+  va_list args_copy;
+  va_copy(args_copy, args);
+  const int len = vsnprintf(buf->str ? buf->str + buf->len : NULL, buf->capacity - buf->len, fmt,
+                            args);
+  va_end(args);
+  if (len < 0) {
+    buf->failed = true;
+    goto cleanup;
+  }
+  if (buf->len + len >= buf->capacity) {
+    const size_t capacity = TICOS_MAX(buf->capacity * 2, buf->len + len + 1);
+    char *str = realloc(buf->str, capacity);
+    if (!str) {
+      buf->failed = true;
+      goto cleanup;
+    }
+    buf->str = str;
+    buf->capacity = capacity;
+    vsnprintf(buf->str + buf->len, buf->capacity - buf->len, fmt, args_copy);
+  }
+  buf->len += len;
+
+cleanup:
+  va_end(args_copy);
+}
+
+static char *prv_finish(sTxStatsBuffer *buf) {
+  if (buf->failed) {
+    fprintf(stderr, "txstats:: Failed to allocate memory for statistics\n");
+    free(buf->str);
+    return NULL;
+  }
+  return buf->str;
+}
+
+/**
+ * @brief Returns an approximation of a latency percentile: the upper bound of the bucket it falls
+ * in, or the maximum latency for the last bucket
+ */
+static uint64_t prv_percentile_s(const sTxStatsHistogram *histogram, uint32_t percent) {
+  if (histogram->count == 0) {
+    return 0;
+  }
+  const uint64_t target = ((uint64_t)histogram->count * percent + 99) / 100;
+  uint64_t cumulative = 0;
+  for (size_t i = 0; i < NUM_BUCKETS - 1; ++i) {
+    cumulative += histogram->buckets[i];
+    if (cumulative >= target) {
+      return TICOS_MIN(s_bucket_bounds[i], histogram->max_s);
+    }
+  }
+  return histogram->max_s;
+}
+
+static uint64_t prv_age_s(time_t timestamp, time_t now) {
+  return (timestamp == 0 || now < timestamp) ? 0 : (uint64_t)(now - timestamp);
+}
+
+/**
+ * @brief Initialises the transmit queue statistics
+ *
+ * @return Statistics handle, NULL on error
+ */
+sTicosdTxStats *ticosd_txstats_init(void) {
+  sTicosdTxStats *handle = calloc(sizeof(sTicosdTxStats), 1);
+  if (!handle) {
+    fprintf(stderr, "txstats:: Failed to allocate statistics handle\n");
+    return NULL;
+  }
+  pthread_mutex_init(&handle->lock, NULL);
+  return handle;
+}
+
+/**
+ * @brief Destroys the transmit queue statistics
+ *
+ * @param handle Statistics handle
+ */
+void ticosd_txstats_destroy(sTicosdTxStats *handle) {
+  if (!handle) {
+    return;
+  }
+  pthread_mutex_destroy(&handle->lock);
+  free(handle);
+}
+
+/**
+ * @brief Records the latency of an entry sent and acknowledged by the server
+ *
+ * @param handle Statistics handle
+ * @param type Entry type, an eTicosdTxDataType value
+ * @param enqueue_time Time the entry was written to the queue, 0 if unknown, in which case nothing
+ * is recorded
+ * @param now Current time
+ */
+void ticosd_txstats_record_ack(sTicosdTxStats *handle, uint8_t type, time_t enqueue_time,
+                               time_t now) {
+  if (enqueue_time == 0) {
+    return;
+  }
+  // The clock may have been stepped back since the entry was queued:
+  const uint64_t latency_s = prv_age_s(enqueue_time, now);
+
+  size_t bucket = 0;
+  while (bucket < NUM_BUCKETS - 1 && latency_s > s_bucket_bounds[bucket]) {
+    bucket++;
+  }
+
+  pthread_mutex_lock(&handle->lock);
+  sTxStatsHistogram *histogram = &handle->latency[prv_txstats_type(type)];
+  histogram->buckets[bucket]++;
+  histogram->count++;
+  histogram->max_s = TICOS_MAX(histogram->max_s, latency_s);
+  pthread_mutex_unlock(&handle->lock);
+}
+
+/**
+ * @brief Formats the statistics of the transmit queue as a JSON object
+ *
+ * @param handle Statistics handle
+ * @param txqueue Transmit queue to report the lanes of
+ * @param now Current time, to compute ages
+ * @return JSON string to free() by the caller, NULL on error
+ */
+char *ticosd_txstats_to_json(sTicosdTxStats *handle, sTicosdTxQueue *txqueue, time_t now) {
+  sTxStatsBuffer buf = {0};
+
+  prv_append(&buf, "{\"lanes\": {");
+  for (int lane = 0; lane < kTicosdTxQueueLane_NumLanes; ++lane) {
+    sTicosdQueueStats stats;
+    ticosd_queue_get_stats(ticosd_txqueue_get_lane(txqueue, lane), &stats);
+    sTicosdTxQueueDropStats drops;
+    ticosd_txqueue_get_drop_stats(txqueue, lane, &drops);
+
+    prv_append(&buf,
+               "%s\"%s\": {\"unread_count\": %u, \"unread_bytes\": %llu, "
+               "\"oldest_unread_age_s\": %llu, \"overwritten_count\": %u, "
+               "\"overwritten_bytes\": %llu, \"expired_count\": %u, \"expired_bytes\": %llu, "
+               "\"spilled_count\": %u, \"dropped_count\": %u, \"dropped_bytes\": %llu}",
+               lane == 0 ? "" : ", ", ticosd_txqueue_lane_name(lane), stats.unread_count,
+               (unsigned long long)stats.unread_bytes,
+               (unsigned long long)prv_age_s(stats.oldest_unread_timestamp, now),
+               stats.overwritten_count, (unsigned long long)stats.overwritten_bytes,
+               stats.expired_count, (unsigned long long)stats.expired_bytes,
+               ticosd_txqueue_get_spill_count(txqueue, lane), drops.entries,
+               (unsigned long long)drops.bytes);
+  }
+
+  prv_append(&buf, "}, \"ack_latency_s\": {\"bucket_bounds\": [");
+  for (size_t i = 0; i < NUM_BUCKETS - 1; ++i) {
+    prv_append(&buf, "%s%u", i == 0 ? "" : ", ", s_bucket_bounds[i]);
+  }
+  prv_append(&buf, "]");
+
+  pthread_mutex_lock(&handle->lock);
+  for (int type = 0; type < kTxStatsType_NumTypes; ++type) {
+    const sTxStatsHistogram *histogram = &handle->latency[type];
+    prv_append(&buf, ", \"%s\": {\"count\": %u, \"max\": %llu, \"buckets\": [", s_type_names[type],
+               histogram->count, (unsigned long long)histogram->max_s);
+    for (size_t i = 0; i < NUM_BUCKETS; ++i) {
+      prv_append(&buf, "%s%u", i == 0 ? "" : ", ", histogram->buckets[i]);
+    }
+    prv_append(&buf, "]}");
+  }
+  pthread_mutex_unlock(&handle->lock);
+
+  prv_append(&buf, "}}");
+  return prv_finish(&buf);
+}
+
+/**
+ * @brief Formats the statistics of the transmit queue as an attributes JSON array, to be sent
+ * along with the device's other attributes
+ *
+ * Histograms do not fit in attributes, the latencies are summarised by their approximate median
+ * and 95th percentile.
+ *
+ * @param handle Statistics handle
+ * @param txqueue Transmit queue to report the lanes of
+ * @param now Current time, to compute ages
+ * @return JSON string to free() by the caller, NULL on error
+ */
+char *ticosd_txstats_to_attributes_json(sTicosdTxStats *handle, sTicosdTxQueue *txqueue,
+                                        time_t now) {
+  sTxStatsBuffer buf = {0};
+
+  prv_append(&buf, "[");
+  for (int lane = 0; lane < kTicosdTxQueueLane_NumLanes; ++lane) {
+    sTicosdQueueStats stats;
+    ticosd_queue_get_stats(ticosd_txqueue_get_lane(txqueue, lane), &stats);
+    sTicosdTxQueueDropStats drops;
+    ticosd_txqueue_get_drop_stats(txqueue, lane, &drops);
+
+    const char *name = ticosd_txqueue_lane_name(lane);
+    prv_append(&buf,
+               "%s{\"string_key\": \"ticosd_queue_%s_depth\", \"value\": %u}, "
+               "{\"string_key\": \"ticosd_queue_%s_oldest_age_s\", \"value\": %llu}, "
+               "{\"string_key\": \"ticosd_queue_%s_overwritten\", \"value\": %u}, "
+               "{\"string_key\": \"ticosd_queue_%s_expired\", \"value\": %u}, "
+               "{\"string_key\": \"ticosd_queue_%s_dropped\", \"value\": %u}, "
+               "{\"string_key\": \"ticosd_queue_%s_dead_lettered\", \"value\": %u}",
+               lane == 0 ? "" : ", ", name,
+               stats.unread_count + ticosd_txqueue_get_spill_count(txqueue, lane), name,
+               (unsigned long long)prv_age_s(stats.oldest_unread_timestamp, now), name,
+               stats.overwritten_count, name, stats.expired_count, name, drops.entries, name,
+               ticosd_txqueue_get_dead_letter_count(txqueue, lane));
+  }
+
+  pthread_mutex_lock(&handle->lock);
+  for (int type = 0; type < kTxStatsType_NumTypes; ++type) {
+    const sTxStatsHistogram *histogram = &handle->latency[type];
+    if (histogram->count == 0) {
+      continue;
+    }
+    const char *name = s_type_names[type];
+    prv_append(&buf,
+               ", {\"string_key\": \"ticosd_ack_%s_count\", \"value\": %u}, "
+               "{\"string_key\": \"ticosd_ack_%s_p50_s\", \"value\": %llu}, "
+               "{\"string_key\": \"ticosd_ack_%s_p95_s\", \"value\": %llu}",
+               name, histogram->count, name,
+               (unsigned long long)prv_percentile_s(histogram, 50), name,
+               (unsigned long long)prv_percentile_s(histogram, 95));
+  }
+  pthread_mutex_unlock(&handle->lock);
+
+  prv_append(&buf, "]");
+  return prv_finish(&buf);
+}
@@ -0,0 +1,36 @@
+//! @file
+//!
+//! Copyright (c) Ticos, Inc.
+//! See License.txt for details
+//!
+//! @brief
+//! Statistics of the transmit queue: depth, age and losses of its lanes, and enqueue-to-ack
+//! latency of the entries sent
+//!
+
+#ifndef __TICOS_TXSTATS_H
+#define __TICOS_TXSTATS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <time.h>
+
+#include "txqueue.h"
+
+typedef struct TicosdTxStats sTicosdTxStats;
+
+sTicosdTxStats *ticosd_txstats_init(void);
+void ticosd_txstats_destroy(sTicosdTxStats *handle);
+void ticosd_txstats_record_ack(sTicosdTxStats *handle, uint8_t type, time_t enqueue_time,
+                               time_t now);
+char *ticosd_txstats_to_json(sTicosdTxStats *handle, sTicosdTxQueue *txqueue, time_t now);
+char *ticosd_txstats_to_attributes_json(sTicosdTxStats *handle, sTicosdTxQueue *txqueue,
+                                        time_t now);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
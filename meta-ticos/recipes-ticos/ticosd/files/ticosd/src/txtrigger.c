@@ -0,0 +1,200 @@
+//! @file
+//!
+//! Copyright (c) Ticos, Inc.
+//! See License.txt for details
+//!
+//! @brief
+//! Decides when the entries queued for transmission are worth sending, and wakes up the main loop
+//! then
+//!
+//! Entries are not sent one by one as they are queued, which would keep the network up: the first
+//! entry queued opens a coalescing window, and the entries queued meanwhile are sent along with it
+//! once the window closes, or as soon as enough of them have piled up. Each type can have its own
+//! window, for entries that must get out quickly or that can wait longer.
+//!
+//! The main loop polls the eventfd, which is signalled whenever the trigger becomes due earlier
+//! than it last knew: on the first entry of a window, on an entry with a shorter window, and when
+//! the batch is full. Other entries do not make any system call.
+//!
+
+#include "txtrigger.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+struct TicosdTxTrigger {
+  pthread_mutex_t lock;
+  //! @brief Signalled when the main loop should look at the trigger again.
+  int event_fd;
+  //! @brief Default coalescing window.
+  uint32_t delay_ms;
+  //! @brief Number of entries from which they are sent without waiting for the window to close.
+  uint32_t batch_count;
+  //! @brief Per-type coalescing windows, indexed by eTicosdTxDataType, 0 if delay_ms applies.
+  uint32_t type_max_latency_ms[UINT8_MAX + 1];
+  //! @brief Number of entries queued since the last reset.
+  uint32_t pending_count;
+  //! @brief Time by which the entries queued since the last reset must be sent, UINT64_MAX if
+  //! there are none.
+  uint64_t deadline_ms;
+};
+
+/**
+ * @brief Initialises the trigger
+ *
+ * @param delay_ms Time queued entries are held back for more entries to send along with them
+ * @param batch_count Number of entries from which they are sent right away, 0 for no limit
+ * @return Trigger object, NULL on failure
+ */
+sTicosdTxTrigger *ticosd_txtrigger_init(uint32_t delay_ms, uint32_t batch_count) {
+  sTicosdTxTrigger *handle = calloc(sizeof(sTicosdTxTrigger), 1);
+  if (!handle) {
+    fprintf(stderr, "txtrigger:: Failed to allocate handle.\n");
+    return NULL;
+  }
+  handle->delay_ms = delay_ms;
+  handle->batch_count = batch_count;
+  handle->deadline_ms = UINT64_MAX;
+
+  if ((handle->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1) {
+    fprintf(stderr, "txtrigger:: Failed to create eventfd: %s\n", strerror(errno));
+    free(handle);
+    return NULL;
+  }
+  pthread_mutex_init(&handle->lock, NULL);
+  return handle;
+}
+
+/**
+ * @brief Destroys the trigger
+ *
+ * @param handle Trigger object
+ */
+void ticosd_txtrigger_destroy(sTicosdTxTrigger *handle) {
+  if (handle) {
+    close(handle->event_fd);
+    pthread_mutex_destroy(&handle->lock);
+    free(handle);
+  }
+}
+
+/**
+ * @brief Sets how long entries of the given type are held back at most, instead of the default
+ * coalescing window
+ *
+ * @param handle Trigger object
+ * @param type Entry type (eTicosdTxDataType)
+ * @param max_latency_ms Maximum time in milliseconds, 0 for the default window
+ */
+void ticosd_txtrigger_set_type_max_latency(sTicosdTxTrigger *handle, uint8_t type,
+                                           uint32_t max_latency_ms) {
+  pthread_mutex_lock(&handle->lock);
+  handle->type_max_latency_ms[type] = max_latency_ms;
+  pthread_mutex_unlock(&handle->lock);
+}
+
+/**
+ * @brief Returns the file descriptor to poll for readability, to learn that the trigger changed
+ *
+ * @param handle Trigger object
+ */
+int ticosd_txtrigger_get_fd(sTicosdTxTrigger *handle) { return handle->event_fd; }
+
+/**
+ * @brief Clears the readability of the file descriptor, once it has been polled
+ *
+ * @param handle Trigger object
+ */
+void ticosd_txtrigger_clear_fd(sTicosdTxTrigger *handle) {
+  uint64_t value;
+  if (read(handle->event_fd, &value, sizeof(value)) == -1 && errno != EAGAIN) {
+    fprintf(stderr, "txtrigger:: Failed to read eventfd: %s\n", strerror(errno));
+  }
+}
+
+/**
+ * @brief Accounts for an entry that was just queued
+ *
+ * @param handle Trigger object
+ * @param type Entry type (eTicosdTxDataType)
+ * @param now_ms Current time, from ticosd_txtrigger_now_ms()
+ */
+void ticosd_txtrigger_notify(sTicosdTxTrigger *handle, uint8_t type, uint64_t now_ms) {
+  pthread_mutex_lock(&handle->lock);
+  const uint32_t max_latency_ms =
+    handle->type_max_latency_ms[type] ? handle->type_max_latency_ms[type] : handle->delay_ms;
+  const uint64_t deadline_ms = now_ms + max_latency_ms;
+  bool wake = false;
+  if (deadline_ms < handle->deadline_ms) {
+    handle->deadline_ms = deadline_ms;
+    wake = true;
+  }
+  if (++handle->pending_count == handle->batch_count) {
+    wake = true;
+  }
+  pthread_mutex_unlock(&handle->lock);
+
+  if (wake) {
+    const uint64_t value = 1;
+    if (write(handle->event_fd, &value, sizeof(value)) == -1 && errno != EAGAIN) {
+      fprintf(stderr, "txtrigger:: Failed to write eventfd: %s\n", strerror(errno));
+    }
+  }
+}
+
+/**
+ * @brief Checks whether the entries queued since the last reset should be sent now
+ *
+ * @param handle Trigger object
+ * @param now_ms Current time, from ticosd_txtrigger_now_ms()
+ */
+bool ticosd_txtrigger_is_due(sTicosdTxTrigger *handle, uint64_t now_ms) {
+  pthread_mutex_lock(&handle->lock);
+  const bool is_due =
+    (handle->batch_count > 0 && handle->pending_count >= handle->batch_count) ||
+    now_ms >= handle->deadline_ms;
+  pthread_mutex_unlock(&handle->lock);
+  return is_due;
+}
+
+/**
+ * @brief Returns the time by which the entries queued since the last reset must be sent
+ *
+ * @param handle Trigger object
+ * @return Deadline, as ticosd_txtrigger_now_ms(), UINT64_MAX if no entry was queued
+ */
+uint64_t ticosd_txtrigger_get_deadline(sTicosdTxTrigger *handle) {
+  pthread_mutex_lock(&handle->lock);
+  const uint64_t deadline_ms = handle->deadline_ms;
+  pthread_mutex_unlock(&handle->lock);
+  return deadline_ms;
+}
+
+/**
+ * @brief Forgets about the entries queued so far, before sending them
+ *
+ * Entries queued from then on open a new window, even if they make it in the ongoing send.
+ *
+ * @param handle Trigger object
+ */
+void ticosd_txtrigger_reset(sTicosdTxTrigger *handle) {
+  pthread_mutex_lock(&handle->lock);
+  handle->pending_count = 0;
+  handle->deadline_ms = UINT64_MAX;
+  pthread_mutex_unlock(&handle->lock);
+}
+
+/**
+ * @brief Returns the current time of the monotonic clock, in milliseconds
+ */
+uint64_t ticosd_txtrigger_now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
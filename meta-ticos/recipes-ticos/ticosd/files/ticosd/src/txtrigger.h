@@ -0,0 +1,38 @@
+//! @file
+//!
+//! Copyright (c) Ticos, Inc.
+//! See License.txt for details
+//!
+//! @brief
+//! Decides when the entries queued for transmission are worth sending, and wakes up the main loop
+//! then
+//!
+
+#ifndef __TICOS_TXTRIGGER_H
+#define __TICOS_TXTRIGGER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct TicosdTxTrigger sTicosdTxTrigger;
+
+sTicosdTxTrigger *ticosd_txtrigger_init(uint32_t delay_ms, uint32_t batch_count);
+void ticosd_txtrigger_destroy(sTicosdTxTrigger *handle);
+void ticosd_txtrigger_set_type_max_latency(sTicosdTxTrigger *handle, uint8_t type,
+                                           uint32_t max_latency_ms);
+int ticosd_txtrigger_get_fd(sTicosdTxTrigger *handle);
+void ticosd_txtrigger_clear_fd(sTicosdTxTrigger *handle);
+void ticosd_txtrigger_notify(sTicosdTxTrigger *handle, uint8_t type, uint64_t now_ms);
+bool ticosd_txtrigger_is_due(sTicosdTxTrigger *handle, uint64_t now_ms);
+uint64_t ticosd_txtrigger_get_deadline(sTicosdTxTrigger *handle);
+void ticosd_txtrigger_reset(sTicosdTxTrigger *handle);
+uint64_t ticosd_txtrigger_now_ms(void);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,147 @@
+//! @file
+//!
+//! Copyright (c) Ticos, Inc.
+//! See License.txt for details
+//!
+//! @brief
+//! Progress of a resumable file upload, persisted in a sidecar file next to the uploaded file
+//!
+//! The sidecar of "<file>" is "<file>.progress", a two-line text file:
+//!
+//!   <version> <file size> <part size> <offset>
+//!   <upload URL>
+//!
+//! It is rewritten through a temporary file and a rename, after each part the server
+//! acknowledges. It is not synced: after a power loss it may be behind or missing, and the parts
+//! since are sent again, which the server accepts.
+//!
+
+#include "upload_progress.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ticos/util/string.h"
+
+#define UPLOAD_PROGRESS_VERSION 1
+
+static char *prv_sidecar_path(const char *filename, const char *suffix) {
+  char *path;
+  if (ticos_asprintf(&path, "%s.progress%s", filename, suffix) == -1) {
+    fprintf(stderr, "upload_progress:: Failed to allocate path\n");
+    return NULL;
+  }
+  return path;
+}
+
+/**
+ * @brief Loads the progress of the upload of a file
+ *
+ * @param filename Uploaded file
+ * @param[out] progress Progress, to be freed with ticosd_upload_progress_free()
+ * @return true Loaded the progress
+ * @return false There is none, or it is unreadable, the upload starts over
+ */
+bool ticosd_upload_progress_load(const char *filename, sTicosdUploadProgress *progress) {
+  *progress = (sTicosdUploadProgress){0};
+  char *path = prv_sidecar_path(filename, "");
+  if (!path) {
+    return false;
+  }
+
+  bool result = false;
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    goto cleanup;
+  }
+
+  unsigned int version;
+  unsigned long long file_size, offset;
+  unsigned int part_size;
+  if (fscanf(file, "%u %llu %u %llu\n", &version, &file_size, &part_size, &offset) != 4 ||
+      version != UPLOAD_PROGRESS_VERSION || offset > file_size || part_size == 0) {
+    fprintf(stderr, "upload_progress:: Ignoring invalid progress file '%s'\n", path);
+    goto cleanup;
+  }
+
+  size_t len = 0;
+  const ssize_t read = getline(&progress->upload_url, &len, file);
+  if (read <= 1 || progress->upload_url[read - 1] != '\n') {
+    fprintf(stderr, "upload_progress:: Ignoring invalid progress file '%s'\n", path);
+    goto cleanup;
+  }
+  progress->upload_url[read - 1] = '\0';
+  progress->file_size = file_size;
+  progress->part_size = part_size;
+  progress->offset = offset;
+  result = true;
+
+cleanup:
+  if (!result) {
+    ticosd_upload_progress_free(progress);
+  }
+  if (file) {
+    fclose(file);
+  }
+  free(path);
+  return result;
+}
+
+/**
+ * @brief Saves the progress of the upload of a file
+ *
+ * @param filename Uploaded file
+ * @param progress Progress
+ * @return true Saved the progress
+ * @return false Failed to, the upload goes on but would start over if interrupted
+ */
+bool ticosd_upload_progress_save(const char *filename, const sTicosdUploadProgress *progress) {
+  char *path = prv_sidecar_path(filename, "");
+  char *tmp_path = prv_sidecar_path(filename, ".tmp");
+  bool result = false;
+  if (!path || !tmp_path) {
+    goto cleanup;
+  }
+
+  FILE *file = fopen(tmp_path, "w");
+  if (!file) {
+    fprintf(stderr, "upload_progress:: Failed to open '%s' : %s\n", tmp_path, strerror(errno));
+    goto cleanup;
+  }
+  const bool written =
+    fprintf(file, "%u %llu %u %llu\n%s\n", UPLOAD_PROGRESS_VERSION,
+            (unsigned long long)progress->file_size, progress->part_size,
+            (unsigned long long)progress->offset, progress->upload_url) > 0;
+  if (fclose(file) != 0 || !written || rename(tmp_path, path) == -1) {
+    fprintf(stderr, "upload_progress:: Failed to write '%s' : %s\n", path, strerror(errno));
+    unlink(tmp_path);
+    goto cleanup;
+  }
+  result = true;
+
+cleanup:
+  free(tmp_path);
+  free(path);
+  return result;
+}
+
+/**
+ * @brief Removes the progress of the upload of a file, once it completed or must start over
+ *
+ * @param filename Uploaded file
+ */
+void ticosd_upload_progress_remove(const char *filename) {
+  char *path = prv_sidecar_path(filename, "");
+  if (path && unlink(path) == -1 && errno != ENOENT) {
+    fprintf(stderr, "upload_progress:: Failed to remove '%s' : %s\n", path, strerror(errno));
+  }
+  free(path);
+}
+
+void ticosd_upload_progress_free(sTicosdUploadProgress *progress) {
+  free(progress->upload_url);
+  progress->upload_url = NULL;
+}
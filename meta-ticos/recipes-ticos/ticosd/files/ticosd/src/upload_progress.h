@@ -0,0 +1,39 @@
+//! @file
+//!
+//! Copyright (c) Ticos, Inc.
+//! See License.txt for details
+//!
+//! @brief
+//! Progress of a resumable file upload, persisted in a sidecar file next to the uploaded file
+//!
+
+#ifndef __TICOS_UPLOAD_PROGRESS_H
+#define __TICOS_UPLOAD_PROGRESS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct TicosdUploadProgress {
+  //! URL the parts are uploaded to.
+  char *upload_url;
+  //! Size of the uploaded file.
+  uint64_t file_size;
+  //! Size of the parts, the last one excepted.
+  uint32_t part_size;
+  //! Number of bytes acknowledged by the server, at a part boundary.
+  uint64_t offset;
+} sTicosdUploadProgress;
+
+bool ticosd_upload_progress_load(const char *filename, sTicosdUploadProgress *progress);
+bool ticosd_upload_progress_save(const char *filename, const sTicosdUploadProgress *progress);
+void ticosd_upload_progress_remove(const char *filename);
+void ticosd_upload_progress_free(sTicosdUploadProgress *progress);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,158 @@
+//! @file
+//!
+//! Copyright (c) Ticos, Inc.
+//! See License.txt for details
+//!
+//! @brief
+//! CRC-32C (Castagnoli) checksum implementation.
+
+#include "ticos/util/crc32c.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+  #include <nmmintrin.h>
+  #define CRC32C_HAVE_SSE42 1
+#elif defined(__ARM_FEATURE_CRC32)
+  #include <arm_acle.h>
+  #define CRC32C_HAVE_ARMV8 1
+#endif
+
+//! Reversed representation of the Castagnoli polynomial 0x1EDC6F41
+#define CRC32C_POLY 0x82f63b78u
+
+typedef uint32_t (*crc32c_impl)(uint32_t crc, const uint8_t *data, size_t len);
+
+static uint32_t s_crc32c_table[8][256];
+static crc32c_impl s_crc32c_impl;
+static pthread_once_t s_crc32c_once = PTHREAD_ONCE_INIT;
+
+static uint32_t prv_crc32c_sw(uint32_t crc, const uint8_t *data, size_t len) {
+  // Process single bytes until the pointer is 8-byte aligned:
+  while (len > 0 && ((uintptr_t)data & 7) != 0) {
+    crc = s_crc32c_table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    len--;
+  }
+
+  // Slice-by-8: two 32-bit words per iteration, as little-endian values:
+  while (len >= 8) {
+    const uint32_t lo = crc ^ ((uint32_t)data[0] | (uint32_t)data[1] << 8 |
+                               (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24);
+    const uint32_t hi = (uint32_t)data[4] | (uint32_t)data[5] << 8 | (uint32_t)data[6] << 16 |
+                        (uint32_t)data[7] << 24;
+    crc = s_crc32c_table[7][lo & 0xff] ^ s_crc32c_table[6][(lo >> 8) & 0xff] ^
+          s_crc32c_table[5][(lo >> 16) & 0xff] ^ s_crc32c_table[4][lo >> 24] ^
+          s_crc32c_table[3][hi & 0xff] ^ s_crc32c_table[2][(hi >> 8) & 0xff] ^
+          s_crc32c_table[1][(hi >> 16) & 0xff] ^ s_crc32c_table[0][hi >> 24];
+    data += 8;
+    len -= 8;
+  }
+
+  while (len > 0) {
+    crc = s_crc32c_table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    len--;
+  }
+  return crc;
+}
+
+#if defined(CRC32C_HAVE_SSE42)
+__attribute__((target("sse4.2"))) static uint32_t prv_crc32c_sse42(uint32_t crc,
+                                                                    const uint8_t *data,
+                                                                    size_t len) {
+  #if defined(__x86_64__)
+  uint64_t crc64 = crc;
+  while (len >= 8) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
+    data += 8;
+    len -= 8;
+  }
+  crc = (uint32_t)crc64;
+  #endif
+  while (len >= 4) {
+    uint32_t word;
+    memcpy(&word, data, sizeof(word));
+    crc = _mm_crc32_u32(crc, word);
+    data += 4;
+    len -= 4;
+  }
+  while (len > 0) {
+    crc = _mm_crc32_u8(crc, *data++);
+    len--;
+  }
+  return crc;
+}
+#endif
+
+#if defined(CRC32C_HAVE_ARMV8)
+static uint32_t prv_crc32c_armv8(uint32_t crc, const uint8_t *data, size_t len) {
+  #if defined(__aarch64__)
+  while (len >= 8) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    crc = __crc32cd(crc, word);
+    data += 8;
+    len -= 8;
+  }
+  #endif
+  while (len >= 4) {
+    uint32_t word;
+    memcpy(&word, data, sizeof(word));
+    crc = __crc32cw(crc, word);
+    data += 4;
+    len -= 4;
+  }
+  while (len > 0) {
+    crc = __crc32cb(crc, *data++);
+    len--;
+  }
+  return crc;
+}
+#endif
+
+static void prv_crc32c_init(void) {
+  for (uint32_t i = 0; i < 256; ++i) {
+    uint32_t crc = i;
+    for (uint32_t j = 0; j < 8; ++j) {
+      crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+    }
+    s_crc32c_table[0][i] = crc;
+  }
+  for (uint32_t i = 0; i < 256; ++i) {
+    for (uint32_t slice = 1; slice < 8; ++slice) {
+      const uint32_t prev = s_crc32c_table[slice - 1][i];
+      s_crc32c_table[slice][i] = s_crc32c_table[0][prev & 0xff] ^ (prev >> 8);
+    }
+  }
+
+  s_crc32c_impl = prv_crc32c_sw;
+#if defined(CRC32C_HAVE_SSE42)
+  if (__builtin_cpu_supports("sse4.2")) {
+    s_crc32c_impl = prv_crc32c_sse42;
+  }
+#elif defined(CRC32C_HAVE_ARMV8)
+  s_crc32c_impl = prv_crc32c_armv8;
+#endif
+}
+
+uint32_t ticos_crc32c(uint32_t crc, const void *data, size_t len) {
+  pthread_once(&s_crc32c_once, prv_crc32c_init);
+  return ~s_crc32c_impl(~crc, data, len);
+}
+
+#ifdef TICOS_UNITTEST
+
+uint32_t ticos_crc32c_sw(uint32_t crc, const void *data, size_t len) {
+  pthread_once(&s_crc32c_once, prv_crc32c_init);
+  return ~prv_crc32c_sw(~crc, data, len);
+}
+
+bool ticos_crc32c_is_hw_accelerated(void) {
+  pthread_once(&s_crc32c_once, prv_crc32c_init);
+  return s_crc32c_impl != prv_crc32c_sw;
+}
+
+#endif
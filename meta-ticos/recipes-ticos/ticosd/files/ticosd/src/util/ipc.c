@@ -13,6 +13,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/un.h>
 #include <unistd.h>
@@ -46,6 +47,53 @@ bool ticosd_ipc_sendmsg(uint8_t *msg, size_t len) {
   return (size_t)result == len;
 }
 
+//! How long to wait for ticosd to reply to a request.
+#define IPC_REQUEST_TIMEOUT_SECONDS 2
+
+bool ticosd_ipc_request(const uint8_t *msg, size_t len, char *reply, size_t reply_size) {
+  bool result = false;
+  int fd;
+
+  if ((fd = socket(AF_UNIX, SOCK_DGRAM, 0)) == -1) {
+    fprintf(stderr, "Failed to create socket() : %s\n", strerror(errno));
+    return false;
+  }
+
+  // Bind to an autobind abstract address, so that ticosd has an address to reply to:
+  struct sockaddr_un client_addr = {.sun_family = AF_UNIX};
+  if (bind(fd, (const struct sockaddr *)&client_addr, sizeof(sa_family_t)) == -1) {
+    fprintf(stderr, "Failed to bind() reply socket : %s\n", strerror(errno));
+    goto cleanup;
+  }
+
+  const struct timeval timeout = {.tv_sec = IPC_REQUEST_TIMEOUT_SECONDS};
+  if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1) {
+    fprintf(stderr, "Failed to set reply timeout : %s\n", strerror(errno));
+    goto cleanup;
+  }
+
+  struct sockaddr_un server_addr = {.sun_family = AF_UNIX};
+  strncpy(server_addr.sun_path, TICOSD_IPC_SOCKET_PATH, sizeof(server_addr.sun_path) - 1);
+
+  if (sendto(fd, msg, len, 0, (const struct sockaddr *)&server_addr, sizeof(server_addr)) !=
+      (ssize_t)len) {
+    fprintf(stderr, "Failed to communicate with ticosd : %s\n", strerror(errno));
+    goto cleanup;
+  }
+
+  const ssize_t received = recv(fd, reply, reply_size - 1, 0);
+  if (received == -1) {
+    fprintf(stderr, "No reply from ticosd : %s\n", strerror(errno));
+    goto cleanup;
+  }
+  reply[received] = '\0';
+  result = true;
+
+cleanup:
+  close(fd);
+  return result;
+}
+
 bool ticosd_send_flush_queue_signal(void) {
   int pid = ticosd_get_pid();
   if (pid == -1) {
@@ -0,0 +1,586 @@
+//! @file
+//!
+//! Copyright (c) Ticos, Inc.
+//! See License.txt for details
+//!
+//! @brief
+//! Microbenchmarks of queue.c
+//!
+//! Prints one JSON object per line and measurement, to compare builds with e.g. jq:
+//!   {"scenario": "throughput", "backing": "mmap", "payload_bytes": 256, ..., "write_p99_ns": 950}
+//!
+//! Scenarios:
+//!   throughput  write then read batches filling half of the queue, across payload sizes
+//!   queue_size  fill queues of increasing sizes up to QUEUE_SIZE_MAX once, wrapping around
+//!   contention  1 to 8 producer threads writing while a consumer reads
+//!   drain       read back a full queue with the copying, zero-copy and batch read APIs
+//!   overwrite   keep writing to a full queue, overwriting or rejecting unread messages
+//!   recovery    ticosd_queue_init() of a full queue file, with and without a checkpoint, with
+//!               the file in the page cache (warm) or evicted from it (cold)
+//!
+//! File-backed queues use the storage backend given with --backend, reported as their backing.
+//!
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "queue.h"
+#include "queue_storage.h"
+
+//! QUEUE_SIZE_MAX of queue.c
+static const uint32_t kQueueSizeMax = 1024 * 1024 * 1024;
+static const uint32_t kKiB = 1024;
+static const uint32_t kMiB = 1024 * 1024;
+
+static sTicosd *g_stub_ticosd = (sTicosd *)~0;
+//! Directory of the queue files, NULL for heap-backed queues.
+static const char *g_data_dir;
+
+char *ticosd_generate_rw_filename(sTicosd *ticosd, const char *filename) {
+  if (!g_data_dir) {
+    return NULL;
+  }
+  char *path = (char *)malloc(strlen(g_data_dir) + strlen(filename) + 2);
+  sprintf(path, "%s/%s", g_data_dir, filename);
+  return path;
+}
+
+struct Options {
+  std::string data_dir;
+  std::string scenario;
+  uint32_t max_queue_size = kQueueSizeMax;
+  eTicosdQueueBackend backend = kTicosdQueueBackend_Mmap;
+  //! Divides the amount of data written by each measurement.
+  uint32_t scale = 1;
+};
+
+static Options g_options;
+
+typedef std::chrono::steady_clock Clock;
+
+static uint64_t elapsed_ns(Clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+}
+
+static uint64_t percentile(std::vector<uint64_t> &samples, int percent) {
+  if (samples.empty()) {
+    return 0;
+  }
+  const size_t index = std::min(samples.size() - 1, samples.size() * percent / 100);
+  std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+  return samples[index];
+}
+
+// Prints a measurement as a JSON object on a single line. The fields are given as a printf format
+// of comma-separated "key": value pairs:
+static void __attribute__((format(printf, 2, 3))) report(const char *scenario, const char *fmt,
+                                                           ...) {
+  printf("{\"scenario\": \"%s\", ", scenario);
+  va_list args;
+  va_start(args, fmt);
+  vprintf(fmt, args);
+  va_end(args);
+  printf("}\n");
+  fflush(stdout);
+}
+
+static const char *backing_name(bool file_backed) {
+  return file_backed ? ticosd_queue_backend_name(g_options.backend) : "heap";
+}
+
+static const char *durability_name(bool file_backed, eTicosdQueueDurability durability) {
+  if (!file_backed) {
+    return "none";
+  }
+  switch (durability) {
+    case kTicosdQueueDurability_Strict:
+      return "strict";
+    case kTicosdQueueDurability_Group:
+      return "group";
+    default:
+      return "async";
+  }
+}
+
+static std::string queue_file() { return g_options.data_dir + "/queue"; }
+
+static sTicosdQueue *open_queue(bool file_backed, uint32_t size,
+                                eTicosdQueueDurability durability) {
+  g_data_dir = file_backed ? g_options.data_dir.c_str() : NULL;
+  sTicosdQueue *queue =
+    ticosd_queue_init_with_backend(g_stub_ticosd, "queue", (int)size, g_options.backend);
+  if (!queue) {
+    fprintf(stderr, "bench_queue:: Failed to create a queue of %u bytes\n", size);
+    exit(EXIT_FAILURE);
+  }
+  ticosd_queue_set_durability(queue, durability);
+  return queue;
+}
+
+static void remove_queue_file() { unlink(queue_file().c_str()); }
+
+// Random bytes do not compress, as most coredumps, the first one is the reboot event type:
+static std::vector<uint8_t> make_payload(uint32_t size) {
+  std::vector<uint8_t> payload(size);
+  std::mt19937 rng(size);
+  for (auto &byte : payload) {
+    byte = (uint8_t)rng();
+  }
+  payload[0] = kTicosdTxDataType_RebootEvent;
+  return payload;
+}
+
+static bool read_one(sTicosdQueue *queue) {
+  uint32_t size;
+  if (!ticosd_queue_peek_head(queue, &size)) {
+    return false;
+  }
+  return ticosd_queue_complete_read(queue);
+}
+
+// Space taken by a message in the queue: header and payload padded to 4 bytes.
+static uint32_t msg_footprint(uint32_t payload_size) { return 20 + ((payload_size + 3) & ~3u); }
+
+static void bench_throughput_case(bool file_backed, eTicosdQueueDurability durability,
+                                  uint32_t payload_size) {
+  const uint32_t queue_size = std::max(4 * kMiB, 4 * msg_footprint(payload_size));
+  // Enough messages for stable percentiles without writing gigabytes of large payloads:
+  const uint64_t total = std::max<uint64_t>(
+    64, std::min<uint64_t>(20000, 256ull * kMiB / payload_size) / g_options.scale);
+  const uint32_t batch = std::max<uint32_t>(1, queue_size / 2 / msg_footprint(payload_size));
+
+  remove_queue_file();
+  sTicosdQueue *queue = open_queue(file_backed, queue_size, durability);
+  const std::vector<uint8_t> payload = make_payload(payload_size);
+
+  std::vector<uint64_t> write_ns;
+  std::vector<uint64_t> read_ns;
+  write_ns.reserve(total);
+  read_ns.reserve(total);
+  uint64_t write_total_ns = 0;
+  uint64_t read_total_ns = 0;
+  uint64_t done = 0;
+  while (done < total) {
+    const uint64_t count = std::min<uint64_t>(batch, total - done);
+    for (uint64_t i = 0; i < count; ++i) {
+      const Clock::time_point start = Clock::now();
+      if (!ticosd_queue_write(queue, payload.data(), payload_size)) {
+        fprintf(stderr, "bench_queue:: Write failed\n");
+        exit(EXIT_FAILURE);
+      }
+      write_ns.push_back(elapsed_ns(start));
+      write_total_ns += write_ns.back();
+    }
+    for (uint64_t i = 0; i < count; ++i) {
+      const Clock::time_point start = Clock::now();
+      if (!read_one(queue)) {
+        fprintf(stderr, "bench_queue:: Read failed\n");
+        exit(EXIT_FAILURE);
+      }
+      read_ns.push_back(elapsed_ns(start));
+      read_total_ns += read_ns.back();
+    }
+    done += count;
+  }
+  ticosd_queue_destroy(queue);
+
+  const double bytes = (double)total * payload_size;
+  report("throughput",
+         "\"backing\": \"%s\", \"durability\": \"%s\", \"payload_bytes\": %u, "
+         "\"queue_bytes\": %u, \"messages\": %llu, \"write_msgs_per_s\": %.0f, "
+         "\"write_mib_per_s\": %.2f, \"write_p50_ns\": %llu, \"write_p99_ns\": %llu, "
+         "\"read_msgs_per_s\": %.0f, \"read_mib_per_s\": %.2f, \"read_p50_ns\": %llu, "
+         "\"read_p99_ns\": %llu",
+         backing_name(file_backed), durability_name(file_backed, durability), payload_size,
+         queue_size, (unsigned long long)total, total * 1e9 / write_total_ns,
+         bytes * 1e9 / write_total_ns / kMiB, (unsigned long long)percentile(write_ns, 50),
+         (unsigned long long)percentile(write_ns, 99), total * 1e9 / read_total_ns,
+         bytes * 1e9 / read_total_ns / kMiB, (unsigned long long)percentile(read_ns, 50),
+         (unsigned long long)percentile(read_ns, 99));
+}
+
+static void bench_throughput() {
+  const uint32_t payload_sizes[] = {16, 256, 4 * kKiB, 64 * kKiB, kMiB};
+  for (uint32_t payload_size : payload_sizes) {
+    bench_throughput_case(false, kTicosdQueueDurability_Strict, payload_size);
+    bench_throughput_case(true, kTicosdQueueDurability_Strict, payload_size);
+    bench_throughput_case(true, kTicosdQueueDurability_Group, payload_size);
+    bench_throughput_case(true, kTicosdQueueDurability_Async, payload_size);
+  }
+}
+
+static void bench_queue_size() {
+  const uint32_t payload_size = 256;
+  const std::vector<uint8_t> payload = make_payload(payload_size);
+  for (uint32_t queue_size = 64 * kKiB; queue_size <= g_options.max_queue_size;
+       queue_size *= 4) {
+    for (bool file_backed : {false, true}) {
+      remove_queue_file();
+      Clock::time_point start = Clock::now();
+      sTicosdQueue *queue = open_queue(file_backed, queue_size, kTicosdQueueDurability_Async);
+      const uint64_t init_ns = elapsed_ns(start);
+
+      // One and a half times the capacity, so that the last writes wrap around:
+      const uint64_t count = (uint64_t)queue_size / msg_footprint(payload_size) * 3 / 2;
+      start = Clock::now();
+      for (uint64_t i = 0; i < count; ++i) {
+        ticosd_queue_write(queue, payload.data(), payload_size);
+      }
+      const uint64_t write_total_ns = elapsed_ns(start);
+
+      sTicosdQueueStats stats;
+      ticosd_queue_get_stats(queue, &stats);
+      start = Clock::now();
+      ticosd_queue_destroy(queue);
+      const uint64_t destroy_ns = elapsed_ns(start);
+
+      report("queue_size",
+             "\"backing\": \"%s\", \"durability\": \"%s\", \"payload_bytes\": %u, "
+             "\"queue_bytes\": %u, \"messages\": %llu, \"init_ns\": %llu, "
+             "\"write_msgs_per_s\": %.0f, \"destroy_ns\": %llu, \"overwritten\": %u",
+             backing_name(file_backed),
+             durability_name(file_backed, kTicosdQueueDurability_Async), payload_size, queue_size,
+             (unsigned long long)count, (unsigned long long)init_ns, count * 1e9 / write_total_ns,
+             (unsigned long long)destroy_ns, stats.overwritten_count);
+    }
+    if (queue_size > UINT32_MAX / 4) {
+      break;
+    }
+  }
+  remove_queue_file();
+}
+
+static void bench_contention_case(bool file_backed, eTicosdQueueDurability durability,
+                                  int producers) {
+  const uint32_t payload_size = 256;
+  const uint32_t queue_size = 4 * kMiB;
+  const uint64_t per_producer = std::max<uint64_t>(100, 20000 / g_options.scale / producers);
+
+  remove_queue_file();
+  sTicosdQueue *queue = open_queue(file_backed, queue_size, durability);
+  const std::vector<uint8_t> payload = make_payload(payload_size);
+
+  std::atomic<bool> stop(false);
+  std::atomic<uint64_t> read_count(0);
+  std::thread consumer([&] {
+    while (!stop.load()) {
+      if (read_one(queue)) {
+        read_count++;
+      } else {
+        std::this_thread::yield();
+      }
+    }
+  });
+
+  std::vector<std::vector<uint64_t>> write_ns(producers);
+  std::vector<std::thread> threads;
+  const Clock::time_point start = Clock::now();
+  for (int p = 0; p < producers; ++p) {
+    threads.emplace_back([&, p] {
+      write_ns[p].reserve(per_producer);
+      for (uint64_t i = 0; i < per_producer; ++i) {
+        const Clock::time_point write_start = Clock::now();
+        ticosd_queue_write(queue, payload.data(), payload_size);
+        write_ns[p].push_back(elapsed_ns(write_start));
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  const uint64_t total_ns = elapsed_ns(start);
+  stop = true;
+  consumer.join();
+
+  sTicosdQueueStats stats;
+  ticosd_queue_get_stats(queue, &stats);
+  ticosd_queue_destroy(queue);
+
+  std::vector<uint64_t> all_ns;
+  for (auto &samples : write_ns) {
+    all_ns.insert(all_ns.end(), samples.begin(), samples.end());
+  }
+  const uint64_t total = per_producer * producers;
+  report("contention",
+         "\"backing\": \"%s\", \"durability\": \"%s\", \"producers\": %d, "
+         "\"payload_bytes\": %u, \"messages\": %llu, \"write_msgs_per_s\": %.0f, "
+         "\"write_p50_ns\": %llu, \"write_p99_ns\": %llu, \"read_msgs\": %llu, "
+         "\"overwritten\": %u",
+         backing_name(file_backed), durability_name(file_backed, durability), producers,
+         payload_size, (unsigned long long)total, total * 1e9 / total_ns,
+         (unsigned long long)percentile(all_ns, 50), (unsigned long long)percentile(all_ns, 99),
+         (unsigned long long)read_count.load(), stats.overwritten_count);
+}
+
+static void bench_contention() {
+  for (int producers : {1, 2, 4, 8}) {
+    bench_contention_case(false, kTicosdQueueDurability_Strict, producers);
+    bench_contention_case(true, kTicosdQueueDurability_Strict, producers);
+    bench_contention_case(true, kTicosdQueueDurability_Group, producers);
+  }
+}
+
+static void bench_drain() {
+  const uint32_t payload_size = 128;
+  const uint32_t queue_size = 4 * kMiB;
+  const uint64_t count = std::min<uint64_t>(queue_size / msg_footprint(payload_size) - 1,
+                                            std::max<uint32_t>(100, 20000 / g_options.scale));
+  const std::vector<uint8_t> payload = make_payload(payload_size);
+  const char *const apis[] = {"read_head", "peek_head", "peek_batch"};
+  for (bool file_backed : {false, true}) {
+    for (int api = 0; api < 3; ++api) {
+      remove_queue_file();
+      sTicosdQueue *queue = open_queue(file_backed, queue_size, kTicosdQueueDurability_Async);
+      for (uint64_t i = 0; i < count; ++i) {
+        ticosd_queue_write(queue, payload.data(), payload_size);
+      }
+      // Each completion is flushed, as by default:
+      ticosd_queue_set_durability(queue, kTicosdQueueDurability_Strict);
+
+      uint64_t drained = 0;
+      uint32_t size;
+      sTicosdQueueEntry entries[64];
+      const Clock::time_point start = Clock::now();
+      switch (api) {
+        case 0:
+          uint8_t *copy;
+          while ((copy = ticosd_queue_read_head(queue, &size))) {
+            free(copy);
+            ticosd_queue_complete_read(queue);
+            drained++;
+          }
+          break;
+        case 1:
+          while (ticosd_queue_peek_head(queue, &size)) {
+            ticosd_queue_complete_read(queue);
+            drained++;
+          }
+          break;
+        default:
+          uint32_t batch_count;
+          while ((batch_count = ticosd_queue_peek_batch(queue, entries, 64, UINT32_MAX))) {
+            ticosd_queue_complete_batch(queue, batch_count);
+            drained += batch_count;
+          }
+          break;
+      }
+      const uint64_t total_ns = elapsed_ns(start);
+      ticosd_queue_destroy(queue);
+
+      report("drain",
+             "\"backing\": \"%s\", \"durability\": \"%s\", \"api\": \"%s\", "
+             "\"payload_bytes\": %u, \"messages\": %llu, \"drain_msgs_per_s\": %.0f",
+             backing_name(file_backed),
+             durability_name(file_backed, kTicosdQueueDurability_Strict), apis[api],
+             payload_size, (unsigned long long)drained, drained * 1e9 / total_ns);
+    }
+  }
+  remove_queue_file();
+}
+
+static void bench_overwrite() {
+  const uint32_t payload_size = 256;
+  const uint32_t queue_size = 64 * kKiB;
+  const std::vector<uint8_t> payload = make_payload(payload_size);
+  for (bool file_backed : {false, true}) {
+    for (bool overwrite : {true, false}) {
+      remove_queue_file();
+      sTicosdQueue *queue = open_queue(file_backed, queue_size, kTicosdQueueDurability_Async);
+      ticosd_queue_set_overwrite(queue, overwrite);
+
+      // Ten times the capacity, without reading:
+      const uint64_t count = (uint64_t)queue_size / msg_footprint(payload_size) * 10;
+      std::vector<uint64_t> write_ns;
+      write_ns.reserve(count);
+      uint64_t write_total_ns = 0;
+      uint64_t rejected = 0;
+      for (uint64_t i = 0; i < count; ++i) {
+        const Clock::time_point start = Clock::now();
+        if (!ticosd_queue_write(queue, payload.data(), payload_size)) {
+          rejected++;
+        }
+        write_ns.push_back(elapsed_ns(start));
+        write_total_ns += write_ns.back();
+      }
+
+      sTicosdQueueStats stats;
+      ticosd_queue_get_stats(queue, &stats);
+      ticosd_queue_destroy(queue);
+
+      report("overwrite",
+             "\"backing\": \"%s\", \"overwrite\": %s, \"payload_bytes\": %u, "
+             "\"queue_bytes\": %u, \"messages\": %llu, \"write_msgs_per_s\": %.0f, "
+             "\"write_p50_ns\": %llu, \"write_p99_ns\": %llu, \"overwritten\": %u, "
+             "\"rejected\": %llu",
+             backing_name(file_backed), overwrite ? "true" : "false", payload_size, queue_size,
+             (unsigned long long)count, count * 1e9 / write_total_ns,
+             (unsigned long long)percentile(write_ns, 50),
+             (unsigned long long)percentile(write_ns, 99), stats.overwritten_count,
+             (unsigned long long)rejected);
+    }
+  }
+  remove_queue_file();
+}
+
+// Evicts the queue file from the page cache, so that the next init reads it from storage:
+static void evict_queue_file() {
+  const int fd = open(queue_file().c_str(), O_RDONLY);
+  if (fd == -1) {
+    return;
+  }
+  fdatasync(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+// Zeroes the checkpoint region that follows the queue buffer in the file, as after a crash of a
+// version without checkpoints, so that init has to scan the whole queue:
+static void remove_checkpoint(uint32_t queue_size) {
+  const int fd = open(queue_file().c_str(), O_WRONLY);
+  if (fd == -1) {
+    return;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size > queue_size) {
+    const std::vector<uint8_t> zeros(st.st_size - queue_size, 0);
+    if (pwrite(fd, zeros.data(), zeros.size(), queue_size) != (ssize_t)zeros.size()) {
+      fprintf(stderr, "bench_queue:: Failed to remove the checkpoint\n");
+    }
+  }
+  close(fd);
+}
+
+static void bench_recovery() {
+  const uint32_t payload_size = 256;
+  const std::vector<uint8_t> payload = make_payload(payload_size);
+  for (uint32_t queue_size = kMiB; queue_size <= std::min(g_options.max_queue_size, 64 * kMiB);
+       queue_size *= 4) {
+    for (bool checkpoint : {true, false}) {
+      for (bool cold : {false, true}) {
+        remove_queue_file();
+        sTicosdQueue *queue = open_queue(true, queue_size, kTicosdQueueDurability_Async);
+        const uint64_t count = (uint64_t)queue_size / msg_footprint(payload_size) - 1;
+        for (uint64_t i = 0; i < count; ++i) {
+          ticosd_queue_write(queue, payload.data(), payload_size);
+        }
+        ticosd_queue_destroy(queue);
+
+        if (!checkpoint) {
+          remove_checkpoint(queue_size);
+        }
+        if (cold) {
+          evict_queue_file();
+        }
+
+        const Clock::time_point start = Clock::now();
+        queue = open_queue(true, queue_size, kTicosdQueueDurability_Async);
+        const uint64_t init_ns = elapsed_ns(start);
+        sTicosdQueueStats stats;
+        ticosd_queue_get_stats(queue, &stats);
+        ticosd_queue_destroy(queue);
+
+        report("recovery",
+               "\"backing\": \"file\", \"checkpoint\": %s, \"cache\": \"%s\", "
+               "\"queue_bytes\": %u, \"messages\": %u, \"init_ns\": %llu",
+               checkpoint ? "true" : "false", cold ? "cold" : "warm", queue_size,
+               stats.unread_count, (unsigned long long)init_ns);
+      }
+    }
+  }
+  remove_queue_file();
+}
+
+static void usage() {
+  printf("Usage: bench_queue [OPTION]...\n\n");
+  printf("      --data-dir <dir>          : Directory of the queue files (default: temporary)\n");
+  printf("      --scenario <name>         : Only run throughput, queue_size, contention,\n");
+  printf("                                  drain, overwrite or recovery\n");
+  printf("      --max-queue-size <bytes>  : Largest queue size to measure (default: %u)\n",
+         kQueueSizeMax);
+  printf("      --backend <name>          : Storage backend of file-backed queues, mmap,\n");
+  printf("                                  pwrite or io_uring (default: mmap)\n");
+  printf("      --quick                   : Write ten times less data, for smoke tests\n");
+}
+
+static bool parse_backend(const std::string &name) {
+  for (eTicosdQueueBackend backend : {kTicosdQueueBackend_Mmap, kTicosdQueueBackend_Pwrite,
+                                      kTicosdQueueBackend_IoUring}) {
+    if (name == ticosd_queue_backend_name(backend)) {
+      g_options.backend = backend;
+      return true;
+    }
+  }
+  return false;
+}
+
+int main(int argc, char *argv[]) {
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    const bool has_value = i + 1 < argc;
+    if (arg == "--data-dir" && has_value) {
+      g_options.data_dir = argv[++i];
+    } else if (arg == "--scenario" && has_value) {
+      g_options.scenario = argv[++i];
+    } else if (arg == "--max-queue-size" && has_value) {
+      g_options.max_queue_size = std::min<uint64_t>(strtoull(argv[++i], NULL, 0), kQueueSizeMax);
+    } else if (arg == "--backend" && has_value && parse_backend(argv[i + 1])) {
+      ++i;
+    } else if (arg == "--quick") {
+      g_options.scale = 10;
+    } else {
+      usage();
+      return arg == "-h" || arg == "--help" ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
+  bool temporary_dir = false;
+  if (g_options.data_dir.empty()) {
+    char dir[] = "/tmp/bench_queue.XXXXXX";
+    if (!mkdtemp(dir)) {
+      perror("bench_queue:: mkdtemp");
+      return EXIT_FAILURE;
+    }
+    g_options.data_dir = dir;
+    temporary_dir = true;
+  }
+
+  const struct {
+    const char *name;
+    void (*run)();
+  } scenarios[] = {
+    {"throughput", bench_throughput}, {"queue_size", bench_queue_size},
+    {"contention", bench_contention}, {"drain", bench_drain},
+    {"overwrite", bench_overwrite},   {"recovery", bench_recovery},
+  };
+  bool found = false;
+  for (const auto &scenario : scenarios) {
+    if (g_options.scenario.empty() || g_options.scenario == scenario.name) {
+      scenario.run();
+      found = true;
+    }
+  }
+
+  remove_queue_file();
+  if (temporary_dir) {
+    rmdir(g_options.data_dir.c_str());
+  }
+  if (!found) {
+    usage();
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,83 @@
+//! @file
+//!
+//! Copyright (c) Ticos, Inc.
+//! See License.txt for details
+//!
+//! @brief
+//! Unit tests for crc32c.c
+//!
+
+#include "ticos/util/crc32c.h"
+
+#include <CppUTest/TestHarness.h>
+
+#include <cstring>
+
+extern "C" {
+uint32_t ticos_crc32c_sw(uint32_t crc, const void *data, size_t len);
+bool ticos_crc32c_is_hw_accelerated(void);
+}
+
+TEST_GROUP(TestGroup_Crc32c){};
+
+// Tests the standard CRC-32C check value and a few reference vectors (RFC 3720, B.4).
+TEST(TestGroup_Crc32c, Test_KnownVectors) {
+  uint8_t buf[32];
+
+  UNSIGNED_LONGS_EQUAL(0x00000000, ticos_crc32c(0, "", 0));
+  UNSIGNED_LONGS_EQUAL(0xe3069283, ticos_crc32c(0, "123456789", 9));
+
+  memset(buf, 0x00, sizeof(buf));
+  UNSIGNED_LONGS_EQUAL(0x8a9136aa, ticos_crc32c(0, buf, sizeof(buf)));
+
+  memset(buf, 0xff, sizeof(buf));
+  UNSIGNED_LONGS_EQUAL(0x62a8ab43, ticos_crc32c(0, buf, sizeof(buf)));
+
+  for (unsigned int i = 0; i < sizeof(buf); ++i) {
+    buf[i] = i;
+  }
+  UNSIGNED_LONGS_EQUAL(0x46dd794e, ticos_crc32c(0, buf, sizeof(buf)));
+}
+
+// Tests that a CRC computed in several chunks equals the CRC computed in one go.
+TEST(TestGroup_Crc32c, Test_Incremental) {
+  const char *data = "The quick brown fox jumps over the lazy dog";
+  const size_t len = strlen(data);
+  const uint32_t expected = ticos_crc32c(0, data, len);
+
+  for (size_t split = 0; split <= len; ++split) {
+    uint32_t crc = ticos_crc32c(0, data, split);
+    crc = ticos_crc32c(crc, data + split, len - split);
+    UNSIGNED_LONGS_EQUAL(expected, crc);
+  }
+}
+
+// Tests that the hardware-accelerated implementation, if any, matches the table-driven one for all
+// alignments and lengths around the word sizes.
+TEST(TestGroup_Crc32c, Test_MatchesSoftwareImplementation) {
+  uint8_t buf[256 + 8];
+  uint32_t seed = 1;
+  for (unsigned int i = 0; i < sizeof(buf); ++i) {
+    seed = seed * 1103515245 + 12345;
+    buf[i] = seed >> 16;
+  }
+
+  for (size_t offset = 0; offset < 8; ++offset) {
+    for (size_t len = 0; len <= 256; ++len) {
+      UNSIGNED_LONGS_EQUAL(ticos_crc32c_sw(0, buf + offset, len),
+                           ticos_crc32c(0, buf + offset, len));
+    }
+  }
+}
+
+// Tests that the hardware-accelerated implementation is used whenever the CPU has one, so that the
+// test above does not silently compare the software implementation with itself.
+TEST(TestGroup_Crc32c, Test_HardwareSelection) {
+#if defined(__x86_64__) || defined(__i386__)
+  CHECK_EQUAL(__builtin_cpu_supports("sse4.2") != 0, ticos_crc32c_is_hw_accelerated());
+#elif defined(__ARM_FEATURE_CRC32)
+  CHECK_TRUE(ticos_crc32c_is_hw_accelerated());
+#else
+  CHECK_FALSE(ticos_crc32c_is_hw_accelerated());
+#endif
+}
@@ -0,0 +1,59 @@
+//! @file
+//!
+//! Copyright (c) Ticos, Inc.
+//! See License.txt for details
+//!
+//! @brief
+//! Unit tests for gzip.c
+//!
+
+#include "ticos/util/gzip.h"
+
+#include <CppUTest/TestHarness.h>
+#include <zlib.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+TEST_GROUP(TestGroup_Gzip){};
+
+// Tests that a JSON body round-trips through a gzip stream, as a server would decode it.
+TEST(TestGroup_Gzip, Test_RoundTrip) {
+  std::string json = "[";
+  for (int i = 0; i < 64; ++i) {
+    json += "{\"type\":\"trace\",\"software_version\":\"1.0.0\",\"sequence\":" +
+            std::to_string(i) + "},";
+  }
+  json.back() = ']';
+
+  void *compressed;
+  size_t compressed_len;
+  CHECK_TRUE(ticos_gzip_compress(json.data(), json.size(), &compressed, &compressed_len));
+  CHECK(compressed_len < json.size() / 4);
+  // gzip magic:
+  UNSIGNED_LONGS_EQUAL(0x1f, ((uint8_t *)compressed)[0]);
+  UNSIGNED_LONGS_EQUAL(0x8b, ((uint8_t *)compressed)[1]);
+
+  z_stream zs = {};
+  LONGS_EQUAL(Z_OK, inflateInit2(&zs, 15 + 16));
+  std::string out(json.size(), '\0');
+  zs.next_in = (Bytef *)compressed;
+  zs.avail_in = compressed_len;
+  zs.next_out = (Bytef *)&out[0];
+  zs.avail_out = out.size();
+  LONGS_EQUAL(Z_STREAM_END, inflate(&zs, Z_FINISH));
+  LONGS_EQUAL(json.size(), zs.total_out);
+  inflateEnd(&zs);
+  STRCMP_EQUAL(json.c_str(), out.c_str());
+
+  free(compressed);
+}
+
+// Tests that data that would not get smaller is left uncompressed.
+TEST(TestGroup_Gzip, Test_NotWorthIt) {
+  void *compressed = (void *)1;
+  size_t compressed_len;
+  CHECK_FALSE(ticos_gzip_compress("{}", 2, &compressed, &compressed_len));
+  POINTERS_EQUAL(NULL, compressed);
+}
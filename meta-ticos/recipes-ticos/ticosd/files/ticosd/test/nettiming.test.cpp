@@ -0,0 +1,117 @@
+//! @file
+//!
+//! Copyright (c) Ticos, Inc.
+//! See License.txt for details
+//!
+//! @brief
+//! Unit tests for nettiming.c
+//!
+
+#include "nettiming.h"
+
+#include <CppUTest/TestHarness.h>
+
+#include <cstdlib>
+#include <string>
+
+TEST_GROUP(TestGroup_NetTiming) {
+  sTicosdNetTiming *nettiming = NULL;
+
+  void setup() override {
+    nettiming = ticosd_nettiming_init();
+    CHECK(nettiming);
+  }
+
+  void teardown() override { ticosd_nettiming_destroy(nettiming); }
+
+  void record(eTicosdNetTimingEndpoint endpoint, uint64_t total_us) {
+    sTicosdNetTimingSample sample = {};
+    sample.phase_us[kTicosdNetTimingPhase_StartTransfer] = total_us / 2;
+    sample.phase_us[kTicosdNetTimingPhase_Total] = total_us;
+    sample.bytes_up = 100;
+    sample.bytes_down = 10;
+    ticosd_nettiming_record(nettiming, endpoint, &sample);
+  }
+
+  std::string to_json() {
+    char *json = ticosd_nettiming_to_json(nettiming);
+    CHECK(json);
+    std::string result(json);
+    free(json);
+    return result;
+  }
+
+  std::string to_attributes_json() {
+    char *json = ticosd_nettiming_to_attributes_json(nettiming);
+    CHECK(json);
+    std::string result(json);
+    free(json);
+    return result;
+  }
+};
+
+// Tests that requests are accounted to the endpoint of their path:
+TEST(TestGroup_NetTiming, Test_Endpoint) {
+  LONGS_EQUAL(kTicosdNetTimingEndpoint_Chunks, ticosd_nettiming_endpoint("/chunks/abc/json"));
+  LONGS_EQUAL(kTicosdNetTimingEndpoint_Attributes,
+              ticosd_nettiming_endpoint("/api/v0/attributes?device_serial=abc"));
+  LONGS_EQUAL(kTicosdNetTimingEndpoint_UploadPrepare,
+              ticosd_nettiming_endpoint("/chunks/abc/fileUrl?type=Coredump"));
+  LONGS_EQUAL(kTicosdNetTimingEndpoint_UploadCommit, ticosd_nettiming_endpoint("/chunks/abc/url"));
+  LONGS_EQUAL(kTicosdNetTimingEndpoint_Other, ticosd_nettiming_endpoint("/chunks/abc/urls"));
+  LONGS_EQUAL(kTicosdNetTimingEndpoint_Other, ticosd_nettiming_endpoint("/chunks/abc"));
+  LONGS_EQUAL(kTicosdNetTimingEndpoint_Other, ticosd_nettiming_endpoint("/api/v0/hawkbit"));
+}
+
+// Tests the statistics before any request:
+TEST(TestGroup_NetTiming, Test_Empty) {
+  const std::string histogram = "{\"max\": 0, \"buckets\": [0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0]}";
+  const std::string endpoint = "{\"count\": 0, \"bytes_up\": 0, \"bytes_down\": 0, "
+                               "\"namelookup\": " + histogram + ", \"connect\": " + histogram +
+                               ", \"appconnect\": " + histogram + ", \"pretransfer\": " +
+                               histogram + ", \"starttransfer\": " + histogram +
+                               ", \"total\": " + histogram + "}";
+  const std::string expected =
+    "{\"bucket_bounds\": [1, 5, 10, 50, 100, 500, 1000, 5000, 10000, 30000], \"chunks\": " +
+    endpoint + ", \"attributes\": " + endpoint + ", \"upload_prepare\": " + endpoint +
+    ", \"upload\": " + endpoint + ", \"upload_part\": " + endpoint +
+    ", \"upload_commit\": " + endpoint + ", \"other\": " + endpoint + "}";
+  STRCMP_EQUAL(expected.c_str(), to_json().c_str());
+  STRCMP_EQUAL("[]", to_attributes_json().c_str());
+}
+
+// Tests that each phase is counted in the histogram of its endpoint, and bytes summed:
+TEST(TestGroup_NetTiming, Test_Buckets) {
+  const uint64_t totals_us[] = {0, 999, 1000, 1001, 45000000};
+  for (uint64_t total_us : totals_us) {
+    record(kTicosdNetTimingEndpoint_Attributes, total_us);
+  }
+
+  const std::string json = to_json();
+  CHECK(json.find("\"attributes\": {\"count\": 5, \"bytes_up\": 500, \"bytes_down\": 50, "
+                  "\"namelookup\": {\"max\": 0, \"buckets\": [5, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0]}") !=
+        std::string::npos);
+  CHECK(json.find("\"starttransfer\": {\"max\": 22500, "
+                  "\"buckets\": [4, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0]}, "
+                  "\"total\": {\"max\": 45000, "
+                  "\"buckets\": [3, 1, 0, 0, 0, 0, 0, 0, 0, 0, 1]}}") != std::string::npos);
+  CHECK(json.find("\"chunks\": {\"count\": 0,") != std::string::npos);
+}
+
+// Tests that the attributes summarise the endpoints requests were sent to:
+TEST(TestGroup_NetTiming, Test_Attributes) {
+  for (int i = 0; i < 10; ++i) {
+    record(kTicosdNetTimingEndpoint_UploadPart, 3000);
+  }
+  record(kTicosdNetTimingEndpoint_UploadPart, 70000);
+
+  // The 95th percentile falls in the (50, 100] ms bucket, capped by the maximum:
+  STRCMP_EQUAL("[{\"string_key\": \"ticosd_net_upload_part_count\", \"value\": 11}, "
+               "{\"string_key\": \"ticosd_net_upload_part_p50_ms\", \"value\": 5}, "
+               "{\"string_key\": \"ticosd_net_upload_part_p95_ms\", \"value\": 70}, "
+               "{\"string_key\": \"ticosd_net_upload_part_appconnect_p95_ms\", \"value\": 0}, "
+               "{\"string_key\": \"ticosd_net_upload_part_starttransfer_p95_ms\", \"value\": 35}, "
+               "{\"string_key\": \"ticosd_net_upload_part_bytes_up\", \"value\": 1100}, "
+               "{\"string_key\": \"ticosd_net_upload_part_bytes_down\", \"value\": 110}]",
+               to_attributes_json().c_str());
+}
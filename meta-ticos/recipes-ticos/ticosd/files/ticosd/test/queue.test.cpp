@@ -11,10 +11,18 @@
 
 #include <CppUTest/TestHarness.h>
 #include <CppUTestExt/MockSupport.h>
+#include <dirent.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cstring>
+#include <string>
+#include <vector>
 
 #include "hex2bin.h"
 
@@ -24,8 +32,21 @@ int ticosd_queue_get_size(sTicosdQueue *handle);
 uint32_t ticosd_queue_get_read_ptr(sTicosdQueue *handle);
 uint32_t ticosd_queue_get_write_ptr(sTicosdQueue *handle);
 uint32_t ticosd_queue_get_prev_ptr(sTicosdQueue *handle);
+void ticosd_queue_set_fake_time(sTicosdQueue *handle, time_t fake_time);
+uint32_t ticosd_queue_get_msg_validation_count(sTicosdQueue *handle);
+uint32_t ticosd_queue_get_sync_count(sTicosdQueue *handle);
 }
 
+// Size of the checkpoint region that follows the ring buffer in the queue file:
+static const size_t kCheckpointRegionSize = 64;
+
+// Enqueue time of the messages written by the tests that check the queue file contents, stored as
+// "78563412":
+static const time_t kFakeTime = 0x12345678;
+
+// Time once the clock has been set, e.g. by NTP, for the tests of the age of messages:
+static const time_t kSyncedTime = 1760000000;
+
 static sTicosd *g_stub_ticosd = (sTicosd *)~0;
 
 char *ticosd_generate_rw_filename(sTicosd *ticosd, const char *filename) {
@@ -74,7 +95,10 @@ TEST_BASE(TicosdQueueUtest) {
     uint8_t *actual_contents = (uint8_t *)malloc(expected_size);
     CHECK_EQUAL(expected_size, (size_t)read(fd, actual_contents, expected_size));
     MEMCMP_EQUAL(expected_contents, actual_contents, expected_size);
-    CHECK_TRUE_TEXT(0 == read(fd, actual_contents, 1),
+    // The ring buffer is followed by the checkpoint region:
+    uint8_t checkpoint_region[kCheckpointRegionSize + 1];
+    CHECK_TRUE_TEXT(kCheckpointRegionSize ==
+                      (size_t)read(fd, checkpoint_region, sizeof(checkpoint_region)),
                     "Queue file contained more data than expected");
     close(fd);
     free(expected_contents);
@@ -95,7 +119,7 @@ TEST_GROUP_BASE(TestGroup_Init, TicosdQueueUtest){};
 TEST(TestGroup_Init, Test_BadQueueFileFallBackToInMemoryQueue) {
   expect_queue_file_get_string_call("");
 
-  sTicosdQueue *queue = ticosd_queue_init(g_stub_ticosd, 16);
+  sTicosdQueue *queue = ticosd_queue_init(g_stub_ticosd, 24);
   CHECK(queue);
   CHECK(!ticosd_queue_is_file_backed(queue));
   ticosd_queue_destroy(queue);
@@ -106,7 +130,7 @@ TEST(TestGroup_Init, Test_BadQueueFileFallBackToInMemoryQueue) {
 TEST(TestGroup_Init, Test_NewFileQueue) {
   expect_queue_file_get_string_call(tmp_queue_file);
 
-  sTicosdQueue *queue = ticosd_queue_init(g_stub_ticosd, 16);
+  sTicosdQueue *queue = ticosd_queue_init(g_stub_ticosd, 24);
   CHECK(queue);
   CHECK(ticosd_queue_is_file_backed(queue));
 
@@ -129,7 +153,7 @@ TEST(TestGroup_Init, Test_WritePointerSetToZeroWhenEndPointerIsHit) {
 TEST(TestGroup_Init, Test_QueueSizeTooSmall) {
   expect_queue_file_get_string_call("");
 
-  sTicosdQueue *queue = ticosd_queue_init(g_stub_ticosd, 15);
+  sTicosdQueue *queue = ticosd_queue_init(g_stub_ticosd, 23);
   CHECK_EQUAL(1024 * 1024, ticosd_queue_get_size(queue));
   ticosd_queue_destroy(queue);
 }
@@ -147,8 +171,8 @@ TEST(TestGroup_Init, Test_QueueSizeTooLarge) {
 TEST(TestGroup_Init, Test_QueueSizeNotAligned) {
   expect_queue_file_get_string_call("");
 
-  sTicosdQueue *queue = ticosd_queue_init(g_stub_ticosd, 17);
-  CHECK_EQUAL(16, ticosd_queue_get_size(queue));
+  sTicosdQueue *queue = ticosd_queue_init(g_stub_ticosd, 25);
+  CHECK_EQUAL(24, ticosd_queue_get_size(queue));
   ticosd_queue_destroy(queue);
 }
 
@@ -158,7 +182,7 @@ TEST_GROUP_BASE(TestGroup_InitFindPointers, TicosdQueueUtest){};
 TEST(TestGroup_InitFindPointers, Test_NewFile) {
   expect_queue_file_get_string_call(tmp_queue_file);
 
-  sTicosdQueue *queue = ticosd_queue_init(g_stub_ticosd, 16);
+  sTicosdQueue *queue = ticosd_queue_init(g_stub_ticosd, 20);
   CHECK(queue);
   CHECK_EQUAL(0, ticosd_queue_get_read_ptr(queue));
   CHECK_EQUAL(0, ticosd_queue_get_write_ptr(queue));
@@ -309,6 +333,70 @@ TEST(TestGroup_InitFindPointers, Test_AllUnread) {
   ticosd_queue_destroy(queue);
 }
 
+// Tests that version 1 messages written by older versions are still read back, alongside version 2
+// messages:
+TEST(TestGroup_InitFindPointers, Test_MixedVersionMessages) {
+  // Queue contains:
+  // - unread (version 1)
+  // - unread (version 2)
+  create_queue_file("A5014800000000000100000011000000"
+                    "A5020000000000000100000078ADFB9322000000"
+                    "00000000000000000000000000000000");
+
+  sTicosdQueue *queue = ticosd_queue_init(g_stub_ticosd, 52);
+  CHECK(queue);
+  CHECK_EQUAL(0, ticosd_queue_get_read_ptr(queue));
+  CHECK_EQUAL(9, ticosd_queue_get_write_ptr(queue));
+  CHECK_EQUAL(4, ticosd_queue_get_prev_ptr(queue));
+
+  uint32_t payload_size;
+  uint8_t *payload = ticosd_queue_read_head(queue, &payload_size);
+  CHECK_EQUAL(1, payload_size);
+  CHECK_EQUAL(0x11, payload[0]);
+  free(payload);
+  CHECK_TRUE(ticosd_queue_complete_read(queue));
+
+  payload = ticosd_queue_read_head(queue, &payload_size);
+  CHECK_EQUAL(1, payload_size);
+  CHECK_EQUAL(0x22, payload[0]);
+  free(payload);
+
+  ticosd_queue_destroy(queue);
+}
+
+// Tests that a version 2 message of which the payload does not match the crc32c is ignored:
+TEST(TestGroup_InitFindPointers, Test_Crc32cMismatch) {
+  // Payload is 0x23 instead of 0x22:
+  create_queue_file("A5020000000000000100000078ADFB9323000000"
+                    "00000000000000000000000000000000");
+
+  sTicosdQueue *queue = ticosd_queue_init(g_stub_ticosd, 36);
+  CHECK(queue);
+  CHECK_EQUAL(0, ticosd_queue_get_read_ptr(queue));
+  CHECK_EQUAL(0, ticosd_queue_get_write_ptr(queue));
+
+  uint32_t payload_size;
+  POINTERS_EQUAL(NULL, ticosd_queue_read_head(queue, &payload_size));
+
+  ticosd_queue_destroy(queue);
+}
+
+// Tests that a message with an unknown header version is ignored:
+TEST(TestGroup_InitFindPointers, Test_UnknownHeaderVersion) {
+  create_queue_file("A5040000000000000100000078ADFB9322000000"
+                    "00000000000000000000000000000000");
+
+  sTicosdQueue *queue = ticosd_queue_init(g_stub_ticosd, 36);
+  CHECK(queue);
+  CHECK_EQUAL(0, ticosd_queue_get_read_ptr(queue));
+  CHECK_EQUAL(0, ticosd_queue_get_write_ptr(queue));
+
+  uint32_t payload_size;
+  POINTERS_EQUAL(NULL, ticosd_queue_read_head(queue, &payload_size));
+
+  ticosd_queue_destroy(queue);
+}
+
 struct TicosdQueueWriteUtest : TicosdQueueUtest {
   void test_write_move_read_pointer(size_t payload_size, uint32_t expected_read_ptr);
 };
@@ -319,11 +407,12 @@ TEST(TestGroup_Write, Test_SimpleWriteIntoNewQueueFile) {
   expect_queue_file_get_string_call(tmp_queue_file);
 
   sTicosdQueue *queue = ticosd_queue_init(g_stub_ticosd, 32);
+  ticosd_queue_set_fake_time(queue, kFakeTime);
   const uint8_t payload[] = {0xFF};
   ticosd_queue_write(queue, payload, sizeof(payload));
 
-  check_queue_file_contents("A5014F000000000001000000FF000000"
-                            "00000000000000000000000000000000");
+  check_queue_file_contents("A50300000000000001000000000000FF78563412"
+                            "FF0000000000000000000000");
   ticosd_queue_destroy(queue);
 }
 
@@ -332,25 +421,26 @@ TEST(TestGroup_Write, Test_SimpleWriteIntoNewQueueFile) {
 TEST(TestGroup_Write, Test_WriteLargerThanQueue) {
   expect_queue_file_get_string_call(tmp_queue_file);
 
-  sTicosdQueue *queue = ticosd_queue_init(g_stub_ticosd, 16);
-  // This won't fit: the queue is 16 bytes, but the item is 12 + 8 (header + payload) = 20 bytes.
+  sTicosdQueue *queue = ticosd_queue_init(g_stub_ticosd, 24);
+  // This won't fit: the queue is 24 bytes, but the item is 20 + 8 (header + payload) = 28 bytes.
   const uint8_t payload[8] = {0};
   ticosd_queue_write(queue, payload, sizeof(payload));
 
   // File is untouched:
-  check_queue_file_contents("00000000000000000000000000000000");
+  check_queue_file_contents("000000000000000000000000000000000000000000000000");
   ticosd_queue_destroy(queue);
 }
 
 TEST(TestGroup_Write, Test_WriteFitsExactly) {
   expect_queue_file_get_string_call(tmp_queue_file);
 
-  sTicosdQueue *queue = ticosd_queue_init(g_stub_ticosd, 16);
+  sTicosdQueue *queue = ticosd_queue_init(g_stub_ticosd, 24);
+  ticosd_queue_set_fake_time(queue, kFakeTime);
   uint8_t payload[4] = {0};
   memset(payload, 0x22, sizeof(payload));
   ticosd_queue_write(queue, payload, sizeof(payload));
 
-  check_queue_file_contents("A5017400000000000400000022222222");
+  check_queue_file_contents("A5030000000000000400000011F846177856341222222222");
   CHECK_EQUAL(0, ticosd_queue_get_read_ptr(queue));
   CHECK_EQUAL(0, ticosd_queue_get_write_ptr(queue));
 
@@ -363,20 +453,21 @@ TEST(TestGroup_Write, Test_WriteWrapAround) {
   expect_queue_file_get_string_call(tmp_queue_file);
 
   sTicosdQueue *queue = ticosd_queue_init(g_stub_ticosd, 32);
-  // Payload one will be 12 + 8 = 20 bytes:
+  ticosd_queue_set_fake_time(queue, kFakeTime);
+  // Payload one will be 20 + 8 = 28 bytes:
   uint8_t payload_one[8];
   memset(payload_one, 0x22, sizeof(payload_one));
   ticosd_queue_write(queue, payload_one, sizeof(payload_one));
 
-  // Payload takes 16 bytes. The call causes an END_POINTER (A55AA55A) to be written, wrap around
-  // the write pointer to the beginning and then overwrite the first 16 bytes of the queue:
+  // Payload takes 24 bytes. The call causes an END_POINTER (A55AA55A) to be written, wrap around
+  // the write pointer to the beginning and then overwrite the first 24 bytes of the queue:
   const uint8_t payload_two = 0x11;
   ticosd_queue_write(queue, &payload_two, 1);
 
-  check_queue_file_contents("A5014800000000000100000011000000"
-                            "22222222A55AA55A0000000000000000");
+  check_queue_file_contents("A503000000000000010000003D1748B078563412"
+                            "1100000022222222A55AA55A");
   CHECK_EQUAL(0, ticosd_queue_get_read_ptr(queue));
-  CHECK_EQUAL(4, ticosd_queue_get_write_ptr(queue));
+  CHECK_EQUAL(6, ticosd_queue_get_write_ptr(queue));
 
   ticosd_queue_destroy(queue);
 }
@@ -394,8 +485,9 @@ TEST(TestGroup_InitFindPointers, Test_PopulatedQueueThenReset) {
   CHECK_EQUAL(0, ticosd_queue_get_write_ptr(queue));
   CHECK_EQUAL(0, ticosd_queue_get_prev_ptr(queue));
 
-  check_queue_file_contents("00000000000000000000000011000000"
-                            "A5010100000000000100000022000000"
+  // Resetting clears the first header, which is longer than the version 1 ones of the file:
+  check_queue_file_contents("00000000000000000000000000000000"
+                            "00000000000000000100000022000000"
                             "00000000000000000000000000000000");
 
   ticosd_queue_destroy(queue);
@@ -405,30 +497,29 @@ void TicosdQueueWriteUtest::test_write_move_read_pointer(size_t payload_size,
                                                             uint32_t expected_read_ptr) {
   expect_queue_file_get_string_call(tmp_queue_file);
 
-  sTicosdQueue *queue = ticosd_queue_init(g_stub_ticosd, 64);
+  sTicosdQueue *queue = ticosd_queue_init(g_stub_ticosd, 96);
   for (int i = 0; i < 4; ++i) {
-    // Payload takes 16 bytes. The call causes an END_POINTER (A55AA55A) to be written, wrap around
-    // the write pointer to the beginning and then overwrite the first 16 bytes of the queue:
+    // Payload takes 24 bytes, the four messages fill up the queue exactly:
     const uint8_t payload_small = 0x11 * (i + 1);
     ticosd_queue_write(queue, &payload_small, 1);
   }
   read_and_complete_head(queue);
 
   // Next write will happen before the read pointer:
-  CHECK_EQUAL(16 / sizeof(uint32_t), ticosd_queue_get_read_ptr(queue));
+  CHECK_EQUAL(24 / sizeof(uint32_t), ticosd_queue_get_read_ptr(queue));
   CHECK_EQUAL(0, ticosd_queue_get_write_ptr(queue));
 
   // Read the next message (will be dropped before it's marked read):
   uint32_t p;
   free(ticosd_queue_read_head(queue, &p));
 
-  // Payload will be 12 (header) + payload_size bytes:
+  // Payload will be 20 (header) + payload_size bytes:
   uint8_t payload_big[payload_size];
   memset(payload_big, 0xAA, sizeof(payload_big));
   ticosd_queue_write(queue, payload_big, sizeof(payload_big));
 
   CHECK_EQUAL(expected_read_ptr, ticosd_queue_get_read_ptr(queue));
-  CHECK_EQUAL((12 + payload_size) / sizeof(uint32_t), ticosd_queue_get_write_ptr(queue));
+  CHECK_EQUAL((20 + payload_size) / sizeof(uint32_t), ticosd_queue_get_write_ptr(queue));
 
   // Message was already removed from the queue:
   CHECK_FALSE(ticosd_queue_complete_read(queue));
@@ -440,14 +531,14 @@ void TicosdQueueWriteUtest::test_write_move_read_pointer(size_t payload_size,
 // is moved up to the next message until it is no longer overwritten ("dropping" oldest messages).
 TEST(TestGroup_Write, Test_WriteMoveReadPointer) {
   const size_t payload_size = 32;
-  const uint32_t expected_read_ptr = (3 * 16) / sizeof(uint32_t);
+  const uint32_t expected_read_ptr = (3 * 24) / sizeof(uint32_t);
   test_write_move_read_pointer(payload_size, expected_read_ptr);
 }
 
 // Tests that when a payload is written and the read pointer would be overwritten, the read pointer
 // is moved up to the next message until it wraps around.
 TEST(TestGroup_Write, Test_WriteMoveReadPointerWrapAround) {
-  const size_t payload_size = 40;
+  const size_t payload_size = 56;
   const uint32_t expected_read_ptr = 0;
   test_write_move_read_pointer(payload_size, expected_read_ptr);
 }
@@ -455,16 +546,17 @@ TEST(TestGroup_Write, Test_WriteMoveReadPointerWrapAround) {
 TEST(TestGroup_Write, Test_WritePreviousHeaderPointer) {
   expect_queue_file_get_string_call(tmp_queue_file);
 
-  sTicosdQueue *queue = ticosd_queue_init(g_stub_ticosd, 52);
+  sTicosdQueue *queue = ticosd_queue_init(g_stub_ticosd, 76);
+  ticosd_queue_set_fake_time(queue, kFakeTime);
   for (int i = 0; i < 4; ++i) {
-    // Payload takes 16 bytes:
+    // Payload takes 24 bytes:
     const uint8_t payload_small = 0x11 * (i + 1);
     ticosd_queue_write(queue, &payload_small, 1);
   }
-  // Note: previous header indices are: 8 (due to the wrap-around), 0, 4
-  check_queue_file_contents("A5010200080000000100000044000000"
-                            "A5010100000000000100000022000000"
-                            "A5014900040000000100000033000000"
+  // Note: previous header indices are: 12 (due to the wrap-around), 0, 6
+  check_queue_file_contents("A50300000C00000001000000F2D99CD47856341244000000"
+                            "A5030000000000000100000078ADFB937856341222000000"
+                            "A5030000060000000100000014E9CE717856341233000000"
                             // END POINTER:
                             "A55AA55A");
   ticosd_queue_destroy(queue);
@@ -473,7 +565,7 @@ TEST(TestGroup_Write, Test_WritePreviousHeaderPointer) {
 TEST(TestGroup_Write, Test_WriteZeroLengthPayload) {
   expect_queue_file_get_string_call(tmp_queue_file);
 
-  sTicosdQueue *queue = ticosd_queue_init(g_stub_ticosd, 16);
+  sTicosdQueue *queue = ticosd_queue_init(g_stub_ticosd, 24);
   uint8_t payload_zero_length[0];
   CHECK_FALSE(ticosd_queue_write(queue, payload_zero_length, sizeof(payload_zero_length)));
   ticosd_queue_destroy(queue);
@@ -482,17 +574,43 @@ TEST(TestGroup_Write, Test_WriteZeroLengthPayload) {
 TEST(TestGroup_Write, Test_WriteNullPayload) {
   expect_queue_file_get_string_call(tmp_queue_file);
 
-  sTicosdQueue *queue = ticosd_queue_init(g_stub_ticosd, 16);
+  sTicosdQueue *queue = ticosd_queue_init(g_stub_ticosd, 24);
   CHECK_FALSE(ticosd_queue_write(queue, NULL, 1));
   ticosd_queue_destroy(queue);
 }
 
+// Tests that without overwriting, writing to a full queue fails until messages are read:
+TEST(TestGroup_Write, Test_WriteWithoutOverwrite) {
+  expect_queue_file_get_string_call(tmp_queue_file);
+
+  sTicosdQueue *queue = ticosd_queue_init(g_stub_ticosd, 72);
+  ticosd_queue_set_overwrite(queue, false);
+  CHECK_EQUAL(72 - 20, ticosd_queue_get_max_payload_size(queue));
+  for (int i = 0; i < 3; ++i) {
+    const uint8_t payload_small = 0x11 * (i + 1);
+    CHECK_TRUE(ticosd_queue_write(queue, &payload_small, 1));
+  }
+
+  const uint8_t payload_new = 0x44;
+  CHECK_FALSE(ticosd_queue_write(queue, &payload_new, 1));
+  CHECK_EQUAL(0, ticosd_queue_get_read_ptr(queue));
+
+  read_and_complete_head(queue);
+  CHECK_TRUE(ticosd_queue_write(queue, &payload_new, 1));
+  CHECK_FALSE(ticosd_queue_write(queue, &payload_new, 1));
+  uint32_t payload_size;
+  const uint8_t *head = ticosd_queue_peek_head(queue, &payload_size);
+  CHECK_EQUAL(0x22, head[0]);
+  ticosd_queue_release_head(queue);
+  ticosd_queue_destroy(queue);
+}
+
 TEST_GROUP_BASE(TestGroup_Read, TicosdQueueUtest){};
 
 TEST(TestGroup_Read, Test_ReadEmptyQueue) {
   expect_queue_file_get_string_call(tmp_queue_file);
 
-  sTicosdQueue *queue = ticosd_queue_init(g_stub_ticosd, 16);
+  sTicosdQueue *queue = ticosd_queue_init(g_stub_ticosd, 24);
   uint32_t payload_size;
   POINTERS_EQUAL(NULL, ticosd_queue_read_head(queue, &payload_size));
   ticosd_queue_destroy(queue);
@@ -501,7 +619,8 @@ TEST(TestGroup_Read, Test_ReadEmptyQueue) {
 TEST(TestGroup_Read, Test_ReadAndMarkRead) {
   expect_queue_file_get_string_call(tmp_queue_file);
 
-  sTicosdQueue *queue = ticosd_queue_init(g_stub_ticosd, 16);
+  sTicosdQueue *queue = ticosd_queue_init(g_stub_ticosd, 24);
+  ticosd_queue_set_fake_time(queue, kFakeTime);
 
   const uint8_t payload_small = 0x11;
   ticosd_queue_write(queue, &payload_small, 1);
@@ -512,9 +631,9 @@ TEST(TestGroup_Read, Test_ReadAndMarkRead) {
   CHECK_TRUE(!!payload);
   MEMCMP_EQUAL(&payload_small, payload, 1);
 
-  check_queue_file_contents("A5014800000000000100000011000000");
+  check_queue_file_contents("A503000000000000010000003D1748B07856341211000000");
   CHECK_TRUE(ticosd_queue_complete_read(queue));
-  check_queue_file_contents("A5014801000000000100000011000000");
+  check_queue_file_contents("A503000100000000010000003D1748B07856341211000000");
   CHECK_FALSE(ticosd_queue_complete_read(queue));
 
   // Nothing to read any more -- read_ptr == write_ptr, but message is already read.
@@ -523,3 +642,1430 @@ TEST(TestGroup_Read, Test_ReadAndMarkRead) {
   free(payload);
   ticosd_queue_destroy(queue);
 }
+
+// Tests that reading stops at the write pointer when it sits on the end marker of a previous
+// wrap-around, instead of following the marker back to the messages already read:
+TEST(TestGroup_Read, Test_ReadUpToStaleEndPointer) {
+  expect_queue_file_get_string_call("");
+
+  // Room for two messages, the third one wraps around leaving an end marker at word 12:
+  sTicosdQueue *queue = ticosd_queue_init(g_stub_ticosd, 60);
+  const uint8_t payloads[] = {0x11, 0x22, 0x33, 0x44};
+  uint32_t payload_size;
+  for (int i = 0; i < 2; ++i) {
+    ticosd_queue_write(queue, &payloads[i], 1);
+    CHECK_TRUE(ticosd_queue_peek_head(queue, &payload_size) != NULL);
+    CHECK_TRUE(ticosd_queue_complete_read(queue));
+  }
+  ticosd_queue_write(queue, &payloads[2], 1);
+  ticosd_queue_write(queue, &payloads[3], 1);
+  CHECK_EQUAL(12, ticosd_queue_get_write_ptr(queue));
+
+  for (int i = 2; i < 4; ++i) {
+    const uint8_t *payload = ticosd_queue_peek_head(queue, &payload_size);
+    CHECK_TRUE(payload != NULL);
+    MEMCMP_EQUAL(&payloads[i], payload, 1);
+    CHECK_TRUE(ticosd_queue_complete_read(queue));
+  }
+  POINTERS_EQUAL(NULL, ticosd_queue_peek_head(queue, &payload_size));
+
+  sTicosdQueueStats stats;
+  ticosd_queue_get_stats(queue, &stats);
+  CHECK_EQUAL(0, stats.unread_count);
+  ticosd_queue_destroy(queue);
+}
+
+// Tests that a write wrapping around onto the oldest unread message at the start of the queue
+// drops only that message, and that the remaining ones are still read in order:
+TEST(TestGroup_Read, Test_WrapAroundOverwritesOldestAtStart) {
+  expect_queue_file_get_string_call("");
+
+  sTicosdQueue *queue = ticosd_queue_init(g_stub_ticosd, 60);
+  const uint8_t payloads[] = {0x11, 0x22, 0x33};
+  for (int i = 0; i < 3; ++i) {
+    ticosd_queue_write(queue, &payloads[i], 1);
+  }
+  CHECK_EQUAL(6, ticosd_queue_get_read_ptr(queue));
+
+  uint32_t payload_size;
+  for (int i = 1; i < 3; ++i) {
+    const uint8_t *payload = ticosd_queue_peek_head(queue, &payload_size);
+    CHECK_TRUE(payload != NULL);
+    MEMCMP_EQUAL(&payloads[i], payload, 1);
+    CHECK_TRUE(ticosd_queue_complete_read(queue));
+  }
+  POINTERS_EQUAL(NULL, ticosd_queue_peek_head(queue, &payload_size));
+
+  sTicosdQueueStats stats;
+  ticosd_queue_get_stats(queue, &stats);
+  CHECK_EQUAL(1, stats.overwritten_count);
+  ticosd_queue_destroy(queue);
+}
+
+TEST_GROUP_BASE(TestGroup_Lease, TicosdQueueUtest){};
+
+// Tests that a peeked message points into the queue and is removed by completing the read:
+TEST(TestGroup_Lease, Test_PeekAndComplete) {
+  expect_queue_file_get_string_call(tmp_queue_file);
+  sTicosdQueue *queue = ticosd_queue_init(g_stub_ticosd, 64);
+
+  const uint8_t payload[] = {0x11, 0x22, 0x33};
+  ticosd_queue_write(queue, payload, sizeof(payload));
+
+  uint32_t payload_size;
+  const uint8_t *head = ticosd_queue_peek_head(queue, &payload_size);
+  CHECK_EQUAL(sizeof(payload), payload_size);
+  MEMCMP_EQUAL(payload, head, sizeof(payload));
+  // Peeking again returns the same memory:
+  POINTERS_EQUAL(head, ticosd_queue_peek_head(queue, &payload_size));
+
+  CHECK_TRUE(ticosd_queue_complete_read(queue));
+  POINTERS_EQUAL(NULL, ticosd_queue_peek_head(queue, &payload_size));
+  CHECK_FALSE(ticosd_queue_complete_read(queue));
+
+  ticosd_queue_destroy(queue);
+}
+
+// Tests that writes that would overwrite the leased message fail, until the lease is released:
+TEST(TestGroup_Lease, Test_LeaseBlocksOverwrite) {
+  expect_queue_file_get_string_call(tmp_queue_file);
+  sTicosdQueue *queue = ticosd_queue_init(g_stub_ticosd, 96);
+  for (int i = 0; i < 4; ++i) {
+    // Payload takes 24 bytes, the four messages fill up the queue exactly:
+    const uint8_t payload_small = 0x11 * (i + 1);
+    ticosd_queue_write(queue, &payload_small, 1);
+  }
+
+  uint32_t payload_size;
+  const uint8_t *head = ticosd_queue_peek_head(queue, &payload_size);
+  CHECK_EQUAL(0x11, head[0]);
+
+  const uint8_t payload_new = 0x55;
+  CHECK_FALSE(ticosd_queue_write(queue, &payload_new, 1));
+  CHECK_EQUAL(0x11, head[0]);
+  CHECK_EQUAL(0, ticosd_queue_get_read_ptr(queue));
+  CHECK_EQUAL(0, ticosd_queue_get_write_ptr(queue));
+
+  // Completing the read frees up the space:
+  CHECK_TRUE(ticosd_queue_complete_read(queue));
+  CHECK_TRUE(ticosd_queue_write(queue, &payload_new, 1));
+  CHECK_EQUAL(6, ticosd_queue_get_read_ptr(queue));
+  CHECK_EQUAL(6, ticosd_queue_get_write_ptr(queue));
+
+  ticosd_queue_destroy(queue);
+}
+
+// Tests that writes that do not overlap the leased message are not affected by the lease:
+TEST(TestGroup_Lease, Test_LeaseAllowsOtherWrites) {
+  expect_queue_file_get_string_call(tmp_queue_file);
+  sTicosdQueue *queue = ticosd_queue_init(g_stub_ticosd, 80);
+  const uint8_t payload_one = 0x11;
+  ticosd_queue_write(queue, &payload_one, 1);
+
+  uint32_t payload_size;
+  CHECK(ticosd_queue_peek_head(queue, &payload_size));
+
+  const uint8_t payload_two = 0x22;
+  CHECK_TRUE(ticosd_queue_write(queue, &payload_two, 1));
+  CHECK_EQUAL(0, ticosd_queue_get_read_ptr(queue));
+  CHECK_EQUAL(12, ticosd_queue_get_write_ptr(queue));
+
+  ticosd_queue_destroy(queue);
+}
+
+// Tests that releasing a lease leaves the message on head of the queue, and no longer protects it:
+TEST(TestGroup_Lease, Test_ReleaseHead) {
+  expect_queue_file_get_string_call(tmp_queue_file);
+  sTicosdQueue *queue = ticosd_queue_init(g_stub_ticosd, 96);
+  for (int i = 0; i < 4; ++i) {
+    const uint8_t payload_small = 0x11 * (i + 1);
+    ticosd_queue_write(queue, &payload_small, 1);
+  }
+  read_and_complete_head(queue);
+
+  uint32_t payload_size;
+  const uint8_t *head = ticosd_queue_peek_head(queue, &payload_size);
+  CHECK_EQUAL(0x22, head[0]);
+  // Payload takes 28 bytes, overwriting the first and second message:
+  const uint8_t payload_new[8] = {0x55};
+  CHECK_FALSE(ticosd_queue_write(queue, payload_new, sizeof(payload_new)));
+
+  ticosd_queue_release_head(queue);
+  CHECK_FALSE(ticosd_queue_complete_read(queue));
+  POINTERS_EQUAL(head, ticosd_queue_peek_head(queue, &payload_size));
+  ticosd_queue_release_head(queue);
+
+  // Without a lease, the oldest message gets dropped:
+  CHECK_TRUE(ticosd_queue_write(queue, payload_new, sizeof(payload_new)));
+  CHECK_EQUAL(12, ticosd_queue_get_read_ptr(queue));
+  head = ticosd_queue_peek_head(queue, &payload_size);
+  CHECK_EQUAL(0x33, head[0]);
+
+  ticosd_queue_destroy(queue);
+}
+
+struct TicosdQueueBatchUtest : TicosdQueueUtest {
+  sTicosdQueue *queue = NULL;
+
+  void teardown() override {
+    ticosd_queue_destroy(queue);
+    TicosdQueueUtest::teardown();
+  }
+
+  void open_queue(int size) {
+    expect_queue_file_get_string_call(tmp_queue_file);
+    queue = ticosd_queue_init(g_stub_ticosd, size);
+  }
+
+  void write_messages(int count, size_t payload_size, uint8_t first_value = 0x11) {
+    uint8_t payload[payload_size];
+    for (int i = 0; i < count; ++i) {
+      memset(payload, first_value + i, payload_size);
+      CHECK_TRUE(ticosd_queue_write(queue, payload, payload_size));
+    }
+  }
+};
+
+TEST_GROUP_BASE(TestGroup_Batch, TicosdQueueBatchUtest){};
+
+// Tests that a batch contains at most the requested number of messages, and that a prefix of it
+// can be completed:
+TEST(TestGroup_Batch, Test_PeekAndCompletePrefix) {
+  open_queue(256);
+  write_messages(5, 1);
+
+  sTicosdQueueEntry entries[8];
+  CHECK_EQUAL(3, ticosd_queue_peek_batch(queue, entries, 3, UINT32_MAX));
+  for (int i = 0; i < 3; ++i) {
+    CHECK_EQUAL(1, entries[i].payload_size_bytes);
+    CHECK_EQUAL(0x11 + i, entries[i].payload[0]);
+  }
+
+  CHECK_FALSE(ticosd_queue_complete_batch(queue, 4));
+  CHECK_TRUE(ticosd_queue_complete_batch(queue, 2));
+  CHECK_EQUAL(12, ticosd_queue_get_read_ptr(queue));
+  // The lease on the remaining message was released:
+  CHECK_FALSE(ticosd_queue_complete_batch(queue, 1));
+
+  CHECK_EQUAL(3, ticosd_queue_peek_batch(queue, entries, 8, UINT32_MAX));
+  CHECK_EQUAL(0x13, entries[0].payload[0]);
+  CHECK_EQUAL(0x15, entries[2].payload[0]);
+  CHECK_TRUE(ticosd_queue_complete_batch(queue, 3));
+  CHECK_EQUAL(0, ticosd_queue_peek_batch(queue, entries, 8, UINT32_MAX));
+}
+
+// Tests that a batch contains at most the requested number of bytes, but at least one message:
+TEST(TestGroup_Batch, Test_PeekByteLimit) {
+  open_queue(256);
+  write_messages(3, 8);
+
+  sTicosdQueueEntry entries[8];
+  CHECK_EQUAL(2, ticosd_queue_peek_batch(queue, entries, 8, 20));
+  CHECK_EQUAL(1, ticosd_queue_peek_batch(queue, entries, 8, 1));
+  CHECK_EQUAL(8, entries[0].payload_size_bytes);
+}
+
+// Tests peeking a batch that wraps around the end of the queue, and that all of its messages are
+// protected from being overwritten:
+TEST(TestGroup_Batch, Test_PeekWrapAround) {
+  open_queue(96);
+  // Payloads take 24 bytes, the four messages fill up the queue exactly:
+  write_messages(4, 1);
+  sTicosdQueueEntry entries[8];
+  CHECK_EQUAL(2, ticosd_queue_peek_batch(queue, entries, 2, UINT32_MAX));
+  CHECK_TRUE(ticosd_queue_complete_batch(queue, 2));
+  write_messages(2, 1, 0x55);
+  CHECK_EQUAL(12, ticosd_queue_get_read_ptr(queue));
+  CHECK_EQUAL(12, ticosd_queue_get_write_ptr(queue));
+
+  CHECK_EQUAL(4, ticosd_queue_peek_batch(queue, entries, 8, UINT32_MAX));
+  CHECK_EQUAL(0x13, entries[0].payload[0]);
+  CHECK_EQUAL(0x14, entries[1].payload[0]);
+  CHECK_EQUAL(0x55, entries[2].payload[0]);
+  CHECK_EQUAL(0x56, entries[3].payload[0]);
+
+  const uint8_t payload = 0x77;
+  CHECK_FALSE(ticosd_queue_write(queue, &payload, 1));
+
+  CHECK_TRUE(ticosd_queue_complete_batch(queue, 4));
+  CHECK_EQUAL(0, ticosd_queue_peek_batch(queue, entries, 8, UINT32_MAX));
+  CHECK_TRUE(ticosd_queue_write(queue, &payload, 1));
+}
+
+// Tests that failed attempts are counted per message, survive a restart, and release the lease:
+TEST(TestGroup_Batch, Test_FailHeadCountsAttempts) {
+  open_queue(256);
+  write_messages(2, 8);
+
+  sTicosdQueueEntry entries[2];
+  CHECK_EQUAL(2, ticosd_queue_peek_batch(queue, entries, 2, UINT32_MAX));
+  CHECK_EQUAL(1, ticosd_queue_fail_head(queue));
+  CHECK_FALSE(ticosd_queue_complete_batch(queue, 1));
+  CHECK_EQUAL(2, ticosd_queue_peek_batch(queue, entries, 2, UINT32_MAX));
+  CHECK_EQUAL(2, ticosd_queue_fail_head(queue));
+
+  ticosd_queue_destroy(queue);
+  open_queue(256);
+  CHECK_EQUAL(2, ticosd_queue_peek_batch(queue, entries, 2, UINT32_MAX));
+  CHECK_EQUAL(0x11, entries[0].payload[0]);
+  CHECK_EQUAL(3, ticosd_queue_fail_head(queue));
+
+  CHECK_EQUAL(2, ticosd_queue_peek_batch(queue, entries, 2, UINT32_MAX));
+  CHECK_TRUE(ticosd_queue_complete_batch(queue, 1));
+  CHECK_EQUAL(1, ticosd_queue_fail_head(queue));
+  CHECK_EQUAL(1, ticosd_queue_peek_batch(queue, entries, 2, UINT32_MAX));
+  CHECK_EQUAL(0x12, entries[0].payload[0]);
+  CHECK_TRUE(ticosd_queue_complete_batch(queue, 1));
+  CHECK_EQUAL(0, ticosd_queue_fail_head(queue));
+}
+
+// Tests that a message acknowledged behind one that failed ends the batch, and is dropped once it
+// gets to the head, also after a restart:
+TEST(TestGroup_Batch, Test_AckedEntrySkipped) {
+  open_queue(256);
+  write_messages(4, 8);
+
+  sTicosdQueueEntry entries[4];
+  CHECK_EQUAL(4, ticosd_queue_peek_batch(queue, entries, 4, UINT32_MAX));
+  CHECK_TRUE(ticosd_queue_ack_entry(queue, 1));
+  CHECK_TRUE(ticosd_queue_ack_entry(queue, 3));
+  CHECK_FALSE(ticosd_queue_ack_entry(queue, 4));
+  CHECK_EQUAL(1, ticosd_queue_fail_head(queue));
+  CHECK_FALSE(ticosd_queue_ack_entry(queue, 0));
+
+  ticosd_queue_destroy(queue);
+  open_queue(256);
+  CHECK_EQUAL(1, ticosd_queue_peek_batch(queue, entries, 4, UINT32_MAX));
+  CHECK_EQUAL(0x11, entries[0].payload[0]);
+  CHECK_TRUE(ticosd_queue_complete_batch(queue, 1));
+
+  CHECK_EQUAL(1, ticosd_queue_peek_batch(queue, entries, 4, UINT32_MAX));
+  CHECK_EQUAL(0x13, entries[0].payload[0]);
+  CHECK_TRUE(ticosd_queue_complete_batch(queue, 1));
+  CHECK_EQUAL(0, ticosd_queue_peek_batch(queue, entries, 4, UINT32_MAX));
+}
+
+// Tests that completing a batch flushes all read flags at once:
+TEST(TestGroup_Batch, Test_CompleteBatchFlushesOnce) {
+  open_queue(1024);
+  write_messages(10, 8);
+  const uint32_t sync_count = ticosd_queue_get_sync_count(queue);
+
+  sTicosdQueueEntry entries[10];
+  CHECK_EQUAL(10, ticosd_queue_peek_batch(queue, entries, 10, UINT32_MAX));
+  CHECK_TRUE(ticosd_queue_complete_batch(queue, 10));
+  CHECK_EQUAL(sync_count + 1, ticosd_queue_get_sync_count(queue));
+}
+
+// Tests that draining a queue with the batch API takes a fraction of the flushes of the copying
+// and the zero-copy single message APIs.
+TEST(TestGroup_Batch, Test_DrainSyncs) {
+  const int count = 512;
+  uint32_t syncs[3];
+
+  for (int mode = 0; mode < 3; ++mode) {
+    open_queue(1024 * 1024);
+    write_messages(count, 128);
+    const uint32_t sync_count = ticosd_queue_get_sync_count(queue);
+
+    int drained = 0;
+    uint32_t payload_size;
+    sTicosdQueueEntry entries[64];
+    switch (mode) {
+      case 0:
+        uint8_t *payload;
+        while ((payload = ticosd_queue_read_head(queue, &payload_size))) {
+          free(payload);
+          ticosd_queue_complete_read(queue);
+          drained++;
+        }
+        break;
+      case 1:
+        while (ticosd_queue_peek_head(queue, &payload_size)) {
+          ticosd_queue_complete_read(queue);
+          drained++;
+        }
+        break;
+      default:
+        uint32_t batch_count;
+        while ((batch_count = ticosd_queue_peek_batch(queue, entries, 64, UINT32_MAX))) {
+          ticosd_queue_complete_batch(queue, batch_count);
+          drained += batch_count;
+        }
+        break;
+    }
+    syncs[mode] = ticosd_queue_get_sync_count(queue) - sync_count;
+    CHECK_EQUAL(count, drained);
+
+    ticosd_queue_destroy(queue);
+    queue = NULL;
+    unlink(tmp_queue_file);
+  }
+
+  CHECK(syncs[2] * 32 < syncs[1]);
+}
+
+struct TicosdQueueCheckpointUtest : TicosdQueueUtest {
+  char tmp_crashed_queue_file[4200] = {0};
+
+  void setup() override {
+    TicosdQueueUtest::setup();
+    sprintf(tmp_crashed_queue_file, "%s/queue-crashed", tmp_dir);
+  }
+
+  void teardown() override {
+    unlink(tmp_crashed_queue_file);
+    TicosdQueueUtest::teardown();
+  }
+
+  sTicosdQueue *open_queue(const char *path, int size) {
+    expect_queue_file_get_string_call(path);
+    return ticosd_queue_init(g_stub_ticosd, size);
+  }
+
+  // Takes a copy of the queue file while the queue is still open, as if ticosd crashed:
+  void copy_queue_file_as_crashed() {
+    const int in_fd = open(tmp_queue_file, O_RDONLY);
+    const int out_fd =
+      open(tmp_crashed_queue_file, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    uint8_t buf[4096];
+    ssize_t len;
+    while ((len = read(in_fd, buf, sizeof(buf))) > 0) {
+      CHECK_EQUAL(len, write(out_fd, buf, len));
+    }
+    close(in_fd);
+    close(out_fd);
+  }
+
+  void corrupt_checkpoints(int size) {
+    const int fd = open(tmp_queue_file, O_WRONLY);
+    uint8_t garbage[kCheckpointRegionSize];
+    memset(garbage, 0xFF, sizeof(garbage));
+    CHECK_EQUAL((ssize_t)sizeof(garbage), pwrite(fd, garbage, sizeof(garbage), size));
+    close(fd);
+  }
+
+  static void write_messages(sTicosdQueue *queue, int count, size_t payload_size) {
+    uint8_t payload[payload_size];
+    for (int i = 0; i < count; ++i) {
+      memset(payload, 0x11 * (i + 1), payload_size);
+      CHECK_TRUE(ticosd_queue_write(queue, payload, payload_size));
+    }
+  }
+
+  static void check_pointers(sTicosdQueue *queue, uint32_t read_ptr, uint32_t write_ptr,
+                             uint32_t prev_ptr) {
+    CHECK_EQUAL(read_ptr, ticosd_queue_get_read_ptr(queue));
+    CHECK_EQUAL(write_ptr, ticosd_queue_get_write_ptr(queue));
+    CHECK_EQUAL(prev_ptr, ticosd_queue_get_prev_ptr(queue));
+  }
+};
+
+TEST_GROUP_BASE(TestGroup_Checkpoint, TicosdQueueCheckpointUtest){};
+
+// Tests that after a clean shutdown, the pointers are restored from the checkpoint without
+// scanning the queue:
+TEST(TestGroup_Checkpoint, Test_RecoverAfterCleanShutdown) {
+  sTicosdQueue *queue = open_queue(tmp_queue_file, 256);
+  write_messages(queue, 5, 1);
+  read_and_complete_head(queue);
+  read_and_complete_head(queue);
+  check_pointers(queue, 12, 30, 24);
+  ticosd_queue_destroy(queue);
+
+  queue = open_queue(tmp_queue_file, 256);
+  check_pointers(queue, 12, 30, 24);
+  // Only the head and the slot at the write pointer get validated:
+  CHECK(ticosd_queue_get_msg_validation_count(queue) <= 3);
+
+  uint32_t payload_size;
+  uint8_t *payload = ticosd_queue_read_head(queue, &payload_size);
+  CHECK_EQUAL(1, payload_size);
+  CHECK_EQUAL(0x33, payload[0]);
+  free(payload);
+  ticosd_queue_destroy(queue);
+}
+
+// Tests that messages written and read after the last checkpoint are recovered after a crash:
+TEST(TestGroup_Checkpoint, Test_RecoverTailAfterCrash) {
+  sTicosdQueue *queue = open_queue(tmp_queue_file, 256);
+  write_messages(queue, 3, 1);
+  read_and_complete_head(queue);
+  copy_queue_file_as_crashed();
+  check_pointers(queue, 6, 18, 12);
+  ticosd_queue_destroy(queue);
+
+  queue = open_queue(tmp_crashed_queue_file, 256);
+  check_pointers(queue, 6, 18, 12);
+  ticosd_queue_destroy(queue);
+}
+
+// Tests that a crash after the write pointer wrapped around is recovered correctly:
+TEST(TestGroup_Checkpoint, Test_RecoverWrappedTailAfterCrash) {
+  sTicosdQueue *queue = open_queue(tmp_queue_file, 96);
+  write_messages(queue, 3, 1);
+  read_and_complete_head(queue);
+  read_and_complete_head(queue);
+  // First message fits exactly at the end, second one wraps around to the start:
+  write_messages(queue, 2, 1);
+  write_messages(queue, 1, 1);
+  copy_queue_file_as_crashed();
+  check_pointers(queue, 12, 12, 6);
+  ticosd_queue_destroy(queue);
+
+  queue = open_queue(tmp_crashed_queue_file, 96);
+  check_pointers(queue, 12, 12, 6);
+  ticosd_queue_destroy(queue);
+}
+
+// Tests that a corrupt checkpoint falls back to scanning the entire queue:
+TEST(TestGroup_Checkpoint, Test_CorruptCheckpointFallsBackToFullScan) {
+  sTicosdQueue *queue = open_queue(tmp_queue_file, 256);
+  write_messages(queue, 5, 1);
+  read_and_complete_head(queue);
+  ticosd_queue_destroy(queue);
+
+  corrupt_checkpoints(256);
+
+  queue = open_queue(tmp_queue_file, 256);
+  check_pointers(queue, 6, 30, 24);
+  CHECK(ticosd_queue_get_msg_validation_count(queue) >= 5);
+  ticosd_queue_destroy(queue);
+}
+
+// Tests that a checkpoint taken for a differently sized queue is not used:
+TEST(TestGroup_Checkpoint, Test_CheckpointIgnoredAfterResize) {
+  sTicosdQueue *queue = open_queue(tmp_queue_file, 256);
+  write_messages(queue, 2, 1);
+  ticosd_queue_destroy(queue);
+
+  queue = open_queue(tmp_queue_file, 128);
+  check_pointers(queue, 0, 12, 6);
+  ticosd_queue_destroy(queue);
+}
+
+// Tests that the number of messages validated when the queue is recovered from a checkpoint does
+// not depend on the size of the queue, unlike a full scan.
+TEST(TestGroup_Checkpoint, Test_RecoveryValidationsVsQueueSize) {
+  const int sizes_kib[] = {16, 64};
+  const size_t payload_size = 1024;
+
+  for (size_t i = 0; i < sizeof(sizes_kib) / sizeof(sizes_kib[0]); ++i) {
+    const int size = sizes_kib[i] * 1024;
+    const int count = size / (20 + payload_size) - 1;
+
+    sTicosdQueue *queue = open_queue(tmp_queue_file, size);
+    write_messages(queue, count, payload_size);
+    for (int j = 0; j < count / 2; ++j) {
+      read_and_complete_head(queue);
+    }
+    const uint32_t read_ptr = ticosd_queue_get_read_ptr(queue);
+    const uint32_t write_ptr = ticosd_queue_get_write_ptr(queue);
+    const uint32_t prev_ptr = ticosd_queue_get_prev_ptr(queue);
+    ticosd_queue_destroy(queue);
+
+    queue = open_queue(tmp_queue_file, size);
+    const uint32_t checkpoint_validations = ticosd_queue_get_msg_validation_count(queue);
+    check_pointers(queue, read_ptr, write_ptr, prev_ptr);
+    ticosd_queue_destroy(queue);
+
+    corrupt_checkpoints(size);
+
+    queue = open_queue(tmp_queue_file, size);
+    const uint32_t full_scan_validations = ticosd_queue_get_msg_validation_count(queue);
+    check_pointers(queue, read_ptr, write_ptr, prev_ptr);
+    ticosd_queue_destroy(queue);
+
+    CHECK(checkpoint_validations <= 3);
+    CHECK(full_scan_validations >= (uint32_t)count);
+    unlink(tmp_queue_file);
+  }
+}
+
+struct TicosdQueueDurabilityUtest : TicosdQueueUtest {
+  sTicosdQueue *queue = NULL;
+
+  void teardown() override {
+    ticosd_queue_destroy(queue);
+    TicosdQueueUtest::teardown();
+  }
+
+  sTicosdQueue *open_queue(int size) {
+    expect_queue_file_get_string_call(tmp_queue_file);
+    return ticosd_queue_init(g_stub_ticosd, size);
+  }
+
+  static void write_typed_messages(sTicosdQueue *queue, uint8_t type, int count,
+                                   size_t payload_size) {
+    uint8_t payload[payload_size];
+    memset(payload, 0x11, payload_size);
+    payload[0] = type;
+    for (int i = 0; i < count; ++i) {
+      CHECK_TRUE(ticosd_queue_write(queue, payload, payload_size));
+    }
+  }
+
+  // Waits up to 2 seconds for the flusher thread to flush the queue:
+  static bool wait_for_sync_count_above(sTicosdQueue *queue, uint32_t sync_count) {
+    for (int i = 0; i < 200; ++i) {
+      if (ticosd_queue_get_sync_count(queue) > sync_count) {
+        return true;
+      }
+      usleep(10 * 1000);
+    }
+    return false;
+  }
+};
+
+TEST_GROUP_BASE(TestGroup_Durability, TicosdQueueDurabilityUtest){};
+
+// Tests that by default, every write and completed read is flushed to the queue file:
+TEST(TestGroup_Durability, Test_StrictFlushesEveryOperation) {
+  queue = open_queue(1024);
+  const uint32_t sync_count = ticosd_queue_get_sync_count(queue);
+
+  write_typed_messages(queue, 'A', 1, 8);
+  CHECK_EQUAL(sync_count + 1, ticosd_queue_get_sync_count(queue));
+
+  read_and_complete_head(queue);
+  CHECK_EQUAL(sync_count + 2, ticosd_queue_get_sync_count(queue));
+}
+
+// Tests that group commit changes are not flushed before the interval or size is reached:
+TEST(TestGroup_Durability, Test_GroupCommitDefersFlush) {
+  queue = open_queue(1024);
+  ticosd_queue_set_group_commit(queue, 60 * 1000, 1024 * 1024);
+  ticosd_queue_set_durability(queue, kTicosdQueueDurability_Group);
+  const uint32_t sync_count = ticosd_queue_get_sync_count(queue);
+
+  write_typed_messages(queue, 'A', 10, 8);
+  read_and_complete_head(queue);
+  CHECK_EQUAL(sync_count, ticosd_queue_get_sync_count(queue));
+}
+
+// Tests that group commit changes are flushed once the group commit size has been written:
+TEST(TestGroup_Durability, Test_GroupCommitFlushesAfterSize) {
+  queue = open_queue(4096);
+  ticosd_queue_set_group_commit(queue, 60 * 1000, 256);
+  ticosd_queue_set_durability(queue, kTicosdQueueDurability_Group);
+  const uint32_t sync_count = ticosd_queue_get_sync_count(queue);
+
+  write_typed_messages(queue, 'A', 10, 64);
+  CHECK_TRUE(wait_for_sync_count_above(queue, sync_count));
+  CHECK(ticosd_queue_get_sync_count(queue) - sync_count < 10);
+}
+
+// Tests that group commit changes are flushed once the group commit interval has elapsed:
+TEST(TestGroup_Durability, Test_GroupCommitFlushesAfterInterval) {
+  queue = open_queue(1024);
+  ticosd_queue_set_group_commit(queue, 10, 1024 * 1024);
+  ticosd_queue_set_durability(queue, kTicosdQueueDurability_Group);
+  const uint32_t sync_count = ticosd_queue_get_sync_count(queue);
+
+  write_typed_messages(queue, 'A', 1, 8);
+  CHECK_TRUE(wait_for_sync_count_above(queue, sync_count));
+}
+
+// Tests that a strict per-type override flushes its own write together with all pending changes:
+TEST(TestGroup_Durability, Test_StrictTypeOverride) {
+  queue = open_queue(1024);
+  ticosd_queue_set_group_commit(queue, 60 * 1000, 1024 * 1024);
+  ticosd_queue_set_durability(queue, kTicosdQueueDurability_Group);
+  ticosd_queue_set_type_durability(queue, 'R', kTicosdQueueDurability_Strict);
+  const uint32_t sync_count = ticosd_queue_get_sync_count(queue);
+
+  write_typed_messages(queue, 'A', 3, 8);
+  CHECK_EQUAL(sync_count, ticosd_queue_get_sync_count(queue));
+
+  write_typed_messages(queue, 'R', 1, 8);
+  CHECK_EQUAL(sync_count + 1, ticosd_queue_get_sync_count(queue));
+}
+
+// Tests that async changes are only flushed when the queue is closed, and are recovered after:
+TEST(TestGroup_Durability, Test_AsyncFlushesOnDestroy) {
+  queue = open_queue(1024);
+  ticosd_queue_set_durability(queue, kTicosdQueueDurability_Async);
+  const uint32_t sync_count = ticosd_queue_get_sync_count(queue);
+
+  write_typed_messages(queue, 'A', 5, 8);
+  read_and_complete_head(queue);
+  CHECK_EQUAL(sync_count, ticosd_queue_get_sync_count(queue));
+  const uint32_t read_ptr = ticosd_queue_get_read_ptr(queue);
+  const uint32_t write_ptr = ticosd_queue_get_write_ptr(queue);
+  ticosd_queue_destroy(queue);
+
+  queue = open_queue(1024);
+  CHECK_EQUAL(read_ptr, ticosd_queue_get_read_ptr(queue));
+  CHECK_EQUAL(write_ptr, ticosd_queue_get_write_ptr(queue));
+}
+
+// Tests the number of flushes of each durability mode, writing and reading back small messages like
+// attributes.
+TEST(TestGroup_Durability, Test_SyncsPerMode) {
+  const eTicosdQueueDurability modes[] = {
+    kTicosdQueueDurability_Strict,
+    kTicosdQueueDurability_Group,
+    kTicosdQueueDurability_Async,
+  };
+  const uint32_t writes = 64;
+  uint32_t syncs[3];
+
+  for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); ++i) {
+    queue = open_queue(1024 * 1024);
+    ticosd_queue_set_group_commit(queue, 100, 64 * 1024);
+    ticosd_queue_set_durability(queue, modes[i]);
+    const uint32_t sync_count = ticosd_queue_get_sync_count(queue);
+
+    for (uint32_t j = 0; j < writes; ++j) {
+      write_typed_messages(queue, 'A', 1, 128);
+      read_and_complete_head(queue);
+    }
+    syncs[i] = ticosd_queue_get_sync_count(queue) - sync_count;
+
+    ticosd_queue_destroy(queue);
+    queue = NULL;
+    unlink(tmp_queue_file);
+  }
+
+  CHECK(syncs[0] >= 2 * writes);
+  CHECK(syncs[1] < writes);
+  CHECK_EQUAL(0, syncs[2]);
+}
+
+struct TicosdQueueReserveUtest : TicosdQueueDurabilityUtest {
+  struct ProducerArgs {
+    sTicosdQueue *queue;
+    uint8_t id;
+    uint32_t count;
+    uint32_t written;
+  };
+
+  // Writes messages tagged with the producer id and a sequence number, until count messages have
+  // been written:
+  static void *producer_thread(void *arg) {
+    ProducerArgs *const args = (ProducerArgs *)arg;
+    for (args->written = 0; args->written < args->count; ++args->written) {
+      sTicosdQueueReservation reservation;
+      if (!ticosd_queue_reserve(args->queue, 1 + sizeof(uint32_t) + 123, &reservation)) {
+        break;
+      }
+      reservation.payload[0] = args->id;
+      memcpy(&reservation.payload[1], &args->written, sizeof(uint32_t));
+      memset(&reservation.payload[1 + sizeof(uint32_t)], args->id, 123);
+      ticosd_queue_commit(args->queue, &reservation);
+    }
+    return NULL;
+  }
+
+  struct ResetArgs {
+    sTicosdQueue *queue;
+    std::atomic<bool> done{false};
+  };
+
+  static void *reset_thread(void *arg) {
+    ResetArgs *const args = (ResetArgs *)arg;
+    ticosd_queue_reset(args->queue);
+    args->done = true;
+    return NULL;
+  }
+};
+
+TEST_GROUP_BASE(TestGroup_Reserve, TicosdQueueReserveUtest){};
+
+// Tests that committed messages only become visible once all messages reserved before them have
+// been committed too:
+TEST(TestGroup_Reserve, Test_CommitOutOfOrder) {
+  queue = open_queue(256);
+  sTicosdQueueReservation first, second;
+  CHECK_TRUE(ticosd_queue_reserve(queue, 1, &first));
+  CHECK_TRUE(ticosd_queue_reserve(queue, 2, &second));
+  first.payload[0] = 0x11;
+  second.payload[0] = 0x22;
+  second.payload[1] = 0x33;
+
+  uint32_t payload_size;
+  POINTERS_EQUAL(NULL, ticosd_queue_peek_head(queue, &payload_size));
+  CHECK_TRUE(ticosd_queue_commit(queue, &second));
+  POINTERS_EQUAL(NULL, ticosd_queue_peek_head(queue, &payload_size));
+  CHECK_FALSE(ticosd_queue_commit(queue, &second));
+
+  CHECK_TRUE(ticosd_queue_commit(queue, &first));
+  sTicosdQueueEntry entries[4];
+  CHECK_EQUAL(2, ticosd_queue_peek_batch(queue, entries, 4, 1024));
+  CHECK_EQUAL(0x11, entries[0].payload[0]);
+  CHECK_EQUAL(0x22, entries[1].payload[0]);
+  CHECK_EQUAL(2, entries[1].payload_size_bytes);
+  ticosd_queue_release_head(queue);
+}
+
+// Tests that a batch stops at the first message that is not committed yet:
+TEST(TestGroup_Reserve, Test_PeekBatchStopsAtPending) {
+  queue = open_queue(256);
+  write_typed_messages(queue, 'A', 1, 4);
+  sTicosdQueueReservation reservation;
+  CHECK_TRUE(ticosd_queue_reserve(queue, 4, &reservation));
+  write_typed_messages(queue, 'B', 1, 4);
+
+  sTicosdQueueEntry entries[4];
+  CHECK_EQUAL(1, ticosd_queue_peek_batch(queue, entries, 4, 1024));
+  CHECK_TRUE(ticosd_queue_complete_batch(queue, 1));
+
+  memset(reservation.payload, 'C', 4);
+  CHECK_TRUE(ticosd_queue_commit(queue, &reservation));
+  CHECK_EQUAL(2, ticosd_queue_peek_batch(queue, entries, 4, 1024));
+  CHECK_EQUAL('C', entries[0].payload[0]);
+  CHECK_EQUAL('B', entries[1].payload[0]);
+  ticosd_queue_release_head(queue);
+}
+
+// Tests that messages that are not committed yet are never overwritten:
+TEST(TestGroup_Reserve, Test_PendingNotOverwritten) {
+  queue = open_queue(96);
+  sTicosdQueueReservation reservations[4];
+  for (int i = 0; i < 4; ++i) {
+    // Payload takes 24 bytes, the four messages fill up the queue exactly:
+    CHECK_TRUE(ticosd_queue_reserve(queue, 1, &reservations[i]));
+    reservations[i].payload[0] = 0x11 * (i + 1);
+  }
+
+  const uint8_t payload_new = 0x55;
+  sTicosdQueueReservation reservation;
+  CHECK_FALSE(ticosd_queue_reserve(queue, 1, &reservation));
+  CHECK_FALSE(ticosd_queue_write(queue, &payload_new, 1));
+
+  // Committing the oldest message allows it to be dropped:
+  CHECK_TRUE(ticosd_queue_commit(queue, &reservations[0]));
+  CHECK_TRUE(ticosd_queue_write(queue, &payload_new, 1));
+  CHECK_EQUAL(6, ticosd_queue_get_write_ptr(queue));
+  CHECK_FALSE(ticosd_queue_write(queue, &payload_new, 1));
+
+  uint32_t payload_size;
+  const uint8_t *head = ticosd_queue_peek_head(queue, &payload_size);
+  CHECK_EQUAL(payload_new, head[0]);
+  CHECK_TRUE(ticosd_queue_complete_read(queue));
+  POINTERS_EQUAL(NULL, ticosd_queue_peek_head(queue, &payload_size));
+
+  for (int i = 1; i < 4; ++i) {
+    CHECK_TRUE(ticosd_queue_commit(queue, &reservations[i]));
+  }
+  for (int i = 1; i < 4; ++i) {
+    head = ticosd_queue_peek_head(queue, &payload_size);
+    CHECK_EQUAL(0x11 * (i + 1), head[0]);
+    CHECK_TRUE(ticosd_queue_complete_read(queue));
+  }
+}
+
+// Tests that resetting the queue waits for the reserved messages to be committed:
+TEST(TestGroup_Reserve, Test_ResetWaitsForCommit) {
+  queue = open_queue(256);
+  sTicosdQueueReservation reservation;
+  CHECK_TRUE(ticosd_queue_reserve(queue, 1, &reservation));
+  reservation.payload[0] = 0x11;
+
+  pthread_t thread;
+  ResetArgs args;
+  args.queue = queue;
+  pthread_create(&thread, NULL, reset_thread, &args);
+  usleep(50 * 1000);
+  CHECK_FALSE(args.done);
+
+  CHECK_TRUE(ticosd_queue_commit(queue, &reservation));
+  pthread_join(thread, NULL);
+  CHECK_TRUE(args.done);
+  uint32_t payload_size;
+  POINTERS_EQUAL(NULL, ticosd_queue_peek_head(queue, &payload_size));
+
+  // The queue is usable again, with no message left pending:
+  CHECK_TRUE(ticosd_queue_reserve(queue, 1, &reservation));
+  reservation.payload[0] = 0x22;
+  CHECK_TRUE(ticosd_queue_commit(queue, &reservation));
+  const uint8_t *head = ticosd_queue_peek_head(queue, &payload_size);
+  CHECK_TRUE(head != NULL);
+  CHECK_EQUAL(0x22, head[0]);
+  CHECK_TRUE(ticosd_queue_complete_read(queue));
+}
+
+// Tests that messages written by concurrent producers are all readable, in order per producer:
+TEST(TestGroup_Reserve, Test_ConcurrentProducers) {
+  const int num_producers = 4;
+  const uint32_t count = 1000;
+  queue = open_queue(1024 * 1024);
+  ticosd_queue_set_durability(queue, kTicosdQueueDurability_Async);
+
+  pthread_t threads[num_producers];
+  ProducerArgs args[num_producers];
+  for (int i = 0; i < num_producers; ++i) {
+    args[i] = (ProducerArgs){.queue = queue, .id = (uint8_t)i, .count = count};
+    pthread_create(&threads[i], NULL, producer_thread, &args[i]);
+  }
+  for (int i = 0; i < num_producers; ++i) {
+    pthread_join(threads[i], NULL);
+    CHECK_EQUAL(count, args[i].written);
+  }
+
+  uint32_t next_seq[num_producers] = {0};
+  uint32_t payload_size;
+  const uint8_t *payload;
+  while ((payload = ticosd_queue_peek_head(queue, &payload_size)) != NULL) {
+    const uint8_t id = payload[0];
+    CHECK(id < num_producers);
+    uint32_t seq;
+    memcpy(&seq, &payload[1], sizeof(uint32_t));
+    CHECK_EQUAL(next_seq[id]++, seq);
+    CHECK_EQUAL(id, payload[payload_size - 1]);
+    CHECK_TRUE(ticosd_queue_complete_read(queue));
+  }
+  for (int i = 0; i < num_producers; ++i) {
+    CHECK_EQUAL(count, next_seq[i]);
+  }
+}
+
+struct TicosdQueueCompressionUtest : TicosdQueueDurabilityUtest {
+  // A reboot event, as queued by the reboot plugin:
+  static size_t make_reboot_event(uint8_t *payload, size_t size, int reason) {
+    payload[0] = 'R';
+    const int len = snprintf(
+      (char *)&payload[1], size - 1,
+      "{\"Type\": \"Trace\",\"SoftwareType\": \"main\",\"SoftwareVersion\": \"1.4.2\","
+      "\"HardwareVersion\": \"evt-board-2\",\"SdkVersion\": \"0.2.0\",\"EventInfo\": "
+      "{\"Reason\": %d},\"UserInfo\": {}}",
+      reason);
+    return 1 + len + 1;
+  }
+
+  static void check_entry(const sTicosdQueueEntry *entry, const uint8_t *payload, size_t size) {
+    CHECK_EQUAL(size, entry->payload_size_bytes);
+    MEMCMP_EQUAL(payload, entry->payload, size);
+  }
+
+  // Number of messages held by a full queue that does not overwrite:
+  uint32_t fill_with_reboot_events(uint32_t queue_size, uint32_t compress_threshold) {
+    queue = open_queue(queue_size);
+    ticosd_queue_set_durability(queue, kTicosdQueueDurability_Async);
+    ticosd_queue_set_overwrite(queue, false);
+    ticosd_queue_set_compression(queue, compress_threshold);
+    uint8_t payload[512];
+    uint32_t count = 0;
+    while (ticosd_queue_write(queue, payload, make_reboot_event(payload, sizeof(payload), count))) {
+      ++count;
+    }
+    ticosd_queue_destroy(queue);
+    queue = NULL;
+    unlink(tmp_queue_file);
+    return count;
+  }
+};
+
+TEST_GROUP_BASE(TestGroup_Compression, TicosdQueueCompressionUtest){};
+
+// Tests that a payload above the threshold is stored compressed, and read back as written:
+TEST(TestGroup_Compression, Test_RoundTrip) {
+  queue = open_queue(1024);
+  ticosd_queue_set_compression(queue, 64);
+  uint8_t payload[512];
+  const size_t size = make_reboot_event(payload, sizeof(payload), 3);
+  CHECK_TRUE(ticosd_queue_write(queue, payload, size));
+  CHECK(ticosd_queue_get_write_ptr(queue) * sizeof(uint32_t) < 20 + size);
+
+  sTicosdQueueEntry entry;
+  CHECK_EQUAL(1, ticosd_queue_peek_batch(queue, &entry, 1, UINT32_MAX));
+  check_entry(&entry, payload, size);
+  ticosd_queue_release_head(queue);
+
+  uint32_t payload_size;
+  uint8_t *read = ticosd_queue_read_head(queue, &payload_size);
+  CHECK_EQUAL(size, payload_size);
+  MEMCMP_EQUAL(payload, read, size);
+  free(read);
+  CHECK_TRUE(ticosd_queue_complete_read(queue));
+}
+
+// Tests that payloads below the threshold, and payloads that do not get any smaller, are stored as
+// they are:
+TEST(TestGroup_Compression, Test_StoredUncompressed) {
+  queue = open_queue(1024);
+  ticosd_queue_set_compression(queue, 64);
+  uint8_t payload[128];
+  payload[0] = 'R';
+  for (size_t i = 1; i < sizeof(payload); ++i) {
+    payload[i] = (uint8_t)(i * 2654435761u >> 13);
+  }
+  CHECK_TRUE(ticosd_queue_write(queue, payload, 63));
+  CHECK_EQUAL(5 + 16, ticosd_queue_get_write_ptr(queue));
+  CHECK_TRUE(ticosd_queue_write(queue, payload, sizeof(payload)));
+  CHECK_EQUAL(5 + 16 + 5 + 32, ticosd_queue_get_write_ptr(queue));
+
+  sTicosdQueueEntry entries[2];
+  CHECK_EQUAL(2, ticosd_queue_peek_batch(queue, entries, 2, UINT32_MAX));
+  check_entry(&entries[0], payload, 63);
+  check_entry(&entries[1], payload, sizeof(payload));
+  CHECK_TRUE(ticosd_queue_complete_batch(queue, 2));
+}
+
+// Tests that a batch mixing compressed and uncompressed messages is decompressed as a whole, and
+// that compressed messages are still readable after a restart:
+TEST(TestGroup_Compression, Test_PeekBatchAfterRestart) {
+  queue = open_queue(2048);
+  ticosd_queue_set_compression(queue, 64);
+  uint8_t payloads[3][512];
+  size_t sizes[3];
+  sizes[0] = make_reboot_event(payloads[0], sizeof(payloads[0]), 1);
+  memcpy(payloads[1], "R{}", 4);
+  sizes[1] = 4;
+  sizes[2] = make_reboot_event(payloads[2], sizeof(payloads[2]), 2);
+  for (int i = 0; i < 3; ++i) {
+    CHECK_TRUE(ticosd_queue_write(queue, payloads[i], sizes[i]));
+  }
+  ticosd_queue_destroy(queue);
+  queue = open_queue(2048);
+
+  sTicosdQueueEntry entries[3];
+  CHECK_EQUAL(3, ticosd_queue_peek_batch(queue, entries, 3, UINT32_MAX));
+  for (int i = 0; i < 3; ++i) {
+    check_entry(&entries[i], payloads[i], sizes[i]);
+  }
+  CHECK_TRUE(ticosd_queue_complete_batch(queue, 2));
+  uint32_t payload_size;
+  const uint8_t *head = ticosd_queue_peek_head(queue, &payload_size);
+  CHECK_EQUAL(sizes[2], payload_size);
+  MEMCMP_EQUAL(payloads[2], head, payload_size);
+  CHECK_TRUE(ticosd_queue_complete_read(queue));
+}
+
+// Tests that a queue holds at least twice as many reboot events with compression as without:
+TEST(TestGroup_Compression, Test_BacklogCapacity) {
+  const uint32_t queue_size = 64 * 1024;
+  const uint32_t uncompressed = fill_with_reboot_events(queue_size, 0);
+  const uint32_t compressed = fill_with_reboot_events(queue_size, 64);
+  CHECK(compressed >= 2 * uncompressed);
+}
+
+TEST_GROUP_BASE(TestGroup_Stats, TicosdQueueDurabilityUtest){};
+
+// Tests the depth and age of the unread messages, and the enqueue time of peeked messages:
+TEST(TestGroup_Stats, Test_DepthAndAge) {
+  queue = open_queue(1024);
+  sTicosdQueueStats stats;
+  ticosd_queue_get_stats(queue, &stats);
+  CHECK_EQUAL(0, stats.unread_count);
+  CHECK_EQUAL(0, stats.unread_bytes);
+  CHECK_EQUAL(0, stats.oldest_unread_timestamp);
+
+  ticosd_queue_set_fake_time(queue, kSyncedTime);
+  write_typed_messages(queue, 'R', 2, 8);
+  ticosd_queue_set_fake_time(queue, kSyncedTime + 1000);
+  write_typed_messages(queue, 'A', 1, 1);
+  ticosd_queue_get_stats(queue, &stats);
+  CHECK_EQUAL(3, stats.unread_count);
+  CHECK_EQUAL(2 * (20 + 8) + (20 + 4), stats.unread_bytes);
+  CHECK_EQUAL(kSyncedTime, stats.oldest_unread_timestamp);
+
+  sTicosdQueueEntry entries[4];
+  CHECK_EQUAL(3, ticosd_queue_peek_batch(queue, entries, 4, UINT32_MAX));
+  CHECK_EQUAL(kSyncedTime, entries[0].timestamp);
+  CHECK_EQUAL(kSyncedTime + 1000, entries[2].timestamp);
+  CHECK_TRUE(ticosd_queue_complete_batch(queue, 2));
+  ticosd_queue_get_stats(queue, &stats);
+  CHECK_EQUAL(1, stats.unread_count);
+  CHECK_EQUAL(kSyncedTime + 1000, stats.oldest_unread_timestamp);
+  CHECK_EQUAL(0, stats.overwritten_count);
+}
+
+// Tests that messages written by older versions, without an enqueue time, have an unknown age:
+TEST(TestGroup_Stats, Test_UnknownAge) {
+  create_queue_file("A5020000000000000100000078ADFB9322000000"
+                    "0000000000000000000000000000000000000000");
+  queue = ticosd_queue_init(g_stub_ticosd, 40);
+  sTicosdQueueStats stats;
+  ticosd_queue_get_stats(queue, &stats);
+  CHECK_EQUAL(1, stats.unread_count);
+  CHECK_EQUAL(20, stats.unread_bytes);
+  CHECK_EQUAL(0, stats.oldest_unread_timestamp);
+}
+
+// Tests that unread messages dropped to make room for new ones are counted:
+TEST(TestGroup_Stats, Test_Overwritten) {
+  queue = open_queue(96);
+  // Payloads take 24 bytes, the four messages fill up the queue exactly:
+  write_typed_messages(queue, 'R', 4, 1);
+  read_and_complete_head(queue);
+
+  // Payload takes 28 bytes, overwriting the second message:
+  write_typed_messages(queue, 'R', 1, 8);
+  sTicosdQueueStats stats;
+  ticosd_queue_get_stats(queue, &stats);
+  CHECK_EQUAL(1, stats.overwritten_count);
+  CHECK_EQUAL(1, stats.overwritten_bytes);
+
+  // Overwrites the third message:
+  write_typed_messages(queue, 'R', 1, 1);
+  ticosd_queue_get_stats(queue, &stats);
+  CHECK_EQUAL(2, stats.overwritten_count);
+  CHECK_EQUAL(2, stats.overwritten_bytes);
+  CHECK_EQUAL(3, stats.unread_count);
+}
+
+struct TicosdQueueBackendUtest : TicosdQueueDurabilityUtest {
+  sTicosdQueue *open_queue_with_backend(int size, eTicosdQueueBackend backend) {
+    expect_queue_file_get_string_call(tmp_queue_file);
+    return ticosd_queue_init_with_backend(g_stub_ticosd, "queue", size, backend);
+  }
+
+  // Returns whether the queue file contains the given bytes:
+  bool queue_file_contains(const uint8_t *data, size_t len) {
+    uint8_t contents[4096];
+    const int fd = open(tmp_queue_file, O_RDONLY);
+    const ssize_t size = read(fd, contents, sizeof(contents));
+    close(fd);
+    for (ssize_t i = 0; i + (ssize_t)len <= size; ++i) {
+      if (memcmp(&contents[i], data, len) == 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+TEST_GROUP_BASE(TestGroup_Backend, TicosdQueueBackendUtest){};
+
+// Tests that the messages written with each backend are recovered, with the same or another one:
+TEST(TestGroup_Backend, Test_RoundTrip) {
+  const eTicosdQueueBackend backends[] = {
+    kTicosdQueueBackend_Mmap,
+    kTicosdQueueBackend_Pwrite,
+    kTicosdQueueBackend_IoUring,
+  };
+  for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); ++i) {
+    const eTicosdQueueBackend next = backends[(i + 1) % (sizeof(backends) / sizeof(backends[0]))];
+    queue = open_queue_with_backend(1024, backends[i]);
+    CHECK_TRUE(ticosd_queue_is_file_backed(queue));
+    const uint8_t payload[] = {'A', (uint8_t)i, 0x22, 0x33};
+    CHECK_TRUE(ticosd_queue_write(queue, payload, sizeof(payload)));
+    ticosd_queue_destroy(queue);
+
+    queue = open_queue_with_backend(1024, backends[i]);
+    uint32_t payload_size;
+    const uint8_t *head = ticosd_queue_peek_head(queue, &payload_size);
+    CHECK_EQUAL(sizeof(payload), payload_size);
+    MEMCMP_EQUAL(payload, head, sizeof(payload));
+    ticosd_queue_release_head(queue);
+    ticosd_queue_destroy(queue);
+
+    queue = open_queue_with_backend(1024, next);
+    head = ticosd_queue_peek_head(queue, &payload_size);
+    MEMCMP_EQUAL(payload, head, sizeof(payload));
+    ticosd_queue_complete_read(queue);
+    ticosd_queue_destroy(queue);
+    queue = NULL;
+  }
+}
+
+// Tests that with a buffered backend, async changes reach the file within the group commit
+// interval, without being flushed:
+TEST(TestGroup_Backend, Test_AsyncWrittenBack) {
+  queue = open_queue_with_backend(1024, kTicosdQueueBackend_Pwrite);
+  ticosd_queue_set_group_commit(queue, 10, 1024 * 1024);
+  ticosd_queue_set_durability(queue, kTicosdQueueDurability_Async);
+  const uint32_t sync_count = ticosd_queue_get_sync_count(queue);
+
+  const uint8_t payload[] = {'A', 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a};
+  CHECK_TRUE(ticosd_queue_write(queue, payload, sizeof(payload)));
+  bool written = false;
+  for (int i = 0; i < 200 && !written; ++i) {
+    usleep(10 * 1000);
+    written = queue_file_contains(payload, sizeof(payload));
+  }
+  CHECK_TRUE(written);
+  CHECK_EQUAL(sync_count, ticosd_queue_get_sync_count(queue));
+}
+
+struct TicosdQueueTtlUtest : TicosdQueueDurabilityUtest {
+  std::vector<std::string> expired;
+
+  static void on_expired(void *ctx, const uint8_t *payload, uint32_t payload_size_bytes) {
+    ((TicosdQueueTtlUtest *)ctx)->expired.emplace_back((const char *)payload, payload_size_bytes);
+  }
+
+  void open_ttl_queue(int size) {
+    queue = open_queue(size);
+    ticosd_queue_set_expired_callback(queue, on_expired, this);
+    ticosd_queue_set_type_ttl(queue, 'A', 60);
+    ticosd_queue_set_fake_time(queue, kSyncedTime);
+  }
+
+  void write(const char *payload) {
+    CHECK_TRUE(ticosd_queue_write(queue, (const uint8_t *)payload, strlen(payload)));
+  }
+};
+
+TEST_GROUP_BASE(TestGroup_Ttl, TicosdQueueTtlUtest){};
+
+// Tests that messages are dropped once their time-to-live elapsed, instead of being returned:
+TEST(TestGroup_Ttl, Test_ExpiredDroppedAtHead) {
+  open_ttl_queue(1024);
+  write("A1");
+  write("A2");
+  write("R1");
+
+  ticosd_queue_set_fake_time(queue, kSyncedTime + 59);
+  uint32_t payload_size;
+  const uint8_t *head = ticosd_queue_peek_head(queue, &payload_size);
+  MEMCMP_EQUAL("A1", head, 2);
+  ticosd_queue_release_head(queue);
+
+  ticosd_queue_set_fake_time(queue, kSyncedTime + 60);
+  head = ticosd_queue_peek_head(queue, &payload_size);
+  MEMCMP_EQUAL("R1", head, 2);
+  CHECK_TRUE(ticosd_queue_complete_read(queue));
+
+  CHECK_EQUAL(2, expired.size());
+  STRCMP_EQUAL("A1", expired[0].c_str());
+  STRCMP_EQUAL("A2", expired[1].c_str());
+  sTicosdQueueStats stats;
+  ticosd_queue_get_stats(queue, &stats);
+  CHECK_EQUAL(2, stats.expired_count);
+  CHECK_EQUAL(4, stats.expired_bytes);
+  CHECK_EQUAL(0, stats.unread_count);
+}
+
+// Tests that an expired message behind one that has not expired ends the batch, and is dropped
+// once it gets to the head:
+TEST(TestGroup_Ttl, Test_ExpiredEndsBatch) {
+  open_ttl_queue(1024);
+  write("R1");
+  write("A1");
+  write("R2");
+  ticosd_queue_set_fake_time(queue, kSyncedTime + 3600);
+
+  sTicosdQueueEntry entries[3];
+  CHECK_EQUAL(1, ticosd_queue_peek_batch(queue, entries, 3, UINT32_MAX));
+  MEMCMP_EQUAL("R1", entries[0].payload, 2);
+  CHECK_TRUE(ticosd_queue_complete_batch(queue, 1));
+
+  CHECK_EQUAL(1, ticosd_queue_peek_batch(queue, entries, 3, UINT32_MAX));
+  MEMCMP_EQUAL("R2", entries[0].payload, 2);
+  CHECK_EQUAL(1, expired.size());
+}
+
+// Tests that expired messages stay dropped after a restart:
+TEST(TestGroup_Ttl, Test_ExpiredStaysDropped) {
+  open_ttl_queue(1024);
+  write("A1");
+  write("R1");
+  ticosd_queue_set_fake_time(queue, kSyncedTime + 60);
+  uint32_t payload_size;
+  free(ticosd_queue_read_head(queue, &payload_size));
+  ticosd_queue_destroy(queue);
+
+  queue = open_queue(1024);
+  const uint8_t *head = ticosd_queue_peek_head(queue, &payload_size);
+  MEMCMP_EQUAL("R1", head, 2);
+  ticosd_queue_release_head(queue);
+}
+
+// Tests the time-to-live of messages that are not in the queue yet:
+TEST(TestGroup_Ttl, Test_ExpireEntry) {
+  open_ttl_queue(1024);
+  const uint8_t attributes[] = {'A', 1};
+  const uint8_t reboot[] = {'R', 1};
+  CHECK_FALSE(ticosd_queue_expire_entry(queue, attributes, sizeof(attributes), kSyncedTime - 59));
+  CHECK_TRUE(ticosd_queue_expire_entry(queue, attributes, sizeof(attributes), kSyncedTime - 60));
+  // Unknown age:
+  CHECK_FALSE(ticosd_queue_expire_entry(queue, attributes, sizeof(attributes), 0));
+  // No time-to-live:
+  CHECK_FALSE(ticosd_queue_expire_entry(queue, reboot, sizeof(reboot), kSyncedTime - 3600));
+  CHECK_EQUAL(1, expired.size());
+}
+
+// Tests that messages written before the clock was set are of unknown age, and do not expire as
+// soon as it is set:
+TEST(TestGroup_Ttl, Test_TimestampBeforeClockSet) {
+  open_ttl_queue(1024);
+  ticosd_queue_set_fake_time(queue, 120);
+  write("A1");
+  ticosd_queue_set_fake_time(queue, kSyncedTime);
+  write("A2");
+
+  ticosd_queue_set_fake_time(queue, kSyncedTime + 60);
+  sTicosdQueueEntry entries[2];
+  CHECK_EQUAL(1, ticosd_queue_peek_batch(queue, entries, 2, UINT32_MAX));
+  MEMCMP_EQUAL("A1", entries[0].payload, 2);
+  CHECK_EQUAL(0, entries[0].timestamp);
+  sTicosdQueueStats stats;
+  ticosd_queue_get_stats(queue, &stats);
+  CHECK_EQUAL(0, stats.oldest_unread_timestamp);
+  CHECK_TRUE(ticosd_queue_complete_batch(queue, 1));
+
+  uint32_t payload_size;
+  POINTERS_EQUAL(NULL, ticosd_queue_peek_head(queue, &payload_size));
+  CHECK_EQUAL(1, expired.size());
+  STRCMP_EQUAL("A2", expired[0].c_str());
+
+  const uint8_t attributes[] = {'A', 1};
+  CHECK_FALSE(ticosd_queue_expire_entry(queue, attributes, sizeof(attributes), 120));
+}
+
+struct TicosdQueueBlobUtest : TicosdQueueDurabilityUtest {
+  char blob_dir[4300] = {0};
+
+  void setup() override {
+    TicosdQueueDurabilityUtest::setup();
+    sprintf(blob_dir, "%s.blobs", tmp_queue_file);
+  }
+
+  void teardown() override {
+    ticosd_queue_destroy(queue);
+    queue = NULL;
+    for (const std::string &name : list_blob_files()) {
+      unlink((std::string(blob_dir) + "/" + name).c_str());
+    }
+    rmdir(blob_dir);
+    TicosdQueueDurabilityUtest::teardown();
+  }
+
+  void open_blob_queue(int size) {
+    queue = open_queue(size);
+    ticosd_queue_set_blob_threshold(queue, 256);
+  }
+
+  std::vector<std::string> list_blob_files() {
+    std::vector<std::string> names;
+    DIR *dir = opendir(blob_dir);
+    if (dir) {
+      struct dirent *entry;
+      while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] != '.') {
+          names.emplace_back(entry->d_name);
+        }
+      }
+      closedir(dir);
+    }
+    return names;
+  }
+
+  static std::string make_payload(char type, size_t size) {
+    std::string payload(size, '\0');
+    payload[0] = type;
+    for (size_t i = 1; i < size; ++i) {
+      payload[i] = (char)(i * 31);
+    }
+    return payload;
+  }
+
+  void write(const std::string &payload) {
+    CHECK_TRUE(
+      ticosd_queue_write(queue, (const uint8_t *)payload.data(), (uint32_t)payload.size()));
+  }
+
+  void check_read_head(const std::string &expected) {
+    uint32_t payload_size;
+    uint8_t *payload = ticosd_queue_read_head(queue, &payload_size);
+    CHECK(payload);
+    CHECK_EQUAL(expected.size(), payload_size);
+    MEMCMP_EQUAL(expected.data(), payload, payload_size);
+    free(payload);
+    CHECK_TRUE(ticosd_queue_complete_read(queue));
+  }
+};
+
+TEST_GROUP_BASE(TestGroup_Blob, TicosdQueueBlobUtest){};
+
+// Tests that a payload from the threshold on is stored in a side file, even if it is larger than
+// the queue, and that the side file is removed once the message is completed:
+TEST(TestGroup_Blob, Test_PeekAndComplete) {
+  open_blob_queue(1024);
+  CHECK_EQUAL(UINT32_MAX, ticosd_queue_get_max_payload_size(queue));
+  const std::string large = make_payload('A', 4000);
+  write(large);
+  write("R1");
+  CHECK_EQUAL(1, list_blob_files().size());
+
+  sTicosdQueueEntry entries[2];
+  CHECK_EQUAL(2, ticosd_queue_peek_batch(queue, entries, 2, UINT32_MAX));
+  CHECK_EQUAL(large.size(), entries[0].payload_size_bytes);
+  MEMCMP_EQUAL(large.data(), entries[0].payload, large.size());
+  MEMCMP_EQUAL("R1", entries[1].payload, 2);
+  CHECK_TRUE(ticosd_queue_complete_batch(queue, 2));
+  CHECK_EQUAL(0, list_blob_files().size());
+}
+
+// Tests that large messages only take the space of their reference, and do not make the queue
+// drop the small messages written before them:
+TEST(TestGroup_Blob, Test_SmallMessagesKept) {
+  open_blob_queue(1024);
+  const std::string large = make_payload('A', 600);
+  for (int i = 0; i < 10; ++i) {
+    write("R" + std::to_string(i));
+    write(large);
+  }
+  sTicosdQueueStats stats;
+  ticosd_queue_get_stats(queue, &stats);
+  CHECK_EQUAL(0, stats.overwritten_count);
+
+  for (int i = 0; i < 10; ++i) {
+    check_read_head("R" + std::to_string(i));
+    check_read_head(large);
+  }
+  CHECK_EQUAL(0, list_blob_files().size());
+}
+
+// Tests that the side files of the messages that are overwritten are removed:
+TEST(TestGroup_Blob, Test_OverwrittenRemoved) {
+  open_blob_queue(256);
+  write(make_payload('A', 1000));
+  for (int i = 0; i < 20; ++i) {
+    write("R" + std::to_string(i));
+  }
+  sTicosdQueueStats stats;
+  ticosd_queue_get_stats(queue, &stats);
+  CHECK(stats.overwritten_count > 0);
+  CHECK_EQUAL(0, list_blob_files().size());
+}
+
+// Tests that side files left by a previous run are still read, even with side files disabled,
+// and that those no unread message refers to are removed:
+TEST(TestGroup_Blob, Test_ReconciledOnStart) {
+  open_blob_queue(1024);
+  const std::string large = make_payload('A', 500);
+  write(make_payload('A', 400));
+  write(large);
+  check_read_head(make_payload('A', 400));
+  // Written by a run that crashed before adding the reference to the queue:
+  const std::string orphan = std::string(blob_dir) + "/00000000000000ff";
+  close(open(orphan.c_str(), O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR));
+  CHECK_EQUAL(2, list_blob_files().size());
+  ticosd_queue_destroy(queue);
+
+  queue = open_queue(1024);
+  CHECK_EQUAL(1, list_blob_files().size());
+  check_read_head(large);
+  CHECK_EQUAL(0, list_blob_files().size());
+
+  // New side files are never named after one seen before:
+  ticosd_queue_set_blob_threshold(queue, 256);
+  write(large);
+  const std::vector<std::string> names = list_blob_files();
+  CHECK_EQUAL(1, names.size());
+  CHECK(names[0] > "00000000000000ff");
+}
+
+// Tests that a message of which the side file is missing or damaged is dropped:
+TEST(TestGroup_Blob, Test_LostSideFileDropped) {
+  open_blob_queue(1024);
+  write(make_payload('A', 300));
+  write(make_payload('A', 400));
+  write("R1");
+  std::vector<std::string> names = list_blob_files();
+  std::sort(names.begin(), names.end());
+  CHECK_EQUAL(2, names.size());
+  unlink((std::string(blob_dir) + "/" + names[0]).c_str());
+  const int fd = open((std::string(blob_dir) + "/" + names[1]).c_str(), O_WRONLY);
+  CHECK_EQUAL(1, pwrite(fd, "x", 1, 100));
+  close(fd);
+
+  uint32_t payload_size;
+  const uint8_t *head = ticosd_queue_peek_head(queue, &payload_size);
+  MEMCMP_EQUAL("R1", head, 2);
+  CHECK_TRUE(ticosd_queue_complete_read(queue));
+  CHECK_EQUAL(0, list_blob_files().size());
+}
@@ -0,0 +1,95 @@
+//! @file
+//!
+//! Copyright (c) Ticos, Inc.
+//! See License.txt for details
+//!
+//! @brief
+//! Unit tests for queue_blob.c
+//!
+
+#include "queue_blob.h"
+
+#include <CppUTest/TestHarness.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <climits>
+#include <cstdio>
+#include <cstring>
+
+TEST_GROUP(TestGroup_QueueBlob) {
+  char tmp_dir[PATH_MAX] = {0};
+  char dir[PATH_MAX + 8] = {0};
+  sTicosdQueueBlobs *blobs = NULL;
+
+  void setup() override {
+    strcpy(tmp_dir, "/tmp/ticosd.XXXXXX");
+    mkdtemp(tmp_dir);
+    sprintf(dir, "%s/blobs", tmp_dir);
+    blobs = ticosd_queue_blobs_open(dir);
+    CHECK(blobs);
+    LONGS_EQUAL(0, ticosd_queue_blobs_reconcile(blobs, NULL, 0));
+  }
+
+  void teardown() override {
+    // Removes all the files:
+    ticosd_queue_blobs_reconcile(blobs, NULL, 0);
+    ticosd_queue_blobs_close(blobs);
+    rmdir(dir);
+    rmdir(tmp_dir);
+  }
+
+  bool exists(uint64_t id) {
+    char path[PATH_MAX + 32];
+    sprintf(path, "%s/%016llx", dir, (unsigned long long)id);
+    return access(path, F_OK) == 0;
+  }
+};
+
+TEST(TestGroup_QueueBlob, Test_WriteMapRemove) {
+  const uint8_t payload[] = "large payload";
+  uint64_t id;
+  CHECK_TRUE(ticosd_queue_blobs_write(blobs, payload, sizeof(payload), true, &id));
+  CHECK_TRUE(exists(id));
+
+  uint8_t *mapped = ticosd_queue_blobs_map(blobs, id, sizeof(payload));
+  CHECK(mapped);
+  // Still readable once removed, until unmapped:
+  ticosd_queue_blobs_remove(blobs, id);
+  CHECK_FALSE(exists(id));
+  MEMCMP_EQUAL(payload, mapped, sizeof(payload));
+  ticosd_queue_blobs_unmap(mapped, sizeof(payload));
+
+  POINTERS_EQUAL(NULL, ticosd_queue_blobs_map(blobs, id, sizeof(payload)));
+}
+
+TEST(TestGroup_QueueBlob, Test_MapChecksSize) {
+  const uint8_t payload[] = "large payload";
+  uint64_t id;
+  CHECK_TRUE(ticosd_queue_blobs_write(blobs, payload, sizeof(payload), false, &id));
+  POINTERS_EQUAL(NULL, ticosd_queue_blobs_map(blobs, id, sizeof(payload) + 1));
+  POINTERS_EQUAL(NULL, ticosd_queue_blobs_map(blobs, id, sizeof(payload) - 1));
+}
+
+TEST(TestGroup_QueueBlob, Test_ReconcileRemovesUnreferenced) {
+  const uint8_t payload[] = "large payload";
+  uint64_t ids[3];
+  for (uint64_t &id : ids) {
+    CHECK_TRUE(ticosd_queue_blobs_write(blobs, payload, sizeof(payload), false, &id));
+  }
+  CHECK(ids[0] < ids[1] && ids[1] < ids[2]);
+
+  uint64_t referenced[] = {ids[2], ids[0]};
+  LONGS_EQUAL(1, ticosd_queue_blobs_reconcile(blobs, referenced, 2));
+  CHECK_TRUE(exists(ids[0]));
+  CHECK_FALSE(exists(ids[1]));
+  CHECK_TRUE(exists(ids[2]));
+
+  // Identifiers are not reused, even those of the files that are gone:
+  uint64_t referenced_missing[] = {ids[2] + 10};
+  ticosd_queue_blobs_reconcile(blobs, referenced_missing, 1);
+  uint64_t id;
+  CHECK_TRUE(ticosd_queue_blobs_write(blobs, payload, sizeof(payload), false, &id));
+  CHECK(id > ids[2] + 10);
+}
@@ -0,0 +1,203 @@
+//! @file
+//!
+//! Copyright (c) Ticos, Inc.
+//! See License.txt for details
+//!
+//! @brief
+//! Unit tests for queue_spill.c
+//!
+
+#include "queue_spill.h"
+
+#include <CppUTest/TestHarness.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <climits>
+#include <cstdio>
+#include <cstring>
+
+static sTicosd *g_stub_ticosd = (sTicosd *)~0;
+static const char *g_data_dir;
+
+char *ticosd_generate_rw_filename(sTicosd *ticosd, const char *filename) {
+  char *path = (char *)malloc(strlen(g_data_dir) + strlen(filename) + 2);
+  sprintf(path, "%s/%s", g_data_dir, filename);
+  return path;
+}
+
+// Segment header and message header sizes:
+static const uint32_t kSegmentHeaderSize = 16;
+static const uint32_t kRecordHeaderSize = 8;
+
+TEST_GROUP(TestGroup_QueueSpill) {
+  char tmp_dir[PATH_MAX] = {0};
+  char spill_dir[PATH_MAX + 8] = {0};
+  sTicosdQueueSpill *spill = NULL;
+
+  void setup() override {
+    strcpy(tmp_dir, "/tmp/ticosd.XXXXXX");
+    mkdtemp(tmp_dir);
+    g_data_dir = tmp_dir;
+    sprintf(spill_dir, "%s/spill", tmp_dir);
+  }
+
+  void teardown() override {
+    ticosd_queue_spill_destroy(spill);
+    DIR *dir = opendir(spill_dir);
+    if (dir) {
+      struct dirent *entry;
+      while ((entry = readdir(dir)) != NULL) {
+        char path[PATH_MAX * 2];
+        sprintf(path, "%s/%s", spill_dir, entry->d_name);
+        unlink(path);
+      }
+      closedir(dir);
+    }
+    rmdir(spill_dir);
+    rmdir(tmp_dir);
+  }
+
+  void open_spill(uint32_t segment_size) {
+    spill = ticosd_queue_spill_init(g_stub_ticosd, "spill", segment_size);
+    CHECK(spill);
+  }
+
+  void reopen_spill(uint32_t segment_size) {
+    ticosd_queue_spill_destroy(spill);
+    open_spill(segment_size);
+  }
+
+  void append(uint8_t first, int count) {
+    for (int i = 0; i < count; ++i) {
+      const uint8_t payload[] = {(uint8_t)(first + i), 0x22, 0x33};
+      CHECK_TRUE(ticosd_queue_spill_append(spill, payload, sizeof(payload), false));
+    }
+  }
+
+  void check_pop(uint8_t expected) {
+    uint32_t payload_size;
+    const uint8_t *payload = ticosd_queue_spill_peek(spill, &payload_size);
+    CHECK(payload);
+    CHECK_EQUAL(3, payload_size);
+    CHECK_EQUAL(expected, payload[0]);
+    ticosd_queue_spill_pop(spill);
+  }
+
+  int count_segment_files() {
+    int count = 0;
+    DIR *dir = opendir(spill_dir);
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+      count += entry->d_name[0] != '.';
+    }
+    closedir(dir);
+    return count;
+  }
+};
+
+// Tests that messages are read back in order across segments, which are unlinked once read:
+TEST(TestGroup_QueueSpill, Test_AppendAndReadAcrossSegments) {
+  // Room for 4 messages per segment:
+  open_spill(kSegmentHeaderSize + 4 * (kRecordHeaderSize + 4));
+  append(0x10, 10);
+  CHECK_EQUAL(10, ticosd_queue_spill_get_count(spill));
+  CHECK_EQUAL(3, count_segment_files());
+  CHECK_EQUAL(3 * kSegmentHeaderSize + 10 * (kRecordHeaderSize + 4),
+              ticosd_queue_spill_get_disk_usage(spill));
+
+  for (int i = 0; i < 5; ++i) {
+    check_pop(0x10 + i);
+  }
+  CHECK_EQUAL(2, count_segment_files());
+
+  // Appending while reading:
+  append(0x1a, 2);
+  for (int i = 5; i < 12; ++i) {
+    check_pop(0x10 + i);
+  }
+  uint32_t payload_size;
+  POINTERS_EQUAL(NULL, ticosd_queue_spill_peek(spill, &payload_size));
+  CHECK_EQUAL(0, ticosd_queue_spill_get_count(spill));
+  CHECK_EQUAL(0, ticosd_queue_spill_get_disk_usage(spill));
+  CHECK_EQUAL(0, count_segment_files());
+}
+
+// Tests that messages not read yet are still there after a restart, and the ones read are not:
+TEST(TestGroup_QueueSpill, Test_ReloadAfterRestart) {
+  const uint32_t segment_size = kSegmentHeaderSize + 4 * (kRecordHeaderSize + 4);
+  open_spill(segment_size);
+  append(0x10, 6);
+  check_pop(0x10);
+  check_pop(0x11);
+
+  reopen_spill(segment_size);
+  CHECK_EQUAL(4, ticosd_queue_spill_get_count(spill));
+  check_pop(0x12);
+
+  // Appending continues in the newest segment:
+  append(0x16, 1);
+  CHECK_EQUAL(2, count_segment_files());
+  for (int i = 3; i < 7; ++i) {
+    check_pop(0x10 + i);
+  }
+}
+
+// Tests that a message torn by a crash is dropped, and appending continues after the last valid
+// message:
+TEST(TestGroup_QueueSpill, Test_TornMessageTruncated) {
+  open_spill(4096);
+  append(0x10, 2);
+  ticosd_queue_spill_destroy(spill);
+  spill = NULL;
+
+  char path[PATH_MAX * 2];
+  sprintf(path, "%s/00000000", spill_dir);
+  const int fd = open(path, O_WRONLY | O_APPEND);
+  const uint8_t torn[] = {0x03, 0x00, 0x00, 0x00, 0xaa};
+  CHECK_EQUAL((ssize_t)sizeof(torn), write(fd, torn, sizeof(torn)));
+  close(fd);
+
+  open_spill(4096);
+  CHECK_EQUAL(2, ticosd_queue_spill_get_count(spill));
+  append(0x12, 1);
+  for (int i = 0; i < 3; ++i) {
+    check_pop(0x10 + i);
+  }
+  uint32_t payload_size;
+  POINTERS_EQUAL(NULL, ticosd_queue_spill_peek(spill, &payload_size));
+}
+
+// Tests that dropping the oldest segment drops its messages that have not been read yet:
+TEST(TestGroup_QueueSpill, Test_DropOldestSegment) {
+  open_spill(kSegmentHeaderSize + 4 * (kRecordHeaderSize + 4));
+  append(0x10, 6);
+  check_pop(0x10);
+
+  uint64_t dropped_bytes;
+  CHECK_EQUAL(3, ticosd_queue_spill_drop_oldest_segment(spill, &dropped_bytes));
+  CHECK_EQUAL(kSegmentHeaderSize + 4 * (kRecordHeaderSize + 4), dropped_bytes);
+  CHECK_EQUAL(2, ticosd_queue_spill_get_count(spill));
+  check_pop(0x14);
+
+  // Dropping the newest segment too:
+  CHECK_EQUAL(1, ticosd_queue_spill_drop_oldest_segment(spill, &dropped_bytes));
+  CHECK_EQUAL(0, ticosd_queue_spill_get_count(spill));
+  CHECK_EQUAL(0, ticosd_queue_spill_drop_oldest_segment(spill, &dropped_bytes));
+  CHECK_EQUAL(0, dropped_bytes);
+}
+
+// Tests that resetting unlinks all segments:
+TEST(TestGroup_QueueSpill, Test_Reset) {
+  open_spill(kSegmentHeaderSize + 4 * (kRecordHeaderSize + 4));
+  append(0x10, 10);
+  ticosd_queue_spill_reset(spill);
+  CHECK_EQUAL(0, ticosd_queue_spill_get_count(spill));
+  CHECK_EQUAL(0, ticosd_queue_spill_get_disk_usage(spill));
+  CHECK_EQUAL(0, count_segment_files());
+
+  append(0x20, 1);
+  check_pop(0x20);
+}
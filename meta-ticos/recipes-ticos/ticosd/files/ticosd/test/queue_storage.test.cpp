@@ -0,0 +1,164 @@
+//! @file
+//!
+//! Copyright (c) Ticos, Inc.
+//! See License.txt for details
+//!
+//! @brief
+//! Unit tests for queue_storage.c
+//!
+
+#include "queue_storage.h"
+
+#include <CppUTest/TestHarness.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+static const eTicosdQueueBackend kBackends[] = {
+  kTicosdQueueBackend_Mmap,
+  kTicosdQueueBackend_Pwrite,
+  kTicosdQueueBackend_IoUring,
+};
+
+// Not a multiple of the block size, so that the last block is partial:
+static const size_t kFileSize = 3 * 4096 + 100;
+
+TEST_GROUP(TestGroup_QueueStorage) {
+  char tmp_dir[PATH_MAX] = {0};
+  char path[PATH_MAX + 8] = {0};
+  sTicosdQueueStorage *storage = NULL;
+  uint8_t *buf = NULL;
+
+  void setup() override {
+    strcpy(tmp_dir, "/tmp/ticosd.XXXXXX");
+    mkdtemp(tmp_dir);
+    sprintf(path, "%s/queue", tmp_dir);
+  }
+
+  void teardown() override {
+    ticosd_queue_storage_close(storage);
+    unlink(path);
+    rmdir(tmp_dir);
+  }
+
+  void open_storage(eTicosdQueueBackend backend) {
+    ticosd_queue_storage_close(storage);
+    const int fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    CHECK(fd != -1);
+    CHECK(ftruncate(fd, kFileSize) == 0);
+    storage = ticosd_queue_storage_open(backend, fd, kFileSize);
+    CHECK(storage);
+    buf = (uint8_t *)ticosd_queue_storage_get_buf(storage);
+    CHECK(buf);
+
+    const eTicosdQueueBackend actual = ticosd_queue_storage_get_backend(storage);
+    // io_uring may not be available where the tests run:
+    if (backend == kTicosdQueueBackend_IoUring) {
+      CHECK(actual == kTicosdQueueBackend_IoUring || actual == kTicosdQueueBackend_Pwrite);
+    } else {
+      LONGS_EQUAL(backend, actual);
+    }
+  }
+
+  void close_storage() {
+    ticosd_queue_storage_close(storage);
+    storage = NULL;
+  }
+
+  std::vector<uint8_t> read_file() {
+    std::vector<uint8_t> contents(kFileSize);
+    const int fd = open(path, O_RDONLY);
+    CHECK(fd != -1);
+    LONGS_EQUAL(kFileSize, pread(fd, contents.data(), kFileSize, 0));
+    close(fd);
+    return contents;
+  }
+
+  void change(size_t start, size_t len, uint8_t value) {
+    memset(buf + start, value, len);
+    ticosd_queue_storage_mark_dirty(storage, start, len);
+  }
+};
+
+TEST(TestGroup_QueueStorage, Test_LoadsExistingContents) {
+  for (eTicosdQueueBackend backend : kBackends) {
+    std::vector<uint8_t> contents(kFileSize);
+    for (size_t i = 0; i < kFileSize; ++i) {
+      contents[i] = (uint8_t)(i * 7 + backend);
+    }
+    const int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    LONGS_EQUAL(kFileSize, pwrite(fd, contents.data(), kFileSize, 0));
+    close(fd);
+
+    open_storage(backend);
+    MEMCMP_EQUAL(contents.data(), buf, kFileSize);
+    close_storage();
+  }
+}
+
+TEST(TestGroup_QueueStorage, Test_SyncWritesChanges) {
+  for (eTicosdQueueBackend backend : kBackends) {
+    open_storage(backend);
+    // Within a block, across blocks, and in the partial last block:
+    change(10, 20, 0x11);
+    change(4000, 5000, 0x22);
+    change(kFileSize - 50, 50, 0x33);
+    CHECK_TRUE(ticosd_queue_storage_sync(storage, 10, kFileSize));
+    MEMCMP_EQUAL(buf, read_file().data(), kFileSize);
+    close_storage();
+
+    unlink(path);
+  }
+}
+
+TEST(TestGroup_QueueStorage, Test_WriteBackWritesChanges) {
+  for (eTicosdQueueBackend backend : kBackends) {
+    open_storage(backend);
+    change(100, 8000, 0x44);
+    CHECK_TRUE(ticosd_queue_storage_write_back(storage, 0, kFileSize));
+    std::vector<uint8_t> expected(buf, buf + kFileSize);
+    // Waits for the writes still in flight:
+    close_storage();
+    MEMCMP_EQUAL(expected.data(), read_file().data(), kFileSize);
+
+    unlink(path);
+  }
+}
+
+TEST(TestGroup_QueueStorage, Test_OnlyWritesDirtyBlocks) {
+  open_storage(kTicosdQueueBackend_Pwrite);
+  CHECK_TRUE(ticosd_queue_storage_needs_write_back(storage));
+  change(0, 1, 0x55);
+  // Changed without marking it dirty, not written:
+  memset(buf + 2 * 4096, 0x66, 16);
+  CHECK_TRUE(ticosd_queue_storage_sync(storage, 0, kFileSize));
+
+  const std::vector<uint8_t> contents = read_file();
+  LONGS_EQUAL(0x55, contents[0]);
+  LONGS_EQUAL(0, contents[2 * 4096]);
+}
+
+TEST(TestGroup_QueueStorage, Test_SyncOutsideRangeKeepsChangesDirty) {
+  open_storage(kTicosdQueueBackend_Pwrite);
+  change(0, 1, 0x77);
+  change(2 * 4096, 1, 0x88);
+  CHECK_TRUE(ticosd_queue_storage_sync(storage, 0, 1));
+  LONGS_EQUAL(0x77, read_file()[0]);
+  LONGS_EQUAL(0, read_file()[2 * 4096]);
+
+  CHECK_TRUE(ticosd_queue_storage_sync(storage, 0, kFileSize));
+  LONGS_EQUAL(0x88, read_file()[2 * 4096]);
+}
+
+TEST(TestGroup_QueueStorage, Test_MmapNeedsNoWriteBack) {
+  open_storage(kTicosdQueueBackend_Mmap);
+  CHECK_FALSE(ticosd_queue_storage_needs_write_back(storage));
+  // Shared mapping, visible in the file without any write back:
+  memset(buf, 0x99, 16);
+  LONGS_EQUAL(0x99, read_file()[15]);
+}
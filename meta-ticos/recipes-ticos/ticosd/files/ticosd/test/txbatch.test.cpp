@@ -0,0 +1,100 @@
+//! @file
+//!
+//! Copyright (c) Ticos, Inc.
+//! See License.txt for details
+//!
+//! @brief
+//! Unit tests for txbatch.c
+//!
+
+#include "txbatch.h"
+
+#include <CppUTest/TestHarness.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "ticosd.h"
+
+TEST_GROUP(TestGroup_TxBatch) {
+  std::vector<std::vector<uint8_t>> payloads;
+  std::vector<sTicosdQueueEntry> entries;
+
+  void add_event(const char *json) {
+    std::vector<uint8_t> payload(sizeof(sTicosdTxData) + strlen(json) + 1);
+    payload[0] = kTicosdTxDataType_RebootEvent;
+    memcpy(&payload[1], json, strlen(json) + 1);
+    add(payload);
+  }
+
+  void add_attributes(time_t timestamp, const char *json) {
+    std::vector<uint8_t> payload(sizeof(sTicosdTxDataAttributes) + strlen(json) + 1);
+    sTicosdTxDataAttributes *data = (sTicosdTxDataAttributes *)payload.data();
+    data->type = kTicosdTxDataType_Attributes;
+    memcpy(&data->timestamp, &timestamp, sizeof(time_t));
+    memcpy(data->json, json, strlen(json) + 1);
+    add(payload);
+  }
+
+  void add(const std::vector<uint8_t> &payload) {
+    payloads.push_back(payload);
+    entries.clear();
+    for (auto &p : payloads) {
+      entries.push_back({.payload = p.data(), .payload_size_bytes = (uint32_t)p.size()});
+    }
+  }
+
+  std::string join(uint32_t offset, uint32_t count) {
+    char *body = ticosd_txbatch_join(&entries[offset], count);
+    CHECK(body);
+    std::string s(body);
+    free(body);
+    return s;
+  }
+};
+
+// Tests that events are combined into a JSON array, within the count and size limits:
+TEST(TestGroup_TxBatch, Test_Events) {
+  add_event("{\"a\": 1}");
+  add_event("{\"b\": 2}");
+  add_event("{\"c\": 3}");
+
+  LONGS_EQUAL(3, ticosd_txbatch_count(entries.data(), 3, 16, UINT32_MAX));
+  STRCMP_EQUAL("[{\"a\": 1},{\"b\": 2},{\"c\": 3}]", join(0, 3).c_str());
+
+  LONGS_EQUAL(2, ticosd_txbatch_count(entries.data(), 3, 2, UINT32_MAX));
+  // "[{"a": 1},{"b": 2}]" is 19 bytes:
+  LONGS_EQUAL(2, ticosd_txbatch_count(entries.data(), 3, 16, 19));
+  LONGS_EQUAL(1, ticosd_txbatch_count(entries.data(), 3, 16, 18));
+  // The first entry is always sent:
+  LONGS_EQUAL(1, ticosd_txbatch_count(entries.data(), 3, 16, 1));
+  LONGS_EQUAL(0, ticosd_txbatch_count(entries.data(), 0, 16, UINT32_MAX));
+}
+
+// Tests that attributes are merged only with those captured at the same time:
+TEST(TestGroup_TxBatch, Test_Attributes) {
+  add_attributes(1000, " [{\"string_key\": \"a\", \"value\": 1}] ");
+  add_attributes(1000, "[]");
+  add_attributes(1000, "[{\"string_key\": \"b\", \"value\": 2}]");
+  add_attributes(2000, "[{\"string_key\": \"c\", \"value\": 3}]");
+
+  LONGS_EQUAL(3, ticosd_txbatch_count(entries.data(), 4, 16, UINT32_MAX));
+  STRCMP_EQUAL("[{\"string_key\": \"a\", \"value\": 1},{\"string_key\": \"b\", \"value\": 2}]",
+               join(0, 3).c_str());
+  LONGS_EQUAL(1, ticosd_txbatch_count(&entries[3], 1, 16, UINT32_MAX));
+}
+
+// Tests that entries of different types, or that are not valid, are never combined:
+TEST(TestGroup_TxBatch, Test_Incompatible) {
+  add_event("{\"a\": 1}");
+  add_attributes(1000, "[{\"string_key\": \"b\", \"value\": 2}]");
+  add_attributes(1000, "{\"string_key\": \"c\"}");
+  add_attributes(1000, "[{\"string_key\": \"d\", \"value\": 4}]");
+
+  LONGS_EQUAL(1, ticosd_txbatch_count(entries.data(), 4, 16, UINT32_MAX));
+  LONGS_EQUAL(1, ticosd_txbatch_count(&entries[1], 3, 16, UINT32_MAX));
+  LONGS_EQUAL(1, ticosd_txbatch_count(&entries[2], 2, 16, UINT32_MAX));
+  POINTERS_EQUAL(NULL, ticosd_txbatch_join(&entries[1], 2));
+}
@@ -0,0 +1,437 @@
+//! @file
+//!
+//! Copyright (c) Ticos, Inc.
+//! See License.txt for details
+//!
+//! @brief
+//! Unit tests for txqueue.c
+//!
+
+#include "txqueue.h"
+
+#include <CppUTest/TestHarness.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+extern "C" {
+void ticosd_queue_set_fake_time(sTicosdQueue *handle, time_t fake_time);
+}
+
+static sTicosd *g_stub_ticosd = (sTicosd *)~0;
+//! data_dir of the queue files, NULL for non-persistent queues.
+static const char *g_data_dir;
+
+char *ticosd_generate_rw_filename(sTicosd *ticosd, const char *filename) {
+  if (!g_data_dir) {
+    return NULL;
+  }
+  char *path = (char *)malloc(strlen(g_data_dir) + strlen(filename) + 2);
+  sprintf(path, "%s/%s", g_data_dir, filename);
+  return path;
+}
+
+// Removes a directory and the files in it, one level deep:
+static void remove_dir(const char *path) {
+  DIR *dir = opendir(path);
+  if (!dir) {
+    return;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    char child[PATH_MAX * 2];
+    sprintf(child, "%s/%s", path, entry->d_name);
+    if (unlink(child) == -1) {
+      remove_dir(child);
+    }
+  }
+  closedir(dir);
+  rmdir(path);
+}
+
+TEST_BASE(TicosdTxQueueUtest) {
+  sTicosdTxQueue *txqueue = NULL;
+  sTicosdTxQueueConfig config = {};
+
+  void teardown() override {
+    ticosd_txqueue_destroy(txqueue);
+    g_data_dir = NULL;
+  }
+
+  void init(int events_weight, int attributes_weight, int bulk_weight) {
+    const int weights[kTicosdTxQueueLane_NumLanes] = {events_weight, attributes_weight,
+                                                      bulk_weight};
+    for (int i = 0; i < kTicosdTxQueueLane_NumLanes; ++i) {
+      if (config.lanes[i].size == 0) {
+        config.lanes[i].size = 1024;
+      }
+      config.lanes[i].weight = weights[i];
+    }
+    txqueue = ticosd_txqueue_init(g_stub_ticosd, &config);
+    CHECK(txqueue);
+  }
+
+  void write(uint8_t type, int count = 1) {
+    for (int i = 0; i < count; ++i) {
+      const uint8_t payload[] = {type, (uint8_t)i};
+      CHECK_TRUE(ticosd_txqueue_write(txqueue, payload, sizeof(payload)));
+    }
+  }
+
+  // Writes entries with sequence numbers starting from first:
+  void write_seq(uint8_t type, int first, int count) {
+    for (int i = first; i < first + count; ++i) {
+      const uint8_t payload[] = {type, (uint8_t)i};
+      CHECK_TRUE(ticosd_txqueue_write(txqueue, payload, sizeof(payload)));
+    }
+  }
+
+  // Sends all entries one by one, returning their sequence numbers:
+  std::string drain_seq() {
+    std::string sent;
+    sTicosdQueueEntry entry;
+    while (ticosd_txqueue_peek_batch(txqueue, &entry, 1, UINT32_MAX)) {
+      sent += std::to_string(entry.payload[1]) + ",";
+      CHECK_TRUE(ticosd_txqueue_complete_batch(txqueue, 1));
+    }
+    return sent;
+  }
+
+  // Sends batches of up to max_count entries until the queue is empty, returning the types of the
+  // entries sent with the batches separated by '|':
+  std::string drain(uint32_t max_count = 16) {
+    std::string sent;
+    sTicosdQueueEntry entries[16];
+    uint32_t count;
+    while ((count = ticosd_txqueue_peek_batch(txqueue, entries, max_count, UINT32_MAX))) {
+      if (!sent.empty()) {
+        sent += '|';
+      }
+      for (uint32_t i = 0; i < count; ++i) {
+        sent += (char)entries[i].payload[0];
+      }
+      CHECK_TRUE(ticosd_txqueue_complete_batch(txqueue, count));
+    }
+    return sent;
+  }
+};
+
+TEST_GROUP_BASE(TestGroup_TxQueue, TicosdTxQueueUtest){};
+
+// Tests that entries are queued in the lane of their type:
+TEST(TestGroup_TxQueue, Test_RoutesByType) {
+  init(1, 1, 1);
+  write(kTicosdTxDataType_RebootEvent);
+  write(kTicosdTxDataType_Attributes);
+  write(kTicosdTxDataType_CoreUpload);
+  write(kTicosdTxDataType_CoreUploadWithGzip);
+
+  sTicosdQueueEntry entries[4];
+  CHECK_EQUAL(1, ticosd_queue_peek_batch(
+                   ticosd_txqueue_get_lane(txqueue, kTicosdTxQueueLane_Events), entries, 4, 1024));
+  CHECK_EQUAL('R', entries[0].payload[0]);
+  CHECK_EQUAL(1, ticosd_queue_peek_batch(
+                   ticosd_txqueue_get_lane(txqueue, kTicosdTxQueueLane_Attributes), entries, 4,
+                   1024));
+  CHECK_EQUAL('A', entries[0].payload[0]);
+  CHECK_EQUAL(2, ticosd_queue_peek_batch(ticosd_txqueue_get_lane(txqueue, kTicosdTxQueueLane_Bulk),
+                                         entries, 4, 1024));
+  CHECK_EQUAL('C', entries[0].payload[0]);
+  CHECK_EQUAL('c', entries[1].payload[0]);
+  for (int lane = 0; lane < kTicosdTxQueueLane_NumLanes; ++lane) {
+    ticosd_queue_release_head(ticosd_txqueue_get_lane(txqueue, (eTicosdTxQueueLane)lane));
+  }
+}
+
+// Tests that each lane sends up to its weight in entries per round:
+TEST(TestGroup_TxQueue, Test_WeightedRoundRobin) {
+  init(2, 1, 1);
+  write(kTicosdTxDataType_CoreUpload, 4);
+  write(kTicosdTxDataType_Attributes, 4);
+  write(kTicosdTxDataType_RebootEvent, 4);
+
+  STRCMP_EQUAL("RR|A|C|RR|A|C|A|C|A|C", drain().c_str());
+}
+
+// Tests that a lane's turn can span several batches:
+TEST(TestGroup_TxQueue, Test_TurnSpansBatches) {
+  init(3, 1, 1);
+  write(kTicosdTxDataType_RebootEvent, 4);
+  write(kTicosdTxDataType_Attributes, 1);
+
+  STRCMP_EQUAL("RR|R|A|R", drain(2).c_str());
+}
+
+// Tests that a lane with nothing to send gives up its turn, and that an event queued behind bulk
+// uploads is sent after at most one turn of the bulk lane:
+TEST(TestGroup_TxQueue, Test_EventNotStuckBehindBulk) {
+  init(4, 2, 1);
+  write(kTicosdTxDataType_CoreUpload, 10);
+
+  sTicosdQueueEntry entries[1];
+  CHECK_EQUAL(1, ticosd_txqueue_peek_batch(txqueue, entries, 1, UINT32_MAX));
+  CHECK_EQUAL('C', entries[0].payload[0]);
+  // An event arrives while the first upload is being sent:
+  write(kTicosdTxDataType_RebootEvent);
+  CHECK_TRUE(ticosd_txqueue_complete_batch(txqueue, 1));
+
+  CHECK_EQUAL(1, ticosd_txqueue_peek_batch(txqueue, entries, 1, UINT32_MAX));
+  CHECK_EQUAL('R', entries[0].payload[0]);
+  CHECK_TRUE(ticosd_txqueue_complete_batch(txqueue, 1));
+
+  STRCMP_EQUAL("C|C|C|C|C|C|C|C|C", drain(1).c_str());
+}
+
+// Tests that a released batch is peeked again, still in the lane's turn:
+TEST(TestGroup_TxQueue, Test_ReleaseKeepsTurn) {
+  init(2, 1, 1);
+  write(kTicosdTxDataType_Attributes, 2);
+  write(kTicosdTxDataType_RebootEvent, 2);
+
+  sTicosdQueueEntry entries[4];
+  CHECK_EQUAL(2, ticosd_txqueue_peek_batch(txqueue, entries, 4, UINT32_MAX));
+  CHECK_EQUAL('R', entries[0].payload[0]);
+  ticosd_txqueue_release_head(txqueue);
+
+  CHECK_EQUAL(2, ticosd_txqueue_peek_batch(txqueue, entries, 4, UINT32_MAX));
+  CHECK_EQUAL('R', entries[0].payload[0]);
+  // Only the first entry could be sent:
+  CHECK_TRUE(ticosd_txqueue_complete_batch(txqueue, 1));
+
+  STRCMP_EQUAL("R|A|A", drain().c_str());
+}
+
+// Tests that a paused lane is skipped until it is resumed:
+TEST(TestGroup_TxQueue, Test_PausedLaneSkipped) {
+  init(1, 1, 1);
+  write(kTicosdTxDataType_RebootEvent, 2);
+  write(kTicosdTxDataType_Attributes, 2);
+
+  ticosd_txqueue_set_lane_paused(txqueue, kTicosdTxQueueLane_Events, true);
+  STRCMP_EQUAL("A|A", drain().c_str());
+  ticosd_txqueue_set_lane_paused(txqueue, kTicosdTxQueueLane_Events, false);
+  STRCMP_EQUAL("R|R", drain().c_str());
+}
+
+// Tests that an entry that keeps failing is moved to the dead-letter queue, unblocking its lane:
+TEST(TestGroup_TxQueue, Test_DeadLetterHead) {
+  config.dead_letter_size = 256;
+  init(4, 1, 1);
+  write_seq(kTicosdTxDataType_RebootEvent, 0, 3);
+
+  sTicosdQueueEntry entries[4];
+  for (uint32_t attempt = 1; attempt <= 3; ++attempt) {
+    CHECK_EQUAL(3, ticosd_txqueue_peek_batch(txqueue, entries, 4, UINT32_MAX));
+    CHECK_EQUAL(kTicosdTxQueueLane_Events, ticosd_txqueue_get_peeked_lane(txqueue));
+    CHECK_EQUAL(attempt, ticosd_txqueue_fail_head(txqueue, kTicosdTxQueueLane_Events));
+  }
+  CHECK_TRUE(ticosd_txqueue_dead_letter_head(txqueue, kTicosdTxQueueLane_Events));
+  CHECK_EQUAL(1, ticosd_txqueue_get_dead_letter_count(txqueue, kTicosdTxQueueLane_Events));
+  CHECK_EQUAL(0, ticosd_txqueue_get_dead_letter_count(txqueue, kTicosdTxQueueLane_Bulk));
+
+  // The next entry starts over:
+  CHECK_EQUAL(2, ticosd_txqueue_peek_batch(txqueue, entries, 4, UINT32_MAX));
+  CHECK_EQUAL(1, entries[0].payload[1]);
+  CHECK_EQUAL(1, ticosd_txqueue_fail_head(txqueue, kTicosdTxQueueLane_Events));
+  STRCMP_EQUAL("1,2,", drain_seq().c_str());
+}
+
+// Tests that the entries of the dead-letter queue are moved back into their lanes:
+TEST(TestGroup_TxQueue, Test_RequeueDeadLetter) {
+  config.dead_letter_size = 256;
+  init(4, 1, 1);
+  write_seq(kTicosdTxDataType_RebootEvent, 0, 2);
+
+  sTicosdQueueEntry entries[4];
+  CHECK_EQUAL(2, ticosd_txqueue_peek_batch(txqueue, entries, 4, UINT32_MAX));
+  ticosd_txqueue_release_head(txqueue);
+  CHECK_TRUE(ticosd_txqueue_dead_letter_head(txqueue, kTicosdTxQueueLane_Events));
+  STRCMP_EQUAL("1,", drain_seq().c_str());
+
+  CHECK_EQUAL(1, ticosd_txqueue_requeue_dead_letter(txqueue));
+  CHECK_EQUAL(0, ticosd_txqueue_requeue_dead_letter(txqueue));
+  STRCMP_EQUAL("0,", drain_seq().c_str());
+}
+
+// Tests that when the first entry of a batch fails and the second one is sent, only the first one
+// is sent again, followed by those that were not sent:
+TEST(TestGroup_TxQueue, Test_AckedEntryNotResent) {
+  init(4, 1, 1);
+  write_seq(kTicosdTxDataType_RebootEvent, 0, 3);
+
+  sTicosdQueueEntry entries[4];
+  CHECK_EQUAL(3, ticosd_txqueue_peek_batch(txqueue, entries, 4, UINT32_MAX));
+  CHECK_TRUE(ticosd_txqueue_ack_entry(txqueue, 1));
+  CHECK_FALSE(ticosd_txqueue_ack_entry(txqueue, 3));
+  CHECK_EQUAL(1, ticosd_txqueue_fail_head(txqueue, kTicosdTxQueueLane_Events));
+
+  CHECK_EQUAL(1, ticosd_txqueue_peek_batch(txqueue, entries, 4, UINT32_MAX));
+  CHECK_EQUAL(0, entries[0].payload[1]);
+  CHECK_TRUE(ticosd_txqueue_complete_batch(txqueue, 1));
+  STRCMP_EQUAL("2,", drain_seq().c_str());
+}
+
+// Tests that resetting empties all lanes:
+TEST(TestGroup_TxQueue, Test_Reset) {
+  init(1, 1, 1);
+  write(kTicosdTxDataType_RebootEvent, 2);
+  write(kTicosdTxDataType_Attributes, 2);
+  write(kTicosdTxDataType_CoreUpload, 2);
+
+  ticosd_txqueue_reset(txqueue);
+  STRCMP_EQUAL("", drain().c_str());
+}
+
+struct TicosdTxQueueSpillUtest : TicosdTxQueueUtest {
+  char tmp_dir[PATH_MAX] = {0};
+
+  void setup() override {
+    strcpy(tmp_dir, "/tmp/ticosd.XXXXXX");
+    mkdtemp(tmp_dir);
+    g_data_dir = tmp_dir;
+    // Room for 3 entries in the queue of each lane:
+    for (int i = 0; i < kTicosdTxQueueLane_NumLanes; ++i) {
+      config.lanes[i].size = 72;
+    }
+    config.spill_budget = 1024 * 1024;
+    config.spill_segment_size = 16 + 4 * 12;
+  }
+
+  void teardown() override {
+    TicosdTxQueueUtest::teardown();
+    remove_dir(tmp_dir);
+  }
+
+  void restart() {
+    ticosd_txqueue_destroy(txqueue);
+    txqueue = ticosd_txqueue_init(g_stub_ticosd, &config);
+    CHECK(txqueue);
+  }
+
+  void check_dropped(eTicosdTxQueueLane lane, uint32_t entries) {
+    sTicosdTxQueueDropStats stats;
+    ticosd_txqueue_get_drop_stats(txqueue, lane, &stats);
+    CHECK_EQUAL(entries, stats.entries);
+  }
+};
+
+TEST_GROUP_BASE(TestGroup_TxQueueSpill, TicosdTxQueueSpillUtest){};
+
+// Tests that entries that do not fit in a full lane are spilled instead of dropping older ones:
+TEST(TestGroup_TxQueueSpill, Test_SpillWhenFull) {
+  init(1, 1, 1);
+  write_seq(kTicosdTxDataType_RebootEvent, 0, 10);
+  CHECK_EQUAL(7, ticosd_txqueue_get_spill_count(txqueue, kTicosdTxQueueLane_Events));
+
+  STRCMP_EQUAL("0,1,2,3,4,5,6,7,8,9,", drain_seq().c_str());
+  CHECK_EQUAL(0, ticosd_txqueue_get_spill_count(txqueue, kTicosdTxQueueLane_Events));
+  check_dropped(kTicosdTxQueueLane_Events, 0);
+}
+
+// Tests that entries written while a lane has spilled entries stay behind them:
+TEST(TestGroup_TxQueueSpill, Test_SpillKeepsOrder) {
+  init(1, 1, 1);
+  write_seq(kTicosdTxDataType_RebootEvent, 0, 5);
+
+  sTicosdQueueEntry entry;
+  CHECK_EQUAL(1, ticosd_txqueue_peek_batch(txqueue, &entry, 1, UINT32_MAX));
+  CHECK_EQUAL(0, entry.payload[1]);
+  CHECK_TRUE(ticosd_txqueue_complete_batch(txqueue, 1));
+  // There is room in the queue again, but entries 3 and 4 are still spilled:
+  write_seq(kTicosdTxDataType_RebootEvent, 5, 2);
+
+  STRCMP_EQUAL("1,2,3,4,5,6,", drain_seq().c_str());
+}
+
+// Tests that spilled entries are still sent after a restart:
+TEST(TestGroup_TxQueueSpill, Test_SpillSurvivesRestart) {
+  init(1, 1, 1);
+  write_seq(kTicosdTxDataType_Attributes, 0, 10);
+  restart();
+  write_seq(kTicosdTxDataType_Attributes, 10, 1);
+
+  STRCMP_EQUAL("0,1,2,3,4,5,6,7,8,9,10,", drain_seq().c_str());
+}
+
+// Tests that the drop_newest policy drops the entries written once the budget is reached:
+TEST(TestGroup_TxQueueSpill, Test_DropNewest) {
+  // Room for 2 segments of 4 entries:
+  config.spill_budget = 2 * (16 + 4 * 12);
+  config.drop_policy = kTicosdTxQueueDropPolicy_DropNewest;
+  init(1, 1, 1);
+  write_seq(kTicosdTxDataType_RebootEvent, 0, 11);
+  const uint8_t payload[] = {kTicosdTxDataType_RebootEvent, 11};
+  CHECK_FALSE(ticosd_txqueue_write(txqueue, payload, sizeof(payload)));
+  check_dropped(kTicosdTxQueueLane_Events, 1);
+
+  STRCMP_EQUAL("0,1,2,3,4,5,6,7,8,9,10,", drain_seq().c_str());
+}
+
+// Tests that the drop_oldest policy drops the oldest spilled segment of the lane written to:
+TEST(TestGroup_TxQueueSpill, Test_DropOldest) {
+  config.spill_budget = 2 * (16 + 4 * 12);
+  config.drop_policy = kTicosdTxQueueDropPolicy_DropOldest;
+  init(1, 1, 1);
+  write_seq(kTicosdTxDataType_RebootEvent, 0, 12);
+  check_dropped(kTicosdTxQueueLane_Events, 4);
+
+  STRCMP_EQUAL("0,1,2,7,8,9,10,11,", drain_seq().c_str());
+}
+
+// Tests that the drop_by_lane policy drops the spilled entries of lower priority lanes first, and
+// never the ones of higher priority lanes:
+TEST(TestGroup_TxQueueSpill, Test_DropByLane) {
+  config.spill_budget = 2 * (16 + 4 * 12);
+  config.drop_policy = kTicosdTxQueueDropPolicy_DropByLane;
+  init(1, 1, 1);
+  write_seq(kTicosdTxDataType_CoreUpload, 0, 7);
+  write_seq(kTicosdTxDataType_RebootEvent, 0, 7);
+
+  // The events lane takes the room of the bulk lane:
+  write_seq(kTicosdTxDataType_RebootEvent, 7, 1);
+  check_dropped(kTicosdTxQueueLane_Bulk, 4);
+  CHECK_EQUAL(0, ticosd_txqueue_get_spill_count(txqueue, kTicosdTxQueueLane_Bulk));
+
+  // But not the other way around:
+  write_seq(kTicosdTxDataType_RebootEvent, 8, 3);
+  const uint8_t payload[] = {kTicosdTxDataType_CoreUpload, 7};
+  CHECK_FALSE(ticosd_txqueue_write(txqueue, payload, sizeof(payload)));
+  check_dropped(kTicosdTxQueueLane_Bulk, 5);
+  check_dropped(kTicosdTxQueueLane_Events, 0);
+}
+
+// Tests that resetting also empties the spill segments:
+TEST(TestGroup_TxQueueSpill, Test_Reset) {
+  init(1, 1, 1);
+  write_seq(kTicosdTxDataType_RebootEvent, 0, 10);
+  ticosd_txqueue_reset(txqueue);
+  CHECK_EQUAL(0, ticosd_txqueue_get_spill_count(txqueue, kTicosdTxQueueLane_Events));
+  STRCMP_EQUAL("", drain_seq().c_str());
+}
+
+// Tests that expired entries are dropped, whether they were in the queue or spilled, also across a
+// restart:
+TEST(TestGroup_TxQueueSpill, Test_ExpiredSpilledEntriesDropped) {
+  init(1, 1, 1);
+  write_seq(kTicosdTxDataType_RebootEvent, 0, 10);
+  restart();
+  write_seq(kTicosdTxDataType_RebootEvent, 10, 1);
+
+  sTicosdQueue *queue = ticosd_txqueue_get_lane(txqueue, kTicosdTxQueueLane_Events);
+  ticosd_queue_set_type_ttl(queue, kTicosdTxDataType_RebootEvent, 60);
+  ticosd_queue_set_fake_time(queue, time(NULL) + 120);
+  STRCMP_EQUAL("", drain_seq().c_str());
+
+  sTicosdQueueStats stats;
+  ticosd_queue_get_stats(queue, &stats);
+  CHECK_EQUAL(11, stats.expired_count);
+  CHECK_EQUAL(0, ticosd_txqueue_get_spill_count(txqueue, kTicosdTxQueueLane_Events));
+}
@@ -0,0 +1,79 @@
+//! @file
+//!
+//! Copyright (c) Ticos, Inc.
+//! See License.txt for details
+//!
+//! @brief
+//! Unit tests for txretry.c
+//!
+
+#include "txretry.h"
+
+#include <CppUTest/TestHarness.h>
+
+static const uint64_t kNow = 1000000;
+
+TEST_GROUP(TestGroup_TxRetry) {
+  sTicosdTxRetry *txretry = NULL;
+
+  void setup() override {
+    const sTicosdTxRetryConfig config = {
+      .first_backoff_ms = 1000,
+      .max_backoff_ms = 8000,
+      .breaker_threshold = 6,
+      .breaker_cooldown_ms = 60000,
+    };
+    txretry = ticosd_txretry_init(&config, 2);
+    CHECK(txretry);
+  }
+
+  void teardown() override { ticosd_txretry_destroy(txretry); }
+
+  void check_delay(uint64_t backoff_ms, uint64_t next_attempt_ms) {
+    CHECK(next_attempt_ms >= kNow + backoff_ms / 2);
+    CHECK(next_attempt_ms <= kNow + backoff_ms);
+  }
+};
+
+// Tests that the backoff of an endpoint doubles with each failure, with jitter, and is reset by a
+// success, without affecting other endpoints:
+TEST(TestGroup_TxRetry, Test_ExponentialBackoff) {
+  CHECK_TRUE(ticosd_txretry_is_eligible(txretry, 0, kNow));
+  const uint64_t expected_ms[] = {1000, 2000, 4000, 8000, 8000};
+  for (uint64_t backoff_ms : expected_ms) {
+    const uint64_t next_attempt_ms = ticosd_txretry_record_failure(txretry, 0, kNow, 0);
+    check_delay(backoff_ms, next_attempt_ms);
+    CHECK_EQUAL(next_attempt_ms, ticosd_txretry_get_next_attempt(txretry, 0));
+    CHECK_FALSE(ticosd_txretry_is_eligible(txretry, 0, next_attempt_ms - 1));
+    CHECK_TRUE(ticosd_txretry_is_eligible(txretry, 0, next_attempt_ms));
+  }
+  CHECK_TRUE(ticosd_txretry_is_eligible(txretry, 1, kNow));
+  CHECK_EQUAL(0, ticosd_txretry_get_next_attempt(txretry, 1));
+
+  ticosd_txretry_record_success(txretry, 0);
+  CHECK_TRUE(ticosd_txretry_is_eligible(txretry, 0, kNow));
+  check_delay(1000, ticosd_txretry_record_failure(txretry, 0, kNow, 0));
+}
+
+// Tests that a longer Retry-After delay is honoured, up to the circuit breaker cooldown:
+TEST(TestGroup_TxRetry, Test_RetryAfter) {
+  CHECK_EQUAL(kNow + 30000, ticosd_txretry_record_failure(txretry, 0, kNow, 30000));
+  check_delay(2000, ticosd_txretry_record_failure(txretry, 0, kNow, 500));
+  CHECK_EQUAL(kNow + 60000, ticosd_txretry_record_failure(txretry, 0, kNow, 3600000));
+}
+
+// Tests that the circuit opens after too many consecutive failures, and closes on a success:
+TEST(TestGroup_TxRetry, Test_CircuitBreaker) {
+  for (int i = 0; i < 5; ++i) {
+    ticosd_txretry_record_failure(txretry, 0, kNow, 0);
+    CHECK_FALSE(ticosd_txretry_is_open(txretry, 0));
+  }
+  check_delay(60000, ticosd_txretry_record_failure(txretry, 0, kNow, 0));
+  CHECK_TRUE(ticosd_txretry_is_open(txretry, 0));
+  // Still open if the trial request fails:
+  check_delay(60000, ticosd_txretry_record_failure(txretry, 0, kNow, 0));
+  CHECK_TRUE(ticosd_txretry_is_open(txretry, 0));
+
+  ticosd_txretry_record_success(txretry, 0);
+  CHECK_FALSE(ticosd_txretry_is_open(txretry, 0));
+}
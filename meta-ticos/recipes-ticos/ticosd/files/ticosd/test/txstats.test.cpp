@@ -0,0 +1,150 @@
+//! @file
+//!
+//! Copyright (c) Ticos, Inc.
+//! See License.txt for details
+//!
+//! @brief
+//! Unit tests for txstats.c
+//!
+
+#include "txstats.h"
+
+#include <CppUTest/TestHarness.h>
+
+#include <cstdlib>
+#include <string>
+
+// Unit test accessors of queue.c:
+extern "C" {
+void ticosd_queue_set_fake_time(sTicosdQueue *handle, time_t fake_time);
+}
+
+static sTicosd *g_stub_ticosd = (sTicosd *)~0;
+
+char *ticosd_generate_rw_filename(sTicosd *ticosd, const char *filename) { return NULL; }
+
+static const time_t kNow = 1760000000;
+
+TEST_GROUP(TestGroup_TxStats) {
+  sTicosdTxQueue *txqueue = NULL;
+  sTicosdTxStats *txstats = NULL;
+
+  void setup() override {
+    sTicosdTxQueueConfig config = {};
+    for (int i = 0; i < kTicosdTxQueueLane_NumLanes; ++i) {
+      config.lanes[i] = {.size = 1024, .weight = 1};
+    }
+    txqueue = ticosd_txqueue_init(g_stub_ticosd, &config);
+    CHECK(txqueue);
+    txstats = ticosd_txstats_init();
+    CHECK(txstats);
+  }
+
+  void teardown() override {
+    ticosd_txstats_destroy(txstats);
+    ticosd_txqueue_destroy(txqueue);
+  }
+
+  std::string to_json() {
+    char *json = ticosd_txstats_to_json(txstats, txqueue, kNow);
+    CHECK(json);
+    std::string result(json);
+    free(json);
+    return result;
+  }
+
+  std::string to_attributes_json() {
+    char *json = ticosd_txstats_to_attributes_json(txstats, txqueue, kNow);
+    CHECK(json);
+    std::string result(json);
+    free(json);
+    return result;
+  }
+};
+
+// Tests the statistics of an empty queue:
+TEST(TestGroup_TxStats, Test_Empty) {
+  const char *lane =
+    "{\"unread_count\": 0, \"unread_bytes\": 0, \"oldest_unread_age_s\": 0, "
+    "\"overwritten_count\": 0, \"overwritten_bytes\": 0, \"expired_count\": 0, "
+    "\"expired_bytes\": 0, \"spilled_count\": 0, \"dropped_count\": 0, \"dropped_bytes\": 0}";
+  const char *histogram = "{\"count\": 0, \"max\": 0, \"buckets\": [0, 0, 0, 0, 0, 0, 0, 0, 0]}";
+  const std::string expected =
+    std::string("{\"lanes\": {\"events\": ") + lane + ", \"attributes\": " + lane +
+    ", \"bulk\": " + lane +
+    "}, \"ack_latency_s\": {\"bucket_bounds\": [1, 10, 60, 600, 3600, 21600, 86400, 604800], "
+    "\"reboot_event\": " + histogram + ", \"core_upload\": " + histogram +
+    ", \"core_upload_gzip\": " + histogram + ", \"attributes\": " + histogram +
+    ", \"other\": " + histogram + "}}";
+  STRCMP_EQUAL(expected.c_str(), to_json().c_str());
+  STRCMP_EQUAL("[{\"string_key\": \"ticosd_queue_events_depth\", \"value\": 0}, "
+               "{\"string_key\": \"ticosd_queue_events_oldest_age_s\", \"value\": 0}, "
+               "{\"string_key\": \"ticosd_queue_events_overwritten\", \"value\": 0}, "
+               "{\"string_key\": \"ticosd_queue_events_expired\", \"value\": 0}, "
+               "{\"string_key\": \"ticosd_queue_events_dropped\", \"value\": 0}, "
+               "{\"string_key\": \"ticosd_queue_events_dead_lettered\", \"value\": 0}, "
+               "{\"string_key\": \"ticosd_queue_attributes_depth\", \"value\": 0}, "
+               "{\"string_key\": \"ticosd_queue_attributes_oldest_age_s\", \"value\": 0}, "
+               "{\"string_key\": \"ticosd_queue_attributes_overwritten\", \"value\": 0}, "
+               "{\"string_key\": \"ticosd_queue_attributes_expired\", \"value\": 0}, "
+               "{\"string_key\": \"ticosd_queue_attributes_dropped\", \"value\": 0}, "
+               "{\"string_key\": \"ticosd_queue_attributes_dead_lettered\", \"value\": 0}, "
+               "{\"string_key\": \"ticosd_queue_bulk_depth\", \"value\": 0}, "
+               "{\"string_key\": \"ticosd_queue_bulk_oldest_age_s\", \"value\": 0}, "
+               "{\"string_key\": \"ticosd_queue_bulk_overwritten\", \"value\": 0}, "
+               "{\"string_key\": \"ticosd_queue_bulk_expired\", \"value\": 0}, "
+               "{\"string_key\": \"ticosd_queue_bulk_dropped\", \"value\": 0}, "
+               "{\"string_key\": \"ticosd_queue_bulk_dead_lettered\", \"value\": 0}]",
+               to_attributes_json().c_str());
+}
+
+// Tests that the depth and age of each lane are reported:
+TEST(TestGroup_TxStats, Test_LaneDepthAndAge) {
+  ticosd_queue_set_fake_time(ticosd_txqueue_get_lane(txqueue, kTicosdTxQueueLane_Bulk),
+                             kNow - 42);
+  const uint8_t payload[] = {kTicosdTxDataType_CoreUpload, 0};
+  CHECK_TRUE(ticosd_txqueue_write(txqueue, payload, sizeof(payload)));
+  CHECK_TRUE(ticosd_txqueue_write(txqueue, payload, sizeof(payload)));
+
+  // Two messages of a 20 bytes header and 2 bytes payload padded to 4:
+  CHECK(to_json().find("\"bulk\": {\"unread_count\": 2, \"unread_bytes\": 48, "
+                       "\"oldest_unread_age_s\": 42,") != std::string::npos);
+  CHECK(to_attributes_json().find("{\"string_key\": \"ticosd_queue_bulk_depth\", \"value\": 2}, "
+                                  "{\"string_key\": \"ticosd_queue_bulk_oldest_age_s\", "
+                                  "\"value\": 42}") != std::string::npos);
+}
+
+// Tests that ack latencies are counted in the histogram of their type:
+TEST(TestGroup_TxStats, Test_LatencyBuckets) {
+  const time_t latencies[] = {0, 1, 2, 10, 61, 700000};
+  for (time_t latency : latencies) {
+    ticosd_txstats_record_ack(txstats, kTicosdTxDataType_RebootEvent, kNow - latency, kNow);
+  }
+  // Clock stepped back, counted as no latency:
+  ticosd_txstats_record_ack(txstats, kTicosdTxDataType_RebootEvent, kNow + 5, kNow);
+  // Unknown enqueue time, ignored:
+  ticosd_txstats_record_ack(txstats, kTicosdTxDataType_RebootEvent, 0, kNow);
+  ticosd_txstats_record_ack(txstats, 'Z', kNow, kNow);
+
+  const std::string json = to_json();
+  CHECK(json.find("\"reboot_event\": {\"count\": 7, \"max\": 700000, "
+                  "\"buckets\": [3, 2, 0, 1, 0, 0, 0, 0, 1]}") != std::string::npos);
+  CHECK(json.find("\"other\": {\"count\": 1, \"max\": 0, "
+                  "\"buckets\": [1, 0, 0, 0, 0, 0, 0, 0, 0]}") != std::string::npos);
+}
+
+// Tests that the attributes summarise latencies with the bounds of their buckets:
+TEST(TestGroup_TxStats, Test_LatencyPercentiles) {
+  for (int i = 0; i < 10; ++i) {
+    ticosd_txstats_record_ack(txstats, kTicosdTxDataType_Attributes, kNow - 5, kNow);
+  }
+  ticosd_txstats_record_ack(txstats, kTicosdTxDataType_Attributes, kNow - 100, kNow);
+
+  // The 95th percentile falls in the (60, 600] bucket, capped by the maximum latency:
+  CHECK(to_attributes_json().find("{\"string_key\": \"ticosd_ack_attributes_count\", "
+                                  "\"value\": 11}, "
+                                  "{\"string_key\": \"ticosd_ack_attributes_p50_s\", "
+                                  "\"value\": 10}, "
+                                  "{\"string_key\": \"ticosd_ack_attributes_p95_s\", "
+                                  "\"value\": 100}]") != std::string::npos);
+}
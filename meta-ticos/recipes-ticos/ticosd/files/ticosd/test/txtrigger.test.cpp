@@ -0,0 +1,88 @@
+//! @file
+//!
+//! Copyright (c) Ticos, Inc.
+//! See License.txt for details
+//!
+//! @brief
+//! Unit tests for txtrigger.c
+//!
+
+#include "txtrigger.h"
+
+#include <CppUTest/TestHarness.h>
+#include <poll.h>
+
+static const uint64_t kNow = 1000000;
+
+TEST_GROUP(TestGroup_TxTrigger) {
+  sTicosdTxTrigger *txtrigger = NULL;
+
+  void setup() override {
+    txtrigger = ticosd_txtrigger_init(5000, 4);
+    CHECK(txtrigger);
+  }
+
+  void teardown() override { ticosd_txtrigger_destroy(txtrigger); }
+
+  // Returns whether the main loop would be woken up, and clears the file descriptor:
+  bool woken_up() {
+    struct pollfd pfd = {.fd = ticosd_txtrigger_get_fd(txtrigger), .events = POLLIN};
+    const bool readable = poll(&pfd, 1, 0) == 1;
+    ticosd_txtrigger_clear_fd(txtrigger);
+    return readable;
+  }
+};
+
+// Tests that queued entries are held back until the coalescing window closes:
+TEST(TestGroup_TxTrigger, Test_CoalescingWindow) {
+  CHECK_FALSE(ticosd_txtrigger_is_due(txtrigger, kNow));
+  CHECK_EQUAL(UINT64_MAX, ticosd_txtrigger_get_deadline(txtrigger));
+  CHECK_FALSE(woken_up());
+
+  ticosd_txtrigger_notify(txtrigger, 'A', kNow);
+  CHECK_TRUE(woken_up());
+  // Later entries do not move the deadline nor wake the loop up again:
+  ticosd_txtrigger_notify(txtrigger, 'A', kNow + 1000);
+  CHECK_FALSE(woken_up());
+  CHECK_EQUAL(kNow + 5000, ticosd_txtrigger_get_deadline(txtrigger));
+
+  CHECK_FALSE(ticosd_txtrigger_is_due(txtrigger, kNow + 4999));
+  CHECK_TRUE(ticosd_txtrigger_is_due(txtrigger, kNow + 5000));
+
+  ticosd_txtrigger_reset(txtrigger);
+  CHECK_FALSE(ticosd_txtrigger_is_due(txtrigger, kNow + 5000));
+  CHECK_EQUAL(UINT64_MAX, ticosd_txtrigger_get_deadline(txtrigger));
+}
+
+// Tests that queued entries are sent right away once the batch is full:
+TEST(TestGroup_TxTrigger, Test_BatchCount) {
+  for (int i = 0; i < 3; ++i) {
+    ticosd_txtrigger_notify(txtrigger, 'A', kNow);
+  }
+  woken_up();
+  CHECK_FALSE(ticosd_txtrigger_is_due(txtrigger, kNow));
+  ticosd_txtrigger_notify(txtrigger, 'A', kNow);
+  CHECK_TRUE(woken_up());
+  CHECK_TRUE(ticosd_txtrigger_is_due(txtrigger, kNow));
+}
+
+// Tests that an entry with a shorter per-type window brings the deadline forward, and that a
+// longer one does not push it back:
+TEST(TestGroup_TxTrigger, Test_TypeMaxLatency) {
+  ticosd_txtrigger_set_type_max_latency(txtrigger, 'R', 1000);
+  ticosd_txtrigger_set_type_max_latency(txtrigger, 'C', 60000);
+
+  ticosd_txtrigger_notify(txtrigger, 'A', kNow);
+  woken_up();
+  ticosd_txtrigger_notify(txtrigger, 'C', kNow);
+  CHECK_FALSE(woken_up());
+  CHECK_EQUAL(kNow + 5000, ticosd_txtrigger_get_deadline(txtrigger));
+
+  ticosd_txtrigger_notify(txtrigger, 'R', kNow + 2000);
+  CHECK_TRUE(woken_up());
+  CHECK_EQUAL(kNow + 3000, ticosd_txtrigger_get_deadline(txtrigger));
+
+  ticosd_txtrigger_reset(txtrigger);
+  ticosd_txtrigger_notify(txtrigger, 'C', kNow);
+  CHECK_EQUAL(kNow + 60000, ticosd_txtrigger_get_deadline(txtrigger));
+}
@@ -0,0 +1,81 @@
+//! @file
+//!
+//! Copyright (c) Ticos, Inc.
+//! See License.txt for details
+//!
+//! @brief
+//! Unit tests for upload_progress.c
+//!
+
+#include "upload_progress.h"
+
+#include <CppUTest/TestHarness.h>
+#include <unistd.h>
+
+#include <climits>
+#include <cstdio>
+#include <cstring>
+
+TEST_GROUP(TestGroup_UploadProgress) {
+  char tmp_dir[PATH_MAX] = {0};
+  char filename[PATH_MAX + 16] = {0};
+  char sidecar[PATH_MAX + 32] = {0};
+
+  void setup() override {
+    strcpy(tmp_dir, "/tmp/ticosd.XXXXXX");
+    mkdtemp(tmp_dir);
+    sprintf(filename, "%s/corefile.gz", tmp_dir);
+    sprintf(sidecar, "%s.progress", filename);
+  }
+
+  void teardown() override {
+    unlink(sidecar);
+    rmdir(tmp_dir);
+  }
+};
+
+// Tests that the progress saved after a part is loaded back, and removed once done.
+TEST(TestGroup_UploadProgress, Test_SaveLoadRemove) {
+  sTicosdUploadProgress progress;
+  CHECK_FALSE(ticosd_upload_progress_load(filename, &progress));
+
+  char url[] = "https://upload.example.com/core?sig=abc";
+  const sTicosdUploadProgress saved = {
+    .upload_url = url,
+    .file_size = 94371840,
+    .part_size = 1048576,
+    .offset = 3145728,
+  };
+  CHECK_TRUE(ticosd_upload_progress_save(filename, &saved));
+  CHECK_TRUE(ticosd_upload_progress_load(filename, &progress));
+  STRCMP_EQUAL(url, progress.upload_url);
+  CHECK_EQUAL(saved.file_size, progress.file_size);
+  CHECK_EQUAL(saved.part_size, progress.part_size);
+  CHECK_EQUAL(saved.offset, progress.offset);
+  ticosd_upload_progress_free(&progress);
+
+  ticosd_upload_progress_remove(filename);
+  CHECK_FALSE(ticosd_upload_progress_load(filename, &progress));
+  // Removing twice is harmless:
+  ticosd_upload_progress_remove(filename);
+}
+
+// Tests that truncated or inconsistent progress files are ignored, so that the upload starts over.
+TEST(TestGroup_UploadProgress, Test_InvalidIgnored) {
+  const char *contents[] = {
+    "",
+    "1 100 10 20\n",
+    "1 100 10 20\nhttps://upload.example.com/core",
+    "1 100 10 200\nhttps://upload.example.com/core\n",
+    "2 100 10 20\nhttps://upload.example.com/core\n",
+  };
+  for (const char *content : contents) {
+    FILE *file = fopen(sidecar, "w");
+    fputs(content, file);
+    fclose(file);
+
+    sTicosdUploadProgress progress;
+    CHECK_FALSE(ticosd_upload_progress_load(filename, &progress));
+    POINTERS_EQUAL(NULL, progress.upload_url);
+  }
+}
@@ -0,0 +1,383 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) Ticos, Inc.
+# See License.txt for details
+"""
+End-to-end benchmark of ticosd's network path, against mock_ticos_server.py.
+
+It runs ticosd with a configuration pointing it at a mock server on loopback, then:
+
+1. drain: queues --messages attributes while the server is down, brings it back and
+   flushes the queue, measuring how fast the queue drains and the request latencies,
+2. recovery: queues --recovery-messages attributes during an --outage-s long outage, and
+   measures how long ticosd takes, on its own, to find the server back and to catch up,
+3. coredumps, with --coredumps: triggers crashes while the server is down, then flushes
+   the queue, measuring the upload throughput and the bytes sent again,
+4. expired_resume, with --coredumps and network.upload_part_size_kib set: interrupts the
+   upload of a coredump after its first part, lets its upload URL expire and flushes the
+   queue again, checking that the upload starts over and is committed.
+
+Run it as root where ticosd is installed, with the ticosd service stopped, as the IPC
+socket path is fixed. Latencies are measured by the server, from the request line to the
+response. ticosd configuration keys are set with --set, e.g.
+--set network.max_concurrent_requests=8, so that runs with and without a change can be
+compared with the same options.
+"""
+import argparse
+import dataclasses
+import json
+import os
+import signal
+import socket
+import struct
+import subprocess
+import tempfile
+import time
+from typing import Any, Dict, List
+
+from mock_ticos_server import (
+    BENCH_SEQ_KEY,
+    MockConfig,
+    MockTicosServer,
+    RequestRecord,
+    add_config_arguments,
+    config_from_arguments,
+    percentiles,
+)
+
+IPC_SOCKET_PATH = "/tmp/ticos-ipc.sock"
+# sTicosAttributesIPC, whose time_t is a long on Linux, followed by the JSON string:
+ATTRIBUTES_IPC_HEADER = struct.Struct("@11sl")
+COREDUMP_ENQUEUED = "coredump:: enqueued corefile"
+
+
+class Ticosd:
+    """ticosd running with a configuration of its own, its output logged to a file."""
+
+    def __init__(
+        self, binary: str, workdir: str, base_url: str, settings: Dict[str, Any]
+    ) -> None:
+        config: Dict[str, Any] = {
+            "base_url": base_url,
+            "project_key": "bench",
+            "enable_data_collection": True,
+            "enable_dev_mode": False,
+            "data_dir": os.path.join(workdir, "data"),
+            "software_type": "bench",
+            "software_version": "0.0.0-bench",
+        }
+        for key, value in settings.items():
+            *parents, name = key.split(".")
+            node = config
+            for parent in parents:
+                node = node.setdefault(parent, {})
+            node[name] = value
+        self.config_path = os.path.join(workdir, "ticosd.conf")
+        with open(self.config_path, "w") as f:
+            json.dump(config, f, indent=2)
+
+        self.log_path = os.path.join(workdir, "ticosd.log")
+        if os.path.exists(IPC_SOCKET_PATH):
+            os.unlink(IPC_SOCKET_PATH)
+        with open(self.log_path, "w") as log:
+            self.process = subprocess.Popen(
+                [binary, "-c", self.config_path], stdout=log, stderr=subprocess.STDOUT
+            )
+        if not _wait_for(lambda: os.path.exists(IPC_SOCKET_PATH), 10):
+            self.stop()
+            raise RuntimeError(f"ticosd did not start, see {self.log_path}")
+
+    def flush(self) -> None:
+        """Sends the queue now, as `ticosctl sync` does."""
+        self.process.send_signal(signal.SIGUSR1)
+
+    def log_count(self, text: str) -> int:
+        with open(self.log_path, errors="replace") as f:
+            return f.read().count(text)
+
+    def stop(self) -> None:
+        self.process.terminate()
+        try:
+            self.process.wait(10)
+        except subprocess.TimeoutExpired:
+            self.process.kill()
+            self.process.wait()
+
+
+def _wait_for(predicate: Any, timeout_s: float) -> bool:
+    deadline = time.monotonic() + timeout_s
+    while not predicate():
+        if time.monotonic() > deadline:
+            return False
+        time.sleep(0.05)
+    return True
+
+
+def _wait_for_progress(counter: Any, expected: int, timeout_s: float) -> int:
+    """Waits until counter() reaches expected, or stops progressing for timeout_s."""
+    count = counter()
+    last_progress = time.monotonic()
+    while count < expected and time.monotonic() - last_progress < timeout_s:
+        time.sleep(0.05)
+        new_count = counter()
+        if new_count != count:
+            count = new_count
+            last_progress = time.monotonic()
+    return count
+
+
+def _send_attributes(sock: socket.socket, seq: int, padding_bytes: int) -> None:
+    attributes = [
+        {"string_key": BENCH_SEQ_KEY, "value": seq},
+        {"string_key": "bench_padding", "value": "x" * padding_bytes},
+    ]
+    header = ATTRIBUTES_IPC_HEADER.pack(b"ATTRIBUTES", int(time.time()))
+    sock.sendto(header + json.dumps(attributes).encode() + b"\0", IPC_SOCKET_PATH)
+
+
+def _ok(records: List[RequestRecord]) -> List[RequestRecord]:
+    return [r for r in records if 200 <= r.status < 300]
+
+
+def run_drain(
+    server: MockTicosServer,
+    ticosd: Ticosd,
+    base: MockConfig,
+    args: argparse.Namespace,
+    first_seq: int,
+) -> Dict[str, Any]:
+    # The lanes hold back until they are flushed:
+    server.configure(outage=True, retry_after_s=3600)
+    with socket.socket(socket.AF_UNIX, socket.SOCK_DGRAM) as sock:
+        for i in range(args.messages):
+            _send_attributes(sock, first_seq + i, args.padding_bytes)
+    time.sleep(args.settle_s)
+
+    server.reset_stats()
+    server.configure(**dataclasses.asdict(base))
+    start = time.monotonic()
+    ticosd.flush()
+    delivered = _wait_for_progress(server.unique_seqs, args.messages, args.timeout_s)
+
+    ok = _ok(server.records())
+    elapsed = (max(r.time for r in ok) if ok else time.monotonic()) - start
+    stats = server.snapshot()
+    return {
+        "messages": args.messages,
+        "delivered": delivered,
+        "elapsed_s": elapsed,
+        "msgs_per_s": delivered / elapsed,
+        "wire_mb_per_s": stats["wire_bytes"] / elapsed / 1e6,
+        "payload_mb_per_s": stats["payload_bytes"] / elapsed / 1e6,
+        "requests": stats["requests"],
+        "statuses": stats["statuses"],
+        "duplicates": stats["duplicate_seqs"],
+        "latency_ms": stats["latency_ms"],
+    }
+
+
+def run_recovery(
+    server: MockTicosServer,
+    ticosd: Ticosd,
+    base: MockConfig,
+    args: argparse.Namespace,
+    first_seq: int,
+) -> Dict[str, Any]:
+    server.reset_stats()
+    server.configure(outage=True, retry_after_s=0)
+    outage_start = time.monotonic()
+    # Messages keep coming during the outage:
+    interval = args.outage_s / max(1, args.recovery_messages)
+    with socket.socket(socket.AF_UNIX, socket.SOCK_DGRAM) as sock:
+        for i in range(args.recovery_messages):
+            _send_attributes(sock, first_seq + i, args.padding_bytes)
+            time.sleep(max(0.0, outage_start + (i + 1) * interval - time.monotonic()))
+    time.sleep(max(0.0, outage_start + args.outage_s - time.monotonic()))
+
+    server.configure(**dataclasses.asdict(base))
+    outage_end = time.monotonic()
+    delivered = _wait_for_progress(
+        server.unique_seqs, args.recovery_messages, args.timeout_s
+    )
+
+    records = server.records()
+    ok_after = _ok([r for r in records if r.time >= outage_end])
+    result: Dict[str, Any] = {
+        "outage_s": args.outage_s,
+        "messages": args.recovery_messages,
+        "delivered": delivered,
+        "requests_during_outage": sum(1 for r in records if r.time < outage_end),
+        "duplicates": server.snapshot()["duplicate_seqs"],
+    }
+    if ok_after:
+        result["first_success_after_s"] = ok_after[0].time - outage_end
+        result["caught_up_after_s"] = ok_after[-1].time - outage_end
+    return result
+
+
+def run_coredumps(
+    server: MockTicosServer,
+    ticosd: Ticosd,
+    base: MockConfig,
+    args: argparse.Namespace,
+) -> Dict[str, Any]:
+    server.configure(outage=True, retry_after_s=3600)
+    enqueued = ticosd.log_count(COREDUMP_ENQUEUED) + args.coredumps
+    for _ in range(args.coredumps):
+        subprocess.run(
+            [args.ticosctl, "-c", ticosd.config_path, "trigger-coredump"], check=False
+        )
+    if not _wait_for(lambda: ticosd.log_count(COREDUMP_ENQUEUED) >= enqueued, 60):
+        print("Not all coredumps were queued, check the coredump rate limit.")
+
+    server.reset_stats()
+    server.configure(**dataclasses.asdict(base))
+    start = time.monotonic()
+    ticosd.flush()
+    committed = _wait_for_progress(
+        lambda: server.snapshot()["files_committed"], args.coredumps, args.timeout_s
+    )
+
+    ok = _ok(server.records())
+    elapsed = (max(r.time for r in ok) if ok else time.monotonic()) - start
+    stats = server.snapshot()
+    return {
+        "coredumps": args.coredumps,
+        "committed": committed,
+        "elapsed_s": elapsed,
+        "upload_mb_per_s": stats["upload_bytes"] / elapsed / 1e6,
+        "upload_bytes": stats["upload_bytes"],
+        "resent_bytes": stats["resent_bytes"],
+        "requests_by_kind": stats["requests_by_kind"],
+        "statuses": stats["statuses"],
+        "latency_ms": percentiles([r.latency_ms for r in ok]),
+    }
+
+
+def run_expired_resume(
+    server: MockTicosServer,
+    ticosd: Ticosd,
+    base: MockConfig,
+    args: argparse.Namespace,
+    part_size_kib: float,
+) -> Dict[str, Any]:
+    server.configure(outage=True, retry_after_s=3600)
+    enqueued = ticosd.log_count(COREDUMP_ENQUEUED) + 1
+    subprocess.run(
+        [args.ticosctl, "-c", ticosd.config_path, "trigger-coredump"], check=False
+    )
+    if not _wait_for(lambda: ticosd.log_count(COREDUMP_ENQUEUED) >= enqueued, 60):
+        print("The coredump was not queued, check the coredump rate limit.")
+
+    # Parts take half a second each, so that the upload is interrupted after the first:
+    server.reset_stats()
+    server.configure(**dataclasses.asdict(base))
+    server.configure(bandwidth_kibps=part_size_kib * 2)
+    ticosd.flush()
+    if not _wait_for(lambda: server.snapshot()["upload_bytes"] > 0, args.timeout_s):
+        print("No part of the coredump was uploaded.")
+    server.configure(outage=True, retry_after_s=0)
+    time.sleep(1)
+
+    server.expire_uploads()
+    server.configure(**dataclasses.asdict(base))
+    start = time.monotonic()
+    ticosd.flush()
+    committed = _wait_for_progress(
+        lambda: server.snapshot()["files_committed"], 1, args.timeout_s
+    )
+    stats = server.snapshot()
+    return {
+        "committed": committed,
+        "elapsed_s": time.monotonic() - start,
+        "upload_bytes": stats["upload_bytes"],
+        "resent_bytes": stats["resent_bytes"],
+        "requests_by_kind": stats["requests_by_kind"],
+        "statuses": stats["statuses"],
+    }
+
+
+def _parse_setting(text: str) -> Any:
+    key, _, value = text.partition("=")
+    try:
+        return key, json.loads(value)
+    except ValueError:
+        return key, value
+
+
+def _print_report(report: Dict[str, Any]) -> None:
+    for phase, results in report.items():
+        print(f"{phase}:")
+        for key, value in results.items():
+            if isinstance(value, float):
+                value = f"{value:.3f}"
+            elif isinstance(value, dict):
+                value = ", ".join(
+                    f"{k}={v:.1f}" if isinstance(v, float) else f"{k}={v}"
+                    for k, v in value.items()
+                )
+            print(f"  {key}: {value}")
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("--ticosd", default="ticosd", help="ticosd binary")
+    parser.add_argument("--ticosctl", default="ticosctl", help="ticosctl binary")
+    parser.add_argument(
+        "--set",
+        action="append",
+        default=[],
+        metavar="KEY=VALUE",
+        help="ticosd configuration key, dot-separated, and JSON value",
+    )
+    parser.add_argument("--messages", type=int, default=2000)
+    parser.add_argument("--padding-bytes", type=int, default=200)
+    parser.add_argument("--recovery-messages", type=int, default=200)
+    parser.add_argument("--outage-s", type=float, default=30)
+    parser.add_argument("--coredumps", type=int, default=0)
+    parser.add_argument(
+        "--settle-s",
+        type=float,
+        default=2,
+        help="time ticosd is given to queue the messages sent to it",
+    )
+    parser.add_argument(
+        "--timeout-s",
+        type=float,
+        default=300,
+        help="time without progress after which a phase is given up",
+    )
+    parser.add_argument("--json", help="also write the report to this file")
+    parser.add_argument("--verbose", action="store_true", help="log every request")
+    add_config_arguments(parser)
+    args = parser.parse_args()
+
+    base = config_from_arguments(args)
+    server = MockTicosServer(config=base, verbose=args.verbose)
+    server.start()
+    report: Dict[str, Any] = {}
+    with tempfile.TemporaryDirectory(prefix="ticosd-bench.") as workdir:
+        settings = dict(_parse_setting(s) for s in args.set)
+        ticosd = Ticosd(args.ticosd, workdir, server.base_url, settings)
+        try:
+            report["drain"] = run_drain(server, ticosd, base, args, 0)
+            report["recovery"] = run_recovery(server, ticosd, base, args, args.messages)
+            if args.coredumps:
+                report["coredumps"] = run_coredumps(server, ticosd, base, args)
+                part_size_kib = settings.get("network.upload_part_size_kib", 0)
+                if part_size_kib:
+                    report["expired_resume"] = run_expired_resume(
+                        server, ticosd, base, args, part_size_kib
+                    )
+        finally:
+            ticosd.stop()
+            server.stop()
+
+    _print_report(report)
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump(report, f, indent=2)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,521 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) Ticos, Inc.
+# See License.txt for details
+"""
+Stand-in for the Ticos endpoints ticosd sends to, to benchmark its network path offline.
+
+It serves, over plain HTTP/1.1 on loopback:
+
+- POST /chunks/<device>/json: events,
+- PATCH /api/v0/attributes: attributes,
+- GET /chunks/<device>/fileUrl: the URL to upload a coredump to, /upload/<token> here,
+- POST /upload/<token>: a coredump upload, either whole as a multipart form, or in parts
+  with Content-Range and X-Ticos-Part-CRC32C headers ("network"/"upload_part_size_kib"),
+- POST /chunks/<device>/url: the commit of a coredump upload,
+- HEAD /: connection warm-ups.
+
+Latency, upstream bandwidth, error rates and 429/503 injection are set on the command
+line, or at runtime by POSTing a JSON object with the fields of MockConfig to
+/__mock__/config. What was received is returned by GET /__mock__/stats, and forgotten by
+POST /__mock__/reset. POST /__mock__/expire_uploads makes the upload URLs handed out so
+far answer 403 Forbidden, as signed URLs do once they expired.
+
+Point ticosd at it with "base_url": "http://127.0.0.1:<port>".
+"""
+import argparse
+import dataclasses
+import gzip
+import json
+import math
+import random
+import re
+import threading
+import time
+import uuid
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from typing import Any, Dict, List, Optional, Set, Tuple
+from urllib.parse import urlsplit
+
+_CHUNKS_PATH = re.compile(r"/chunks/([^/]+)/(json|fileUrl|url)")
+_UPLOAD_PATH = re.compile(r"/upload/([0-9a-f]+)")
+_CONTENT_RANGE = re.compile(r"bytes (\d+)-(\d+)/(\d+)")
+
+# Attribute whose values the benchmark numbers its messages with, to count duplicates:
+BENCH_SEQ_KEY = "bench_seq"
+
+
+def _crc32c_table() -> List[int]:
+    table = []
+    for i in range(256):
+        crc = i
+        for _ in range(8):
+            crc = (crc >> 1) ^ (0x82F63B78 if crc & 1 else 0)
+        table.append(crc)
+    return table
+
+
+_CRC32C_TABLE = _crc32c_table()
+
+
+def crc32c(data: bytes) -> int:
+    """CRC-32C of data, as ticos_crc32c(0, data, len). Slow, but parts are small."""
+    crc = 0xFFFFFFFF
+    for byte in data:
+        crc = _CRC32C_TABLE[(crc ^ byte) & 0xFF] ^ (crc >> 8)
+    return crc ^ 0xFFFFFFFF
+
+
+def percentiles(values: List[float]) -> Dict[str, float]:
+    """Nearest-rank percentiles of values."""
+    if not values:
+        return {}
+    ordered = sorted(values)
+
+    def _rank(p: float) -> float:
+        return ordered[max(0, math.ceil(p / 100 * len(ordered)) - 1)]
+
+    return {"p50": _rank(50), "p90": _rank(90), "p99": _rank(99), "max": ordered[-1]}
+
+
+@dataclasses.dataclass
+class MockConfig:
+    # Added to the handling of every request:
+    latency_ms: float = 0.0
+    jitter_ms: float = 0.0
+    # Rate request bodies are read at, shared by all connections like an uplink, 0 for
+    # no limit:
+    bandwidth_kibps: float = 0.0
+    # Fraction of the requests answered 500 Internal Server Error:
+    error_rate: float = 0.0
+    # Fraction of the requests answered 429 Too Many Requests, with Retry-After if set:
+    throttle_rate: float = 0.0
+    retry_after_s: int = 0
+    # Every request is answered 503 Service Unavailable, with Retry-After if not 0:
+    outage: bool = False
+    # Gzipped request bodies are answered 415 Unsupported Media Type:
+    reject_gzip: bool = False
+    # Fraction of the upload parts answered 409 Conflict, as if the upload was lost:
+    part_loss_rate: float = 0.0
+
+
+@dataclasses.dataclass
+class RequestRecord:
+    # time.monotonic() the response was sent at:
+    time: float
+    kind: str
+    status: int
+    # Events or attributes received:
+    items: int
+    latency_ms: float
+
+
+@dataclasses.dataclass
+class _Upload:
+    # Bytes received in order, for uploads in parts:
+    received: int = 0
+    complete: bool = False
+    expired: bool = False
+
+
+class MockStats:
+    """What the server received, guarded by the lock of the server."""
+
+    def __init__(self) -> None:
+        self.records: List[RequestRecord] = []
+        self.items = 0
+        self.bench_seqs: Set[Any] = set()
+        self.duplicate_seqs = 0
+        # Request bodies as received, and once decompressed:
+        self.wire_bytes = 0
+        self.payload_bytes = 0
+        self.upload_bytes = 0
+        # Bytes of upload parts received again, after an interruption:
+        self.resent_bytes = 0
+        self.files_committed = 0
+
+    def snapshot(self) -> Dict[str, Any]:
+        ok = [r for r in self.records if 200 <= r.status < 300]
+        statuses: Dict[str, int] = {}
+        kinds: Dict[str, int] = {}
+        for r in self.records:
+            statuses[str(r.status)] = statuses.get(str(r.status), 0) + 1
+            kinds[r.kind] = kinds.get(r.kind, 0) + 1
+        return {
+            "requests": len(self.records),
+            "requests_by_kind": kinds,
+            "statuses": statuses,
+            "items": self.items,
+            "unique_seqs": len(self.bench_seqs),
+            "duplicate_seqs": self.duplicate_seqs,
+            "wire_bytes": self.wire_bytes,
+            "payload_bytes": self.payload_bytes,
+            "upload_bytes": self.upload_bytes,
+            "resent_bytes": self.resent_bytes,
+            "files_committed": self.files_committed,
+            "latency_ms": percentiles([r.latency_ms for r in ok]),
+        }
+
+
+class _Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    server: "MockTicosServer"
+
+    def log_message(self, format: str, *args: Any) -> None:  # noqa: A002
+        if self.server.verbose:
+            super().log_message(format, *args)
+
+    def do_GET(self) -> None:
+        self._handle()
+
+    def do_HEAD(self) -> None:
+        self._handle()
+
+    def do_POST(self) -> None:
+        self._handle()
+
+    def do_PATCH(self) -> None:
+        self._handle()
+
+    def _read_exactly(self, size: int) -> bytes:
+        data = bytearray()
+        while len(data) < size:
+            block = self.rfile.read(min(size - len(data), 16384))
+            if not block:
+                raise ConnectionError("connection closed mid-body")
+            data += block
+            self.server.throttle(len(block))
+        return bytes(data)
+
+    def _read_body(self) -> bytes:
+        # Streamed coredumps are sent with chunked transfer encoding:
+        if self.headers.get("Transfer-Encoding", "").lower() == "chunked":
+            chunks = []
+            while True:
+                size = int(self.rfile.readline().split(b";")[0].strip(), 16)
+                if size == 0:
+                    while self.rfile.readline() not in (b"\r\n", b"\n", b""):
+                        pass
+                    return b"".join(chunks)
+                chunks.append(self._read_exactly(size))
+                self.rfile.readline()
+        return self._read_exactly(int(self.headers.get("Content-Length") or 0))
+
+    def _reply(
+        self, status: int, body: Optional[Dict[str, Any]] = None, headers: Tuple = ()
+    ) -> None:
+        data = json.dumps(body).encode() if body is not None else b""
+        self.send_response(status)
+        for name, value in headers:
+            self.send_header(name, value)
+        if data:
+            self.send_header("Content-Type", "application/json")
+        self.send_header("Content-Length", str(len(data)))
+        self.end_headers()
+        if data and self.command != "HEAD":
+            self.wfile.write(data)
+
+    def _handle(self) -> None:
+        start = time.monotonic()
+        url = urlsplit(self.path)
+        if url.path.startswith("/__mock__/"):
+            self._control(url.path)
+            return
+        body = self._read_body()
+        config = self.server.get_config()
+
+        delay_ms = config.latency_ms + random.uniform(0, config.jitter_ms)
+        if delay_ms > 0:
+            time.sleep(delay_ms / 1000)
+
+        retry_after: Tuple = ()
+        if config.retry_after_s:
+            retry_after = (("Retry-After", str(config.retry_after_s)),)
+        if config.outage:
+            kind, status, reply, headers, items = "outage", 503, None, retry_after, 0
+        elif random.random() < config.throttle_rate:
+            kind, status, reply, headers, items = "throttled", 429, None, retry_after, 0
+        elif random.random() < config.error_rate:
+            kind, status, reply, headers, items = "error", 500, None, (), 0
+        else:
+            kind, status, reply, items = self._route(url.path, body, config)
+            headers = ()
+        self._reply(status, reply, headers)
+        self.server.record(
+            RequestRecord(
+                time=time.monotonic(),
+                kind=kind,
+                status=status,
+                items=items,
+                latency_ms=(time.monotonic() - start) * 1000,
+            ),
+            wire_bytes=len(body),
+        )
+
+    def _decode(self, body: bytes, config: MockConfig) -> Optional[bytes]:
+        if self.headers.get("Content-Encoding", "").lower() != "gzip":
+            return body
+        if config.reject_gzip:
+            return None
+        return gzip.decompress(body)
+
+    def _route(
+        self, path: str, body: bytes, config: MockConfig
+    ) -> Tuple[str, int, Optional[Dict[str, Any]], int]:
+        """Returns the kind of request, the status and body of the reply, the items."""
+        chunks = _CHUNKS_PATH.fullmatch(path)
+        upload = _UPLOAD_PATH.fullmatch(path)
+        if self.command == "HEAD":
+            return "warm_up", 200, None, 0
+        if (chunks and chunks[2] == "json" and self.command == "POST") or (
+            path == "/api/v0/attributes" and self.command in ("PATCH", "POST")
+        ):
+            kind = "events" if chunks else "attributes"
+            try:
+                payload = self._decode(body, config)
+                if payload is None:
+                    return kind, 415, None, 0
+                items = json.loads(payload)
+            except (OSError, ValueError):
+                return kind, 400, {"error": "invalid body"}, 0
+            if not isinstance(items, list):
+                return kind, 400, {"error": "expected an array"}, 0
+            self.server.add_items(items, len(payload))
+            return kind, 202, None, len(items)
+        if chunks and chunks[2] == "fileUrl" and self.command == "GET":
+            token = self.server.new_upload()
+            upload_url = f"{self.server.base_url}/upload/{token}"
+            return "prepare", 200, {"upload_url": upload_url}, 0
+        if upload and self.command == "POST":
+            return self._upload(upload[1], body, config)
+        if chunks and chunks[2] == "url" and self.command == "POST":
+            try:
+                commit = json.loads(body)
+            except ValueError:
+                return "commit", 400, {"error": "invalid JSON"}, 0
+            if not self.server.commit_upload(commit.get("url", "")):
+                return "commit", 400, {"error": "unknown upload"}, 0
+            return "commit", 200, None, 0
+        return "unknown", 404, None, 0
+
+    def _upload(
+        self, token: str, body: bytes, config: MockConfig
+    ) -> Tuple[str, int, Optional[Dict[str, Any]], int]:
+        content_range = self.headers.get("Content-Range")
+        file_url = {"url": f"{self.server.base_url}/files/{token}"}
+        if content_range is None:
+            # Whole file, as a multipart form:
+            status = self.server.upload_whole(token, len(body))
+            return "upload", status, file_url if status == 200 else None, 0
+
+        match = _CONTENT_RANGE.fullmatch(content_range)
+        if not match or int(match[2]) - int(match[1]) + 1 != len(body):
+            return "part", 400, {"error": "invalid Content-Range"}, 0
+        first, last, total = int(match[1]), int(match[2]), int(match[3])
+        if random.random() < config.part_loss_rate:
+            self.server.forget_upload(token)
+            return "part", 409, None, 0
+        checksum = self.headers.get("X-Ticos-Part-CRC32C", "")
+        try:
+            if int(checksum, 16) != crc32c(body):
+                return "part", 422, None, 0
+        except ValueError:
+            return "part", 422, None, 0
+        status = self.server.upload_part(token, first, last, total)
+        if status != 200 or last + 1 < total:
+            return "part", status, None, 0
+        return "part", 200, file_url, 0
+
+    def _control(self, path: str) -> None:
+        body = self._read_exactly(int(self.headers.get("Content-Length") or 0))
+        if path == "/__mock__/stats" and self.command == "GET":
+            self._reply(200, self.server.snapshot())
+        elif path == "/__mock__/reset" and self.command == "POST":
+            self.server.reset_stats()
+            self._reply(204)
+        elif path == "/__mock__/expire_uploads" and self.command == "POST":
+            self.server.expire_uploads()
+            self._reply(204)
+        elif path == "/__mock__/config" and self.command == "POST":
+            try:
+                self.server.configure(**json.loads(body or b"{}"))
+            except (TypeError, ValueError) as e:
+                self._reply(400, {"error": str(e)})
+                return
+            self._reply(200, dataclasses.asdict(self.server.get_config()))
+        else:
+            self._reply(404)
+
+
+class MockTicosServer(ThreadingHTTPServer):
+    daemon_threads = True
+
+    def __init__(
+        self,
+        address: Tuple[str, int] = ("127.0.0.1", 0),
+        config: Optional[MockConfig] = None,
+        verbose: bool = False,
+    ) -> None:
+        super().__init__(address, _Handler)
+        self.verbose = verbose
+        self._lock = threading.Lock()
+        self._config = config or MockConfig()
+        self._stats = MockStats()
+        self._uploads: Dict[str, _Upload] = {}
+        # Time the throttled uplink is free again, as time.monotonic():
+        self._link_free_at = 0.0
+        self._thread: Optional[threading.Thread] = None
+
+    @property
+    def base_url(self) -> str:
+        host, port = self.server_address[:2]
+        return f"http://{host}:{port}"
+
+    def start(self) -> None:
+        self._thread = threading.Thread(target=self.serve_forever, daemon=True)
+        self._thread.start()
+
+    def stop(self) -> None:
+        self.shutdown()
+        self.server_close()
+
+    def get_config(self) -> MockConfig:
+        with self._lock:
+            return dataclasses.replace(self._config)
+
+    def configure(self, **changes: Any) -> None:
+        with self._lock:
+            self._config = dataclasses.replace(self._config, **changes)
+
+    def throttle(self, size: int) -> None:
+        with self._lock:
+            bandwidth = self._config.bandwidth_kibps * 1024
+            if bandwidth <= 0:
+                return
+            now = time.monotonic()
+            self._link_free_at = max(self._link_free_at, now) + size / bandwidth
+            wait = self._link_free_at - now
+        time.sleep(wait)
+
+    def record(self, record: RequestRecord, wire_bytes: int) -> None:
+        with self._lock:
+            self._stats.records.append(record)
+            self._stats.wire_bytes += wire_bytes
+
+    def add_items(self, items: List[Any], payload_bytes: int) -> None:
+        with self._lock:
+            self._stats.items += len(items)
+            self._stats.payload_bytes += payload_bytes
+            for item in items:
+                if isinstance(item, dict) and item.get("string_key") == BENCH_SEQ_KEY:
+                    seq = item.get("value")
+                    if seq in self._stats.bench_seqs:
+                        self._stats.duplicate_seqs += 1
+                    self._stats.bench_seqs.add(seq)
+
+    def new_upload(self) -> str:
+        token = uuid.uuid4().hex
+        with self._lock:
+            self._uploads[token] = _Upload()
+        return token
+
+    def forget_upload(self, token: str) -> None:
+        with self._lock:
+            self._uploads.pop(token, None)
+
+    def expire_uploads(self) -> None:
+        """Makes the upload URLs handed out so far answer 403 Forbidden."""
+        with self._lock:
+            for upload in self._uploads.values():
+                upload.expired = True
+
+    def upload_whole(self, token: str, size: int) -> int:
+        """Accepts a whole file, returns the status to answer with."""
+        with self._lock:
+            upload = self._uploads.get(token)
+            if upload is None:
+                return 404
+            if upload.expired:
+                return 403
+            upload.complete = True
+            self._stats.upload_bytes += size
+            return 200
+
+    def upload_part(self, token: str, first: int, last: int, total: int) -> int:
+        """Accepts a part, returns the status to answer with."""
+        with self._lock:
+            upload = self._uploads.get(token)
+            if upload is None:
+                # Lost, or from before a restart of the server:
+                return 409
+            if upload.expired:
+                return 403
+            if first > upload.received or last >= total:
+                return 416
+            self._stats.upload_bytes += last - first + 1
+            # A part sent again, as its acknowledgement was not persisted or got lost:
+            self._stats.resent_bytes += min(upload.received, last + 1) - first
+            upload.received = max(upload.received, last + 1)
+            upload.complete = upload.received == total
+            return 200
+
+    def commit_upload(self, file_url: str) -> bool:
+        token = file_url.rsplit("/", 1)[-1]
+        with self._lock:
+            upload = self._uploads.get(token)
+            if upload is None or not upload.complete:
+                return False
+            self._stats.files_committed += 1
+            return True
+
+    def snapshot(self) -> Dict[str, Any]:
+        with self._lock:
+            return self._stats.snapshot()
+
+    def records(self) -> List[RequestRecord]:
+        with self._lock:
+            return list(self._stats.records)
+
+    def unique_seqs(self) -> int:
+        with self._lock:
+            return len(self._stats.bench_seqs)
+
+    def reset_stats(self) -> None:
+        with self._lock:
+            self._stats = MockStats()
+
+
+def add_config_arguments(parser: argparse.ArgumentParser) -> None:
+    """Adds a command line option for each field of MockConfig."""
+    for field in dataclasses.fields(MockConfig):
+        option = "--" + field.name.replace("_", "-")
+        if field.type in (bool, "bool"):
+            parser.add_argument(option, action="store_true")
+        else:
+            parser.add_argument(option, type=type(field.default), default=field.default)
+
+
+def config_from_arguments(args: argparse.Namespace) -> MockConfig:
+    fields = dataclasses.fields(MockConfig)
+    return MockConfig(**{f.name: getattr(args, f.name) for f in fields})
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("--port", type=int, default=8080)
+    parser.add_argument("--verbose", action="store_true", help="log every request")
+    add_config_arguments(parser)
+    args = parser.parse_args()
+
+    config = config_from_arguments(args)
+    server = MockTicosServer(("127.0.0.1", args.port), config, args.verbose)
+    print(f"Serving on {server.base_url}")
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    print(json.dumps(server.snapshot(), indent=2))
+
+
+if __name__ == "__main__":
+    main()